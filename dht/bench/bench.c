@@ -0,0 +1,346 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+
+#include "../src/sim.h"
+
+//
+//		Micro benchmarks
+//
+// bench [filter]
+//
+// Times the Kademlia hot paths on the default configuration and prints one
+// JSON object per benchmark and line. Each benchmark runs BENCH_BATCHES
+// timed batches, the percentiles are over the per batch ns/op. Allocations
+// are counted by wrapping malloc, calloc and realloc at link time.
+//
+
+#define BENCH_BATCHES 101
+#define BENCH_NODES 1000
+#define BENCH_KEYS 0x4000
+
+int quiet = 1;
+
+//
+//		Allocation counting
+//
+
+extern "C" void * __real_malloc(size_t size);
+extern "C" void * __real_calloc(size_t n, size_t size);
+extern "C" void * __real_realloc(void * ptr, size_t size);
+
+static long allocations = 0;
+
+extern "C" void * __wrap_malloc(size_t size) { allocations++; return __real_malloc(size); }
+extern "C" void * __wrap_calloc(size_t n, size_t size) { allocations++; return __real_calloc(n,size); }
+extern "C" void * __wrap_realloc(void * ptr, size_t size) { allocations++; return __real_realloc(ptr,size); }
+
+//
+//		Runner
+//
+
+typedef void (*BENCH_FN)(void * arg, int n);
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static const char * filter = NULL;
+static volatile int sink; // keeps results alive
+
+static void bench(const char * name, BENCH_FN fn, BENCH_FN reset, void * arg, int batch)
+{
+	// reset runs untimed after every batch to put the state back
+
+	if(filter && !strstr(name,filter)) return;
+
+	double samples[BENCH_BATCHES];
+	double total = 0;
+	long allocs = 0;
+
+	fn(arg,batch); // warm up
+	if(reset) reset(arg,batch);
+
+	for(int i = 0; i < BENCH_BATCHES; i++)
+	{
+		long before = allocations;
+		double start = now_ns();
+		fn(arg,batch);
+		double elapsed = now_ns() - start;
+		allocs += allocations - before;
+
+		if(reset) reset(arg,batch);
+		samples[i] = elapsed / batch;
+		total += elapsed;
+	}
+	qsort(samples,BENCH_BATCHES,sizeof(double),compare_doubles);
+
+	#define PCT(P) samples[(int)((P)/100.0*(BENCH_BATCHES-1))]
+	printf("{\"name\":\"%s\",\"ops\":%d,\"ns_per_op\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f,\"allocs_per_op\":%.3f}\n",
+		name, batch*BENCH_BATCHES, total/(batch*BENCH_BATCHES),
+		PCT(50), PCT(90), PCT(99), PCT(100), allocs/(double)(batch*BENCH_BATCHES));
+	#undef PCT
+	fflush(stdout);
+}
+
+//
+//		Inputs
+//
+
+static K_ID keys[BENCH_KEYS];     // random ids, also used as hashes
+static char key_data[BENCH_KEYS]; // something for the entries to point at
+static int cursor = 0;
+
+static unsigned char * next_key()
+{
+	cursor = (cursor+1) & (BENCH_KEYS-1);
+	return keys[cursor];
+}
+
+//
+//		Hashing
+//
+
+static void bench_get_hash(void * arg, int n)
+{
+	HASH_ENTRY * entry = (HASH_ENTRY*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		get_hash(entry);
+		entry->data[0] = entry->hash[0]; // the next input depends on this one
+	}
+}
+
+//
+//		Hash tables
+//
+
+typedef struct
+{
+	HASH_ENTRY * table;    // fixed table at a given load
+	HASH_STORE_T<KADEMLIA> store;
+	int first;             // first key that is not in the table
+} TABLE_ARG;
+
+static void fill_entry(HASH_ENTRY * entry, int key)
+{
+	memcpy(entry->hash,keys[key],sizeof(K_ID));
+	entry->data = &key_data[key];
+	entry->size = 1;
+}
+
+static void bench_hash_insert(void * arg, int n)
+{
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		HASH_ENTRY entry; fill_entry(&entry,t->first+i);
+		hash_insert(t->table,&entry);
+	}
+}
+
+static void reset_hash_insert(void * arg, int n)
+{
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	for(int i = 0; i < n; i++) hash_remove(t->table,keys[t->first+i]);
+}
+
+static void bench_hash_search_hit(void * arg, int n)
+{
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		HASH_ENTRY entry; memcpy(entry.hash,keys[i % t->first],sizeof(K_ID));
+		sink += hash_search<KADEMLIA>(t->table,&entry);
+	}
+}
+
+static void bench_hash_search_miss(void * arg, int n)
+{
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		HASH_ENTRY entry; memcpy(entry.hash,keys[t->first + i % (BENCH_KEYS - t->first)],sizeof(K_ID));
+		sink += hash_search<KADEMLIA>(t->table,&entry);
+	}
+}
+
+static void bench_store_insert(void * arg, int n)
+{
+	// a node's growable store from empty
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		HASH_ENTRY entry; fill_entry(&entry,i);
+		hash_insert(&t->store,&entry);
+	}
+}
+
+static void reset_store_insert(void * arg, int n)
+{
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	free(t->store.entries);
+	memset(&t->store,0,sizeof(t->store));
+}
+
+static void bench_store_search(void * arg, int n)
+{
+	TABLE_ARG * t = (TABLE_ARG*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		HASH_ENTRY entry; memcpy(entry.hash,keys[i % t->store.n_entries],sizeof(K_ID));
+		sink += hash_search(&t->store,&entry);
+	}
+}
+
+//
+//		Routing table
+//
+
+static void bench_find_bucket(void * arg, int n)
+{
+	NODE * node = (NODE*) arg;
+	for(int i = 0; i < n; i++)
+		sink += find_bucket(node->contacts,next_key())->n_contacts;
+}
+
+static void bench_add_contact(void * arg, int n)
+{
+	// fills an empty routing table from the whole network
+	NODE * node = (NODE*) arg;
+	NODE ** all_nodes = network<KADEMLIA>()->nodes;
+	for(int i = 0; i < n; i++)
+		add_contact(node,&all_nodes[i % BENCH_NODES]->info);
+}
+
+static void reset_add_contact(void * arg, int n)
+{
+	NODE * node = (NODE*) arg;
+	free_routing_table(node->contacts);
+	node->contacts = NULL;
+}
+
+static void bench_get_closest_nodes(void * arg, int n)
+{
+	NODE * node = (NODE*) arg;
+	for(int i = 0; i < n; i++)
+	{
+		CONTACT * closest[N_CONTACTS] = {0};
+		get_closest_contacts(node->contacts,next_key(),closest);
+		sink += closest[0]->idx;
+	}
+}
+
+static void bench_merge_contact_lists(void * arg, int n)
+{
+	NODE ** all_nodes = network<KADEMLIA>()->nodes;
+	for(int i = 0; i < n; i++)
+	{
+		CONTACT * dst[N_CONTACTS], * src[N_CONTACTS];
+		for(int j = 0; j < N_CONTACTS; j++)
+		{
+			dst[j] = &all_nodes[(i+j) % BENCH_NODES]->info;
+			src[j] = &all_nodes[(i*7+j+N_CONTACTS) % BENCH_NODES]->info;
+		}
+		merge_contact_lists<KADEMLIA>(dst,src,next_key());
+		sink += dst[0]->idx;
+	}
+}
+
+//
+//		Lookups
+//
+
+static void bench_kademlia_search(void * arg, int n)
+{
+	NODE ** all_nodes = network<KADEMLIA>()->nodes;
+	for(int i = 0; i < n; i++)
+	{
+		NODE * node = all_nodes[cursor % BENCH_NODES];
+		CONTACT * closest[N_CONTACTS] = {0};
+		sink += kademlia_search(node,next_key(),closest);
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	if(argc > 1) filter = argv[1];
+
+	pcg32_random_t rng = {0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL};
+	for(int i = 0; i < BENCH_KEYS; i++)
+	for(int j = 0; j < K_ID_LEN; j++)
+		keys[i][j] = pcg32_random_r(&rng);
+
+	// hashing
+	static char input[16384];
+	int sizes[] = {4, 64, 1024, 16384};
+	for(int i = 0; i < 4; i++)
+	{
+		char name[64]; sprintf(name,"get_hash/%d",sizes[i]);
+		HASH_ENTRY entry = {{0},input,sizes[i]};
+		bench(name,bench_get_hash,NULL,&entry,sizes[i] > 1024 ? 16 : 1000);
+	}
+
+	// fixed table at several loads, keys past first are never in the table
+	static HASH_TABLE table;
+	int loads[] = {10, 50, 90};
+	for(int i = 0; i < 3; i++)
+	{
+		memset(table,0,sizeof(table));
+		TABLE_ARG t = {table};
+		int count = HASH_TABLE_SIZE/100*loads[i];
+
+		// fill the table with filler entries, then the benchmark keys
+		for(int j = 0; j < count - BENCH_KEYS/2; j++)
+		{
+			HASH_ENTRY entry = {{0},key_data,1};
+			for(int b = 0; b < K_ID_LEN; b++) entry.hash[b] = pcg32_random_r(&rng);
+			hash_insert(table,&entry);
+		}
+		for(t.first = 0; t.first < BENCH_KEYS/2; t.first++)
+		{
+			HASH_ENTRY entry; fill_entry(&entry,t.first);
+			hash_insert(table,&entry);
+		}
+
+		char name[64];
+		sprintf(name,"hash_insert/load%d",loads[i]); bench(name,bench_hash_insert,reset_hash_insert,&t,256);
+		sprintf(name,"hash_search_hit/load%d",loads[i]); bench(name,bench_hash_search_hit,NULL,&t,1000);
+		sprintf(name,"hash_search_miss/load%d",loads[i]); bench(name,bench_hash_search_miss,NULL,&t,1000);
+	}
+
+	{
+		TABLE_ARG t = {NULL};
+		bench("hash_store_insert/1000",bench_store_insert,reset_store_insert,&t,1000);
+		bench_store_insert(&t,1000);
+		bench("hash_store_search/1000",bench_store_search,NULL,&t,1000);
+		reset_store_insert(&t,0);
+	}
+
+	// routing table of a node in a grown network
+	srand(0);
+	NODE ** all_nodes = build_network<KADEMLIA>(BENCH_NODES);
+
+	bench("find_bucket",bench_find_bucket,NULL,all_nodes[0],1000);
+	bench("get_closest_nodes",bench_get_closest_nodes,NULL,all_nodes[0],100);
+	bench("merge_contact_lists",bench_merge_contact_lists,NULL,NULL,1000);
+	{
+		NODE empty = {0};
+		empty.info = all_nodes[0]->info;
+		bench("add_contact",bench_add_contact,reset_add_contact,&empty,BENCH_NODES);
+	}
+	bench("kademlia_search",bench_kademlia_search,NULL,NULL,20);
+
+	network_free<KADEMLIA>();
+	return 0;
+}
@@ -0,0 +1,269 @@
+#include "netsim.h"
+
+//
+//		Churn simulation
+//
+// main churn [name=value...]
+//
+// Once the network is built, every node alternates between sessions online
+// and time offline while stores and lookups arrive as a Poisson stream. A
+// node keeps its routing table and values while it is away, and when it
+// comes back it looks up its own id to catch up. For each interval of
+// virtual time it reports how many lookups found their value, how many
+// requests timed out (stale contacts, plus losses when loss= is set) and
+// the lookup latency. What a node does about a contact that does not
+// answer is up to the client's code.
+//
+// The whole workload is scheduled before the run so the ops never move in
+// memory while the shards are running.
+//
+
+#define CHURN_JOIN_MS 10 // between nodes joining while the network is built
+
+enum CHURN_EVENTS { EVENT_JOIN = EVENT_USER, EVENT_LEAVE };
+enum CHURN_OPS { OP_PUT, OP_GET, OP_JOIN, OP_REFRESH, OP_REPUBLISH, N_OPS };
+
+typedef struct
+{
+	int n_nodes;
+	double duration;  // seconds of virtual time
+	double interval;  // seconds per report line
+	double rate;      // stores and lookups per second
+	double put;       // fraction of them that store
+	int session_model;
+	double session;   // mean seconds online
+	double downtime;  // mean seconds offline, exponential
+	double refresh;   // seconds between routing table refreshes, 0 for none
+	double republish; // seconds between stores of the same value, 0 for none
+	double poll;      // ms between node_polls of an idle node
+	unsigned seed;
+	int n_threads;
+	LINK_MODEL link;
+} CHURN_CONFIG;
+
+typedef struct
+{
+	int type;
+	int op;
+	int put; // for OP_GET, the op that stored the value
+} CHURN_OP;
+
+static void churn_event(NETSIM * sim, SIM_EVENT * event)
+{
+	netsim_online(sim,(int)(intptr_t)event->data,event->type == EVENT_JOIN);
+}
+
+static void churn_config(CHURN_CONFIG * config)
+{
+	const double MS = 1000; // the network simulation counts in ms
+
+	NETSIM sim;
+	netsim_create(&sim,config->n_nodes,config->n_threads,config->seed,&config->link,config->poll);
+	sim.on_event = churn_event;
+
+	pcg32_random_t rng = {config->seed, 0}; // for setting up the workload
+	netsim_build(&sim,CHURN_JOIN_MS,&rng);
+	double start = netsim_now(&sim); // the time below counts from here
+
+	int n_intervals = (int)ceil(config->duration/config->interval);
+	int * online_at = (int*) calloc(n_intervals,sizeof(int)); // at the start of each interval
+
+	CHURN_OP * ops = NULL;
+	int n_ops = 0, max_ops = 0;
+
+	#define ADD_OP(TYPE,OP,PUT) do { \
+		if(n_ops == max_ops) ops = (CHURN_OP*) realloc(ops,(max_ops = max_ops ? max_ops*2 : 1024)*sizeof(CHURN_OP)); \
+		CHURN_OP op = {TYPE,OP,PUT}; ops[n_ops++] = op; } while(0)
+
+	// sessions, starting from the steady state
+	double p_online = config->session/(config->session+config->downtime);
+	for(int i = 0; i < config->n_nodes; i++)
+	{
+		int online = sim_uniform(&rng) < p_online;
+		if(!online) event_schedule(&netsim_shard(&sim,i)->queue,start,netsim_seq(&sim,i),EVENT_LEAVE,(void*)(intptr_t)i);
+
+		for(double t = 0; t < config->duration; online = !online)
+		{
+			double next = t + (online ? sim_sample(config->session_model,config->session,&rng)
+				: sim_sample(LATENCY_EXPONENTIAL,config->downtime,&rng));
+
+			if(online)
+				for(int k = (int)ceil(t/config->interval); k < n_intervals && k*config->interval < next; k++)
+					online_at[k]++;
+
+			if(next < config->duration)
+			{
+				event_schedule(&netsim_shard(&sim,i)->queue,start + next*MS,netsim_seq(&sim,i),
+					online ? EVENT_LEAVE : EVENT_JOIN,(void*)(intptr_t)i);
+
+				if(!online)
+				{
+					// the join event comes first, it was scheduled first
+					HASH_ENTRY self = {{0}};
+					memcpy(self.hash,sim.nodes[i].node->info.id,sizeof(K_ID));
+					ADD_OP(OP_JOIN,netsim_op(&sim,i,SIM_FIND_NODE,&self,start + next*MS),-1);
+				}
+			}
+			t = next;
+		}
+	}
+
+	// routing table refreshes at a random phase per node
+	if(config->refresh > 0)
+	for(int i = 0; i < config->n_nodes; i++)
+	for(double t = sim_uniform(&rng)*config->refresh; t < config->duration; t += config->refresh)
+	{
+		HASH_ENTRY target = {{0}};
+		for(int j = 0; j < (int)sizeof(K_ID); j++) target.hash[j] = pcg32_random_r(&rng);
+		ADD_OP(OP_REFRESH,netsim_op(&sim,i,SIM_FIND_NODE,&target,start + t*MS),-1);
+	}
+
+	// stores and lookups, a lookup asks for a value stored before it
+	int * puts = NULL;
+	int n_puts = 0;
+	for(double t = sim_sample(LATENCY_EXPONENTIAL,1/config->rate,&rng); t < config->duration;
+		t += sim_sample(LATENCY_EXPONENTIAL,1/config->rate,&rng))
+	{
+		int node = pcg32_random_r(&rng) % config->n_nodes;
+
+		if(n_puts == 0 || sim_uniform(&rng) < config->put)
+		{
+			HASH_ENTRY entry = {{0}, (char*) malloc(128), 128};
+			for(int j = 0; j < 128; j++) entry.data[j] = pcg32_random_r(&rng);
+			get_hash(&entry);
+
+			int put = netsim_op(&sim,node,SIM_STORE,&entry,start + t*MS);
+			ADD_OP(OP_PUT,put,-1);
+			puts = (int*) realloc(puts,(n_puts+1)*sizeof(int));
+			puts[n_puts++] = put;
+
+			if(config->republish > 0)
+			for(double r = t + config->republish; r < config->duration; r += config->republish)
+				ADD_OP(OP_REPUBLISH,netsim_op(&sim,node,SIM_STORE,&entry,start + r*MS),-1);
+		}
+		else
+		{
+			int put = puts[pcg32_random_r(&rng) % n_puts];
+			HASH_ENTRY entry = sim.ops[put].entry;
+			ADD_OP(OP_GET,netsim_op(&sim,node,SIM_FIND_VALUE,&entry,start + t*MS),put);
+		}
+	}
+	#undef ADD_OP
+
+	netsim_run(&sim);
+
+	// lookups are counted in the interval they started in, and only if the
+	// value was stored before they started
+
+	int * gets = (int*) calloc(n_intervals,sizeof(int));
+	int * found = (int*) calloc(n_intervals,sizeof(int));
+	int * stale = (int*) calloc(n_intervals,sizeof(int));
+	HISTOGRAM * latency = (HISTOGRAM*) calloc(n_intervals+1,sizeof(HISTOGRAM)); // in us, the last one is the total
+	int done[N_OPS] = {0}, skipped[N_OPS] = {0};
+
+	for(int i = 0; i < n_ops; i++)
+	{
+		SIM_OP * op = &sim.ops[ops[i].op];
+		if(op->skipped) { skipped[ops[i].type]++; continue; }
+		done[ops[i].type]++;
+		if(ops[i].type != OP_GET) continue;
+
+		SIM_OP * put = &sim.ops[ops[i].put];
+		if(put->skipped || put->end > op->start) continue;
+
+		int k = (int)((op->start - start)/MS/config->interval);
+		if(k >= n_intervals) k = n_intervals-1;
+		gets[k]++;
+		stale[k] += op->timeouts;
+		if(netsim_found(op,put)) found[k]++;
+		hist_record(&latency[k],(uint64_t)((op->end - op->start)*1000));
+		hist_record(&latency[n_intervals],(uint64_t)((op->end - op->start)*1000));
+	}
+
+	printf("k=%d alpha=%d\n", N_CONTACTS, PARALLEL_QUERIES);
+	printf("%8s %7s %8s %8s %7s %9s %9s\n", "time s", "online", "lookups", "success", "stale", "p50 ms", "p99 ms");
+	int total_gets = 0, total_found = 0, total_stale = 0;
+	for(int k = 0; k < n_intervals; k++)
+	{
+		printf("%8.0f %7d %8d %7.1f%% %7.2f %9.1f %9.1f\n",
+			k*config->interval, online_at[k], gets[k],
+			gets[k] ? 100.0*found[k]/gets[k] : 0, gets[k] ? (double)stale[k]/gets[k] : 0,
+			hist_percentile(&latency[k],50)/1000.0, hist_percentile(&latency[k],99)/1000.0);
+		total_gets += gets[k];
+		total_found += found[k];
+		total_stale += stale[k];
+	}
+	printf("%8s %7s %8d %7.1f%% %7.2f %9.1f %9.1f\n", "total", "",
+		total_gets, total_gets ? 100.0*total_found/total_gets : 0, total_gets ? (double)total_stale/total_gets : 0,
+		hist_percentile(&latency[n_intervals],50)/1000.0, hist_percentile(&latency[n_intervals],99)/1000.0);
+
+	int sent = 0, lost = 0;
+	for(int i = 0; i < sim.n_shards; i++)
+	{
+		sent += sim.shards[i].sent;
+		lost += sim.shards[i].lost;
+	}
+	printf("stores %d, joins %d, refreshes %d, republishes %d (skipped while offline %d, %d, %d, %d), sent %d, lost %d\n\n",
+		done[OP_PUT], done[OP_JOIN], done[OP_REFRESH], done[OP_REPUBLISH],
+		skipped[OP_PUT], skipped[OP_JOIN], skipped[OP_REFRESH], skipped[OP_REPUBLISH], sent, lost);
+	fflush(stdout);
+
+	for(int i = 0; i < n_puts; i++) free(sim.ops[puts[i]].entry.data);
+	free(puts);
+	free(ops);
+	free(online_at);
+	free(gets);
+	free(found);
+	free(stale);
+	free(latency);
+	netsim_free(&sim);
+}
+
+int churn_main(int argc, char * argv[])
+{
+	CHURN_CONFIG config = {1000, 7200, 600, 2, 0.2, LATENCY_EXPONENTIAL, 3600, 1800, 3600, 3600, 1000, 1, 1,
+		{LATENCY_EXPONENTIAL, 20, 30, 0, 0}};
+
+	for(int i = 0; i < argc; i++)
+	{
+		char model[32];
+		if(sscanf(argv[i],"nodes=%d",&config.n_nodes)==1) continue;
+		if(sscanf(argv[i],"duration=%lf",&config.duration)==1) continue;
+		if(sscanf(argv[i],"interval=%lf",&config.interval)==1) continue;
+		if(sscanf(argv[i],"rate=%lf",&config.rate)==1) continue;
+		if(sscanf(argv[i],"put=%lf",&config.put)==1) continue;
+		if(sscanf(argv[i],"session=%lf",&config.session)==1) continue;
+		if(sscanf(argv[i],"downtime=%lf",&config.downtime)==1) continue;
+		if(sscanf(argv[i],"refresh=%lf",&config.refresh)==1) continue;
+		if(sscanf(argv[i],"republish=%lf",&config.republish)==1) continue;
+		if(sscanf(argv[i],"poll=%lf",&config.poll)==1) continue;
+		if(sscanf(argv[i],"seed=%u",&config.seed)==1) continue;
+		if(sscanf(argv[i],"threads=%d",&config.n_threads)==1) continue;
+		if(sscanf(argv[i],"latency=%lf",&config.link.latency)==1) continue;
+		if(sscanf(argv[i],"jitter=%lf",&config.link.jitter)==1) continue;
+		if(sscanf(argv[i],"loss=%lf",&config.link.loss)==1) continue;
+		if(sscanf(argv[i],"bandwidth=%lf",&config.link.bandwidth)==1) continue;
+		if(sscanf(argv[i],"model=%31s",model)==1 && link_model(model) >= 0)
+			{ config.link.model = link_model(model); continue; }
+		if(sscanf(argv[i],"sessions=%31s",model)==1 && link_model(model) >= 0)
+			{ config.session_model = link_model(model); continue; }
+
+		printf("unknown option: %s\n", argv[i]);
+		printf("options: nodes duration interval rate put session downtime refresh republish (seconds)\n");
+		printf("         poll seed threads latency jitter loss bandwidth (ms and bytes per ms)\n");
+		printf("         sessions= and model=constant|uniform|exponential|pareto\n");
+		return 1;
+	}
+	if(config.n_nodes < 2 || config.rate <= 0 || config.duration <= 0 || config.interval <= 0)
+		{ printf("need 2 nodes and a rate, duration and interval above 0\n"); return 1; }
+	if(config.n_threads < 1) config.n_threads = 1;
+	if(config.n_threads > 1 && config.link.latency <= 0) { printf("threads need a latency above 0\n"); return 1; }
+
+	log_level = LOG_ERROR;
+	printf("%d nodes for %.0fs, %.1f ops/s with %.0f%% stores, sessions %.0fs, downtime %.0fs, refresh %.0fs, republish %.0fs, poll %.0fms\n",
+		config.n_nodes, config.duration, config.rate, config.put*100, config.session, config.downtime,
+		config.refresh, config.republish, config.poll);
+
+	churn_config(&config);
+	return 0;
+}
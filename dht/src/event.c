@@ -0,0 +1,114 @@
+#include "string.h"
+
+#include "event.h"
+
+static int event_before(SIM_EVENT * a, SIM_EVENT * b)
+{
+	if(a->time != b->time) return a->time < b->time;
+	return a->seq < b->seq;
+}
+
+void event_schedule(EVENT_QUEUE * queue, double time, uint64_t seq, int type, void * data)
+{
+	if(queue->n_events == queue->capacity)
+	{
+		queue->capacity = queue->capacity ? queue->capacity*2 : 256;
+		queue->events = (SIM_EVENT*) realloc(queue->events,queue->capacity*sizeof(SIM_EVENT));
+	}
+
+	SIM_EVENT event = {time < queue->now ? queue->now : time, seq, type, data};
+
+	// sift up
+	int i = queue->n_events++;
+	while(i > 0)
+	{
+		int parent = (i-1)/2;
+		if(!event_before(&event,&queue->events[parent])) break;
+		queue->events[i] = queue->events[parent];
+		i = parent;
+	}
+	queue->events[i] = event;
+}
+
+int event_next(EVENT_QUEUE * queue, SIM_EVENT * event)
+{
+	if(queue->n_events == 0) return 0;
+
+	*event = queue->events[0];
+	queue->now = event->time;
+
+	// sift the last event down from the root
+	SIM_EVENT last = queue->events[--queue->n_events];
+	int i = 0;
+	for(;;)
+	{
+		int child = i*2+1;
+		if(child >= queue->n_events) break;
+		if(child+1 < queue->n_events && event_before(&queue->events[child+1],&queue->events[child])) child++;
+		if(!event_before(&queue->events[child],&last)) break;
+		queue->events[i] = queue->events[child];
+		i = child;
+	}
+	if(queue->n_events) queue->events[i] = last;
+	return 1;
+}
+
+double event_time(EVENT_QUEUE * queue)
+{
+	return queue->n_events ? queue->events[0].time : HUGE_VAL;
+}
+
+void event_free(EVENT_QUEUE * queue)
+{
+	free(queue->events);
+	memset(queue,0,sizeof(EVENT_QUEUE));
+}
+
+void mailbox_post(MAILBOX * mailbox, MAIL * mail)
+{
+	mail->next = mailbox->head.load(std::memory_order_relaxed);
+	while(!mailbox->head.compare_exchange_weak(mail->next,mail,std::memory_order_release,std::memory_order_relaxed));
+}
+
+void mailbox_deliver(MAILBOX * mailbox, EVENT_QUEUE * queue)
+{
+	MAIL * mail = mailbox->head.exchange(NULL,std::memory_order_acquire);
+	while(mail)
+	{
+		event_schedule(queue,mail->event.time,mail->event.seq,mail->event.type,mail->event.data);
+		mail = mail->next;
+	}
+}
+
+double sim_uniform(pcg32_random_t * rng)
+{
+	return (pcg32_random_r(rng) + 0.5) / 4294967296.0;
+}
+
+double sim_sample(int model, double mean, pcg32_random_t * rng)
+{
+	double u = sim_uniform(rng);
+
+	switch(model)
+	{
+		case LATENCY_UNIFORM: return 2*mean*u;
+		case LATENCY_EXPONENTIAL: return -mean*log(u);
+		case LATENCY_PARETO:
+			// shape 1.5 has a mean of 3 times the scale, less the scale itself
+			return mean/2*(pow(u,-1/1.5) - 1);
+		default: return mean;
+	}
+}
+
+double link_delay(LINK_MODEL * link, pcg32_random_t * rng)
+{
+	return link->latency + sim_sample(link->model,link->jitter,rng);
+}
+
+int link_model(const char * name)
+{
+	const char * names[] = {"constant","uniform","exponential","pareto"};
+	for(int i = 0; i < 4; i++)
+		if(strcmp(name,names[i])==0) return i;
+	return -1;
+}
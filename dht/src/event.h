@@ -0,0 +1,86 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "stdlib.h"
+#include "stdint.h"
+#include "math.h"
+#include <atomic>
+
+#include "../../src/kademlia.h"
+
+//
+//		Discrete event scheduling
+//
+// Events are kept in a binary heap ordered by virtual time. Ties are broken
+// by a sequence number the caller picks, so a run repeats exactly no matter
+// in which order events with the same time were scheduled.
+//
+
+typedef struct
+{
+	double time; // virtual milliseconds
+	uint64_t seq;
+	int type;
+	void * data;
+} SIM_EVENT;
+
+typedef struct
+{
+	SIM_EVENT * events;
+	int n_events;
+	int capacity;
+	double now; // time of the last event taken from the queue
+} EVENT_QUEUE;
+
+void event_schedule(EVENT_QUEUE * queue, double time, uint64_t seq, int type, void * data);
+int event_next(EVENT_QUEUE * queue, SIM_EVENT * event); // 0 once the queue is empty
+double event_time(EVENT_QUEUE * queue); // of the next event, HUGE_VAL if there is none
+void event_free(EVENT_QUEUE * queue);
+
+//
+//		Mailboxes
+//
+// Hand events to a queue owned by another thread. Any number of threads
+// can post without locking, the owner takes everything at once and
+// schedules it, which is safe because the sequence numbers decide the order.
+//
+
+typedef struct MAIL
+{
+	struct MAIL * next;
+	SIM_EVENT event;
+} MAIL;
+
+typedef struct
+{
+	std::atomic<MAIL*> head;
+} MAILBOX;
+
+void mailbox_post(MAILBOX * mailbox, MAIL * mail);
+void mailbox_deliver(MAILBOX * mailbox, EVENT_QUEUE * queue);
+
+//
+//		Link model
+//
+// A message waits for the sender's uplink (bandwidth), then takes the fixed
+// latency plus jitter drawn from one of the distributions below. Each jitter
+// distribution has the configured mean.
+//
+
+enum LATENCY_MODELS { LATENCY_CONSTANT, LATENCY_UNIFORM, LATENCY_EXPONENTIAL, LATENCY_PARETO };
+
+typedef struct
+{
+	int model;
+	double latency;   // fixed one way delay in ms
+	double jitter;    // mean extra delay in ms
+	double loss;      // chance that a message is dropped
+	double bandwidth; // bytes per ms on each node's uplink, 0 for unlimited
+} LINK_MODEL;
+
+double sim_uniform(pcg32_random_t * rng); // in (0,1)
+double sim_sample(int model, double mean, pcg32_random_t * rng); // >= 0 with the given mean
+double link_delay(LINK_MODEL * link, pcg32_random_t * rng);
+int link_model(const char * name); // -1 if unknown
+
+#endif
@@ -0,0 +1,200 @@
+#include "netsim.h"
+#include "replay.h"
+
+//
+//		Network simulation
+//
+// main netsim [name=value...]
+//
+// Builds a network of client nodes that join one after the other, stores
+// values and then looks them up over the simulated transport, and prints
+// lookup latency percentiles in virtual time. The nodes run the client's
+// code, so alpha, k and the rpc timeouts are the ones in ../src/dht.h.
+// threads= splits the nodes over that many shards, the results are the
+// same for any number of threads.
+//
+
+typedef struct
+{
+	int n_nodes;
+	int n_lookups;
+	double spacing;     // ms between lookups starting
+	double join;        // ms between nodes joining
+	double poll;        // ms between node_polls of an idle node
+	double offline;     // fraction of nodes that never answer
+	unsigned seed;
+	int n_threads;
+	LINK_MODEL link;
+} NETSIM_CONFIG;
+
+#define REPLAY_JOIN_MS 10 // between nodes joining before a replay
+
+static int compare_doubles(const void * a, const void * b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double * sorted, int n, double p)
+{
+	if(n == 0) return 0;
+	int i = (int)ceil(p/100*n) - 1;
+	return sorted[i < 0 ? 0 : i];
+}
+
+static void netsim_config(NETSIM_CONFIG * config)
+{
+	NETSIM sim;
+	netsim_create(&sim,config->n_nodes,config->n_threads,config->seed,&config->link,config->poll);
+
+	pcg32_random_t rng = {config->seed, 0}; // for setting up the workload
+	netsim_build(&sim,config->join,&rng);
+
+	for(int i = 1; i < config->n_nodes; i++) // node 0 stays up
+		if(sim_uniform(&rng) < config->offline) sim.nodes[i].online = 0;
+
+	#define RANDOM_ONLINE_NODE(N) do N = pcg32_random_r(&rng) % config->n_nodes; while(!sim.nodes[N].online)
+
+	int n = config->n_lookups;
+	char (*data)[128] = (char(*)[128]) malloc(n*128);
+	int * puts = (int*) malloc(n*sizeof(int));
+
+	double start = netsim_now(&sim);
+	for(int i = 0; i < n; i++)
+	{
+		for(int j = 0; j < 128; j++) data[i][j] = pcg32_random_r(&rng);
+
+		HASH_ENTRY entry = {{0}, data[i], 128};
+		get_hash(&entry);
+
+		int node; RANDOM_ONLINE_NODE(node);
+		puts[i] = netsim_op(&sim,node,SIM_STORE,&entry,start + i*config->spacing);
+	}
+	netsim_run(&sim);
+
+	start = netsim_now(&sim);
+	int first = sim.n_ops;
+	for(int i = 0; i < n; i++)
+	{
+		int node; RANDOM_ONLINE_NODE(node);
+		netsim_op(&sim,node,SIM_FIND_VALUE,&sim.ops[puts[i]].entry,start + i*config->spacing);
+	}
+	netsim_run(&sim);
+
+	#undef RANDOM_ONLINE_NODE
+
+	double * latency = (double*) malloc(n*sizeof(double));
+	int queries = 0, timeouts = 0, failures = 0, sent = 0, lost = 0;
+	for(int i = 0; i < n; i++)
+	{
+		SIM_OP * op = &sim.ops[first+i];
+		latency[i] = op->end - op->start;
+		queries += op->queries;
+		timeouts += op->timeouts;
+		if(!netsim_found(op,&sim.ops[puts[i]])) failures++;
+	}
+	for(int i = 0; i < sim.n_shards; i++)
+	{
+		sent += sim.shards[i].sent;
+		lost += sim.shards[i].lost;
+	}
+	qsort(latency,n,sizeof(double),compare_doubles);
+
+	printf("k=%-3d alpha=%d  latency p50 %7.1fms  p90 %7.1fms  p99 %7.1fms  max %7.1fms  queries %5.2f  timeouts %5.2f  failures %4d  sent %7d  lost %5d\n",
+		N_CONTACTS, PARALLEL_QUERIES,
+		percentile(latency,n,50), percentile(latency,n,90), percentile(latency,n,99), percentile(latency,n,100),
+		queries/(double)n, timeouts/(double)n, failures, sent, lost);
+	fflush(stdout);
+
+	free(latency);
+	free(puts);
+	free(data);
+	netsim_free(&sim);
+}
+
+//
+//		Trace replay, main replay mode=netsim
+//
+
+void replay_netsim(REPLAY_CONFIG * config, REPLAY_OP * ops, int n_ops)
+{
+	static char data[REPLAY_MAX_SIZE];
+	log_level = LOG_ERROR;
+
+	NETSIM sim;
+	netsim_create(&sim,config->n_nodes,config->n_threads,config->seed,&config->link,config->poll);
+	pcg32_random_t rng = {config->seed, 0};
+	netsim_build(&sim,REPLAY_JOIN_MS,&rng);
+
+	double start = netsim_now(&sim);
+	double speed = config->speed > 0 ? config->speed : 1; // virtual time costs nothing
+	int first = sim.n_ops;
+	for(int i = 0; i < n_ops; i++)
+	{
+		HASH_ENTRY entry = {{0}, data, ops[i].size};
+		memcpy(entry.hash,ops[i].key,sizeof(K_ID));
+		int type = ops[i].type == TRACE_STORE ? SIM_STORE : ops[i].type == TRACE_FIND_VALUE ? SIM_FIND_VALUE : SIM_FIND_NODE;
+		netsim_op(&sim,ops[i].node,type,&entry,start + ops[i].time/speed);
+	}
+
+	netsim_run(&sim);
+
+	HISTOGRAM latency[3] = {0}; // in us, per request type
+	int found = 0, timeouts = 0;
+	for(int i = 0; i < n_ops; i++)
+	{
+		SIM_OP * op = &sim.ops[first+i];
+		hist_record(&latency[replay_kind(ops[i].type)],(uint64_t)((op->end - op->start)*1000));
+		timeouts += op->timeouts;
+		if(op->type == SIM_FIND_VALUE && op->result == 1) found++;
+	}
+
+	const char * names[3] = {"store", "find node", "find value"};
+	printf("%-11s %8s %9s %9s %9s\n", "", "count", "p50 ms", "p99 ms", "max ms");
+	for(int i = 0; i < 3; i++)
+		printf("%-11s %8llu %9.1f %9.1f %9.1f\n", names[i], (unsigned long long)latency[i].count,
+			hist_percentile(&latency[i],50)/1000.0, hist_percentile(&latency[i],99)/1000.0, latency[i].max/1000.0);
+	printf("found %d of %d values, %d timeouts\n", found, (int)latency[2].count, timeouts);
+
+	netsim_free(&sim);
+}
+
+int netsim_main(int argc, char * argv[])
+{
+	NETSIM_CONFIG config = {1000, 1000, 10, 10, 1000, 0, 1, 1, {LATENCY_EXPONENTIAL, 20, 30, 0, 0}};
+
+	for(int i = 0; i < argc; i++)
+	{
+		char model[32];
+		if(sscanf(argv[i],"nodes=%d",&config.n_nodes)==1) continue;
+		if(sscanf(argv[i],"lookups=%d",&config.n_lookups)==1) continue;
+		if(sscanf(argv[i],"spacing=%lf",&config.spacing)==1) continue;
+		if(sscanf(argv[i],"join=%lf",&config.join)==1) continue;
+		if(sscanf(argv[i],"poll=%lf",&config.poll)==1) continue;
+		if(sscanf(argv[i],"offline=%lf",&config.offline)==1) continue;
+		if(sscanf(argv[i],"seed=%u",&config.seed)==1) continue;
+		if(sscanf(argv[i],"threads=%d",&config.n_threads)==1) continue;
+		if(sscanf(argv[i],"latency=%lf",&config.link.latency)==1) continue;
+		if(sscanf(argv[i],"jitter=%lf",&config.link.jitter)==1) continue;
+		if(sscanf(argv[i],"loss=%lf",&config.link.loss)==1) continue;
+		if(sscanf(argv[i],"bandwidth=%lf",&config.link.bandwidth)==1) continue;
+		if(sscanf(argv[i],"model=%31s",model)==1 && link_model(model) >= 0)
+			{ config.link.model = link_model(model); continue; }
+
+		printf("unknown option: %s\n", argv[i]);
+		printf("options: nodes lookups spacing join poll offline seed threads latency jitter loss bandwidth\n");
+		printf("         model=constant|uniform|exponential|pareto\n");
+		return 1;
+	}
+	if(config.n_nodes < 2 || config.n_lookups < 1) { printf("need 2 nodes and 1 lookup\n"); return 1; }
+	if(config.n_threads < 1) config.n_threads = 1;
+	if(config.n_threads > 1 && config.link.latency <= 0) { printf("threads need a latency above 0\n"); return 1; }
+
+	log_level = LOG_ERROR;
+	printf("%d nodes, %d lookups, latency %.0fms + %.0fms jitter, loss %.3f, offline %.3f, poll %.0fms, seed %u, %d threads\n",
+		config.n_nodes, config.n_lookups, config.link.latency, config.link.jitter,
+		config.link.loss, config.offline, config.poll, config.seed, config.n_threads);
+
+	netsim_config(&config);
+	return 0;
+}
@@ -0,0 +1,147 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <atomic>
+
+#include "../../src/dht.h"
+#include "event.h"
+#include "stats.h"
+
+//
+//		Simulated transport
+//
+// Runs the client's node code, ../src/dht.c, over a TRANSPORT_SIM transport
+// whose messages are delivered by the event queue in virtual time. Each
+// node is a NODE with a thread running the node loop: the operations given
+// to it, node_poll, and a wait for messages. The lookups, stores, retries
+// and retransmission timeouts are the client's, clock_ms reads the virtual
+// clock and a wait (transport->wait) hands the thread back to the shard
+// until the semaphore is posted by a delivery or the timeout passes.
+//
+// Nodes can be split over shards that each run on their own thread, and
+// only one thread of a shard runs at a time: the shard's, or the node it
+// handed an event to. A shard only touches the state of its own nodes and
+// hands messages for other shards over through their mailboxes. The shards
+// advance together in windows as long as the smallest link latency, so
+// nothing sent in a window can arrive before it ends. Random draws and tie
+// breaks belong to the sending node, so the results do not depend on the
+// number of shards.
+//
+// Messages on a connection arrive in order as on a stream. A lost one is
+// sent again after NETSIM_RTO and the ones behind it wait for it, a node
+// that is offline drops what arrives and sends nothing.
+//
+
+#define NETSIM_FIRST_PORT 10000 // node i listens on NETSIM_FIRST_PORT + i
+#define NETSIM_RTO 200 // ms before a lost message is sent again
+#define NETSIM_STACK (1 << 20) // bytes of stack per node thread
+
+enum NETSIM_EVENTS { EVENT_DELIVER, EVENT_WAKE, EVENT_OP, EVENT_USER }; // EVENT_USER and up go to on_event
+enum NETSIM_OPS { SIM_STORE, SIM_FIND_VALUE, SIM_FIND_NODE, SIM_JOIN };
+
+typedef struct SIM_MESSAGE_t
+{
+	int from; // port
+	int to;   // node index
+	unsigned number; // on the sender's connection, see CONNECTION.udp_sent
+	int follows; // sent in the same instant as the one before, which it belongs to
+	MAIL mail; // for delivery to another shard
+	struct SIM_MESSAGE_t * next; // waiting for room at the node
+	int size;
+	char data[1];
+} SIM_MESSAGE;
+
+typedef struct
+{
+	int type; // NETSIM_OPS
+	int node;
+	HASH_ENTRY entry; // value to store or key to find, for SIM_FIND_VALUE the data found
+	int bootstrap; // node a SIM_JOIN joins through
+
+	double start, end; // virtual ms
+	int result;  // of kademlia_store_value, kademlia_find_value, kademlia_search or kademlia_join
+	int queries, timeouts; // requests the node sent and that timed out meanwhile
+	int done;
+	int skipped; // the node was offline when it was due
+	int next; // queued behind it on the node, -1 for none
+} SIM_OP;
+
+typedef struct
+{
+	int port;
+	double sent, delay, arrives; // of the last message on the connection
+} SIM_LINK;
+
+struct NETSIM_t;
+
+typedef struct
+{
+	NODE * node;
+	TRANSPORT transport;
+	struct NETSIM_t * sim;
+	int idx;
+	int online;
+
+	pthread_t thread;
+	sem_t run; // posted when the node's thread may go on
+	sem_t * waiting; // what it waits for, NULL while it runs
+	uint64_t wake; // seq of the EVENT_WAKE that ends the wait, 0 for none
+	int posted; // the last wait ended because waiting was posted
+	int idle; // waiting in the node loop, not in an operation
+	int first_op, last_op; // queued, -1 for none
+
+	SIM_MESSAGE * backlog; // arrived while the connection had no room, in order
+	SIM_LINK links[MAX_CONNECTIONS]; // by connection
+	pcg32_random_t rng;
+	unsigned seq; // orders events with the same time
+	double uplink_free; // when its uplink is next idle
+} SIM_NODE;
+
+typedef struct
+{
+	EVENT_QUEUE queue;
+	MAILBOX mailbox;
+	double next; // time of the next event once the mail is in
+	sem_t back; // posted when the node running on the shard waits
+	int sent, lost;
+	double bytes;
+	char pad[64]; // keep shards on separate cache lines
+} SHARD;
+
+typedef struct NETSIM_t
+{
+	SHARD * shards; // node i belongs to shard i % n_shards
+	int n_shards;
+	pthread_barrier_t barrier;
+
+	SIM_NODE * nodes;
+	int n_nodes;
+	LINK_MODEL link;
+	double poll; // ms between node_polls of an idle node, 0 only when messages arrive
+
+	SIM_OP * ops; // only added to between runs
+	int n_ops, max_ops;
+	std::atomic<int> pending; // ops not done, node threads left while stopping
+	int stopping;
+
+	void (*on_event)(struct NETSIM_t * sim, SIM_EVENT * event); // runs on the shard of the event
+	void * user;
+} NETSIM;
+
+void netsim_create(NETSIM * sim, int n_nodes, int n_shards, unsigned seed, LINK_MODEL * link, double poll); // the nodes know nobody yet
+void netsim_build(NETSIM * sim, double spacing, pcg32_random_t * rng); // node i joins through a random node before it, spacing ms apart
+void netsim_free(NETSIM * sim); // stops the node threads
+
+int netsim_op(NETSIM * sim, int node, int type, HASH_ENTRY * entry, double start); // queued to begin at virtual ms start, returns its index
+int netsim_join(NETSIM * sim, int node, int bootstrap, double start);
+void netsim_run(NETSIM * sim); // until every op is done
+void netsim_online(NETSIM * sim, int node, int online); // from on_event
+
+SHARD * netsim_shard(NETSIM * sim, int node);
+double netsim_now(NETSIM * sim); // of the shard furthest ahead
+uint64_t netsim_seq(NETSIM * sim, int node);
+int netsim_found(SIM_OP * get, SIM_OP * put); // the value a SIM_FIND_VALUE found is the one put stored
+
+#endif
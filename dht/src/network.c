@@ -0,0 +1,571 @@
+#include "netsim.h"
+
+//
+//		Simulated network, see netsim.h
+//
+
+static thread_local SHARD * this_shard; // of the calling thread, a shard or one of its nodes
+static thread_local SIM_NODE * this_node; // on a node's thread
+
+static unsigned netsim_clock()
+{
+	return this_shard ? (unsigned)this_shard->queue.now : 0;
+}
+
+SHARD * netsim_shard(NETSIM * sim, int node)
+{
+	return &sim->shards[node % sim->n_shards];
+}
+
+double netsim_now(NETSIM * sim)
+{
+	double now = 0;
+	for(int i = 0; i < sim->n_shards; i++)
+		if(sim->shards[i].queue.now > now) now = sim->shards[i].queue.now;
+	return now;
+}
+
+uint64_t netsim_seq(NETSIM * sim, int node)
+{
+	return ((uint64_t)node << 32) | ++sim->nodes[node].seq; // never 0, see SIM_NODE.wake
+}
+
+static int requests(NODE * node, int counter)
+{
+	// requests the node sent, or that timed out, over all its metrics shards
+	static const int types[] = {PING, STORE, FIND_NODE, FIND_VALUE, JOIN};
+	uint64_t n = 0;
+	for(METRICS_SHARD * shard = node->metrics->shards.load(); shard; shard = shard->next)
+	for(int i = 0; i < (int)(sizeof(types)/sizeof(types[0])); i++)
+		n += shard->counters[counter + types[i]].load(std::memory_order_relaxed);
+	return (int)n;
+}
+
+//
+//		Switching between a shard and its nodes
+//
+
+static void netsim_yield(SIM_NODE * node)
+{
+	// from the node's thread, until the shard lets it go on
+	sem_post(&netsim_shard(node->sim,node->idx)->back);
+	sem_wait(&node->run);
+}
+
+static void netsim_flush(SIM_NODE * node);
+
+static void netsim_resume(SIM_NODE * node, int posted)
+{
+	// from the shard's thread, runs the node until it waits again. Whatever
+	// it read may have made room for the backlog, and what arrived may be
+	// what it waits for now
+	for(;;)
+	{
+		node->waiting = NULL;
+		node->wake = 0;
+		node->posted = posted;
+		sem_post(&node->run);
+		sem_wait(&netsim_shard(node->sim,node->idx)->back);
+
+		netsim_flush(node);
+		if(!node->waiting || sem_trywait(node->waiting) != 0) return;
+		posted = 1;
+	}
+}
+
+static int netsim_wait(TRANSPORT * transport, sem_t * sem, unsigned timeout)
+{
+	if(sem_trywait(sem) == 0) return 1;
+	SIM_NODE * node = this_node;
+	if(timeout == 0 || !node) return 0;
+
+	node->waiting = sem;
+	node->wake = netsim_seq(node->sim,node->idx);
+	event_schedule(&this_shard->queue,this_shard->queue.now + timeout,node->wake,EVENT_WAKE,node);
+	netsim_yield(node);
+	return node->posted;
+}
+
+static void netsim_idle(SIM_NODE * node)
+{
+	// the node loop's wait, at most poll ms while the node is online
+	NETSIM * sim = node->sim;
+	if(sem_trywait(&node->transport.arrived) == 0) return;
+
+	node->idle = 1;
+	node->waiting = &node->transport.arrived;
+	if(sim->poll > 0 && node->online)
+	{
+		node->wake = netsim_seq(sim,node->idx);
+		event_schedule(&this_shard->queue,this_shard->queue.now + sim->poll,node->wake,EVENT_WAKE,node);
+	}
+	netsim_yield(node);
+	node->idle = 0;
+}
+
+//
+//		Transport
+//
+
+static int netsim_listen(TRANSPORT * transport)
+{
+	return 1;
+}
+
+static int netsim_open(TRANSPORT * transport, CONNECTION * connection, int port)
+{
+	// nothing to set up, what goes to a port without a node is lost
+	connection_reset(connection,port);
+	return 1;
+}
+
+static void netsim_close(CONNECTION * connection)
+{
+	sem_wait(&connection->mutex);
+	connection->live = 0;
+	connection->size = 0;
+	sem_post(&connection->mutex);
+	sem_post(&connection->ready);
+	sem_post(&connection->empty);
+}
+
+static void netsim_send(CONNECTION * connection, char * data, int size)
+{
+	// from the node's thread, a message sent in the same instant as the
+	// one before on the connection takes the same path, so the payload of
+	// an rpc arrives with it
+
+	SIM_NODE * node = this_node;
+	NETSIM * sim = node->sim;
+	SHARD * here = this_shard;
+	int to = connection->port - NETSIM_FIRST_PORT;
+	if(!node->online) return;
+
+	here->sent++;
+	here->bytes += size;
+	if(to < 0 || to >= sim->n_nodes) return;
+
+	SIM_LINK * link = &node->links[connection - node->transport.connections];
+	int follows = connection->udp_sent > 0 && link->port == connection->port && link->sent == here->queue.now;
+	if(!follows)
+	{
+		link->delay = link_delay(&sim->link,&node->rng);
+		while(sim_uniform(&node->rng) < sim->link.loss)
+		{
+			here->lost++;
+			link->delay += NETSIM_RTO;
+		}
+	}
+
+	double depart = here->queue.now;
+	if(sim->link.bandwidth > 0)
+	{
+		if(node->uplink_free > depart) depart = node->uplink_free;
+		depart += size / sim->link.bandwidth;
+		node->uplink_free = depart;
+	}
+	double arrives = depart + link->delay;
+	if(link->port == connection->port && arrives < link->arrives) arrives = link->arrives;
+	link->port = connection->port;
+	link->sent = here->queue.now;
+	link->arrives = arrives;
+
+	SIM_MESSAGE * msg = (SIM_MESSAGE*) malloc(sizeof(SIM_MESSAGE) + size);
+	msg->from = node->transport.port;
+	msg->to = to;
+	msg->number = ++connection->udp_sent;
+	msg->follows = follows;
+	msg->next = NULL;
+	msg->size = size;
+	memcpy(msg->data,data,size);
+
+	SHARD * there = netsim_shard(sim,to);
+	SIM_EVENT event = {arrives, netsim_seq(sim,node->idx), EVENT_DELIVER, msg};
+	if(here == there)
+		event_schedule(&here->queue,event.time,event.seq,event.type,event.data);
+	else
+	{
+		msg->mail.event = event;
+		mailbox_post(&there->mailbox,&msg->mail);
+	}
+}
+
+static void netsim_flush(SIM_NODE * node)
+{
+	// delivers the backlog in order, a message waits while one before it
+	// from the same peer does
+
+	SIM_MESSAGE ** next = &node->backlog;
+	while(*next)
+	{
+		SIM_MESSAGE * msg = *next;
+		int blocked = 0;
+		for(SIM_MESSAGE * before = node->backlog; before != msg && !blocked; before = before->next)
+			blocked = before->from == msg->from;
+		if(blocked) { next = &msg->next; continue; }
+
+		CONNECTION * connection = node->online ? transport_accept(&node->transport,msg->from) : NULL;
+		if(connection && msg->follows && connection->udp_message != msg->number - 1)
+			connection = NULL; // the rest of a message that was dropped
+		if(connection)
+		{
+			if(!connection_append(connection,msg->data,msg->size,0)) { next = &msg->next; continue; }
+			connection->udp_message = msg->number;
+		}
+		*next = msg->next;
+		free(msg);
+	}
+}
+
+static void netsim_deliver(NETSIM * sim, SIM_MESSAGE * msg)
+{
+	SIM_NODE * node = &sim->nodes[msg->to];
+	if(!node->online) { free(msg); return; }
+
+	SIM_MESSAGE ** last = &node->backlog;
+	while(*last) last = &(*last)->next;
+	*last = msg;
+	netsim_flush(node);
+	if(node->waiting && sem_trywait(node->waiting) == 0) netsim_resume(node,1);
+}
+
+//
+//		Nodes
+//
+
+static void netsim_do(SIM_NODE * node, SIM_OP * op)
+{
+	NETSIM * sim = node->sim;
+	NODE * self = node->node;
+	int queries = requests(self,METRIC_RPCS_SENT), timeouts = requests(self,METRIC_RPC_TIMEOUTS);
+	op->start = this_shard->queue.now;
+
+	switch(op->type)
+	{
+		case SIM_STORE:
+			op->result = kademlia_store_value(self,&op->entry);
+			break;
+		case SIM_FIND_VALUE:
+			op->entry.data = NULL;
+			op->result = kademlia_find_value(self,&op->entry,0);
+			break;
+		case SIM_FIND_NODE:
+		{
+			LOOKUP lookup = {{&self->info},1};
+			CONTACT * closest[N_CONTACTS] = {0};
+			op->result = kademlia_search(self,op->entry.hash,NULL,closest,&lookup);
+			break;
+		}
+		case SIM_JOIN:
+		{
+			CONTACT bootstrap = sim->nodes[op->bootstrap].node->info;
+			op->result = kademlia_join(self,&bootstrap);
+			break;
+		}
+	}
+
+	op->end = this_shard->queue.now;
+	op->queries = requests(self,METRIC_RPCS_SENT) - queries;
+	op->timeouts = requests(self,METRIC_RPC_TIMEOUTS) - timeouts;
+	op->done = 1;
+	sim->pending--;
+}
+
+static void * node_thread(void * data)
+{
+	SIM_NODE * node = (SIM_NODE*)data;
+	NETSIM * sim = node->sim;
+	this_node = node;
+	this_shard = netsim_shard(sim,node->idx);
+	sem_wait(&node->run);
+
+	while(!sim->stopping)
+	{
+		if(node->first_op >= 0)
+		{
+			SIM_OP * op = &sim->ops[node->first_op];
+			node->first_op = op->next;
+			if(node->first_op < 0) node->last_op = -1;
+			netsim_do(node,op);
+			continue;
+		}
+		if(!node_poll(node->node)) netsim_idle(node);
+	}
+
+	sim->pending--;
+	sem_post(&this_shard->back);
+	return NULL;
+}
+
+void netsim_online(NETSIM * sim, int idx, int online)
+{
+	// an idle node waits for messages while it is offline, it polls again
+	// once it is back
+	SIM_NODE * node = &sim->nodes[idx];
+	node->online = online;
+	if(online && node->idle && !node->wake) netsim_resume(node,0);
+}
+
+//
+//		Running shards
+//
+
+static void shard_window(NETSIM * sim, int idx, double end)
+{
+	// runs the shard's events up to but not including end
+
+	EVENT_QUEUE * queue = &sim->shards[idx].queue;
+	SIM_EVENT event;
+	while(event_time(queue) < end && event_next(queue,&event))
+	{
+		switch(event.type)
+		{
+			case EVENT_DELIVER:
+				netsim_deliver(sim,(SIM_MESSAGE*)event.data);
+				break;
+			case EVENT_WAKE:
+			{
+				SIM_NODE * node = (SIM_NODE*)event.data;
+				if(event.seq != node->wake) break; // the wait ended before
+				if(node->idle && !node->online && !sim->stopping) { node->wake = 0; break; }
+				netsim_resume(node,0);
+				break;
+			}
+			case EVENT_OP:
+			{
+				SIM_OP * op = &sim->ops[(intptr_t)event.data];
+				SIM_NODE * node = &sim->nodes[op->node];
+				if(!node->online)
+				{
+					op->start = op->end = queue->now;
+					op->done = op->skipped = 1;
+					sim->pending--;
+					break;
+				}
+				if(node->last_op >= 0) sim->ops[node->last_op].next = (int)(op - sim->ops);
+				else node->first_op = (int)(op - sim->ops);
+				node->last_op = (int)(op - sim->ops);
+				if(node->idle) netsim_resume(node,0);
+				break;
+			}
+			default:
+				sim->on_event(sim,&event);
+		}
+	}
+}
+
+static double netsim_window(NETSIM * sim)
+{
+	// anything sent in a window arrives after it ends
+	return sim->link.latency > 0 ? sim->link.latency : 1;
+}
+
+typedef struct
+{
+	NETSIM * sim;
+	int idx;
+	pthread_t thread;
+} SHARD_THREAD;
+
+static void * shard_thread(void * arg)
+{
+	NETSIM * sim = ((SHARD_THREAD*)arg)->sim;
+	int idx = ((SHARD_THREAD*)arg)->idx;
+	SHARD * shard = &sim->shards[idx];
+	this_shard = shard;
+
+	for(;;)
+	{
+		// no shard runs between the barriers, so they all see the same pending
+		mailbox_deliver(&shard->mailbox,&shard->queue);
+		shard->next = sim->pending > 0 ? event_time(&shard->queue) : HUGE_VAL;
+		pthread_barrier_wait(&sim->barrier);
+
+		double next = HUGE_VAL;
+		for(int i = 0; i < sim->n_shards; i++)
+			if(sim->shards[i].next < next) next = sim->shards[i].next;
+		if(next == HUGE_VAL) break;
+
+		shard_window(sim,idx,next + netsim_window(sim));
+		pthread_barrier_wait(&sim->barrier);
+	}
+	return NULL;
+}
+
+void netsim_run(NETSIM * sim)
+{
+	// a run stops at the end of the window the last op finished in, for
+	// any number of shards
+
+	if(sim->n_shards == 1)
+	{
+		this_shard = &sim->shards[0];
+		double next;
+		while(sim->pending > 0 && (next = event_time(&this_shard->queue)) != HUGE_VAL)
+			shard_window(sim,0,next + netsim_window(sim));
+		this_shard = NULL;
+		return;
+	}
+
+	SHARD_THREAD * threads = (SHARD_THREAD*) calloc(sim->n_shards,sizeof(SHARD_THREAD));
+	pthread_barrier_init(&sim->barrier,NULL,sim->n_shards);
+
+	for(int i = 0; i < sim->n_shards; i++)
+	{
+		threads[i].sim = sim;
+		threads[i].idx = i;
+		pthread_create(&threads[i].thread,NULL,shard_thread,&threads[i]);
+	}
+	for(int i = 0; i < sim->n_shards; i++)
+		pthread_join(threads[i].thread,NULL);
+
+	pthread_barrier_destroy(&sim->barrier);
+	free(threads);
+}
+
+int netsim_op(NETSIM * sim, int node, int type, HASH_ENTRY * entry, double start)
+{
+	HASH_ENTRY copy = {{0}}; // entry may be one of the ops, which can move
+	if(entry) copy = *entry;
+
+	if(sim->n_ops == sim->max_ops)
+	{
+		sim->max_ops = sim->max_ops ? sim->max_ops*2 : 64;
+		sim->ops = (SIM_OP*) realloc(sim->ops,sim->max_ops*sizeof(SIM_OP));
+	}
+	int id = sim->n_ops++;
+
+	SIM_OP * op = &sim->ops[id];
+	memset(op,0,sizeof(SIM_OP));
+	op->type = type;
+	op->node = node;
+	op->next = -1;
+	op->entry = copy;
+	if(type == SIM_FIND_VALUE) op->entry.data = NULL;
+
+	sim->pending++;
+	event_schedule(&netsim_shard(sim,node)->queue, start, netsim_seq(sim,node), EVENT_OP, (void*)(intptr_t)id);
+	return id;
+}
+
+int netsim_join(NETSIM * sim, int node, int bootstrap, double start)
+{
+	int id = netsim_op(sim,node,SIM_JOIN,NULL,start);
+	sim->ops[id].bootstrap = bootstrap;
+	return id;
+}
+
+int netsim_found(SIM_OP * get, SIM_OP * put)
+{
+	return get->result == 1 && get->entry.data && get->entry.size == put->entry.size &&
+		memcmp(get->entry.data,put->entry.data,put->entry.size) == 0;
+}
+
+//
+//		Setting up
+//
+
+void netsim_create(NETSIM * sim, int n_nodes, int n_shards, unsigned seed, LINK_MODEL * link, double poll)
+{
+	memset(sim,0,sizeof(NETSIM));
+	sim->shards = (SHARD*) calloc(n_shards,sizeof(SHARD));
+	sim->n_shards = n_shards;
+	sim->nodes = (SIM_NODE*) calloc(n_nodes,sizeof(SIM_NODE));
+	sim->n_nodes = n_nodes;
+	sim->link = *link;
+	sim->poll = poll;
+	for(int i = 0; i < n_shards; i++) sem_init(&sim->shards[i].back,0,0);
+	virtual_clock = netsim_clock;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr,NETSIM_STACK);
+
+	for(int i = 0; i < n_nodes; i++)
+	{
+		SIM_NODE * node = &sim->nodes[i];
+		node->sim = sim;
+		node->idx = i;
+		node->online = 1;
+		node->first_op = node->last_op = -1;
+		node->rng.state = seed;
+		node->rng.inc = i*2+1; // one stream per node
+		sem_init(&node->run,0,0);
+
+		TRANSPORT * transport = &node->transport;
+		transport_create(transport,TRANSPORT_SIM,NETSIM_FIRST_PORT+i,MAX_CONNECTIONS);
+		transport->listen = netsim_listen; transport->open = netsim_open;
+		transport->send = netsim_send; transport->close = netsim_close;
+		transport->wait = netsim_wait;
+		transport_listen(transport);
+
+		node->node = (NODE*) calloc(1,sizeof(NODE));
+		node_init(node->node,transport,transport->port);
+
+		// the thread waits to be woken for the first time at 0
+		node->wake = netsim_seq(sim,i);
+		event_schedule(&netsim_shard(sim,i)->queue,0,node->wake,EVENT_WAKE,node);
+		pthread_create(&node->thread,&attr,node_thread,node);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void netsim_build(NETSIM * sim, double spacing, pcg32_random_t * rng)
+{
+	double start = netsim_now(sim);
+	for(int i = 1; i < sim->n_nodes; i++)
+		netsim_join(sim,i,pcg32_random_r(rng) % i,start + i*spacing);
+	netsim_run(sim);
+}
+
+void netsim_free(NETSIM * sim)
+{
+	// wakes the idle nodes and runs until every node left its loop, a
+	// node in an rpc finishes it first
+
+	sim->stopping = 1;
+	sim->pending = sim->n_nodes;
+	for(int i = 0; i < sim->n_nodes; i++)
+	{
+		SIM_NODE * node = &sim->nodes[i];
+		if(!node->idle) continue;
+		SHARD * shard = netsim_shard(sim,i);
+		node->wake = netsim_seq(sim,i);
+		event_schedule(&shard->queue,shard->queue.now,node->wake,EVENT_WAKE,node);
+	}
+	netsim_run(sim);
+
+	for(int i = 0; i < sim->n_shards; i++)
+	{
+		SHARD * shard = &sim->shards[i];
+		mailbox_deliver(&shard->mailbox,&shard->queue);
+		SIM_EVENT event;
+		while(event_next(&shard->queue,&event))
+			if(event.type == EVENT_DELIVER) free(event.data);
+		event_free(&shard->queue);
+		sem_destroy(&shard->back);
+	}
+
+	for(int i = 0; i < sim->n_nodes; i++)
+	{
+		SIM_NODE * node = &sim->nodes[i];
+		pthread_join(node->thread,NULL);
+		while(node->backlog)
+		{
+			SIM_MESSAGE * msg = node->backlog;
+			node->backlog = msg->next;
+			free(msg);
+		}
+		node_free(node->node);
+		free(node->node);
+		transport_close(&node->transport);
+		sem_destroy(&node->run);
+	}
+	for(int i = 0; i < sim->n_ops; i++)
+		if(sim->ops[i].type == SIM_FIND_VALUE) free(sim->ops[i].entry.data);
+
+	virtual_clock = NULL;
+	free(sim->ops);
+	free(sim->nodes);
+	free(sim->shards);
+}
@@ -0,0 +1,208 @@
+#include "time.h"
+
+#include "sim.h"
+#include "replay.h"
+
+//
+//		Trace replay
+//
+// main replay <trace file> [name=value...]
+//
+// Feeds the requests in an rpc trace recorded by the client (main <port>
+// <bootstrap> <trace file>) into a simulated network. Every peer in the
+// trace is mapped to a node of the network and the recording node is node
+// 0. A lookup in the client sends the same request to several contacts, so
+// requests from the same node for the same key within REPLAY_WINDOW_MS
+// are replayed once.
+//
+// mode=inproc runs them through kademlia_search in real time, divided by
+// speed= (0 runs them back to back), mode=netsim runs them on client nodes
+// over the simulated transport in virtual time, see netsim.c. The same
+// trace and seed replay the same operations, so two builds can be compared
+// on identical traffic.
+//
+
+static int peer_node(TRACE_RECORD * record, int n_nodes)
+{
+	// any node but the recording one, the same one for the same peer
+	uint32_t h = record->ip * 2654435761u ^ record->port * 40503u;
+	return 1 + h % (n_nodes-1);
+}
+
+int replay_kind(int type)
+{
+	// the position of a replayed request type in the per type counts
+	return type == TRACE_STORE ? 0 : type == TRACE_FIND_NODE ? 1 : type == TRACE_FIND_VALUE ? 2 : -1;
+}
+
+static const char * trace_rpc_name(int type)
+{
+	static const char * names[] = {TRACE_RPC_NAMES};
+	return type >= 0 && type < TRACE_N_RPCS ? names[type] : "unknown";
+}
+
+static REPLAY_OP * replay_load(REPLAY_CONFIG * config, int id_len, int * n_ops)
+{
+	// reads the requests of the trace, returns NULL if it can not be read
+
+	TRACE trace;
+	if(!trace_open(&trace,config->path)) { printf("%s is not an rpc trace\n", config->path); return NULL; }
+	if(trace.id_len != id_len)
+	{
+		printf("%s has %d byte ids, the simulation uses %d\n", config->path, trace.id_len, id_len);
+		trace_close(&trace);
+		return NULL;
+	}
+
+	REPLAY_OP * ops = NULL;
+	int max_ops = 0, n_records = 0, n_requests = 0;
+	*n_ops = 0;
+
+	TRACE_RECORD record;
+	while(trace_read(&trace,&record))
+	{
+		n_records++;
+		if(config->print)
+		{
+			printf("%8u %-8s %3d.%d.%d.%d:%-5u %-11s %6u ", record.time_ms,
+				record.direction == TRACE_SENT ? "sent to" : "from",
+				record.ip & 0xff, (record.ip >> 8) & 0xff, (record.ip >> 16) & 0xff, record.ip >> 24,
+				record.port, trace_rpc_name(record.type), record.size);
+			for(int i = 0; i < 8 && i < id_len; i++) printf("%02x", record.key[i]);
+			printf("\n");
+		}
+		if(replay_kind(record.type) < 0) continue;
+		n_requests++;
+
+		REPLAY_OP op = {0};
+		op.time = record.time_ms;
+		op.node = record.direction == TRACE_SENT ? 0 : peer_node(&record,config->n_nodes);
+		op.type = record.type;
+		op.size = record.size < REPLAY_MAX_SIZE ? record.size : REPLAY_MAX_SIZE;
+		memcpy(op.key,record.key,id_len);
+
+		int duplicate = 0;
+		for(int i = *n_ops-1; i >= 0 && op.time - ops[i].time < REPLAY_WINDOW_MS && !duplicate; i--)
+			duplicate = ops[i].node == op.node && ops[i].type == op.type && memcmp(ops[i].key,op.key,id_len) == 0;
+		if(duplicate) continue;
+
+		if(*n_ops == max_ops) ops = (REPLAY_OP*) realloc(ops,(max_ops = max_ops ? max_ops*2 : 256)*sizeof(REPLAY_OP));
+		ops[(*n_ops)++] = op;
+	}
+	trace_close(&trace);
+
+	printf("%d records, %d requests, %d operations over %.1fs\n", n_records, n_requests, *n_ops,
+		*n_ops ? ops[*n_ops-1].time/1000 : 0);
+	return ops;
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+	uint64_t now = stats_clock_ns();
+	if(now >= deadline_ns) return;
+	struct timespec ts = {(time_t)((deadline_ns-now)/1000000000), (long)((deadline_ns-now)%1000000000)};
+	nanosleep(&ts,NULL);
+}
+
+template<class P> void replay_inproc(REPLAY_CONFIG * config, REPLAY_OP * ops, int n_ops)
+{
+	typedef HASH_ENTRY_T<P> HASH_ENTRY;
+	static char data[REPLAY_MAX_SIZE]; // what stores store
+
+	NODE_T<P> ** all_nodes = network<P>()->nodes;
+	int counts[3] = {0}, found = 0;
+
+	lookup_stats_reset();
+	uint64_t start = stats_clock_ns();
+	for(int i = 0; i < n_ops; i++)
+	{
+		if(config->speed > 0) sleep_until(start + (uint64_t)(ops[i].time/config->speed*1000000));
+
+		NODE_T<P> * node = all_nodes[ops[i].node];
+		HASH_ENTRY entry = {{0}};
+		memcpy(entry.hash,ops[i].key,P::id_len);
+		counts[replay_kind(ops[i].type)]++;
+
+		if(ops[i].type == TRACE_STORE)
+		{
+			entry.data = data;
+			entry.size = ops[i].size;
+			kademlia_store_value(node,&entry);
+		}
+		else if(ops[i].type == TRACE_FIND_VALUE)
+		{
+			kademlia_find_value(node,&entry);
+			if(entry.data) found++;
+		}
+		else
+		{
+			CONTACT_T<P> * closest[P::k] = {0};
+			kademlia_search(node,entry.hash,closest);
+		}
+	}
+	double elapsed = (stats_clock_ns() - start)/1e9;
+
+	printf("stores %d, find nodes %d, find values %d (found %d) in %.2fs, %.0f ops/s\n",
+		counts[0], counts[1], counts[2], found, elapsed, n_ops/elapsed);
+	lookup_stats_print(&lookup_stats);
+}
+
+template<class P> void replay_config(REPLAY_CONFIG * config)
+{
+	int n_ops;
+	REPLAY_OP * ops = replay_load(config,P::id_len,&n_ops);
+	if(!ops) return;
+
+	if(config->mode == REPLAY_NETSIM) replay_netsim(config,ops,n_ops);
+	else
+	{
+		srand(config->seed);
+		build_network<P>(config->n_nodes);
+		replay_inproc<P>(config,ops,n_ops);
+		network_free<P>();
+	}
+	free(ops);
+}
+
+int replay_main(int argc, char * argv[])
+{
+	REPLAY_CONFIG config = {NULL, REPLAY_INPROC, 1, 1000, 1, 0, 1, {LATENCY_EXPONENTIAL, 20, 30, 0, 0}, 1000};
+
+	for(int i = 0; i < argc; i++)
+	{
+		char name[32];
+		if(sscanf(argv[i],"speed=%lf",&config.speed)==1) continue;
+		if(sscanf(argv[i],"nodes=%d",&config.n_nodes)==1) continue;
+		if(sscanf(argv[i],"seed=%u",&config.seed)==1) continue;
+		if(sscanf(argv[i],"print=%d",&config.print)==1) continue;
+		if(sscanf(argv[i],"threads=%d",&config.n_threads)==1) continue;
+		if(sscanf(argv[i],"poll=%lf",&config.poll)==1) continue;
+		if(sscanf(argv[i],"latency=%lf",&config.link.latency)==1) continue;
+		if(sscanf(argv[i],"jitter=%lf",&config.link.jitter)==1) continue;
+		if(sscanf(argv[i],"loss=%lf",&config.link.loss)==1) continue;
+		if(sscanf(argv[i],"bandwidth=%lf",&config.link.bandwidth)==1) continue;
+		if(sscanf(argv[i],"model=%31s",name)==1 && link_model(name) >= 0)
+			{ config.link.model = link_model(name); continue; }
+		if(strcmp(argv[i],"mode=inproc")==0) { config.mode = REPLAY_INPROC; continue; }
+		if(strcmp(argv[i],"mode=netsim")==0) { config.mode = REPLAY_NETSIM; continue; }
+		if(!strchr(argv[i],'=') && !config.path) { config.path = argv[i]; continue; }
+
+		printf("unknown option: %s\n", argv[i]);
+		config.path = NULL;
+		break;
+	}
+	if(!config.path)
+	{
+		printf("usage: main replay <trace file> [name=value...]\n");
+		printf("options: mode=inproc|netsim speed (1 as recorded, 0 back to back) nodes seed print\n");
+		printf("         for netsim: threads poll latency jitter loss bandwidth model\n");
+		return 1;
+	}
+	if(config.n_nodes < 2) { printf("need 2 nodes\n"); return 1; }
+	if(config.n_threads < 1) config.n_threads = 1;
+	if(config.n_threads > 1 && config.link.latency <= 0) { printf("threads need a latency above 0\n"); return 1; }
+
+	quiet = 1;
+	replay_config< KADEMLIA >(&config);
+	return 0;
+}
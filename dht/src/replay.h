@@ -0,0 +1,41 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "event.h"
+#include "../../src/trace.h"
+
+//
+//		Trace replay, see replay.c
+//
+
+#define REPLAY_WINDOW_MS 1000
+#define REPLAY_MAX_SIZE 4096 // stored values are cut to this
+
+enum REPLAY_MODES { REPLAY_INPROC, REPLAY_NETSIM };
+
+typedef struct
+{
+	const char * path;
+	int mode;
+	double speed;
+	int n_nodes;
+	unsigned seed;
+	int print;
+	int n_threads;
+	LINK_MODEL link;
+	double poll; // ms between node_polls of an idle node
+} REPLAY_CONFIG;
+
+typedef struct
+{
+	double time; // ms since the start of the trace
+	int node;
+	int type;    // TRACE_STORE, TRACE_FIND_NODE or TRACE_FIND_VALUE
+	int size;
+	unsigned char key[TRACE_MAX_ID_LEN];
+} REPLAY_OP;
+
+int replay_kind(int type); // the position of a replayed request type in the per type counts, -1 if it is not replayed
+void replay_netsim(REPLAY_CONFIG * config, REPLAY_OP * ops, int n_ops); // in netsim.c, the nodes run the client's code
+
+#endif
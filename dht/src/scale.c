@@ -0,0 +1,87 @@
+#include "sim.h"
+
+//
+//		Scaling benchmark
+//
+// Grows a network with build_network, then stores and finds random values
+// and reports memory and throughput for each size.
+//
+
+#define SCALE_LOOKUPS 1000
+
+template<class P> size_t node_bytes(NODE_T<P> * node)
+{
+	// everything the network holds for one node, contacts point at the
+	// other node's info so they are not counted twice
+	return sizeof(NODE_T<P>*) + sizeof(NODE_T<P>)
+		+ routing_table_bytes(node->contacts)
+		+ node->table.capacity*sizeof(HASH_ENTRY_T<P>);
+}
+
+template<class P> void scale_network(int n_nodes)
+{
+	typedef HASH_ENTRY_T<P> HASH_ENTRY;
+
+	srand(0);
+	clock_t start = clock();
+	NODE_T<P> ** all_nodes = build_network<P>(n_nodes);
+	double build_seconds = (double)(clock() - start)/CLOCKS_PER_SEC;
+
+	static char rand_data[SCALE_LOOKUPS][128];
+	static HASH_ENTRY hashes[SCALE_LOOKUPS];
+	int store_queries = 0, find_queries = 0, failures = 0;
+
+	for(int i = 0; i < SCALE_LOOKUPS; i++)
+	{
+		for(int j = 0; j < 128; j++) rand_data[i][j] = rand();
+
+		hashes[i].data = rand_data[i];
+		hashes[i].size = 128;
+		get_hash(&hashes[i]);
+		store_queries += kademlia_store_value(all_nodes[rand()%n_nodes],&hashes[i]);
+	}
+
+	start = clock();
+	for(int i = 0; i < SCALE_LOOKUPS; i++)
+	{
+		HASH_ENTRY tmp = hashes[i];
+		tmp.data = NULL;
+		find_queries += kademlia_find_value(all_nodes[rand()%n_nodes],&tmp);
+		if(tmp.data != hashes[i].data) failures++;
+	}
+	double seconds = (double)(clock() - start)/CLOCKS_PER_SEC;
+
+	size_t bytes = 0;
+	for(int i = 0; i < n_nodes; i++) bytes += node_bytes(all_nodes[i]);
+
+	printf("nodes %7d  build %7.2fs  %7.0f bytes/node  store queries %6.2f  find queries %6.2f  failures %4d  %8.0f lookups/s\n",
+		n_nodes, build_seconds, (double)bytes/n_nodes,
+		store_queries/(double)SCALE_LOOKUPS, find_queries/(double)SCALE_LOOKUPS, failures,
+		seconds > 0 ? SCALE_LOOKUPS/seconds : 0);
+	fflush(stdout);
+
+	network_free<P>();
+}
+
+int scale_main(int argc, char * argv[])
+{
+	// main scale [nodes...], defaults to 1k, 10k and 100k nodes
+
+	quiet = 1;
+	printf("k=%d alpha=%d B=%d, %d stores and lookups per size\n",
+		KADEMLIA::k, KADEMLIA::alpha, KADEMLIA::bits, SCALE_LOOKUPS);
+
+	if(argc == 0)
+	{
+		scale_network<KADEMLIA>(1000);
+		scale_network<KADEMLIA>(10000);
+		scale_network<KADEMLIA>(100000);
+	}
+	for(int i = 0; i < argc; i++)
+	{
+		int n_nodes = atoi(argv[i]);
+		if(n_nodes > 1) scale_network<KADEMLIA>(n_nodes);
+		else printf("bad network size: %s\n", argv[i]);
+	}
+	return 0;
+}
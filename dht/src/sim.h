@@ -0,0 +1,342 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "stdint.h"
+
+#include "../../src/kademlia.h"
+#include "stats.h"
+
+//
+//		This implementation of a DHT protocol is based on Kademlia:
+//		http://xlattice.sourceforge.net/components/protocol/kademlia/specs.html
+//
+
+// Kademlia is parameterized by alpha, B, and k:
+// 	N_CONTACTS is K=20 in the kademlia spec
+// 	K_ID_LEN is (B=160)/8 (the number of bytes in a hash id)
+//	PARRALLEL_QUERIES is alpha=3 in the spec
+
+//	alpha controls how many peers are queried in parallel for the lookup operations
+// 	we are using alpha = 1 for simplicity of implementation.
+
+// The simulation is a template on KADEMLIA_PARAMS so that several
+// configurations can be run side by side, these are the defaults.
+
+#define PARALLEL_QUERIES 1
+#define N_CONTACTS 5
+#define K_ID_LEN 20
+#define N_NODES 64
+#define N_REPLACEMENTS 20
+#define MAX_QUERIED 256 // nodes one lookup may query
+#define RPC_HEADER_SIZE 16 // type, sender and payload size in front of every message
+
+typedef KADEMLIA_PARAMS<N_CONTACTS,PARALLEL_QUERIES,K_ID_LEN*8> KADEMLIA;
+
+template<class P>
+struct CONTACT_T
+{
+	typename P::K_ID id;
+	unsigned idx; // this is for our simulation only, stands in for the ip
+	unsigned last_seen;
+};
+
+template<class P>
+struct NODE_T
+{
+	CONTACT_T<P> info;
+	HASH_STORE_T<P> table; // grows with what the node stores
+	BUCKET_TREE_T<P,CONTACT_T<P> > * contacts;
+	int is_online;
+};
+
+typedef KADEMLIA::K_ID K_ID; // a 160 bit value
+typedef HASH_ENTRY_T<KADEMLIA> HASH_ENTRY;
+typedef HASH_ENTRY HASH_TABLE[HASH_TABLE_SIZE];
+typedef CONTACT_T<KADEMLIA> CONTACT;
+typedef NODE_T<KADEMLIA> NODE;
+
+template<class P>
+struct NETWORK_T
+{
+	NODE_T<P> ** nodes; // NULL until the node is created
+	int n_nodes;
+};
+
+extern int quiet; // only print summaries
+
+template<class P> NETWORK_T<P> * network()
+{
+	// one network per configuration
+	static NETWORK_T<P> net = {NULL,0};
+	return &net;
+}
+
+template<class P> NODE_T<P> ** network_create(int n_nodes)
+{
+	NETWORK_T<P> * net = network<P>();
+	net->nodes = (NODE_T<P>**) calloc(n_nodes,sizeof(NODE_T<P>*));
+	net->n_nodes = n_nodes;
+	return net->nodes;
+}
+
+template<class P> NODE_T<P> * network_node(int idx)
+{
+	// nodes are only allocated once they take part in the simulation
+	NETWORK_T<P> * net = network<P>();
+	if(!net->nodes[idx]) net->nodes[idx] = (NODE_T<P>*) calloc(1,sizeof(NODE_T<P>));
+	return net->nodes[idx];
+}
+
+template<class P> void network_free()
+{
+	NETWORK_T<P> * net = network<P>();
+	for(int i = 0; i < net->n_nodes; i++)
+	{
+		NODE_T<P> * node = net->nodes[i];
+		if(!node) continue;
+		free_routing_table(node->contacts);
+		free(node->table.entries);
+		free(node);
+	}
+	free(net->nodes);
+	net->nodes = NULL;
+	net->n_nodes = 0;
+}
+
+template<class P> void add_contact(NODE_T<P> * node, CONTACT_T<P> * contact)
+{
+	if(hash_equ<P::id_len>(contact->id,node->info.id)) return;
+	if(search_contacts(node->contacts,contact->id)) return;
+	
+	insert_contact(&node->contacts,node->info.id,contact);
+}
+
+template<class P> void list_contacts(BUCKET_TREE_T<P,CONTACT_T<P> > * tree)
+{
+	if(tree->children[0])
+	{
+		list_contacts(tree->children[0]);
+		list_contacts(tree->children[1]);
+	}
+	else
+	{
+		BUCKET_T<P,CONTACT_T<P> > * bucket = tree->bucket;
+		
+		printf("Tree Node: "); hash_print<P::id_len>(tree->min); printf("-"); hash_print<P::id_len>(tree->max); printf("\n");
+		for(int i = 0; i < bucket->n_contacts; i++)
+		{
+			printf("\tContact %d: ", bucket->contacts[i]->idx); hash_print<P::id_len>(bucket->contacts[i]->id); printf("\n");
+		}
+	}	
+}
+
+//
+//		Remote Procedure Call (RPC) interface
+//
+
+template<class P> int rpc_ping(NODE_T<P> * sender, CONTACT_T<P> * contact)
+{	
+	NODE_T<P> * node = network<P>()->nodes[contact->idx];
+	if(node && node->is_online) 
+	{
+		contact->last_seen = time(NULL);
+		add_contact(sender,contact);
+		add_contact(node,&sender->info);
+	}
+	return node && node->is_online;
+}
+
+template<class P> void rpc_store_value(NODE_T<P> * sender, CONTACT_T<P> * contact, HASH_ENTRY_T<P> * entry)
+{
+	if(!rpc_ping(sender,contact)) return;
+	NODE_T<P> * node = network<P>()->nodes[contact->idx];	
+	hash_insert(&node->table,entry);
+}
+
+template<class P> int rpc_find_node(NODE_T<P> * sender, CONTACT_T<P> * contact, unsigned char * hash, CONTACT_T<P> ** closest)
+{
+	// iterate on all buckets of contacts
+	// to find the nodes closest to the desired hash
+	
+	if(!rpc_ping(sender,contact)) return 0;	
+	NODE_T<P> * node = network<P>()->nodes[contact->idx];
+	
+	//printf("searching %d\n",node->info.idx);
+	
+	get_closest_contacts(node->contacts,hash,closest);
+	/*
+	for(int i = 0; closest[i] && i < N_CONTACTS; i++)
+	{
+		printf("\t %d ", closest[i]->idx); hash_print(closest[i]->id); printf("\n");
+	}*/
+	return 1;
+}
+
+template<class P> int rpc_find_value(NODE_T<P> * sender, CONTACT_T<P> * contact, HASH_ENTRY_T<P> * entry, CONTACT_T<P> ** closest)
+{
+	if(!rpc_ping(sender,contact)) return 0;
+	NODE_T<P> * node = network<P>()->nodes[contact->idx];
+	
+	hash_search(&node->table,entry);
+	
+	if(!entry->data) rpc_find_node(sender,contact,entry->hash,closest);
+	return 1;
+}
+
+template<class P> int found_node_size(CONTACT_T<P> ** closest)
+{
+	int size = RPC_HEADER_SIZE + P::id_len;
+	for(int i = 0; i < P::k && closest[i]; i++) size += P::id_len + 6; // id, ip and port
+	return size;
+}
+
+//
+//		Kademlia Operations
+//
+// The lookup is kademlia_lookup from kademlia.h, the one the nodes run,
+// with rpcs that call straight into the other node.
+//
+
+template<class P>
+struct SEARCH_T
+{
+	// the state of one kademlia_lookup
+	CONTACT_T<P> * exclusion[MAX_QUERIED]; // queried already, our own info first
+	int n_exclusion;
+	char answered[MAX_QUERIED];
+	int rounds, queries;
+	LOOKUP_SAMPLE sample;
+};
+
+template<class P> void search_count(SEARCH_T<P> * search, int answered, HASH_ENTRY_T<P> * entry, CONTACT_T<P> ** closest)
+{
+	// the traffic of one query
+	LOOKUP_SAMPLE * sample = &search->sample;
+	sample->rpcs++;
+	sample->bytes += RPC_HEADER_SIZE + P::id_len;
+	if(!answered) sample->failed++;
+	else if(entry && entry->data) sample->bytes += RPC_HEADER_SIZE + P::id_len + entry->size;
+	else sample->bytes += found_node_size<P>(closest);
+}
+
+template<class P>
+struct DIRECT_RPCS
+{
+	typedef CONTACT_T<P> CONTACT;
+
+	static void closest_contacts(NODE_T<P> * node, unsigned char * hash, CONTACT ** closest, SEARCH_T<P> * search)
+	{
+		rpc_find_node(node,&node->info,hash,closest);
+	}
+
+	static int find_node(NODE_T<P> * node, CONTACT * contact, unsigned char * hash, CONTACT ** closest, SEARCH_T<P> * search)
+	{
+		int answered = rpc_find_node(node,contact,hash,closest);
+		search_count(search,answered,(HASH_ENTRY_T<P>*)NULL,closest);
+		return answered;
+	}
+
+	static int find_value(NODE_T<P> * node, CONTACT * contact, HASH_ENTRY_T<P> * entry, CONTACT ** closest, SEARCH_T<P> * search)
+	{
+		int answered = rpc_find_value(node,contact,entry,closest);
+		search_count(search,answered,entry,closest);
+		return answered;
+	}
+
+	static void cache_value(NODE_T<P> * node, CONTACT * contact, HASH_ENTRY_T<P> * entry)
+	{
+		rpc_store_value(node,contact,entry);
+	}
+
+	static int store_values(NODE_T<P> * node, CONTACT ** closest, HASH_ENTRY_T<P> * entry)
+	{
+		int n = 0;
+		for(; n < P::k && closest[n]; n++)
+		{
+			if(!quiet) { printf("Storing data to node %d: ",closest[n]->idx); hash_print<P::id_len>(closest[n]->id); printf("\n"); }
+			rpc_store_value(node,closest[n],entry);
+		}
+		return n;
+	}
+};
+
+template<class P> void search_start(NODE_T<P> * node, SEARCH_T<P> * search)
+{
+	memset(search,0,sizeof(SEARCH_T<P>));
+	search->exclusion[0] = &node->info;
+	search->n_exclusion = 1;
+	search->sample.wall_ns = stats_clock_ns();
+}
+
+template<class P> int search_end(SEARCH_T<P> * search)
+{
+	// records the lookup into lookup_stats, returns the number of nodes queried
+	search->sample.hops = search->rounds;
+	search->sample.wall_ns = stats_clock_ns() - search->sample.wall_ns;
+	lookup_stats_record(&lookup_stats,&search->sample);
+	return search->queries;
+}
+
+template<class P> int kademlia_search(NODE_T<P> * node, unsigned char * hash, CONTACT_T<P> ** closest)
+{
+	SEARCH_T<P> search;
+	search_start(node,&search);
+	kademlia_lookup<P,DIRECT_RPCS<P> >(node,hash,(HASH_ENTRY_T<P>*)NULL,closest,&search);
+	return search_end(&search);
+}
+
+template<class P> int kademlia_store_value(NODE_T<P> * node, HASH_ENTRY_T<P> * entry)
+{
+	SEARCH_T<P> search;
+	CONTACT_T<P> * closest[P::k] = {0};
+	
+	if(!quiet) { printf("finding nodes closest to "); hash_print<P::id_len>(entry->hash); printf("\n"); }
+	
+	search_start(node,&search);
+	kademlia_lookup<P,DIRECT_RPCS<P> >(node,entry->hash,(HASH_ENTRY_T<P>*)NULL,closest,&search);
+	int query_count = search_end(&search);
+	DIRECT_RPCS<P>::store_values(node,closest,entry);
+	return query_count;
+}
+
+template<class P> int kademlia_find_value(NODE_T<P> * node, HASH_ENTRY_T<P> * entry)
+{
+	SEARCH_T<P> search;
+	CONTACT_T<P> * closest[P::k] = {0};
+	
+	search_start(node,&search);
+	kademlia_lookup<P,DIRECT_RPCS<P> >(node,(unsigned char*)NULL,entry,closest,&search);
+	if(entry->data && !quiet) printf("Found closest nodes in %d queries\n",search.queries);
+	return search_end(&search);
+}
+
+template<class P> NODE_T<P> ** build_network(int n_nodes)
+{
+	// grows a network one join at a time, the way real nodes arrive: each
+	// new node knows one random earlier node and looks up its own id
+	
+	typedef HASH_ENTRY_T<P> HASH_ENTRY;
+	NODE_T<P> ** all_nodes = network_create<P>(n_nodes);
+	
+	for(int i = 0; i < n_nodes; i++)
+	{
+		NODE_T<P> * node = network_node<P>(i);
+		node->info.idx = i;
+		HASH_ENTRY tmp = {{},(char*)&i,4};	get_hash(&tmp);
+		memcpy(node->info.id,tmp.hash,P::id_len);
+		node->is_online = 1;
+		if(i == 0) continue;
+		
+		add_contact(node,&all_nodes[rand()%i]->info);
+		
+		CONTACT_T<P> * closest[P::k] = {0};
+		kademlia_search(node,node->info.id,closest);
+	}
+	return all_nodes;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+
+#include "stats.h"
+#include "../../src/snapshot.h"
+
+//
+//		Snapshot analyser
+//
+// main snapshot <file>... [name=value...]
+//
+// Reads node snapshots taken by the client (/snapshot <file>, or
+// snapshot=<prefix> on main load with cluster=) and reports for every node
+// how well its buckets cover the id space, how stale and slow its contacts
+// are and how close its keys are to its id. Given the snapshots of several
+// nodes it also reports how evenly the keys and the routing table entries
+// are spread between them and the hottest keys over all of them.
+//
+
+#define SNAPSHOT_MAX_DEPTH (SNAPSHOT_MAX_ID_LEN*8)
+
+typedef struct
+{
+	int top;      // hot keys listed
+	int stale;    // seconds without a response before a contact counts as stale
+	int buckets;  // list every bucket
+} ANALYSE_CONFIG;
+
+typedef struct
+{
+	unsigned char id[SNAPSHOT_MAX_ID_LEN];
+	int port;
+	int n_entries, n_replicas;
+	uint64_t bytes;
+	int known_by; // snapshots of other nodes with it in their routing table
+} NODE_SUMMARY;
+
+typedef struct
+{
+	unsigned char key[SNAPSHOT_MAX_ID_LEN];
+	uint64_t reads;
+	int n_nodes, n_extra;
+} HOT_SUMMARY;
+
+typedef struct
+{
+	// what is compared across the snapshots
+	int id_len;
+	NODE_SUMMARY * nodes;
+	int n_nodes;
+	unsigned char (*contacts)[SNAPSHOT_MAX_ID_LEN]; // of all the routing tables
+	int * contact_owner; // index into nodes
+	int n_contacts;
+	HOT_SUMMARY * hot;
+	int n_hot;
+	uint64_t first_digit[16]; // entries by the first hex digit of their key
+} ANALYSIS;
+
+static int common_bits(const unsigned char * a, const unsigned char * b, int len)
+{
+	// hash_common_bits in kademlia.h for an id length read from the file
+	for(int i = 0; i < len; i++)
+	if(a[i] != b[i])
+	{
+		int bits = i*8;
+		for(unsigned char x = a[i]^b[i]; !(x&0x80); x <<= 1) bits++;
+		return bits;
+	}
+	return len*8;
+}
+
+static const char * id_prefix(const unsigned char * id, char * out)
+{
+	// the first 8 hex digits, enough to tell ids apart in a report
+	sprintf(out,"%02X%02X%02X%02X..",id[0],id[1],id[2],id[3]);
+	return out;
+}
+
+static int analyse_file(ANALYSIS * analysis, ANALYSE_CONFIG * config, const char * path)
+{
+	SNAPSHOT snapshot;
+	if(!snapshot_open(&snapshot,path)) { printf("%s is not a snapshot\n", path); return 0; }
+	SNAPSHOT_HEADER * header = &snapshot.header;
+	int len = header->id_len, k = header->k;
+	if(analysis->n_nodes && len != analysis->id_len)
+		{ printf("%s has %d bit ids, the others %d\n", path, len*8, analysis->id_len*8); snapshot_close(&snapshot); return 0; }
+	analysis->id_len = len;
+
+	char prefix[16];
+	int owner = analysis->n_nodes++;
+	analysis->nodes = (NODE_SUMMARY*) realloc(analysis->nodes,analysis->n_nodes*sizeof(NODE_SUMMARY));
+	NODE_SUMMARY * node = &analysis->nodes[owner];
+	memset(node,0,sizeof(NODE_SUMMARY));
+	memcpy(node->id,snapshot.id,len);
+	node->port = header->port;
+	printf("\n%s: node %d id %s, %u buckets, %u contacts, %u entries, %u hot keys\n", path, header->port,
+		id_prefix(snapshot.id,prefix), header->n_buckets, header->n_contacts, header->n_entries, header->n_hot_keys);
+
+	// buckets and their contacts
+	int full = 0, empty = 0, offline = 0, connected = 0, stale = 0, unseen = 0;
+	double covered = 0, covered_full = 0; // fractions of the id space
+	int depth_fill[SNAPSHOT_MAX_DEPTH+1] = {0}; // contacts by bits shared with the node id
+	HISTOGRAM rtt = {0};
+	if(config->buckets) printf("  %5s  %-10s  %-10s  %s\n", "depth", "min", "max", "contacts");
+	for(unsigned b = 0; b < header->n_buckets; b++)
+	{
+		SNAPSHOT_BUCKET bucket;
+		unsigned char min[SNAPSHOT_MAX_ID_LEN], max[SNAPSHOT_MAX_ID_LEN];
+		if(!snapshot_read(&snapshot,&bucket,sizeof(bucket),min) || !snapshot_read_id(&snapshot,max))
+			{ printf("  cut short in bucket %u\n", b); break; }
+
+		double share = ldexp(1,-bucket.depth);
+		if(bucket.n_contacts) covered += share;
+		if(bucket.n_contacts >= k) { full++; covered_full += share; }
+		if(!bucket.n_contacts) empty++;
+		if(config->buckets)
+		{
+			char max_prefix[16];
+			printf("  %5d  %-10s  %-10s  %d/%d\n", bucket.depth, id_prefix(min,prefix), id_prefix(max,max_prefix), bucket.n_contacts, k);
+		}
+
+		for(int i = 0; i < bucket.n_contacts; i++)
+		{
+			SNAPSHOT_CONTACT contact;
+			int c = analysis->n_contacts;
+			analysis->contacts = (unsigned char (*)[SNAPSHOT_MAX_ID_LEN]) realloc(analysis->contacts,(c+1)*SNAPSHOT_MAX_ID_LEN);
+			analysis->contact_owner = (int*) realloc(analysis->contact_owner,(c+1)*sizeof(int));
+			if(!snapshot_read(&snapshot,&contact,sizeof(contact),analysis->contacts[c]))
+				{ printf("  cut short in bucket %u\n", b); b = header->n_buckets; break; }
+			analysis->contact_owner[c] = owner;
+			analysis->n_contacts++;
+
+			depth_fill[common_bits(analysis->contacts[c],snapshot.id,len)]++;
+			offline += !contact.online;
+			connected += contact.connected;
+			if(!contact.last_seen) unseen++; // only heard of from other nodes
+			else if(header->time - contact.last_seen > (unsigned)config->stale) stale++;
+			if(contact.srtt) hist_record(&rtt,contact.srtt);
+		}
+	}
+	printf("  buckets: %d full, %d empty, %.1f%% of the id space in buckets with contacts, %.1f%% in full ones\n",
+		full, empty, 100*covered, 100*covered_full);
+	printf("  contacts: %d offline, %d connected, %d never seen, %d not seen for %ds", offline, connected, unseen, stale, config->stale);
+	if(rtt.count) printf(", srtt p50 %llu ms p99 %llu ms of %llu measured", (unsigned long long)hist_percentile(&rtt,50),
+		(unsigned long long)hist_percentile(&rtt,99), (unsigned long long)rtt.count);
+	printf("\n  contacts by bits shared with the node id:");
+	for(int d = 0; d <= len*8; d++) if(depth_fill[d]) printf(" %d:%d", d, depth_fill[d]);
+	printf("\n");
+
+	// store index
+	double key_bits = 0;
+	for(unsigned e = 0; e < header->n_entries; e++)
+	{
+		SNAPSHOT_ENTRY entry;
+		unsigned char key[SNAPSHOT_MAX_ID_LEN];
+		if(!snapshot_read(&snapshot,&entry,sizeof(entry),key)) { printf("  cut short in entry %u\n", e); break; }
+		node->n_entries++;
+		node->bytes += entry.size;
+		node->n_replicas += entry.expires != 0;
+		key_bits += common_bits(key,snapshot.id,len);
+		analysis->first_digit[key[0] >> 4]++;
+	}
+	// a random key shares one bit with the node id on average
+	printf("  store: %d entries, %llu bytes, %d extra replicas", node->n_entries, (unsigned long long)node->bytes, node->n_replicas);
+	if(node->n_entries) printf(", keys share %.2f bits with the node id on average", key_bits/node->n_entries);
+	printf("\n");
+
+	// hot keys, merged with the same key from other snapshots
+	for(unsigned h = 0; h < header->n_hot_keys; h++)
+	{
+		SNAPSHOT_HOT_KEY key;
+		unsigned char hash[SNAPSHOT_MAX_ID_LEN];
+		if(!snapshot_read(&snapshot,&key,sizeof(key),hash)) { printf("  cut short in hot key %u\n", h); break; }
+		HOT_SUMMARY * hot = NULL;
+		for(int i = 0; i < analysis->n_hot && !hot; i++)
+			if(memcmp(analysis->hot[i].key,hash,len)==0) hot = &analysis->hot[i];
+		if(!hot)
+		{
+			analysis->hot = (HOT_SUMMARY*) realloc(analysis->hot,(analysis->n_hot+1)*sizeof(HOT_SUMMARY));
+			hot = &analysis->hot[analysis->n_hot++];
+			memset(hot,0,sizeof(HOT_SUMMARY));
+			memcpy(hot->key,hash,len);
+		}
+		hot->reads += key.reads;
+		hot->n_nodes++;
+		hot->n_extra += key.n_extra;
+	}
+
+	snapshot_close(&snapshot);
+	return 1;
+}
+
+static int hotter(const void * a, const void * b)
+{
+	uint64_t x = ((HOT_SUMMARY*)a)->reads, y = ((HOT_SUMMARY*)b)->reads;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void analyse_spread(ANALYSIS * analysis)
+{
+	// how evenly keys and routing table entries fall on the nodes
+	int n = analysis->n_nodes, len = analysis->id_len;
+	for(int c = 0; c < analysis->n_contacts; c++)
+	for(int i = 0; i < n; i++)
+	if(i != analysis->contact_owner[c] && memcmp(analysis->nodes[i].id,analysis->contacts[c],len)==0)
+		analysis->nodes[i].known_by++;
+
+	double sum = 0, square = 0;
+	int least = 0, most = 0, unknown = 0, least_known = 0, most_known = 0;
+	for(int i = 0; i < n; i++)
+	{
+		NODE_SUMMARY * node = &analysis->nodes[i];
+		sum += node->n_entries;
+		square += (double)node->n_entries*node->n_entries;
+		if(node->n_entries < analysis->nodes[least].n_entries) least = i;
+		if(node->n_entries > analysis->nodes[most].n_entries) most = i;
+		if(node->known_by < analysis->nodes[least_known].known_by) least_known = i;
+		if(node->known_by > analysis->nodes[most_known].known_by) most_known = i;
+		unknown += !node->known_by;
+	}
+	double mean = sum/n, deviation = sqrt(square/n - mean*mean > 0 ? square/n - mean*mean : 0);
+
+	printf("\n%d nodes\n", n);
+	printf("  entries per node: mean %.1f, least %d on %d, most %d on %d, max/mean %.2f, cv %.2f\n", mean,
+		analysis->nodes[least].n_entries, analysis->nodes[least].port, analysis->nodes[most].n_entries, analysis->nodes[most].port,
+		mean > 0 ? analysis->nodes[most].n_entries/mean : 0, mean > 0 ? deviation/mean : 0);
+	printf("  in the routing tables of the others: least %d (%d), most %d (%d), %d in none\n",
+		analysis->nodes[least_known].known_by, analysis->nodes[least_known].port,
+		analysis->nodes[most_known].known_by, analysis->nodes[most_known].port, unknown);
+
+	uint64_t total = 0, top = 0;
+	for(int d = 0; d < 16; d++) { total += analysis->first_digit[d]; if(analysis->first_digit[d] > top) top = analysis->first_digit[d]; }
+	printf("  entries by the first hex digit of the key:");
+	for(int d = 0; d < 16; d++) printf(" %llu", (unsigned long long)analysis->first_digit[d]);
+	if(total) printf(", max/mean %.2f", top*16.0/total);
+	printf("\n");
+}
+
+int snapshot_main(int argc, char * argv[])
+{
+	ANALYSE_CONFIG config = {10, 60, 0};
+	const char ** paths = (const char**) malloc((argc+1)*sizeof(char*));
+	int n_paths = 0;
+
+	for(int i = 0; i < argc; i++)
+	{
+		if(sscanf(argv[i],"top=%d",&config.top)==1) continue;
+		if(sscanf(argv[i],"stale=%d",&config.stale)==1) continue;
+		if(sscanf(argv[i],"buckets=%d",&config.buckets)==1) continue;
+		if(!strchr(argv[i],'=')) { paths[n_paths++] = argv[i]; continue; }
+
+		printf("unknown option: %s\n", argv[i]);
+		n_paths = 0;
+		break;
+	}
+	if(!n_paths)
+	{
+		printf("usage: main snapshot <snapshot file>... [name=value...]\n");
+		printf("options: top (hot keys listed) stale (seconds before a contact is stale) buckets (1 lists them)\n");
+		free(paths);
+		return 1;
+	}
+
+	ANALYSIS analysis = {0};
+	for(int i = 0; i < n_paths; i++) analyse_file(&analysis,&config,paths[i]);
+	if(analysis.n_nodes > 1) analyse_spread(&analysis);
+
+	if(analysis.n_hot)
+	{
+		char prefix[16];
+		qsort(analysis.hot,analysis.n_hot,sizeof(HOT_SUMMARY),hotter);
+		printf("\nhottest keys, reads per half life summed over the nodes\n");
+		printf("  %-10s %8s %6s %6s\n", "key", "reads", "nodes", "extra");
+		for(int i = 0; i < analysis.n_hot && i < config.top; i++)
+			printf("  %-10s %8llu %6d %6d\n", id_prefix(analysis.hot[i].key,prefix),
+				(unsigned long long)analysis.hot[i].reads, analysis.hot[i].n_nodes, analysis.hot[i].n_extra);
+	}
+
+	free(analysis.nodes);
+	free(analysis.contacts);
+	free(analysis.contact_owner);
+	free(analysis.hot);
+	free(paths);
+	return analysis.n_nodes ? 0 : 1;
+}
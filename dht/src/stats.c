@@ -0,0 +1,122 @@
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+
+#include "stats.h"
+
+LOOKUP_STATS lookup_stats;
+
+static int hist_index(uint64_t value)
+{
+	// the bucket exponent is how far the value has to be shifted to fit
+	// in HIST_SUB_BITS+1 bits, the rest of the index is what is left of it
+	int msb = 63;
+	if(value == 0) return 0;
+	while(!(value >> msb)) msb--;
+
+	int shift = msb - HIST_SUB_BITS;
+	if(shift <= 0) return (int)value;
+	return shift*HIST_SUB_COUNT + (int)(value >> shift);
+}
+
+static uint64_t hist_highest(int idx)
+{
+	// largest value that is counted in bucket idx
+	if(idx < 2*HIST_SUB_COUNT) return idx;
+	int shift = idx/HIST_SUB_COUNT - 1;
+	uint64_t mantissa = idx - shift*HIST_SUB_COUNT;
+	return ((mantissa+1) << shift) - 1;
+}
+
+void hist_record(HISTOGRAM * hist, uint64_t value)
+{
+	hist->counts[hist_index(value)]++;
+	if(hist->count == 0 || value < hist->min) hist->min = value;
+	if(value > hist->max) hist->max = value;
+	hist->count++;
+	hist->sum += value;
+}
+
+uint64_t hist_percentile(HISTOGRAM * hist, double percentile)
+{
+	if(hist->count == 0) return 0;
+
+	uint64_t rank = (uint64_t)(percentile/100*hist->count + 0.5);
+	if(rank < 1) rank = 1;
+
+	uint64_t seen = 0;
+	for(int i = 0; i < HIST_SIZE; i++)
+	{
+		seen += hist->counts[i];
+		if(seen >= rank)
+		{
+			uint64_t value = hist_highest(i);
+			return value > hist->max ? hist->max : value;
+		}
+	}
+	return hist->max;
+}
+
+double hist_mean(HISTOGRAM * hist)
+{
+	return hist->count ? hist->sum / hist->count : 0;
+}
+
+void hist_merge(HISTOGRAM * dst, HISTOGRAM * src)
+{
+	if(src->count == 0) return;
+	for(int i = 0; i < HIST_SIZE; i++) dst->counts[i] += src->counts[i];
+	if(dst->count == 0 || src->min < dst->min) dst->min = src->min;
+	if(src->max > dst->max) dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+
+void hist_reset(HISTOGRAM * hist)
+{
+	memset(hist,0,sizeof(HISTOGRAM));
+}
+
+void lookup_stats_record(LOOKUP_STATS * stats, LOOKUP_SAMPLE * sample)
+{
+	hist_record(&stats->hops,sample->hops);
+	hist_record(&stats->rpcs,sample->rpcs);
+	hist_record(&stats->failed,sample->failed);
+	hist_record(&stats->bytes,sample->bytes);
+	hist_record(&stats->wall_ns,sample->wall_ns);
+}
+
+void lookup_stats_snapshot(LOOKUP_STATS * dst)
+{
+	memcpy(dst,&lookup_stats,sizeof(LOOKUP_STATS));
+}
+
+void lookup_stats_reset()
+{
+	memset(&lookup_stats,0,sizeof(LOOKUP_STATS));
+}
+
+static void print_row(const char * name, HISTOGRAM * hist, double scale)
+{
+	printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+		hist_percentile(hist,50)/scale, hist_percentile(hist,90)/scale,
+		hist_percentile(hist,99)/scale, hist->max/scale, hist_mean(hist)/scale);
+}
+
+void lookup_stats_print(LOOKUP_STATS * stats)
+{
+	printf("lookups %llu\n", (unsigned long long)stats->rpcs.count);
+	printf("%-8s %10s %10s %10s %10s %10s\n", "", "p50", "p90", "p99", "max", "mean");
+	print_row("hops",&stats->hops,1);
+	print_row("rpcs",&stats->rpcs,1);
+	print_row("failed",&stats->failed,1);
+	print_row("bytes",&stats->bytes,1);
+	print_row("wall us",&stats->wall_ns,1000);
+}
+
+uint64_t stats_clock_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "stdint.h"
+
+//
+//		Histograms
+//
+// HDR style: values are counted in buckets that keep their top
+// HIST_SUB_BITS+1 bits, so any recorded value is reported within about
+// 1/2^HIST_SUB_BITS of what was recorded, from 1 up to 2^63.
+//
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct
+{
+	unsigned counts[HIST_SIZE];
+	uint64_t count;
+	uint64_t min, max;
+	double sum;
+} HISTOGRAM;
+
+void hist_record(HISTOGRAM * hist, uint64_t value);
+uint64_t hist_percentile(HISTOGRAM * hist, double percentile); // highest value in the bucket
+double hist_mean(HISTOGRAM * hist);
+void hist_merge(HISTOGRAM * dst, HISTOGRAM * src);
+void hist_reset(HISTOGRAM * hist);
+
+//
+//		Lookup statistics
+//
+// kademlia_search records every lookup into lookup_stats. Take a snapshot
+// to read them while the simulation goes on, reset to start a new interval.
+//
+
+typedef struct
+{
+	int hops;   // rounds of queries
+	int rpcs;   // queries sent
+	int failed; // queries the contact did not answer
+	int bytes;  // sent and received, estimated from the message layout
+	uint64_t wall_ns;
+} LOOKUP_SAMPLE;
+
+typedef struct
+{
+	HISTOGRAM hops;
+	HISTOGRAM rpcs;
+	HISTOGRAM failed;
+	HISTOGRAM bytes;
+	HISTOGRAM wall_ns;
+} LOOKUP_STATS;
+
+extern LOOKUP_STATS lookup_stats;
+
+void lookup_stats_record(LOOKUP_STATS * stats, LOOKUP_SAMPLE * sample);
+void lookup_stats_snapshot(LOOKUP_STATS * dst); // copies lookup_stats
+void lookup_stats_reset();
+void lookup_stats_print(LOOKUP_STATS * stats);
+
+uint64_t stats_clock_ns(); // monotonic
+
+#endif
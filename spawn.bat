@@ -6,3 +6,4 @@ REM start cmd /k "main 22004 22000"
 REM start cmd /k "main 22005 22000"
 REM start cmd /k "main 22006 22000"
 REM start cmd /k "main 22007 22000"
+REM start cmd /k "main load 23000 22000 22001 22002 22003 clients=16 duration=30"
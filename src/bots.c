@@ -0,0 +1,328 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "bots.h"
+
+//
+//		Command table
+//
+
+static unsigned name_hash(const char * name, int length)
+{
+	// FNV-1a
+	unsigned hash = 2166136261u;
+	for(int i = 0; i < length; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	return hash;
+}
+
+static BOT_COMMAND * find_command(BOTS * bots, const char * name, int length)
+{
+	// open addressing, a free slot ends the probe since commands are never taken out
+	unsigned at = name_hash(name,length);
+	for(int i = 0; i < BOT_TABLE_SIZE; i++)
+	{
+		BOT_COMMAND * command = &bots->commands[(at + i) & (BOT_TABLE_SIZE-1)];
+		if(!command->name[0]) return NULL;
+		if((int)strlen(command->name) == length && memcmp(command->name,name,length) == 0) return command;
+	}
+	return NULL;
+}
+
+int bots_command(BOTS * bots, int bot, const char * name, BOT_HANDLER handler, double rate, double burst, const char * help)
+{
+	int length = strlen(name);
+	if(length == 0 || length >= (int)sizeof(bots->commands[0].name) || find_command(bots,name,length)) return 0;
+
+	unsigned at = name_hash(name,length);
+	for(int i = 0; i < BOT_TABLE_SIZE; i++)
+	{
+		BOT_COMMAND * command = &bots->commands[(at + i) & (BOT_TABLE_SIZE-1)];
+		if(command->name[0]) continue;
+
+		memset(command,0,sizeof(BOT_COMMAND));
+		command->bot = bot;
+		command->handler = handler;
+		command->help = help ? help : "";
+		command->rate = rate;
+		command->burst = command->tokens = burst;
+		command->refilled = clock_ms();
+		strcpy(command->name,name); // last, the slot is taken from here on
+		return 1;
+	}
+	return 0;
+}
+
+static int take_token(BOT_COMMAND * command)
+{
+	unsigned now = clock_ms();
+	command->tokens += command->rate * (now - command->refilled) / 1000.0;
+	if(command->tokens > command->burst) command->tokens = command->burst;
+	command->refilled = now;
+	if(command->tokens < 1) return 0;
+	command->tokens -= 1;
+	return 1;
+}
+
+//
+//		Bots
+//
+
+int bots_add(BOTS * bots, const char * name)
+{
+	for(int i = 0; i < bots->n_bots; i++)
+		if(strcmp(bots->bots[i].name,name) == 0) return i;
+	if(bots->n_bots == BOT_MAX_BOTS) return -1;
+
+	BOT * bot = &bots->bots[bots->n_bots];
+	memset(bot,0,sizeof(BOT));
+	snprintf(bot->name,sizeof(bot->name),"%s",name);
+	return bots->n_bots++;
+}
+
+static int in_channel(BOT * bot, const char * channel)
+{
+	for(int i = 0; i < bot->n_channels; i++)
+		if(strcmp(bot->channels[i],channel) == 0) return 1;
+	return 0;
+}
+
+int bots_join(BOTS * bots, int bot, const char * channel)
+{
+	BOT * b = &bots->bots[bot];
+	if(in_channel(b,channel)) return 1;
+	if(b->n_channels == BOT_MAX_CHANNELS || !pubsub_subscribe(bots->node,channel)) return 0;
+	snprintf(b->channels[b->n_channels++],sizeof(b->channels[0]),"%s",channel);
+	return 1;
+}
+
+//
+//		Jobs
+//
+
+static int ring_put(BOT_RING * ring, BOT_JOB * job)
+{
+	if(ring->n == BOT_QUEUE) return 0;
+	ring->jobs[(ring->first + ring->n++) % BOT_QUEUE] = *job;
+	return 1;
+}
+
+static int ring_take(BOT_RING * ring, BOT_JOB * job)
+{
+	if(!ring->n) return 0;
+	*job = ring->jobs[ring->first];
+	ring->first = (ring->first + 1) % BOT_QUEUE;
+	ring->n--;
+	return 1;
+}
+
+static void * bot_worker(void * data)
+{
+	BOTS * bots = (BOTS*)data;
+	BOT_JOB job;
+	for(;;)
+	{
+		sem_wait( &bots->work );
+		sem_wait( &bots->mutex );
+		int stopping = bots->stopping, taken = !stopping && ring_take(&bots->pending,&job);
+		sem_post( &bots->mutex );
+		if(stopping) return NULL;
+		if(!taken) continue;
+
+		bots->commands[job.command].handler(&job);
+
+		// the ring has room, no more than BOT_QUEUE jobs are ever out
+		sem_wait( &bots->mutex );
+		ring_put(&bots->done,&job);
+		sem_post( &bots->mutex );
+		sem_post( &bots->node->transport->arrived ); // wakes the main loop
+	}
+}
+
+static void help(BOTS * bots, BOT_JOB * job)
+{
+	// the commands of the bots in the job's channel
+	int size = 0;
+	for(int i = 0; i < BOT_TABLE_SIZE; i++)
+	{
+		BOT_COMMAND * command = &bots->commands[i];
+		if(!command->name[0] || !in_channel(&bots->bots[command->bot],job->channel)) continue;
+		int n = snprintf(job->reply + size,sizeof(job->reply) - size,"%s!%s%s%s",size ? ", " : "commands: ",command->name,
+			command->help[0] ? " " : "",command->help);
+		if(n < 0 || size + n >= (int)sizeof(job->reply)) break;
+		size += n;
+	}
+}
+
+void bots_read(void * data, const char * channel, unsigned origin, const char * text, int length)
+{
+	BOTS * bots = (BOTS*)data;
+	if(length < 2 || text[0] != '!') return;
+
+	int name_length = 1;
+	while(name_length < length && text[name_length] != ' ') name_length++;
+	BOT_COMMAND * command = find_command(bots,text+1,name_length-1);
+	if(!command || !in_channel(&bots->bots[command->bot],channel)) return;
+
+	if(!take_token(command))
+	{
+		command->limited++;
+		metrics_add(bots->node->metrics,METRIC_BOT_LIMITED,1);
+		return;
+	}
+	if(bots->queued == BOT_QUEUE)
+	{
+		command->dropped++;
+		metrics_add(bots->node->metrics,METRIC_BOT_DROPPED,1);
+		log_warn("bot workers are behind, !%s dropped", command->name);
+		return;
+	}
+
+	BOT_JOB job;
+	job.command = command - bots->commands;
+	job.id = ++bots->jobs;
+	snprintf(job.channel,sizeof(job.channel),"%s",channel);
+	job.origin = origin;
+	int args = name_length < length ? name_length+1 : length;
+	snprintf(job.args,sizeof(job.args),"%.*s",length - args,text + args);
+	job.reply[0] = '\0';
+	job.store = 0;
+
+	command->runs++;
+	metrics_add(bots->node->metrics,METRIC_BOT_COMMANDS,1);
+	bots->queued++;
+	sem_wait( &bots->mutex );
+	if(command->handler) ring_put(&bots->pending,&job);
+	else { help(bots,&job); ring_put(&bots->done,&job); }
+	sem_post( &bots->mutex );
+	if(command->handler) sem_post( &bots->work );
+}
+
+int bots_poll(BOTS * bots)
+{
+	int n = 0;
+	BOT_JOB job;
+	for(;;)
+	{
+		sem_wait( &bots->mutex );
+		int taken = ring_take(&bots->done,&job);
+		sem_post( &bots->mutex );
+		if(!taken) return n;
+		bots->queued--;
+		n++;
+		if(!job.reply[0]) continue;
+
+		char text[BOT_MAX_TEXT + 64];
+		BOT_COMMAND * command = &bots->commands[job.command];
+		if(job.store)
+		{
+			HASH_ENTRY entry = {{},job.reply,(int)strlen(job.reply)+1}; // as /send stores it, so /load finds it
+			get_hash(&entry);
+			char hex[2*K_ID_LEN+1];
+			if(kademlia_store_value(bots->node,&entry) > 0) snprintf(text,sizeof(text),"%s: stored as %s",command->name,hash_string(entry.hash,hex));
+			else snprintf(text,sizeof(text),"%s: could not store it",command->name);
+		}
+		else snprintf(text,sizeof(text),"%s",job.reply);
+		printf("[%s] %u: %s\n", job.channel, bots->node->info.port, text); // a channel does not send us our own lines
+		pubsub_publish(bots->node,job.channel,text);
+	}
+}
+
+//
+//		Starting and stopping
+//
+
+int bots_start(BOTS * bots, NODE * node)
+{
+	memset(bots,0,sizeof(BOTS));
+	bots->node = node;
+	sem_init( &bots->mutex, 0, 1 );
+	sem_init( &bots->work, 0, 0 );
+	for(int i = 0; i < BOT_WORKERS; i++)
+		if(pthread_create(&bots->workers[bots->n_workers],NULL,bot_worker,bots) == 0) bots->n_workers++;
+	if(!bots->n_workers) return 0;
+
+	node->pubsub_handler = bots_read;
+	node->pubsub_data = bots;
+	return 1;
+}
+
+void bots_stop(BOTS * bots)
+{
+	if(bots->node && bots->node->pubsub_data == bots) bots->node->pubsub_handler = NULL;
+	sem_wait( &bots->mutex );
+	bots->stopping = 1;
+	sem_post( &bots->mutex );
+	for(int i = 0; i < bots->n_workers; i++) sem_post( &bots->work );
+	for(int i = 0; i < bots->n_workers; i++) pthread_join(bots->workers[i],NULL);
+	bots->n_workers = 0;
+	sem_destroy( &bots->mutex );
+	sem_destroy( &bots->work );
+}
+
+void bots_print(BOTS * bots)
+{
+	for(int i = 0; i < bots->n_bots; i++)
+	{
+		BOT * bot = &bots->bots[i];
+		printf("%s in", bot->name);
+		for(int j = 0; j < bot->n_channels; j++) printf(" %s", bot->channels[j]);
+		printf("\n");
+		for(int j = 0; j < BOT_TABLE_SIZE; j++)
+		{
+			BOT_COMMAND * command = &bots->commands[j];
+			if(!command->name[0] || command->bot != i) continue;
+			printf("\t!%-8s %6llu runs %6llu over the limit of %.1f/s %6llu dropped\n", command->name,
+				(unsigned long long)command->runs, (unsigned long long)command->limited, command->rate, (unsigned long long)command->dropped);
+		}
+	}
+	printf("%d jobs queued\n", bots->queued);
+}
+
+//
+//		Built in bots
+//
+
+static void greet(BOT_JOB * job)
+{
+	snprintf(job->reply,sizeof(job->reply),"hello %u, welcome to %s", job->origin, job->channel);
+}
+
+static void roll(BOT_JOB * job)
+{
+	// !roll [<n>d<sides>], 1d6 if not given
+	int n = 1, sides = 6;
+	if(sscanf(job->args,"%dd%d",&n,&sides) != 2 || n < 1 || n > 20 || sides < 2 || sides > 1000) n = 1, sides = 6;
+
+	unsigned x = (clock_ms() ^ (job->id * 2654435761u)) | 1; // xorshift, rand is not for threads
+	int size = snprintf(job->reply,sizeof(job->reply),"%u rolled %dd%d:", job->origin, n, sides), total = 0;
+	for(int i = 0; i < n; i++)
+	{
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		int die = 1 + x % sides;
+		total += die;
+		size += snprintf(job->reply + size,sizeof(job->reply) - size," %d",die);
+	}
+	snprintf(job->reply + size,sizeof(job->reply) - size," = %d",total);
+}
+
+static void paste(BOT_JOB * job)
+{
+	// kept in the DHT, the reply is the hash to /load it by
+	if(!job->args[0]) return;
+	snprintf(job->reply,sizeof(job->reply),"%s",job->args);
+	job->store = 1;
+}
+
+void bots_builtin(BOTS * bots, const char * channel)
+{
+	int greeter = bots_add(bots,"greeter"), dice = bots_add(bots,"dice"), paster = bots_add(bots,"paste");
+	if(greeter < 0 || dice < 0 || paster < 0) { printf("Too many bots\n"); return; }
+
+	bots_command(bots,greeter,"hello",greet,1,5,"");
+	bots_command(bots,greeter,"help",NULL,0.2,2,"");
+	bots_command(bots,dice,"roll",roll,2,10,"[<n>d<sides>]");
+	bots_command(bots,paster,"paste",paste,0.5,3,"<text>");
+
+	if(!bots_join(bots,greeter,channel) || !bots_join(bots,dice,channel) || !bots_join(bots,paster,channel))
+		printf("Could not put the bots in %s\n", channel);
+}
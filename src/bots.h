@@ -0,0 +1,100 @@
+#ifndef BOTS_H
+#define BOTS_H
+
+#include "stdint.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include "dht.h"
+
+//
+//		Utility bots
+//
+// A bot answers commands written in the channels it is in, lines that
+// start with ! and the command's name. The node thread finds the command
+// by name in a hash table, takes a token from its rate limit and queues a
+// job for the worker threads. A worker runs the handler and queues the job
+// back, and bots_poll, from the client's main loop, publishes the reply to
+// the channel, or stores it in the DHT and publishes its hash when the
+// handler asks for that. Handlers only see the job, never the node, so a
+// burst of commands or a slow handler does not keep the node from serving
+// its peers. A command that finds BOT_QUEUE jobs already queued is dropped.
+// Command names are unique on a node, whichever bot they belong to.
+//
+
+#define BOT_MAX_BOTS 16
+#define BOT_MAX_CHANNELS 8 // each bot is in
+#define BOT_TABLE_SIZE 64 // command slots, a power of two
+#define BOT_WORKERS 4
+#define BOT_QUEUE 64 // jobs queued or running, results not yet published
+#define BOT_MAX_TEXT 512
+
+typedef struct
+{
+	int command; // slot in the table
+	unsigned id; // counts the jobs taken in
+	char channel[32];
+	unsigned origin; // port of the node the command came from
+	char args[BOT_MAX_TEXT]; // what follows the name
+	char reply[BOT_MAX_TEXT]; // set by the handler, nothing is published if it is empty
+	int store; // set by the handler to store the reply and publish its hash
+} BOT_JOB;
+
+typedef void (*BOT_HANDLER)(BOT_JOB * job); // runs on a worker
+
+typedef struct
+{
+	char name[16]; // empty for a free slot
+	int bot;
+	BOT_HANDLER handler; // NULL for help, answered on the node thread
+	const char * help; // its arguments, listed by !help
+
+	// a token bucket, rate per second up to burst at once
+	double rate, burst, tokens;
+	unsigned refilled; // clock_ms
+
+	uint64_t runs, limited, dropped;
+} BOT_COMMAND;
+
+typedef struct
+{
+	char name[16];
+	char channels[BOT_MAX_CHANNELS][32];
+	int n_channels;
+} BOT;
+
+typedef struct
+{
+	BOT_JOB jobs[BOT_QUEUE];
+	int first, n;
+} BOT_RING;
+
+typedef struct
+{
+	NODE * node;
+	BOT bots[BOT_MAX_BOTS];
+	int n_bots;
+	BOT_COMMAND commands[BOT_TABLE_SIZE];
+	int queued; // jobs taken in and not published yet, at most BOT_QUEUE
+	unsigned jobs;
+
+	// to and from the workers
+	BOT_RING pending, done;
+	sem_t mutex;
+	sem_t work; // posted for each pending job, and once per worker to stop
+	int stopping;
+	pthread_t workers[BOT_WORKERS];
+	int n_workers;
+} BOTS;
+
+int bots_start(BOTS * bots, NODE * node); // the workers, and the node's channel messages from now on
+void bots_stop(BOTS * bots);
+int bots_add(BOTS * bots, const char * name); // found or added, -1 if there are too many
+int bots_join(BOTS * bots, int bot, const char * channel); // subscribes the node too, 0 if it can not
+int bots_command(BOTS * bots, int bot, const char * name, BOT_HANDLER handler, double rate, double burst, const char * help); // 0 if the name is taken or there is no room
+void bots_read(void * bots, const char * channel, unsigned origin, const char * text, int length); // a channel line, the node's pubsub_handler
+int bots_poll(BOTS * bots); // publishes what the workers finished, returns how many
+void bots_print(BOTS * bots);
+
+void bots_builtin(BOTS * bots, const char * channel); // the greeter, dice and paste bots, in the channel
+
+#endif
@@ -0,0 +1,134 @@
+#include "stdlib.h"
+#include "string.h"
+#include "dht.h"
+
+//
+//		Value cache
+//
+// Values are stored under the hash of their content, so one that was found
+// once can not change and there is no need to look it up again. The lookups
+// look here first and keep what they find, up to cache.limit bytes. A key
+// that is not the hash of its value, like the chat log's, names something
+// that changes and is never kept. Slots are given up in CLOCK order: the
+// hand clears the mark of each value read since it last passed and takes
+// the first one without a mark.
+//
+// Keys that were not found are remembered for CACHE_MISSING_MS, so a caller
+// that asks again right away for a value that is not there does not run
+// another full search. Storing a key forgets that it was missing. Another
+// node may store a key named after something that changes at any time, so
+// the lookups of those, like the chat log's, pass latest and skip this.
+//
+
+static CACHE_ENTRY * find(VALUE_CACHE * cache, K_ID hash)
+{
+	for(int i = 0; i < CACHE_SLOTS; i++)
+		if(cache->entries[i].data && hash_equ<K_ID_LEN>(cache->entries[i].hash,hash)) return &cache->entries[i];
+	return NULL;
+}
+
+static void drop(VALUE_CACHE * cache, CACHE_ENTRY * slot)
+{
+	cache->bytes -= slot->size;
+	free(slot->data);
+	memset(slot,0,sizeof(CACHE_ENTRY));
+}
+
+int cache_get(NODE * node, HASH_ENTRY * entry)
+{
+	VALUE_CACHE * cache = &node->cache;
+	CACHE_ENTRY * slot = find(cache,entry->hash);
+	if(!slot)
+	{
+		cache->misses++;
+		metrics_add(node->metrics,METRIC_CACHE_MISSES,1);
+		return 0;
+	}
+
+	slot->referenced = 1;
+	entry->data = (char*) malloc(slot->size);
+	memcpy(entry->data,slot->data,slot->size);
+	entry->size = slot->size;
+	cache->hits++;
+	metrics_add(node->metrics,METRIC_CACHE_HITS,1);
+	return 1;
+}
+
+void cache_put(NODE * node, HASH_ENTRY * entry)
+{
+	VALUE_CACHE * cache = &node->cache;
+	if(!entry->data || entry->size <= 0 || (size_t)entry->size > cache->limit || find(cache,entry->hash)) return;
+
+	HASH_ENTRY check = {{},entry->data,entry->size};
+	get_hash(&check);
+	if(!hash_equ<K_ID_LEN>(check.hash,entry->hash)) return;
+
+	// round until there is a free slot and room for the value, the second
+	// time round nothing is marked any more
+	CACHE_ENTRY * slot = NULL;
+	while(!slot || cache->bytes + entry->size > cache->limit)
+	{
+		CACHE_ENTRY * next = &cache->entries[cache->hand];
+		cache->hand = (cache->hand + 1) % CACHE_SLOTS;
+		if(next->data && next->referenced) { next->referenced = 0; continue; }
+		if(next->data) drop(cache,next);
+		if(!slot) slot = next;
+	}
+
+	memcpy(slot->hash,entry->hash,sizeof(K_ID));
+	slot->data = (char*) malloc(entry->size);
+	memcpy(slot->data,entry->data,entry->size);
+	slot->size = entry->size;
+	cache->bytes += entry->size;
+}
+
+void cache_free(NODE * node)
+{
+	VALUE_CACHE * cache = &node->cache;
+	for(int i = 0; i < CACHE_SLOTS; i++) free(cache->entries[i].data);
+	memset(cache->entries,0,sizeof(cache->entries));
+	cache->bytes = 0;
+}
+
+//
+//		Missing keys
+//
+
+static CACHE_MISS * find_missing(VALUE_CACHE * cache, K_ID hash)
+{
+	unsigned now = clock_ms();
+	for(int i = 0; i < CACHE_MISSING; i++)
+	{
+		CACHE_MISS * miss = &cache->missing[i];
+		if(miss->expires && (int)(miss->expires - now) > 0 && hash_equ<K_ID_LEN>(miss->hash,hash)) return miss;
+	}
+	return NULL;
+}
+
+int cache_missing(NODE * node, K_ID hash)
+{
+	if(!find_missing(&node->cache,hash)) return 0;
+	node->cache.missing_hits++;
+	metrics_add(node->metrics,METRIC_CACHE_MISSING_HITS,1);
+	return 1;
+}
+
+void cache_miss(NODE * node, K_ID hash)
+{
+	VALUE_CACHE * cache = &node->cache;
+	CACHE_MISS * miss = find_missing(cache,hash);
+	if(!miss)
+	{
+		miss = &cache->missing[cache->next_missing];
+		cache->next_missing = (cache->next_missing + 1) % CACHE_MISSING;
+		memcpy(miss->hash,hash,sizeof(K_ID));
+	}
+	miss->expires = clock_ms() + CACHE_MISSING_MS;
+	if(!miss->expires) miss->expires = 1; // 0 is a free slot
+}
+
+void cache_forget(NODE * node, K_ID hash)
+{
+	CACHE_MISS * miss = find_missing(&node->cache,hash);
+	if(miss) miss->expires = 0;
+}
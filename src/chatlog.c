@@ -0,0 +1,256 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "chatlog.h"
+
+#define CHAT_MAX_PENDING (CHAT_SEGMENT_BYTES*4) // lines kept while appends fail, newer ones are dropped
+
+static void chat_key(CHAT_CHANNEL * channel, int segment, K_ID hash)
+{
+	// segment -1 is the head
+	char name[64];
+	if(segment < 0) snprintf(name,sizeof(name),"chat %s head",channel->name);
+	else snprintf(name,sizeof(name),"chat %s %d",channel->name,segment);
+	HASH_ENTRY tmp = {{},name,(int)strlen(name)}; get_hash(&tmp);
+	memcpy(hash,tmp.hash,sizeof(K_ID));
+}
+
+static int chat_head(NODE * node, CHAT_CHANNEL * channel, CHAT_HEAD * head)
+{
+	// 0 if the channel has no history yet, -1 if the closest nodes to the
+	// head could not all be asked
+	HASH_ENTRY entry = {0};
+	chat_key(channel,-1,entry.hash);
+	int found = kademlia_find_value(node,&entry,1);
+
+	int valid = entry.data && entry.size == sizeof(CHAT_HEAD) && ((CHAT_HEAD*)entry.data)->magic == CHAT_HEAD_MAGIC;
+	if(valid) *head = *(CHAT_HEAD*)entry.data;
+	free(entry.data);
+	if(valid && head->segments > channel->known_segments) channel->known_segments = head->segments;
+	return found < 0 ? -1 : valid;
+}
+
+static int chat_store(NODE * node, CHAT_CHANNEL * channel, int segment, char * data, int size)
+{
+	HASH_ENTRY entry = {{},data,size};
+	chat_key(channel,segment,entry.hash);
+	return kademlia_store_value(node,&entry) > 0;
+}
+
+CHAT_CHANNEL * chat_channel(CHAT_LOG * log, const char * name)
+{
+	for(int i = 0; i < log->n_channels; i++)
+		if(strcmp(log->channels[i].name,name) == 0) return &log->channels[i];
+	if(log->n_channels == CHAT_MAX_CHANNELS) return NULL;
+
+	CHAT_CHANNEL * channel = &log->channels[log->n_channels++];
+	memset(channel,0,sizeof(CHAT_CHANNEL));
+	snprintf(channel->name,sizeof(channel->name),"%s",name);
+	return channel;
+}
+
+static int chat_retry(CHAT_CHANNEL * channel)
+{
+	// the lines stay pending, tried again after another CHAT_BATCH_MS
+	log_warn("could not append %d lines to the chat log of %s", channel->pending_lines, channel->name);
+	channel->pending_since = clock_ms();
+	channel->failed = 1;
+	return 0;
+}
+
+//
+//		Appending
+//
+
+void chat_append(NODE * node, CHAT_CHANNEL * channel, const char * text)
+{
+	int length = strlen(text);
+	if(length > CHAT_MAX_LINE) length = CHAT_MAX_LINE;
+	if(channel->pending_size + (int)sizeof(CHAT_LINE) + length > CHAT_MAX_PENDING)
+	{
+		log_warn("chat log of %s is not reachable, line dropped", channel->name);
+		return;
+	}
+
+	CHAT_LINE line = {(uint32_t)time(NULL),(uint16_t)node->info.port,(uint16_t)length};
+	channel->pending = (char*) realloc(channel->pending,channel->pending_size + sizeof(line) + length);
+	memcpy(channel->pending + channel->pending_size,&line,sizeof(line));
+	memcpy(channel->pending + channel->pending_size + sizeof(line),text,length);
+	channel->pending_size += sizeof(line) + length;
+	if(channel->pending_lines++ == 0) channel->pending_since = clock_ms();
+}
+
+int chat_flush(NODE * node, CHAT_CHANNEL * channel)
+{
+	// adds the pending lines to the end of the last segment, closing it and
+	// starting a new one when they do not fit, then moves the head on. The
+	// segments are stored before the head so it never points past them.
+	// Nothing is written until the head and last segment were either found
+	// or known not to be there, a timeout could make us write over them.
+
+	if(!channel->pending_lines) return 1;
+	SPAN("chat_flush");
+
+	CHAT_HEAD head = {CHAT_HEAD_MAGIC,1,0};
+	HASH_ENTRY last = {0};
+	int found = chat_head(node,channel,&head);
+	if(!found) head.segments = channel->known_segments; // no head, the segments we saw are not written over
+	if(found >= 0 && head.segments > 0)
+	{
+		chat_key(channel,head.segments-1,last.hash);
+		found = kademlia_find_value(node,&last,1);
+		if(!found) { log_warn("the last segment of %s is missing, starting a new one", channel->name); head.segments++; }
+	}
+	if(found < 0) return chat_retry(channel);
+	if(!head.segments) head.segments = 1;
+
+	int segment = head.segments-1, size = last.data ? last.size : 0, ok = 1;
+	char * data = (char*) malloc(size + channel->pending_size > CHAT_SEGMENT_BYTES ? size + channel->pending_size : CHAT_SEGMENT_BYTES);
+	if(size) memcpy(data,last.data,size);
+	free(last.data);
+
+	for(int offset = 0; offset < channel->pending_size && ok;)
+	{
+		CHAT_LINE * line = (CHAT_LINE*)(channel->pending + offset);
+		int line_size = sizeof(CHAT_LINE) + line->length;
+		if(size && size + line_size > CHAT_SEGMENT_BYTES)
+		{
+			ok = chat_store(node,channel,segment++,data,size); // closed for good
+			size = 0;
+		}
+		memcpy(data + size,line,line_size);
+		size += line_size;
+		offset += line_size;
+	}
+	ok = ok && chat_store(node,channel,segment,data,size);
+	free(data);
+
+	head.segments = segment+1;
+	head.lines += channel->pending_lines;
+	ok = ok && chat_store(node,channel,-1,(char*)&head,sizeof(head));
+	if(!ok) return chat_retry(channel);
+
+	channel->known_segments = head.segments;
+	log_debug("appended %d lines to %s, %u segments", channel->pending_lines, channel->name, head.segments);
+	free(channel->pending);
+	channel->pending = NULL;
+	channel->pending_size = channel->pending_lines = channel->failed = 0;
+	return 1;
+}
+
+void chat_poll(NODE * node, CHAT_LOG * log)
+{
+	unsigned now = clock_ms();
+	for(int i = 0; i < log->n_channels; i++)
+	{
+		CHAT_CHANNEL * channel = &log->channels[i];
+		if((channel->pending_lines >= CHAT_BATCH_LINES && !channel->failed) || (channel->pending_lines && now - channel->pending_since >= CHAT_BATCH_MS))
+			chat_flush(node,channel);
+	}
+}
+
+//
+//		Catching up
+//
+
+static int print_lines(CHAT_CHANNEL * channel, char * data, int size, int from)
+{
+	int n = 0;
+	for(int offset = from; offset + (int)sizeof(CHAT_LINE) <= size; n++)
+	{
+		CHAT_LINE * line = (CHAT_LINE*)(data + offset);
+		if(offset + (int)sizeof(CHAT_LINE) + line->length > size) break;
+
+		time_t when = line->time;
+		char stamp[32]; strftime(stamp,sizeof(stamp),"%m-%d %H:%M",localtime(&when));
+		printf("[%s %s] %d: %.*s\n", channel->name, stamp, line->port, line->length, data + offset + sizeof(CHAT_LINE));
+		offset += sizeof(CHAT_LINE) + line->length;
+	}
+	return n;
+}
+
+int chat_sync(NODE * node, CHAT_CHANNEL * channel)
+{
+	// the head, then every segment from the first one not seen in full,
+	// all of them in one batch of lookups
+
+	SPAN("chat_sync");
+	CHAT_HEAD head;
+	if(chat_head(node,channel,&head) <= 0) return 0;
+	if(head.segments <= channel->seen_segment) return 0;
+
+	if(head.segments - channel->seen_segment > CHAT_MAX_SEGMENTS)
+	{
+		printf("[%s] %u older segments skipped\n", channel->name, head.segments - channel->seen_segment - CHAT_MAX_SEGMENTS);
+		channel->seen_segment = head.segments - CHAT_MAX_SEGMENTS;
+		channel->seen_bytes = 0;
+	}
+
+	int n = head.segments - channel->seen_segment, lines = 0;
+	HASH_ENTRY * segments = (HASH_ENTRY*) calloc(n,sizeof(HASH_ENTRY));
+	for(int i = 0; i < n; i++) chat_key(channel,channel->seen_segment + i,segments[i].hash);
+	kademlia_find_values(node,segments,n,1);
+
+	for(int i = 0; i < n; i++)
+	{
+		if(!segments[i].data)
+		{
+			// tried again by the next sync
+			printf("[%s] segment %u could not be found\n", channel->name, channel->seen_segment);
+			lines = lines ? lines : -1;
+			break;
+		}
+		lines += print_lines(channel,segments[i].data,segments[i].size,channel->seen_bytes);
+		if(i < n-1) { channel->seen_segment++; channel->seen_bytes = 0; }
+		else channel->seen_bytes = segments[i].size;
+	}
+	for(int i = 0; i < n; i++) free(segments[i].data);
+	free(segments);
+	return lines;
+}
+
+//
+//		State between runs
+//
+
+int chat_load(CHAT_LOG * log, const char * path)
+{
+	// returns 0 if there is no file yet
+	FILE * file = fopen(path,"rb");
+	if(!file) return 0;
+
+	CHAT_CHANNEL saved;
+	while(fread(&saved,sizeof(saved),1,file) == 1)
+	{
+		saved.name[sizeof(saved.name)-1] = '\0';
+		CHAT_CHANNEL * channel = chat_channel(log,saved.name);
+		if(!channel) break;
+		channel->seen_segment = saved.seen_segment;
+		channel->seen_bytes = saved.seen_bytes;
+		channel->known_segments = saved.known_segments;
+	}
+	fclose(file);
+	return 1;
+}
+
+int chat_save(CHAT_LOG * log, const char * path)
+{
+	FILE * file = fopen(path,"wb");
+	if(!file) return 0;
+	for(int i = 0; i < log->n_channels; i++)
+	{
+		CHAT_CHANNEL saved = log->channels[i];
+		saved.pending = NULL;
+		saved.pending_size = saved.pending_lines = saved.failed = 0;
+		fwrite(&saved,sizeof(saved),1,file);
+	}
+	fclose(file);
+	return 1;
+}
+
+void chat_free(CHAT_LOG * log)
+{
+	for(int i = 0; i < log->n_channels; i++) free(log->channels[i].pending);
+	memset(log,0,sizeof(CHAT_LOG));
+}
@@ -0,0 +1,77 @@
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include "stdint.h"
+#include "dht.h"
+
+//
+//		Chat log
+//
+// Each channel's history is kept in the DHT as append-only segments. The
+// value under the key hash("chat <channel> <n>") is segment n, a run of
+// CHAT_LINE records each followed by its text. The key hash("chat <channel>
+// head") holds a CHAT_HEAD with the number of segments. Only the last
+// segment grows, an append stores it again with the new lines at the end,
+// once it would go past CHAT_SEGMENT_BYTES the lines start a new one and
+// the ones before never change again. Lines are batched before they are
+// appended, and a client that comes back fetches the head and then every
+// segment it has not seen in one round of FIND_VALUEs, see chat_sync.
+// Two clients appending to the same segment at once can lose the lines of
+// one of them, the chat log is a record for those who were away, not a
+// consistent log.
+//
+
+#define CHAT_SEGMENT_BYTES 4096 // a segment takes one chunk of an rpc payload
+#define CHAT_MAX_LINE 512
+#define CHAT_MAX_CHANNELS 16
+#define CHAT_MAX_SEGMENTS 64 // fetched by one chat_sync, older ones are skipped
+#define CHAT_BATCH_LINES 16 // appended at once
+#define CHAT_BATCH_MS 2000 // longest a line waits to be appended
+#define CHAT_HEAD_MAGIC 0x54414843 // "CHAT"
+
+typedef struct
+{
+	uint32_t time;   // seconds since the epoch
+	uint16_t port;   // of the node that wrote it
+	uint16_t length; // of the text after it
+} CHAT_LINE;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t segments; // the last one is the one that grows
+	uint32_t lines;
+} CHAT_HEAD;
+
+typedef struct
+{
+	char name[32];
+
+	// what we have shown so far, segments before seen_segment are done
+	uint32_t seen_segment, seen_bytes;
+	uint32_t known_segments; // in the last head we got, in case it can not be found
+
+	// lines waiting to be appended
+	char * pending;
+	int pending_size, pending_lines;
+	unsigned pending_since; // clock_ms of the oldest, or of the last append that failed
+	int failed; // then only tried again after CHAT_BATCH_MS
+} CHAT_CHANNEL;
+
+typedef struct
+{
+	CHAT_CHANNEL channels[CHAT_MAX_CHANNELS];
+	int n_channels;
+} CHAT_LOG;
+
+CHAT_CHANNEL * chat_channel(CHAT_LOG * log, const char * name); // found or added, NULL if there are too many
+void chat_append(NODE * node, CHAT_CHANNEL * channel, const char * text); // batched, see chat_poll
+int chat_flush(NODE * node, CHAT_CHANNEL * channel); // appends the pending lines now, 0 if it could not
+void chat_poll(NODE * node, CHAT_LOG * log); // flushes the batches that are full or old enough
+int chat_sync(NODE * node, CHAT_CHANNEL * channel); // prints the lines not seen yet, returns how many or -1
+
+int chat_load(CHAT_LOG * log, const char * path); // what was seen of each channel, from an earlier run
+int chat_save(CHAT_LOG * log, const char * path);
+void chat_free(CHAT_LOG * log);
+
+#endif
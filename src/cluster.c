@@ -0,0 +1,86 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "dht.h"
+
+//
+//		Clusters
+//
+// Runs n nodes inside this process on ports first_port and up, each on
+// its own thread with its own transport. Node i joins node 0, one after
+// the other like nodes started from spawn.bat.
+//
+
+typedef struct
+{
+	CLUSTER * cluster;
+	int idx;
+} NODE_ARG;
+
+static void * node_thread(void * data)
+{
+	NODE_ARG * arg = (NODE_ARG*) data;
+	CLUSTER * cluster = arg->cluster;
+	NODE * node = &cluster->nodes[arg->idx];
+	span_thread_name("node %d",node->info.port);
+
+	if(arg->idx > 0)
+	{
+		CONTACT bootstrap = {0}; bootstrap.port = cluster->nodes[0].info.port;
+		kademlia_join(node,&bootstrap);
+	}
+	sem_post(&cluster->joined);
+
+	while(!cluster->stop)
+		if(!node_poll(node)) transport_wait(node->transport,10);
+
+	free(arg);
+	return NULL;
+}
+
+int cluster_start(CLUSTER * cluster, int n_nodes, int first_port, int type, size_t quota)
+{
+	// returns 0 if a node can not listen on its port, a quota of 0 leaves the default
+	memset(cluster,0,sizeof(CLUSTER));
+	cluster->nodes = (NODE*) calloc(n_nodes,sizeof(NODE));
+	cluster->transports = (TRANSPORT*) calloc(n_nodes,sizeof(TRANSPORT));
+	cluster->threads = (pthread_t*) calloc(n_nodes,sizeof(pthread_t));
+	sem_init(&cluster->joined,0,0);
+
+	for(int i = 0; i < n_nodes; i++)
+	{
+		TRANSPORT * transport = &cluster->transports[i];
+		if(!transport_create(transport,type,first_port+i,MAX_CONNECTIONS) || !transport_listen(transport))
+		{
+			log_error("could not use %s port %d", transport_name(type), first_port+i);
+			cluster_stop(cluster);
+			return 0;
+		}
+		node_init(&cluster->nodes[i],transport,first_port+i);
+		if(quota) cluster->nodes[i].quota = quota;
+
+		NODE_ARG * arg = (NODE_ARG*) malloc(sizeof(NODE_ARG));
+		arg->cluster = cluster;
+		arg->idx = i;
+		pthread_create(&cluster->threads[i],NULL,node_thread,arg);
+		cluster->n_nodes++;
+		sem_wait(&cluster->joined);
+	}
+	return 1;
+}
+
+void cluster_stop(CLUSTER * cluster)
+{
+	cluster->stop = 1;
+	for(int i = 0; i < cluster->n_nodes; i++) pthread_join(cluster->threads[i],NULL);
+	for(int i = 0; i < cluster->n_nodes; i++)
+	{
+		transport_close(&cluster->transports[i]);
+		node_free(&cluster->nodes[i]);
+	}
+	free(cluster->nodes);
+	free(cluster->transports);
+	free(cluster->threads);
+	sem_destroy(&cluster->joined);
+	cluster->n_nodes = 0;
+}
@@ -0,0 +1,727 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "connection.h"
+#include "log.h"
+#include "span.h"
+
+#define INPROC_SEND_TIMEOUT 4000 // ms a full peer may keep a sender waiting before the connection is dropped
+#define UDP_APPEND_TIMEOUT 100 // ms a datagram waits for room before it counts as lost
+
+#define VIRTUAL_EPOCH 1000000000 // clock_s of the simulator's time 0
+
+unsigned (*virtual_clock)() = NULL;
+
+unsigned clock_ms()
+{
+	if(virtual_clock) return virtual_clock();
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000 + t.tv_nsec/1000000;
+}
+
+unsigned clock_s()
+{
+	if(virtual_clock) return VIRTUAL_EPOCH + virtual_clock()/1000;
+	return time(NULL);
+}
+
+static void deadline_after(unsigned timeout, struct timespec * deadline)
+{
+	// sem_timedwait takes a CLOCK_REALTIME deadline
+	clock_gettime(CLOCK_REALTIME,deadline);
+	deadline->tv_sec += timeout/1000;
+	deadline->tv_nsec += (timeout%1000)*1000000;
+	if(deadline->tv_nsec >= 1000000000) { deadline->tv_sec++; deadline->tv_nsec -= 1000000000; }
+}
+
+static int clock_wait(TRANSPORT * transport, sem_t * sem, unsigned timeout)
+{
+	struct timespec deadline; deadline_after(timeout,&deadline);
+	return sem_timedwait(sem,&deadline) == 0;
+}
+
+static int wait_until(TRANSPORT * transport, sem_t * sem, unsigned deadline)
+{
+	// a deadline that passed still takes a post that is already there
+	int remaining = (int)(deadline - clock_ms());
+	return transport->wait(transport,sem,remaining > 0 ? remaining : 0);
+}
+
+void connection_reset(CONNECTION * connection, int port)
+{
+	// a connection slot taken for a new peer, call with the mutex held
+	connection->live = 1;
+	connection->port = port;
+	connection->used = clock_ms();
+	connection->size = 0;
+	connection->peer = NULL;
+	connection->srtt = connection->rttvar = connection->rto = 0;
+	connection->udp_sent = connection->udp_message = connection->udp_offset = 0;
+}
+
+//
+//		Reading, the same for every transport
+//
+
+int connection_take(CONNECTION * connection, char * data, int size)
+{
+	// call with the mutex held, takes size bytes off the front of the buffer
+	if(!connection->live || connection->size < size) return 0;
+
+	memcpy(data,connection->buffer,size);
+	metrics_add(connection->transport->metrics,METRIC_BYTES_IN,size);
+	connection->used = clock_ms();
+	connection->size -= size;
+	memmove(connection->buffer,connection->buffer+size,connection->size);
+	sem_post( &connection->empty );
+	return 1;
+}
+
+int connection_append(CONNECTION * connection, char * data, int size, unsigned timeout)
+{
+	// waits up to timeout ms for room in the buffer, returns 0 if there was
+	// none or the connection closed
+
+	unsigned deadline = clock_ms() + timeout;
+	for(;;)
+	{
+		sem_wait( &connection->mutex );
+		if(!connection->live) { sem_post( &connection->mutex ); return 0; }
+		if((int)sizeof(connection->buffer) - connection->size >= size)
+		{
+			memcpy(connection->buffer+connection->size,data,size);
+			connection->size += size;
+			sem_post( &connection->mutex );
+			sem_post( &connection->ready );
+			sem_post( &connection->transport->arrived );
+			return 1;
+		}
+		sem_post( &connection->mutex );
+		if(!wait_until(connection->transport,&connection->empty,deadline)) return 0;
+	}
+}
+
+void connection_read(CONNECTION * connection, char * data, int size)
+{
+	sem_wait( &connection->mutex );
+	if(!connection_take(connection,data,size)) memset(data,0,size);
+	sem_post( &connection->mutex );
+}
+
+int connection_peek(CONNECTION * connection, char * data, int size)
+{
+	sem_wait( &connection->mutex );
+	int ready = connection->live && connection->size >= size;
+	if(ready) memcpy(data,connection->buffer,size);
+	sem_post( &connection->mutex );
+	return ready;
+}
+
+int connection_wait(CONNECTION * connection, char * data, int size, unsigned timeout)
+{
+	// blocks until size bytes have arrived, the connection closes
+	// or timeout ms pass, returns 1 if data was read
+
+	unsigned deadline = clock_ms() + timeout;
+
+	for(;;)
+	{
+		sem_wait( &connection->mutex );
+		int live = connection->live, taken = connection_take(connection,data,size);
+		sem_post( &connection->mutex );
+
+		if(taken) return 1;
+		if(!live) return 0;
+		if(!wait_until(connection->transport,&connection->ready,deadline)) return 0;
+	}
+}
+
+void connection_send(CONNECTION * connection, char * data, int size)
+{
+	sem_wait( &connection->mutex );
+	int live = connection->live;
+	sem_post( &connection->mutex );
+	if(!live) return;
+	connection->used = clock_ms();
+	metrics_add(connection->transport->metrics,METRIC_BYTES_OUT,size);
+	connection->transport->send(connection,data,size);
+}
+
+void connection_close(CONNECTION * connection)
+{
+	connection->transport->close(connection);
+}
+
+static CONNECTION * free_connection(TRANSPORT * transport)
+{
+	// a slot for a new peer with its mutex held, NULL if there is none.
+	// When all are live the one used least recently that no rpc waits on
+	// is closed, so a node reaches more peers than it has connections.
+	// A tcp connection is only free once its socket thread stopped, the
+	// peer after this one gets it
+
+	CONNECTION * oldest = NULL;
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		CONNECTION * connection = &transport->connections[i];
+		sem_wait(&connection->mutex);
+		if(!connection->live) return connection;
+		sem_post(&connection->mutex);
+		if(!connection->waiting && (!oldest || (int)(connection->used - oldest->used) < 0)) oldest = connection;
+	}
+	if(!oldest) return NULL;
+
+	log_info("closing the connection to %d, it was used least recently",oldest->port);
+	connection_close(oldest);
+	sem_wait(&oldest->mutex);
+	if(!oldest->live) return oldest;
+	sem_post(&oldest->mutex);
+	return NULL;
+}
+
+//
+//		TCP
+//
+
+static void * tcp_socket_thread(void* data)
+{
+	// appends whatever arrives on the socket to connection->buffer,
+	// readers take whole messages off the front of it
+
+	CONNECTION * connection = (CONNECTION*)data;
+	span_thread_name("tcp %d from %d",connection->transport->port,connection->port);
+
+	for(;;)
+	{
+		sem_wait( &connection->mutex );
+
+		if(sizeof(connection->buffer) - connection->size >= SOCKET_BUFFER_SIZE)
+		{
+			sem_post( &connection->mutex );
+
+			int n = 0; char tmp[SOCKET_BUFFER_SIZE];
+
+			n = recv(connection->socket, tmp, sizeof(tmp), 0);
+
+			if(n<=0) break;
+
+			//printf("received: %s\n",tmp);
+			SPAN("tcp_deliver",NULL,connection->port);
+			sem_wait( &connection->mutex );
+			if(connection->live==0)
+			{
+				sem_post( &connection->mutex );
+				break;
+			}
+			memcpy(connection->buffer+connection->size,tmp,n);
+			connection->size += n;
+			sem_post( &connection->mutex );
+			sem_post( &connection->ready );
+			sem_post( &connection->transport->arrived );
+		}
+		else
+		{
+			// wait for a reader to drain the buffer instead of spinning
+			sem_post( &connection->mutex );
+			SPAN("tcp_full",NULL,connection->port);
+			sem_wait( &connection->empty );
+		}
+	}
+
+
+	sem_wait( &connection->mutex );
+	log_info("closing connection to %d",connection->port);
+	connection->live = 0;
+	connection->size = 0;
+	closesocket(connection->socket);
+	sem_post( &connection->mutex );
+	sem_post( &connection->ready ); // wake anyone waiting on a response
+	return NULL;
+}
+
+static void tcp_start(CONNECTION * connection)
+{
+	// call with the mutex held, the previous socket thread of the slot is
+	// done once live is 0 but still has to be joined
+	if(connection->thread) pthread_join(connection->thread,NULL);
+	pthread_create(&connection->thread, NULL, tcp_socket_thread, connection);
+}
+
+static void tcp_no_delay(SOCKET socket)
+{
+	// a message goes out in more than one send and each rpc waits for the
+	// answer, Nagle would hold the rest of it until the peer's delayed ack
+	int on = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+}
+
+static void * tcp_server_thread(void * data)
+{
+	TRANSPORT * transport = (TRANSPORT*)data;
+	SOCKET listener = transport->socket; // transport_close only changes it after the join
+	SOCKET client;
+	SOCKADDR_IN clientAddr;
+
+	socklen_t clientAddrSize = sizeof(clientAddr);
+	while((client = accept(listener, (SOCKADDR *)&clientAddr, &clientAddrSize)) != INVALID_SOCKET)
+	{
+		int port = 0;
+		tcp_no_delay(client);
+		recv(client,(char*)&port,sizeof(int),0);
+
+		CONNECTION * connection = port>0 && transport->listening ? free_connection(transport) : NULL;
+		if(connection)
+		{
+			log_info("received connection from port %d (%d)",port,ntohs(clientAddr.sin_port));
+			connection_reset(connection,port);
+			connection->socket = client;
+			connection->addr = clientAddr;
+			tcp_start(connection);
+			sem_post(&connection->mutex);
+		}
+		else closesocket(client);
+	}
+	return NULL;
+}
+
+static int tcp_listen(TRANSPORT * transport)
+{
+	SOCKADDR_IN serverAddr;
+
+	transport->socket = socket(AF_INET, SOCK_STREAM, 0);
+
+	serverAddr.sin_addr.s_addr = INADDR_ANY;
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons(transport->port);
+
+	if(bind(transport->socket, (SOCKADDR *)&serverAddr, sizeof(serverAddr)) != 0) return 0;
+	listen(transport->socket, 0);
+	pthread_create(&transport->thread, NULL, tcp_server_thread, transport);
+	return 1;
+}
+
+static int tcp_open(TRANSPORT * transport, CONNECTION * connection, int port)
+{
+	// connects and introduces us with our port
+
+	SOCKET server;
+	SOCKADDR_IN addr;
+
+	server = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	log_debug("connecting to %d", port);
+
+	int r = connect(server, (SOCKADDR *)&addr, sizeof(addr));
+	tcp_no_delay(server);
+	send(server,(char*)&transport->port,sizeof(int),0);
+
+	if(r) { log_warn("could not connect to %d", port); closesocket(server); return 0; }
+	else log_info("connected to %d", port);
+
+	connection_reset(connection,port);
+	connection->socket = server;
+	connection->addr = addr;
+	tcp_start(connection);
+	return 1;
+}
+
+static void tcp_send(CONNECTION * connection, char * data, int size)
+{
+	send(connection->socket,data,size,0);
+}
+
+static void tcp_close(CONNECTION * connection)
+{
+	// the socket thread sees the shutdown and closes the connection
+	sem_wait(&connection->mutex);
+	if(connection->live) shutdown(connection->socket,2);
+	sem_post(&connection->mutex);
+	sem_post(&connection->empty);
+}
+
+//
+//		UDP
+//
+
+static CONNECTION * udp_connection(TRANSPORT * transport, int port, SOCKADDR_IN * from)
+{
+	// the connection datagrams from port go to, a new one if we are listening
+
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		CONNECTION * connection = &transport->connections[i];
+		sem_wait(&connection->mutex);
+		int found = connection->live && connection->port == port;
+		sem_post(&connection->mutex);
+		if(found) return connection;
+	}
+
+	CONNECTION * connection = transport->listening ? free_connection(transport) : NULL;
+	if(!connection) return NULL;
+
+	log_info("received datagrams from port %d",port);
+	connection_reset(connection,port);
+	connection->addr = *from;
+	sem_post(&connection->mutex);
+	return connection;
+}
+
+static void udp_close(CONNECTION * connection);
+
+typedef struct
+{
+	int port;         // the sender's, peers know it by it
+	unsigned message; // counts the messages sent on the connection
+	int offset, size; // of the data that follows in the message, of the message
+} UDP_HEADER;
+
+static void * udp_thread(void * data)
+{
+	// a datagram is a UDP_HEADER and a piece of a message, which waits a
+	// little for room in the buffer. A piece that does not follow the last
+	// one means one went missing, was cut short or came out of order.
+	// Nothing after the part of the message already in the buffer would
+	// start where a message does, so the connection is closed and the next
+	// message starts a new one
+
+	TRANSPORT * transport = (TRANSPORT*)data;
+	SOCKET listener = transport->socket; // transport_close only changes it after the join
+	char datagram[sizeof(UDP_HEADER) + SOCKET_BUFFER_SIZE];
+	span_thread_name("udp %d",transport->port);
+
+	for(;;)
+	{
+		SOCKADDR_IN from;
+		socklen_t fromSize = sizeof(from);
+		int n = recvfrom(listener, datagram, sizeof(datagram), 0, (SOCKADDR *)&from, &fromSize);
+		if(n <= 0) break; // closed, we never send empty datagrams
+		if(n <= (int)sizeof(UDP_HEADER)) continue;
+
+		UDP_HEADER header; memcpy(&header,datagram,sizeof(header));
+		int size = n - sizeof(UDP_HEADER);
+		if(header.offset < 0 || header.offset + size > header.size) continue;
+		CONNECTION * connection = udp_connection(transport,header.port,&from);
+		if(!connection) continue;
+
+		if(header.offset != connection->udp_offset || (header.offset && header.message != connection->udp_message))
+		{
+			if(connection->udp_offset)
+			{
+				log_warn("lost part of a message from %d, closing the connection",header.port);
+				udp_close(connection);
+			}
+			if(header.offset || !(connection = udp_connection(transport,header.port,&from))) continue;
+		}
+		connection->udp_message = header.message;
+		connection->udp_offset = header.offset + size < header.size ? header.offset + size : 0;
+
+		// one thread receives for every connection, so one that is not read
+		// must not hold up the others, the reader may be waiting on them
+		SPAN("udp_deliver",NULL,header.port);
+		if(!connection_append(connection,datagram+sizeof(UDP_HEADER),size,UDP_APPEND_TIMEOUT) && header.size > size)
+		{
+			log_warn("no room for part of a message from %d, closing the connection",header.port);
+			udp_close(connection);
+		}
+	}
+	return NULL;
+}
+
+static int udp_listen(TRANSPORT * transport)
+{
+	return 1; // udp_thread takes new peers from now on
+}
+
+static int udp_open(TRANSPORT * transport, CONNECTION * connection, int port)
+{
+	connection_reset(connection,port);
+	connection->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	connection->addr.sin_family = AF_INET;
+	connection->addr.sin_port = htons(port);
+	return 1;
+}
+
+static void udp_send(CONNECTION * connection, char * data, int size)
+{
+	// one message, in datagrams that each say where their piece goes
+	char datagram[sizeof(UDP_HEADER) + SOCKET_BUFFER_SIZE];
+	UDP_HEADER header = {connection->transport->port, ++connection->udp_sent, 0, size};
+
+	for(; header.offset < size; header.offset += SOCKET_BUFFER_SIZE)
+	{
+		int n = size - header.offset < SOCKET_BUFFER_SIZE ? size - header.offset : SOCKET_BUFFER_SIZE;
+		memcpy(datagram,&header,sizeof(header));
+		memcpy(datagram+sizeof(UDP_HEADER),data+header.offset,n);
+		sendto(connection->transport->socket, datagram, sizeof(UDP_HEADER)+n, 0, (SOCKADDR *)&connection->addr, sizeof(connection->addr));
+	}
+}
+
+static void udp_close(CONNECTION * connection)
+{
+	sem_wait(&connection->mutex);
+	connection->live = 0;
+	connection->size = 0;
+	sem_post(&connection->mutex);
+	sem_post(&connection->ready);
+	sem_post(&connection->empty);
+}
+
+static int udp_create(TRANSPORT * transport)
+{
+	SOCKADDR_IN addr;
+
+	transport->socket = socket(AF_INET, SOCK_DGRAM, 0);
+
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(transport->port);
+
+	if(bind(transport->socket, (SOCKADDR *)&addr, sizeof(addr)) != 0) { closesocket(transport->socket); return 0; }
+
+	// a message is one datagram or more and the default buffer holds only
+	// a few, a lost one costs the connection
+	int size = UDP_RECEIVE_BUFFER;
+	setsockopt(transport->socket, SOL_SOCKET, SO_RCVBUF, (char*)&size, sizeof(size));
+	pthread_create(&transport->thread, NULL, udp_thread, transport);
+	return 1;
+}
+
+//
+//		In-process
+//
+
+static pthread_mutex_t inproc_lock = PTHREAD_MUTEX_INITIALIZER;
+static TRANSPORT * inproc_hosts = NULL; // listening transports of this process
+
+static int inproc_listen(TRANSPORT * transport)
+{
+	pthread_mutex_lock(&inproc_lock);
+	transport->next = inproc_hosts;
+	inproc_hosts = transport;
+	pthread_mutex_unlock(&inproc_lock);
+	return 1;
+}
+
+static int inproc_open(TRANSPORT * transport, CONNECTION * connection, int port)
+{
+	// pairs the connection with a free one of the transport on port
+
+	pthread_mutex_lock(&inproc_lock);
+	TRANSPORT * host = inproc_hosts;
+	while(host && host->port != port) host = host->next;
+	pthread_mutex_unlock(&inproc_lock);
+	if(!host) { log_warn("no node on port %d",port); return 0; }
+
+	for(int i = 0; i < host->n_connections; i++)
+	{
+		// only try the lock, the host may be opening a connection to us
+		CONNECTION * peer = &host->connections[i];
+		if(sem_trywait(&peer->mutex) != 0) continue;
+		if(!peer->live)
+		{
+			connection_reset(peer,transport->port);
+			peer->peer = connection;
+			peer->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+			sem_post(&peer->mutex);
+
+			connection_reset(connection,port);
+			connection->peer = peer;
+			connection->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+			return 1;
+		}
+		sem_post(&peer->mutex);
+	}
+	return 0;
+}
+
+static void inproc_close(CONNECTION * connection)
+{
+	sem_wait(&connection->mutex);
+	CONNECTION * peer = connection->live ? connection->peer : NULL;
+	connection->live = 0;
+	connection->size = 0;
+	sem_post(&connection->mutex);
+	sem_post(&connection->ready);
+	sem_post(&connection->empty);
+	if(!peer) return;
+
+	sem_wait(&peer->mutex);
+	if(peer->peer == connection) { peer->live = 0; peer->size = 0; }
+	sem_post(&peer->mutex);
+	sem_post(&peer->ready);
+	sem_post(&peer->empty);
+}
+
+static void inproc_send(CONNECTION * connection, char * data, int size)
+{
+	// a peer that does not read for INPROC_SEND_TIMEOUT is treated like a
+	// reset tcp connection, so neither side can block the other for good
+	for(int i = 0; i < size; i += SOCKET_BUFFER_SIZE)
+	if(!connection_append(connection->peer,data+i,size-i < SOCKET_BUFFER_SIZE ? size-i : SOCKET_BUFFER_SIZE,INPROC_SEND_TIMEOUT))
+	{
+		inproc_close(connection);
+		return;
+	}
+}
+
+//
+//		Transports
+//
+
+int transport_create(TRANSPORT * transport, int type, int port, int n_connections)
+{
+	// returns 0 if the transport can not be used on port
+
+	memset(transport,0,sizeof(TRANSPORT));
+	transport->type = type;
+	transport->port = port;
+	transport->n_connections = n_connections;
+	transport->connections = (CONNECTION*) calloc(n_connections,sizeof(CONNECTION));
+	transport->wait = clock_wait;
+	sem_init(&transport->arrived,0,0);
+
+	for(int i = 0; i < n_connections; i++)
+	{
+		transport->connections[i].transport = transport;
+		sem_init(&transport->connections[i].mutex,0,1);
+		sem_init(&transport->connections[i].empty,0,1);
+		sem_init(&transport->connections[i].ready,0,0);
+	}
+
+	switch(type)
+	{
+		case TRANSPORT_TCP:
+			transport->listen = tcp_listen; transport->open = tcp_open;
+			transport->send = tcp_send; transport->close = tcp_close;
+			return 1;
+		case TRANSPORT_UDP:
+			transport->listen = udp_listen; transport->open = udp_open;
+			transport->send = udp_send; transport->close = udp_close;
+			return udp_create(transport);
+		case TRANSPORT_INPROC:
+			transport->listen = inproc_listen; transport->open = inproc_open;
+			transport->send = inproc_send; transport->close = inproc_close;
+			return 1;
+		case TRANSPORT_SIM:
+			return 1;
+	}
+	return 0;
+}
+
+int transport_listen(TRANSPORT * transport)
+{
+	if(!transport->listening) transport->listening = transport->listen(transport);
+	return transport->listening;
+}
+
+CONNECTION * transport_connect(TRANSPORT * transport, int port)
+{
+	if(transport->port == port) return NULL;
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		CONNECTION * connection = &transport->connections[i];
+		sem_wait(&connection->mutex);
+		if(connection->live)
+		if(connection->port==port)
+		{
+			sem_post(&connection->mutex);
+			return connection;
+		}
+		sem_post(&connection->mutex);
+	}
+
+	CONNECTION * connection = free_connection(transport);
+	if(!connection) return NULL;
+	int opened = transport->open(transport,connection,port);
+	sem_post(&connection->mutex);
+	return opened ? connection : NULL;
+}
+
+CONNECTION * transport_accept(TRANSPORT * transport, int port)
+{
+	// for a transport that delivers itself, as udp_thread does
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		CONNECTION * connection = &transport->connections[i];
+		sem_wait(&connection->mutex);
+		int found = connection->live && connection->port == port;
+		sem_post(&connection->mutex);
+		if(found) return connection;
+	}
+
+	CONNECTION * connection = transport->listening ? free_connection(transport) : NULL;
+	if(!connection) return NULL;
+	connection_reset(connection,port);
+	sem_post(&connection->mutex);
+	return connection;
+}
+
+int transport_wait(TRANSPORT * transport, unsigned timeout)
+{
+	return transport->wait(transport,&transport->arrived,timeout);
+}
+
+void transport_close(TRANSPORT * transport)
+{
+	// stops taking peers and closes every connection, the transport can
+	// be freed afterwards
+
+	if(transport->type == TRANSPORT_INPROC && transport->listening)
+	{
+		pthread_mutex_lock(&inproc_lock);
+		TRANSPORT ** host = &inproc_hosts;
+		while(*host && *host != transport) host = &(*host)->next;
+		if(*host) *host = transport->next;
+		pthread_mutex_unlock(&inproc_lock);
+	}
+	transport->listening = 0;
+
+	// closed before joining the listener, which may be waiting for room
+	// in one of them, and again after for any peer it took meanwhile
+	for(int i = 0; i < transport->n_connections; i++) transport->close(&transport->connections[i]);
+	if(transport->thread)
+	{
+		// closed before the join, as in metrics_stop, winsock does not
+		// wake an accept for a shutdown
+		shutdown(transport->socket,2);
+		closesocket(transport->socket);
+		pthread_join(transport->thread,NULL);
+		transport->socket = INVALID_SOCKET;
+		transport->thread = 0;
+	}
+
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		CONNECTION * connection = &transport->connections[i];
+		transport->close(connection);
+		if(connection->thread) pthread_join(connection->thread,NULL);
+		connection->thread = 0;
+	}
+	free(transport->connections);
+	transport->connections = NULL;
+	transport->n_connections = 0;
+}
+
+int transport_type(const char * name)
+{
+	for(int type = TRANSPORT_TCP; type <= TRANSPORT_INPROC; type++)
+		if(strcmp(name,transport_name(type))==0) return type;
+	return -1;
+}
+
+const char * transport_name(int type)
+{
+	switch(type)
+	{
+		case TRANSPORT_TCP: return "tcp";
+		case TRANSPORT_UDP: return "udp";
+		case TRANSPORT_INPROC: return "inproc";
+		case TRANSPORT_SIM: return "sim";
+	}
+	return "unknown";
+}
@@ -7,28 +7,110 @@
 #include <pthread.h>
 #include <semaphore.h>
 
-#include <winsock2.h>
+#include "sockets.h"
+#include "metrics.h"
 #define MAX_CONNECTIONS 64
 #define SOCKET_BUFFER_SIZE 8192
+#define STREAM_BUFFER_SIZE (SOCKET_BUFFER_SIZE*4) // bytes received but not yet read
+#define UDP_RECEIVE_BUFFER (SOCKET_BUFFER_SIZE*128) // datagrams the system keeps while udp_thread waits for room
 #undef RPC_MESSAGE
 
+struct TRANSPORT_t;
+
 typedef struct CONNECTION_t
 {
 	SOCKET socket;
 	SOCKADDR_IN addr;
-	char buffer[SOCKET_BUFFER_SIZE];
+	char buffer[STREAM_BUFFER_SIZE];
 	int size;
 	int live;
 	int port;
 	pthread_t thread;
 	sem_t mutex;
-	sem_t empty;
+	sem_t empty; // posted when a reader takes data out of the buffer
+	sem_t ready; // posted when the socket thread adds data to the buffer
+
+	struct TRANSPORT_t * transport; // the one the connection belongs to
+	struct CONNECTION_t * peer; // other end of an in-process connection
+
+	// RFC 6298 retransmission timer for rpcs to this peer in ms,
+	// srtt is 0 until the first sample
+	unsigned srtt,rttvar,rto;
+	int waiting; // rpc waits reading the responses on it, see wait_rpcs in dht.c
+	unsigned used; // clock_ms of the last read or send, see free_connection
+
+	// udp: messages sent, and the one coming in with the offset of its
+	// next datagram, 0 between messages. The simulator numbers messages
+	// with them too
+	unsigned udp_sent, udp_message;
+	int udp_offset;
 } CONNECTION;
 
+//
+//		Transports
+//
+// Every transport delivers what a peer sends into connection->buffer in
+// order, so readers use connection_read and connection_wait whatever
+// carries the bytes. A connection_send is one whole message. They differ
+// in how bytes are sent and how peers connect:
+//	TRANSPORT_TCP     a stream socket and a reader thread per connection
+//	TRANSPORT_UDP     one datagram socket per transport, datagrams start
+//	                  with a UDP_HEADER, only for loopback since a lost
+//	                  datagram is not sent again, a message that misses
+//	                  one closes the connection
+//	TRANSPORT_INPROC  sends copy straight into the peer's buffer, for
+//	                  several nodes in one process
+//	TRANSPORT_SIM     the simulator in dht/ sets the functions and
+//	                  delivers with transport_accept and connection_append
+// A node owns one transport, its connections are the node's peers. When
+// every connection is taken, a new peer gets the one used least recently.
+//
+
+enum TRANSPORTS { TRANSPORT_TCP, TRANSPORT_UDP, TRANSPORT_INPROC, TRANSPORT_SIM };
+
+typedef struct TRANSPORT_t
+{
+	int type;
+	int port; // ours, peers know us by it
+	CONNECTION * connections;
+	int n_connections;
+	sem_t arrived; // posted whenever data arrives on any connection
+
+	// set by transport_create for the type, open is called with
+	// connection->mutex held
+	int (*listen)(struct TRANSPORT_t * transport);
+	int (*open)(struct TRANSPORT_t * transport, CONNECTION * connection, int port);
+	void (*send)(CONNECTION * connection, char * data, int size);
+	void (*close)(CONNECTION * connection);
+	int (*wait)(struct TRANSPORT_t * transport, sem_t * sem, unsigned timeout); // until sem is posted or timeout ms pass, 1 if it was
+
+	SOCKET socket;    // listening or datagram socket
+	pthread_t thread; // accepts or receives on it
+	int listening;
+	struct TRANSPORT_t * next; // listening in-process transports
+	METRICS * metrics; // counts the bytes when set
+} TRANSPORT;
+
+int transport_create(TRANSPORT * transport, int type, int port, int n_connections);
+int transport_listen(TRANSPORT * transport); // start taking connections from peers
+CONNECTION * transport_connect(TRANSPORT * transport, int port); // an open connection to port, NULL if it can not be made
+CONNECTION * transport_accept(TRANSPORT * transport, int port); // the connection for a peer on port, a new one if we are listening, NULL if there is no room
+int transport_wait(TRANSPORT * transport, unsigned timeout); // until data arrives or timeout ms, returns 1 if it did
+void transport_close(TRANSPORT * transport); // closes all connections
+int transport_type(const char * name); // -1 if not a transport
+const char * transport_name(int type);
 
-CONNECTION * ping(int src_port,int port); // Implementation in main.c
 void connection_send(CONNECTION * connection, char * data, int size);
 void connection_read(CONNECTION * connection, char * data, int size);
+int connection_peek(CONNECTION * connection, char * data, int size); // copies without taking, 0 if size bytes are not there yet
+int connection_wait(CONNECTION * connection, char * data, int size, unsigned timeout);
+void connection_close(CONNECTION * connection);
+void connection_reset(CONNECTION * connection, int port); // taken for a new peer, with the mutex held
+int connection_append(CONNECTION * connection, char * data, int size, unsigned timeout); // 0 if there was no room for timeout ms or it closed
+
+extern unsigned (*virtual_clock)(); // ms, the simulator's clock instead of the system's when set
+unsigned clock_ms();
+unsigned clock_s(); // seconds, for times that are kept in seconds
 
 
-#endif
\ No newline at end of file
+#endif
@@ -5,399 +5,831 @@
 #include "stdint.h"
 #include "dht.h"
 
-// *Really* minimal PCG32 code / (c) 2014 M.E. O'Neill / pcg-random.org
-// Licensed under Apache License 2.0 (NO WARRANTY, etc. see website)
-
-typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
-uint32_t pcg32_random_r(pcg32_random_t* rng)
-{
-    uint64_t oldstate = rng->state;
-    rng->state = oldstate * 6364136223846793005ULL + (rng->inc|1);
-    uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
-    uint32_t rot = oldstate >> 59u;
-    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
-}
-
 //NODE all_nodes[N_NODES]; // for our simulation
 
-void hash_distance(K_ID a, K_ID b, K_ID out)
-{
-	for(int i = 0; i < K_ID_LEN; i++)
-		out[i] = a[i]^b[i];
-}
+// the templates in kademlia.h instantiated for the configuration in dht.h
 
-int hash_equ(K_ID a, K_ID b)
-{
-	for(int i = 0; i < K_ID_LEN; i++)
-		if(a[i] != b[i]) return 0;
-	return 1;
-}
+void hash_distance(K_ID a, K_ID b, K_ID out) { hash_distance<K_ID_LEN>(a,b,out); }
+int hash_equ(K_ID a, K_ID b) { return hash_equ<K_ID_LEN>(a,b); }
+int hash_lth(K_ID a, K_ID b) { return hash_lth<K_ID_LEN>(a,b); }
+int hash_in_range(K_ID hash, K_ID min, K_ID max) { return hash_in_range<K_ID_LEN>(hash,min,max); }
+void hash_split(K_ID min, K_ID max, K_ID split) { hash_split<K_ID_LEN>(min,max,split); }
+
+void hash_print(K_ID hash) { hash_print<K_ID_LEN>(hash); }
+char * hash_string(K_ID hash, char * out) { return hash_string<K_ID_LEN>(hash,out); }
 
-int hash_lth(K_ID a, K_ID b)
+int hash_insert(HASH_TABLE table, HASH_ENTRY * entry)
 {
-	for(int i = 0; i < K_ID_LEN; i++)
-		if(a[i] < b[i]) return 1;
-		else if(a[i] > b[i]) return 0;
-	return 0;
+	SPAN("hash_insert",NULL,0,entry->hash);
+	return hash_insert<KADEMLIA>(table,entry);
 }
 
-int hash_in_range(K_ID hash, K_ID min, K_ID max)
+int hash_search(HASH_TABLE table, HASH_ENTRY * entry)
 {
-	return hash_lth(hash,max) && (hash_lth(min,hash) || hash_equ(hash,min));
+	SPAN("hash_search",NULL,0,entry->hash);
+	int idx = hash_search<KADEMLIA>(table,entry);
+	if(idx >= 0) log_trace("found hash at %d %.*s", idx, table[idx].size, table[idx].data);
+	return idx;
 }
 
-void hash_print(K_ID hash)
+void merge_contact_lists(CONTACT ** dst, CONTACT ** src, K_ID hash)
 {
-	for(int i = 0; i < K_ID_LEN; i++) 
-		printf("%02X",hash[i]);
+	merge_contact_lists<KADEMLIA>(dst,src,hash);
 }
 
-void hash_split(K_ID min, K_ID max, K_ID split)
+CONTACT * add_contact(NODE * node, CONTACT * contact)
 {
-	// calculate a midpoint of two hashes
-	// ( find difference, divide by 2, add min)
-	memset(split,0,sizeof(K_ID));
+	log_trace("trying to add %d", contact->port);
+	if(hash_equ(contact->id,node->info.id)) return NULL;
 	
-	unsigned carry = 1;
-	for(int i = K_ID_LEN-1; i >= 0; i--)
+	CONTACT * existing = search_contacts(node->contacts,contact->id);
+	if(existing) return existing;
+	
+	for(int i = 0; i < MAX_CONTACTS; i++)
+	if(hash_equ(node->contact_table[i].id,contact->id))
 	{
-		unsigned a = max[i];
-		unsigned b = (~min[i])&0xFF;
-		split[i] = (a+b+carry)&0xFF;
-		carry = ((a+b+carry)&0xFF00) >> 8;
+		contact = &node->contact_table[i];
+		contact->is_online = 1;
+		insert_contact(&node->contacts,node->info.id,contact);
+		pubsub_handoff(node,contact);
+		return contact;
 	}
 	
-	carry = 0;
-	for(int i = 0; i < K_ID_LEN; i++)
+	for(int i = 0; i < MAX_CONTACTS; i++)
+	if(!node->contact_table[i].is_online)
 	{
-		unsigned a = split[i];
-		split[i] = (carry<<7) | (a>>1);
-		carry = a&0x1;
+		
+		char hex[2*K_ID_LEN+1];
+		log_debug("adding contact for id: %s", hash_string(contact->id,hex));
+		node->contact_table[i] = *contact;
+		contact = &node->contact_table[i];
+		contact->is_online = 1;
+		insert_contact(&node->contacts,node->info.id,contact);
+		pubsub_handoff(node,contact);
+		return contact;
 	}
 	
-	carry = 0;
-	for(int i = K_ID_LEN-1; i >= 0; i--)
+	return NULL;
+}
+
+void list_contacts(BUCKET_TREE * tree)
+{
+	if(tree->children[0])
 	{
-		unsigned a = split[i];
-		unsigned b = min[i];
-		split[i] = (a+b+carry)&0xFF;
-		carry = ((a+b+carry)&0xFF00) >> 8;
+		list_contacts(tree->children[0]);
+		list_contacts(tree->children[1]);
+	}
+	else
+	{
+		BUCKET * bucket = tree->bucket;
+		
+		printf("Tree Node: "); hash_print(tree->min); printf("-"); hash_print(tree->max); printf("\n");
+		for(int i = 0; i < bucket->n_contacts; i++)
+		{
+			//printf("\tContact %d: ", bucket->contacts[i]->idx); hash_print(bucket->contacts[i]->id); printf("\n");
+			printf("\tContact: "); hash_print(bucket->contacts[i]->id); printf("\n");
+		}
 	}	
 }
 
-void get_hash(HASH_ENTRY * entry)
+CONTACT * find_contact(NODE * node, K_ID id)
 {
-	// No guarentee that this is a good hash, but it should be 
-	// evenly distributed enough for our purposes.
-	char * input = entry->data;
-	int size = entry->size;
-	unsigned * output = (unsigned *)entry->hash;
-	
-	// cryptographic salt for small inputs
-	// just to help with evening the distribution
-	unsigned buffer[4] = {0xFFAB10FA,0xA123ACDB,0x7FACE134,0xF0BC1724};
+	for(int i = 0; i < MAX_CONTACTS; i++)
+	if(node->contact_table[i].is_online)
+	if(hash_equ(node->contact_table[i].id,id))
+		return &node->contact_table[i];
+	return NULL;
+}
+
+int learn_contact(NODE * node, CONTACT * contact)
+{
+	// contacts returned by FOUND_NODE are used by the lookup straight away,
+	// they are only pinged later on by verify_contacts, returns 0 for one
+	// that is of no use
 	
-	if(size < 16) 
-	{
-		input = (char*)buffer;
-		memcpy(buffer,entry->data,size);
-		size = 16;
-	}
+	if(contact->port == 0) return 0;
+	if(hash_equ(contact->id,node->info.id)) return 0;
+	if(find_contact(node,contact->id)) return 1;
 	
-	memset(entry->hash,0,sizeof(K_ID));
+	int first = node->n_pending > N_PENDING ? node->n_pending - N_PENDING : 0;
+	for(int i = first; i < node->n_pending; i++)
+	if(hash_equ(node->pending[i%N_PENDING].id,contact->id))
+		return 1;
 	
-	unsigned remainder = 0;
-	for(int i=size-(size%4); i < size; i++)
-		remainder = (remainder<<8) | (input[i]&0xFF);
+	CONTACT * pending = &node->pending[node->n_pending++ % N_PENDING];
+	*pending = *contact;
+	pending->connection = NULL; // this pointer belongs to the remote process
+	pending->is_online = 0;
+	return 1;
+}
+
+static CONTACT * lookup_contact(NODE * node, LOOKUP * lookup, CONTACT * contact)
+{
+	// the lookup's own copy of a contact from a FOUND_NODE, NULL without a lookup
 	
-	pcg32_random_t pcg = {remainder,1};
-	for(int i = 0; i < K_ID_LEN/4; i++)
-		output[i] ^= pcg32_random_r(&pcg);
+	if(!learn_contact(node,contact) || !lookup) return NULL;
+	for(int i = 0; i < lookup->n_contacts; i++)
+		if(hash_equ(lookup->contacts[i].id,contact->id)) return &lookup->contacts[i];
+	if(lookup->n_contacts == LOOKUP_CONTACTS) return NULL;
 	
-	for(int i = 0; i < size/4; i++)
-	{
-		pcg.state ^= ((unsigned*)input)[i];
-		for(int j = 0; j < K_ID_LEN/4; j++)
-			output[j] ^= pcg32_random_r(&pcg);
-	}
+	CONTACT * copy = &lookup->contacts[lookup->n_contacts++];
+	*copy = *contact;
+	copy->connection = NULL;
+	return copy;
 }
 
-void hash_insert(HASH_TABLE table, HASH_ENTRY * entry)
+void verify_contacts(NODE * node)
 {
-	// these functions will fail on a full table, 
-	// but we should never let it be full anway
+	// pings at most one learned contact per call and does not wait for the
+	// PONG, read_rpc adds the contact when it comes in. One that never
+	// answers never gets into the routing table
 	
-	unsigned short idx = entry->hash[K_ID_LEN-2] | (entry->hash[K_ID_LEN-1]<<8);
-	while( table[idx].data ) 
+	if(node->n_pending - node->n_verified > N_PENDING)
+		node->n_verified = node->n_pending - N_PENDING;
+	
+	while(node->n_verified < node->n_pending)
 	{
-		if( hash_equ(table[idx].hash,entry->hash) ) break;
-		idx++;	
+		CONTACT contact = node->pending[node->n_verified++ % N_PENDING];
+		if(find_contact(node,contact.id)) continue; // already answered an rpc
+		
+		log_debug("pinging %d",contact.port);
+		CONNECTION * connection = transport_connect(node->transport,contact.port);
+		RPC_MESSAGE in = {PING,node->info};
+		if(connection) post_rpc(node,connection,&in);
+		return;
 	}
-	
-	table[idx] = *entry;
 }
 
-void hash_search(HASH_TABLE table, HASH_ENTRY * entry)
+void clean_contacts(NODE * node)
 {
-	unsigned short idx = entry->hash[K_ID_LEN-2] | (entry->hash[K_ID_LEN-1]<<8);
-	while( !hash_equ( table[idx].hash, entry->hash ) )
+	for(int i = 0; i < MAX_CONTACTS; i++)
+	if(node->contact_table[i].connection)
+	if(node->contact_table[i].connection->live==0)
 	{
-		if(table[idx].data) idx++;
-		else return;
+		node->contact_table[i].is_online = 0;
 	}
-	*entry = table[idx];
-	printf("found hash at %d %s\n", idx, table[idx].data);
 }
 
-void merge_contact_lists(CONTACT ** dst, CONTACT ** src, K_ID hash)
+void get_closest_nodes(NODE * node, K_ID hash, CONTACT ** closest)
 {	
-	K_ID src_distance[N_CONTACTS] = {0};
-	K_ID dst_distance[N_CONTACTS] = {0};
+	//printf("searching %d\n",node->info.idx);
+	
+	get_closest_contacts(node->contacts,hash,closest);
+	/*
+	for(int i = 0; i < N_CONTACTS && closest[i]; i++)
+	{
+		printf("\t %d ", closest[i]->idx); hash_print(closest[i]->id); printf("\n");
+	}*/
+}
+
+//
+//		Hot key replication
+//
+// A node counts the reads of every key it serves. Once a key gets more
+// than HOT_READS reads per half life, replicate_hot_keys stores extra
+// copies on the nodes just outside the k closest, one more per HOT_READS,
+// and FOUND_VALUE responses list them so readers can pick one at random.
+// The extra copies are stored with a ttl and refreshed while the key
+// stays hot, when demand drops they are no longer refreshed and expire.
+//
+
+void decay_reads(KEY_STATS * key, unsigned now)
+{
+	unsigned halvings = (now - key->last_read)/HOT_HALF_LIFE;
+	if(halvings == 0) return;
+	key->reads = halvings < 32 ? key->reads >> halvings : 0;
+	key->last_read += halvings*HOT_HALF_LIFE;
+}
 
-	for(int i=0; dst[i] && i<N_CONTACTS; i++)
-		hash_distance(hash,dst[i]->id,dst_distance[i]);
+KEY_STATS * count_read(NODE * node, K_ID hash)
+{
+	// the slot of the coldest key is reused for keys we do not track yet
 	
-	for(int i=0; src[i] && i<N_CONTACTS; i++)
-		hash_distance(hash,src[i]->id,src_distance[i]);
+	unsigned now = clock_s();
+	KEY_STATS * stats = NULL, * coldest = &node->hot_keys[0];
+	for(int i = 0; i < N_HOT_KEYS; i++)
+	{
+		KEY_STATS * key = &node->hot_keys[i];
+		decay_reads(key,now);
+		if(hash_equ(key->hash,hash)) stats = key;
+		if(key->reads < coldest->reads) coldest = key;
+	}
 	
-	for(int i=0; src[i] && i<N_CONTACTS; i++)
+	if(!stats)
 	{
-		CONTACT * contact = src[i];
-		int skip = 0;
-		for(int j = 0; dst[j] && j < N_CONTACTS; j++)
-		if(hash_equ(contact->id,dst[j]->id))
-		//if(contact->idx == dst[j]->idx)
-			skip = 1;
-		
-		if(skip) continue;
-		
-		int add = 0;
-		int j = 0;
-		for(; dst[j] && j < N_CONTACTS; j++)		
-		if(hash_lth(src_distance[i],dst_distance[j]))
-		{
-			for(int k = N_CONTACTS-1; k > j; k--)
-				dst[k] = dst[k-1];
-			dst[j] = contact;
-			add=1;
-			break;
-		}
-		
-		if(!add && j < N_CONTACTS && !dst[j]) 
-		{
-			dst[j] = contact;
-			add=1;
-		}
+		stats = coldest;
+		memset(stats,0,sizeof(KEY_STATS));
+		memcpy(stats->hash,hash,sizeof(K_ID));
+		stats->last_read = now;
 	}
+	stats->reads++;
+	return stats;
 }
 
-BUCKET * find_bucket(BUCKET_TREE * tree, K_ID id)
+REPLICA * find_replica(NODE * node, K_ID hash)
 {
-	if(!tree) return NULL;
-	
-	if(tree->children[0])
+	for(int i = 0; i < N_REPLICAS; i++)
+	if(node->replicas[i].expires && hash_equ(node->replicas[i].hash,hash))
+		return &node->replicas[i];
+	return NULL;
+}
+
+//
+//		Memory quota
+//
+// A node counts the bytes of its values, an index entry per value and its
+// routing table against node->quota. A store that would go over it evicts
+// entries down to STORE_LOW_WATER percent first: cached copies before
+// values kept for other nodes, within each the ones with the most bytes
+// unused for the longest. Values saved on the node itself are never
+// evicted. When eviction can not make room the STORE is answered full and
+// the sender tries another node, see kademlia_store_value.
+//
+
+#define STORE_ENTRY_BYTES (sizeof(HASH_ENTRY) + sizeof(STORE_USE))
+
+size_t node_memory(NODE * node)
+{
+	return node->store_bytes + node->n_entries*STORE_ENTRY_BYTES + node->contact_bytes;
+}
+
+int parse_bytes(const char * text, size_t * bytes)
+{
+	double n; char unit = 0;
+	if(sscanf(text,"%lf%c",&n,&unit) < 1 || n < 0) return 0;
+	switch(unit)
 	{
-		if(hash_lth(id,tree->children[0]->max))
-			return find_bucket(tree->children[0],id);
-		else
-			return find_bucket(tree->children[1],id);
+		case 0: break;
+		case 'k': case 'K': n *= 1 << 10; break;
+		case 'm': case 'M': n *= 1 << 20; break;
+		case 'g': case 'G': n *= 1 << 30; break;
+		default: return 0;
 	}
-	else return tree->bucket;
+	*bytes = (size_t)n;
+	return 1;
 }
 
-CONTACT * add_contact(NODE * node, CONTACT * contact)
+static void remove_entry(NODE * node, K_ID hash)
 {
-	printf("trying to add %d\n", contact->port);
-	if(hash_equ(contact->id,node->info.id)) return NULL;
+	HASH_ENTRY entry = {0}; memcpy(entry.hash,hash,sizeof(K_ID));
+	hash_search<KADEMLIA>(node->table,&entry);
+	if(!hash_remove<KADEMLIA>(node->table,hash,node->store_use)) return;
 	
-	#define MALLOC_Z(S) (memset(malloc((S)),0,(S)))
+	node->n_entries--;
+	node->store_bytes -= entry.size;
+	free(entry.data);
 	
-	BUCKET * bucket = find_bucket(node->contacts,contact->id);
+	REPLICA * replica = find_replica(node,hash);
+	if(replica) memset(replica,0,sizeof(REPLICA));
+	metrics_set(node->metrics,METRIC_STORE_ENTRIES,node->n_entries);
+	metrics_set(node->metrics,METRIC_STORE_BYTES,node->store_bytes);
+}
+
+typedef struct
+{
+	K_ID hash;
+	int origin;
+	double score;
+} EVICTION;
+
+static int eviction_order(const void * a, const void * b)
+{
+	const EVICTION * x = (const EVICTION*)a, * y = (const EVICTION*)b;
+	if(x->origin != y->origin) return x->origin - y->origin;
+	return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+static int make_room(NODE * node, K_ID keep, size_t bytes, int entries, int max_origin)
+{
+	// evicts entries up to max_origin, except keep, so that bytes more and
+	// entries more fit, returns 0 without evicting anything if they can not
+	
+	size_t memory = node_memory(node);
+	int n_entries = node->n_entries;
+	if(memory + bytes <= node->quota && n_entries + entries <= STORE_MAX_ENTRIES) return 1;
 	
+	size_t low = (size_t)node->quota/100*STORE_LOW_WATER, low_entries = STORE_MAX_ENTRIES/100*STORE_LOW_WATER;
+	size_t target = low > bytes ? low - bytes : 0;
+	int target_entries = low_entries > (size_t)entries ? low_entries - entries : 0;
 	
-	if(bucket == NULL)
+	unsigned now = clock_s();
+	EVICTION * victims = (EVICTION*) malloc(node->n_entries*sizeof(EVICTION));
+	int n = 0;
+	size_t freeable = 0;
+	for(int i = 0; i < HASH_TABLE_SIZE && n < node->n_entries; i++)
 	{
-		node->contacts = (BUCKET_TREE*) MALLOC_Z(sizeof(BUCKET_TREE));
-		bucket = node->contacts->bucket = (BUCKET*) MALLOC_Z(sizeof(BUCKET));
-		bucket->parent = node->contacts;
-		memset(bucket->parent->min,0x00,sizeof(K_ID));
-		memset(bucket->parent->max,0xFF,sizeof(K_ID));
+		HASH_ENTRY * entry = &node->table[i];
+		STORE_USE * use = &node->store_use[i];
+		if(!entry->data || use->origin > max_origin || hash_equ(entry->hash,keep)) continue;
+		
+		EVICTION * victim = &victims[n++];
+		memcpy(victim->hash,entry->hash,sizeof(K_ID));
+		victim->origin = use->origin;
+		victim->score = (double)(now - use->last_used + 1)*(entry->size + STORE_ENTRY_BYTES);
+		freeable += entry->size + STORE_ENTRY_BYTES;
 	}
 	
-	for(int i = 0; i < bucket->n_contacts; i++)
-	if(hash_equ(bucket->contacts[i]->id, contact->id))
+	if(memory - freeable + bytes > node->quota || n_entries - n + entries > STORE_MAX_ENTRIES)
 	{
-		return bucket->contacts[i];
+		free(victims);
+		return 0;
 	}
 	
-	if(bucket->n_contacts < N_CONTACTS) bucket->n_contacts++;
-	else if( hash_in_range(node->info.id, bucket->parent->min, bucket->parent->max) )
-	{		
-		BUCKET_TREE * tree = bucket->parent;
-		
-		K_ID split; hash_split(tree->min,tree->max,split);
-		
-		tree->children[0] = (BUCKET_TREE*) MALLOC_Z(sizeof(BUCKET_TREE));
-		tree->children[1] = (BUCKET_TREE*) MALLOC_Z(sizeof(BUCKET_TREE));
-		tree->children[0]->bucket = (BUCKET*) MALLOC_Z(sizeof(BUCKET));
-		tree->children[1]->bucket = (BUCKET*) MALLOC_Z(sizeof(BUCKET));
-		
-		tree->children[0]->bucket->parent = tree->children[0];
-		tree->children[1]->bucket->parent = tree->children[1];
-		tree->bucket = NULL;		
-		
-		memcpy(tree->children[0]->min,bucket->parent->min,sizeof(K_ID));
-		memcpy(tree->children[1]->max,bucket->parent->max,sizeof(K_ID));
-		memcpy(tree->children[0]->max,split,sizeof(K_ID));
-		memcpy(tree->children[1]->min,split,sizeof(K_ID));
-		
-		for(int i=0; i < bucket->n_contacts; i++)
+	qsort(victims,n,sizeof(EVICTION),eviction_order);
+	int evicted = 0;
+	for(; evicted < n && (node_memory(node) > target || node->n_entries > target_entries); evicted++)
+		remove_entry(node,victims[evicted].hash);
+	free(victims);
+	
+	metrics_add(node->metrics,METRIC_EVICTIONS,evicted);
+	log_debug("evicted %d entries, %u bytes in use of %u", evicted, (unsigned)node_memory(node), (unsigned)node->quota);
+	return 1;
+}
+
+int store_entry(NODE * node, HASH_ENTRY * entry, int ttl, int origin)
+{
+	// a STORE with a ttl is a cached copy, it never replaces a copy we
+	// were asked to keep for good and only evicts other cached copies
+	
+	HASH_ENTRY existing = {0}; memcpy(existing.hash,entry->hash,sizeof(K_ID));
+	int slot = hash_search<KADEMLIA>(node->table,&existing);
+	REPLICA * replica = find_replica(node,entry->hash);
+	
+	if(ttl > 0)
+	{
+		if(existing.data && !replica) { free(entry->data); return STORE_OK; }
+		for(int i = 0; !replica && i < N_REPLICAS; i++)
+			if(!node->replicas[i].expires) replica = &node->replicas[i];
+		if(!replica) // holding too many already
 		{
-			BUCKET * dst = find_bucket(tree,bucket->contacts[i]->id);
-			dst->contacts[dst->circle_idx++] = bucket->contacts[i];
-			dst->n_contacts++;
+			metrics_add(node->metrics,METRIC_STORES_REFUSED,1);
+			free(entry->data);
+			return STORE_FULL;
 		}
-		
-		free(bucket);
-		bucket = find_bucket(tree,contact->id);
+		origin = STORE_CACHED;
 	}
-		
-	bucket->circle_idx %= N_CONTACTS;
+	else if(existing.data && node->store_use[slot].origin > origin) origin = node->store_use[slot].origin;
 	
-	for(int i = 0; i < MAX_CONTACTS; i++)
-	if(!node->contact_table[i].is_online)	
-	if(hash_equ(node->contact_table[i].id,contact->id))
+	int max_origin = origin == STORE_CACHED ? STORE_CACHED : STORE_STORED;
+	size_t bytes = existing.data ? (entry->size > existing.size ? entry->size - existing.size : 0) : entry->size + STORE_ENTRY_BYTES;
+	if(!make_room(node,entry->hash,bytes,existing.data ? 0 : 1,max_origin))
 	{
-		contact = &node->contact_table[i];
-		bucket->contacts[bucket->circle_idx++] = contact;
-		bucket->circle_idx %= N_CONTACTS;
-		return contact;
+		char hex[2*K_ID_LEN+1];
+		log_debug("no room for %d bytes: %s", entry->size, hash_string(entry->hash,hex));
+		metrics_add(node->metrics,METRIC_STORES_REFUSED,1);
+		free(entry->data);
+		return STORE_FULL;
 	}
 	
-	for(int i = 0; i < MAX_CONTACTS; i++)
-	if(!node->contact_table[i].is_online)
+	if(ttl > 0)
 	{
-		
-		printf("adding contact for id: "); hash_print(contact->id); printf("\n");
-		node->contact_table[i] = *contact;
-		contact = &node->contact_table[i];
-		bucket->contacts[bucket->circle_idx++] = contact;
-		bucket->circle_idx %= N_CONTACTS;
-		return contact;
+		memcpy(replica->hash,entry->hash,sizeof(K_ID));
+		replica->expires = clock_s() + ttl;
 	}
+	else if(replica) memset(replica,0,sizeof(REPLICA));
+	
+	slot = hash_insert(node->table,entry);
+	if(slot < 0) { free(entry->data); return STORE_FULL; } // make_room keeps this from happening
+	STORE_USE use = {clock_s(),origin};
+	node->store_use[slot] = use;
+	
+	if(!existing.data) node->n_entries++;
+	node->store_bytes += entry->size - (existing.data ? existing.size : 0);
+	metrics_set(node->metrics,METRIC_STORE_ENTRIES,node->n_entries);
+	metrics_set(node->metrics,METRIC_STORE_BYTES,node->store_bytes);
+	if(existing.data && existing.data != entry->data) free(existing.data);
+	return STORE_OK;
+}
+
+void expire_replicas(NODE * node)
+{
+	unsigned now = clock_s();
+	for(int i = 0; i < N_REPLICAS; i++)
+	{
+		REPLICA * replica = &node->replicas[i];
+		if(!replica->expires || replica->expires > now) continue;
 		
-	#undef MALLOC_Z
-	return NULL;
+		K_ID hash; memcpy(hash,replica->hash,sizeof(K_ID));
+		memset(replica,0,sizeof(REPLICA));
+		remove_entry(node,hash);
+	}
 }
 
-void list_contacts(BUCKET_TREE * tree)
+void get_extra_replicas(NODE * node, K_ID hash, CONTACT ** extra)
 {
-	if(tree->children[0])
+	// the contacts closest to the hash after the k closest ones
+	
+	CONTACT * closest[N_CONTACTS] = {0};
+	get_closest_nodes(node,hash,closest);
+	
+	for(int i = 0; i < MAX_CONTACTS; i++)
 	{
-		list_contacts(tree->children[0]);
-		list_contacts(tree->children[1]);
+		CONTACT * contact = &node->contact_table[i];
+		if(!contact->is_online) continue;
+		
+		int skip = 0;
+		for(int j = 0; j < N_CONTACTS && closest[j]; j++)
+			if(closest[j] == contact) skip = 1;
+		if(skip) continue;
+		
+		CONTACT * one[N_CONTACTS] = {contact};
+		merge_contact_lists(extra,one,hash);
 	}
-	else
+}
+
+void replicate_hot_keys(NODE * node)
+{
+	// (re)stores the extra replicas of at most one key per call
+	
+	unsigned now = clock_s();
+	for(int i = 0; i < N_HOT_KEYS; i++)
 	{
-		BUCKET * bucket = tree->bucket;
+		KEY_STATS * key = &node->hot_keys[i];
+		decay_reads(key,now);
 		
-		printf("Tree Node: "); hash_print(tree->min); printf("-"); hash_print(tree->max); printf("\n");
-		for(int i = 0; i < bucket->n_contacts; i++)
+		int wanted = key->reads / HOT_READS;
+		if(wanted > N_CONTACTS) wanted = N_CONTACTS;
+		if(wanted == 0) { key->n_extra = 0; continue; } // left to expire
+		int refresh = now - key->pushed >= REPLICA_TTL/2;
+		if(!refresh && (key->n_extra >= wanted || key->topped_up == now)) continue;
+		
+		HASH_ENTRY entry = {0}; memcpy(entry.hash,key->hash,sizeof(K_ID));
+		hash_search<KADEMLIA>(node->table,&entry);
+		if(!entry.data) { key->n_extra = 0; continue; }
+		
+		CONTACT * extra[N_CONTACTS] = {0};
+		get_extra_replicas(node,key->hash,extra);
+		
+		char hex[2*K_ID_LEN+1];
+		log_info("key is hot (%u reads), spreading to %d replicas: %s", key->reads, wanted, hash_string(key->hash,hex));
+		
+		// the STOREs are not waited for, a full node takes itself off the
+		// list when its response comes in, see refuse_replica, and the next
+		// call tops the list up with nodes not tried yet
+		if(refresh) { key->n_extra = key->n_refused = 0; key->pushed = now; }
+		else key->topped_up = now;
+		for(int j = 0; j < N_CONTACTS && extra[j] && key->n_extra < wanted; j++)
 		{
-			//printf("\tContact %d: ", bucket->contacts[i]->idx); hash_print(bucket->contacts[i]->id); printf("\n");
-			printf("\tContact: "); hash_print(bucket->contacts[i]->id); printf("\n");
+			int tried = 0;
+			for(int r = 0; r < key->n_refused && !tried; r++) tried = key->refused[r] == extra[j]->port;
+			for(int r = 0; r < key->n_extra && !tried; r++) tried = key->extra[r].port == extra[j]->port;
+			if(!tried && rpc_cache_value(node,extra[j],&entry))
+				key->extra[key->n_extra++] = *extra[j];
 		}
-	}	
+		return;
+	}
 }
 
-void clean_contacts(NODE * node)
+void refuse_replica(NODE * node, RPC_MESSAGE * stored)
 {
-	for(int i = 0; i < MAX_CONTACTS; i++)
-	if(node->contact_table[i].connection->live==0)
+	// a node we pushed an extra replica to was full
+	for(int i = 0; i < N_HOT_KEYS; i++)
 	{
-		node->contact_table[i].is_online = 0;
+		KEY_STATS * key = &node->hot_keys[i];
+		if(!hash_equ(key->hash,stored->entry.hash)) continue;
+		
+		for(int j = 0; j < key->n_extra; j++)
+		if(key->extra[j].port == stored->sender.port)
+		{
+			key->extra[j--] = key->extra[--key->n_extra];
+			if(key->n_refused < N_CONTACTS) key->refused[key->n_refused++] = stored->sender.port;
+		}
+		return;
 	}
 }
 
-void get_closest_nodes(NODE * node, K_ID hash, CONTACT ** closest)
-{	
-	//printf("searching %d\n",node->info.idx);
-	
-	BUCKET_TREE * stack[160*2] = {node->contacts}; // n*2 should be big enough
-	int stack_size=1;
+REPLICA_HINT * find_hint(NODE * node, K_ID hash)
+{
+	unsigned now = clock_s();
+	for(int i = 0; i < N_HINTS; i++)
+	if(node->hints[i].expires > now && hash_equ(node->hints[i].hash,hash))
+		return &node->hints[i];
+	return NULL;
+}
 
-	while(stack_size>0)
+static unsigned node_random(NODE * node)
+{
+	// xorshift, rand is not for threads and every node has its own
+	unsigned x = node->random;
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	return node->random = x;
+}
+
+void remember_replicas(NODE * node, RPC_MESSAGE * out)
+{
+	REPLICA_HINT * hint = find_hint(node,out->entry.hash);
+	for(int i = 0; !hint && i < N_HINTS; i++)
+		if(node->hints[i].expires <= clock_s()) hint = &node->hints[i];
+	if(!hint) hint = &node->hints[node_random(node)%N_HINTS];
+	
+	memcpy(hint->hash,out->entry.hash,sizeof(K_ID));
+	hint->expires = clock_s() + REPLICA_TTL;
+	hint->n_replicas = 0;
+	for(int i = 0; i < N_CONTACTS && out->closest[i].port; i++)
 	{
-		BUCKET_TREE * bucket_tree = stack[--stack_size];
-		BUCKET * bucket = bucket_tree->bucket;
-		if(bucket_tree->children[0]) stack[stack_size++] = bucket_tree->children[0];
-		if(bucket_tree->children[1]) stack[stack_size++] = bucket_tree->children[1];
-		
-		
-		if(bucket) merge_contact_lists(closest,bucket->contacts,hash);
+		hint->replicas[hint->n_replicas] = out->closest[i];
+		hint->replicas[hint->n_replicas++].connection = NULL;
 	}
-	/*
-	for(int i = 0; closest[i] && i < N_CONTACTS; i++)
-	{
-		printf("\t %d ", closest[i]->idx); hash_print(closest[i]->id); printf("\n");
-	}*/
 }
 
 //
 //		Remote Procedure Call (RPC) interface
 //
 
-RPC_MESSAGE send_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
+TRACE rpc_trace;
+
+const char * rpc_names[] = {TRACE_RPC_NAMES, NULL};
+static_assert(sizeof(rpc_names)/sizeof(rpc_names[0]) == TRACE_N_RPCS+1, "TRACE_RPC_NAMES needs a name for every rpc type");
+
+void trace_rpc(CONNECTION * connection, int direction, RPC_MESSAGE * rpc)
+{
+	if(!rpc_trace.file) return;
+	
+	TRACE_RECORD record = {0, (uint32_t)connection->addr.sin_addr.s_addr, (uint16_t)connection->port,
+		(uint8_t)rpc->type, (uint8_t)direction, (uint32_t)rpc->data_size};
+	memcpy(record.key,rpc->entry.hash,sizeof(K_ID));
+	trace_write(&rpc_trace,clock_ms(),&record);
+}
+
+void post_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
 {
-	if(!connection->live) return {};
+	// sends a request or response without waiting for anything back
+	
+	if(!connection->live) return;
 	
-	printf("sending rpc type=%d\n",input->type);
+	log_trace("sending rpc type=%d",input->type);
+	span_flow(SPAN_FLOW_OUT,span_flow_id(node->info.port,connection->port,input->type,input->entry.hash));
 	
 	switch(input->type)
 	{
 		case STORE: 	  
 		case FOUND_VALUE: 
+		case PUBLISH:
 		input->data = input->entry.data; input->data_size = input->entry.size; break;
 	}
+	trace_rpc(connection,TRACE_SENT,input);
+	metrics_rpc(node->metrics,METRIC_RPCS_SENT,input->type);
 	
 	GENERIC_MESSAGE in_msg; 
-	in_msg.type = RPC_REQUEST;
+	switch(input->type)
+	{
+		case FOUND_NODE:
+		case FOUND_VALUE:
+		case JOINED:
+		case STORED:
+		case PONG: in_msg.type = RPC_RESPONSE; break;
+		default: in_msg.type = RPC_REQUEST;
+	}
+	// a retransmission keeps its number, so an answer to either copy will do
+	while(in_msg.type == RPC_REQUEST && !input->seq) input->seq = ++node->rpc_sequence;
 	in_msg.rpc = *input; in_msg.length = sizeof(GENERIC_MESSAGE); 
 	in_msg.rpc.sender = node->info;
 
-	connection_send(connection,(char*)&in_msg,sizeof(in_msg));
+	if(input->data_size <= 0)
+	{
+		connection_send(connection,(char*)&in_msg,sizeof(in_msg));
+		return;
+	}
+	
+	// the payload goes in the same send, a datagram transport keeps a
+	// message together
+	char * message = (char*) malloc(sizeof(in_msg) + input->data_size);
+	memcpy(message,&in_msg,sizeof(in_msg));
+	memcpy(message+sizeof(in_msg),input->data,input->data_size);
+	connection_send(connection,message,sizeof(in_msg) + input->data_size);
+	free(message);
+}
 
-	for(int i = 0; i < input->data_size; i+=4096)
+unsigned rpc_timeout(CONNECTION * connection)
+{
+	// RTO = SRTT + max(G, 4*RTTVAR) from RFC 6298, kept in connection->rto
+	if(!connection->rto) connection->rto = RPC_INITIAL_TIMEOUT;
+	return connection->rto;
+}
+
+void rtt_sample(CONNECTION * connection, unsigned rtt)
+{
+	if(rtt == 0) rtt = 1; // srtt of 0 means no samples yet
+	
+	if(!connection->srtt)
 	{
-		int size = input->data_size - i;
-		if(size > 4096) size = 4096;
-		
-		connection_send(connection,input->data+i,size);
+		connection->srtt = rtt;
+		connection->rttvar = rtt/2;
+	}
+	else
+	{
+		int err = (int)connection->srtt - (int)rtt;
+		connection->rttvar = (3*connection->rttvar + (err < 0 ? -err : err))/4; // beta = 1/4
+		connection->srtt = (7*connection->srtt + rtt)/8; // alpha = 1/8
+	}
+	
+	unsigned var = 4*connection->rttvar;
+	connection->rto = connection->srtt + (var > 1 ? var : 1);
+	if(connection->rto < RPC_MIN_TIMEOUT) connection->rto = RPC_MIN_TIMEOUT;
+	if(connection->rto > RPC_MAX_TIMEOUT) connection->rto = RPC_MAX_TIMEOUT;
+}
+
+void rtt_backoff(CONNECTION * connection)
+{
+	connection->rto = rpc_timeout(connection)*2;
+	if(connection->rto > RPC_MAX_TIMEOUT) connection->rto = RPC_MAX_TIMEOUT;
+}
+
+static void serve_requests(NODE * node)
+{
+	// the requests on the connections no wait reads from. A response there
+	// answers a request nobody waits for any more, it is read and dropped
+	// so it does not hold up the requests behind it
+	
+	TRANSPORT * transport = node->transport;
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		CONNECTION * connection = &transport->connections[i];
+		GENERIC_MESSAGE message;
+		while(!connection->waiting && connection_wait(connection,(char*)&message,sizeof(message),0))
+		{
+			if(message.type == RPC_REQUEST) read_rpc(node,connection,&message.rpc);
+			else if(message.type == TEXT_MESSAGE) printf("%s\n",message.buffer);
+			else if(message.type == RPC_RESPONSE)
+			{
+				log_debug("dropping a late %s from %d", rpc_names[message.rpc.type >= 0 && message.rpc.type <= PONG ? message.rpc.type : FAILURE], connection->port);
+				RPC_MESSAGE late = read_rpc(node,connection,&message.rpc);
+				if(late.data_size > 0) free(late.data);
+			}
+		}
 	}
+}
+
+static int answers(int request, int response)
+{
+	switch(request)
+	{
+		case FIND_NODE: return response == FOUND_NODE;
+		case FIND_VALUE: return response == FOUND_VALUE || response == FOUND_NODE;
+		case JOIN: return response == JOINED;
+		case STORE: return response == STORED;
+		case PING: return response == PONG;
+	}
+	return 0;
+}
+
+int wait_rpcs(NODE * node, CONNECTION ** connections, unsigned * seqs, unsigned * deadlines, int n, int type, RPC_MESSAGE * out)
+{
+	// waits for the responses to requests of the given type posted to
+	// several peers at once. Slot i waits on connections[i] for the
+	// response with sequence number seqs[i], any of the type for 0, until
+	// deadlines[i] in clock_ms time, 0 for a slot that does not wait.
+	// Slots may share a connection. Returns the first slot answered, with
+	// the response in out, or one whose deadline passed with out->type
+	// FAILURE, and clears its deadline. -1 once no slot waits.
+	//
+	// The connections are read as data arrives, so a peer that does not
+	// answer does not keep the others waiting, and a deadline only passes
+	// after everything that arrived before it was read. Requests from the
+	// peers are served meanwhile and those from other peers every
+	// RPC_SERVE_MS, so a lookup does not stop the node from serving. Any
+	// other response answers a request that timed out, or was answered
+	// twice after a retransmission, and is read and dropped so the next
+	// one starts where it should
+	
+	SPAN("wait_rpc",rpc_names[type]);
+	for(int i = 0; i < n; i++) if(connections[i]) connections[i]->waiting++;
 	
+	int slot = -1;
 	GENERIC_MESSAGE message = {0};
-	if(input->type == FIND_NODE || input->type == FIND_VALUE)
-	{	
-		connection_read(connection,(char*)&message,sizeof(message));
+	for(;;)
+	{
+		int waiting = 0, read = 0;
+		for(int i = 0; i < n && slot < 0; i++)
+		{
+			CONNECTION * connection = connections[i];
+			if(!connection || !deadlines[i]) continue;
+			waiting++;
+			if(!connection_wait(connection,(char*)&message,sizeof(message),0)) continue;
+			read++;
+			
+			if(message.type == RPC_REQUEST) { read_rpc(node,connection,&message.rpc); continue; }
+			if(message.type == TEXT_MESSAGE) { printf("%s\n",message.buffer); continue; }
+			if(message.type != RPC_RESPONSE) continue;
+			
+			for(int j = 0; j < n && slot < 0; j++)
+				if(connections[j] == connection && deadlines[j] && answers(type,message.rpc.type) && (!seqs[j] || message.rpc.seq == seqs[j])) slot = j;
+			if(slot >= 0)
+			{
+				log_trace("received response mt=%d, rpc_t=%d",message.type,message.rpc.type);
+				*out = read_rpc(node,connection,&message.rpc);
+				break;
+			}
+			
+			log_debug("dropping a late %s from %d", rpc_names[message.rpc.type >= 0 && message.rpc.type <= PONG ? message.rpc.type : FAILURE], connection->port);
+			RPC_MESSAGE late = read_rpc(node,connection,&message.rpc);
+			if(late.data_size > 0) free(late.data);
+		}
+		if(slot >= 0 || !waiting) break;
+		if(read) continue;
 		
-		printf("received response mt=%d, rpc_t=%d\n",message.type,message.rpc.type);
+		// nothing was there, so a slot past its deadline timed out
+		unsigned now = clock_ms();
+		int next = RPC_SERVE_MS;
+		for(int i = 0; i < n && slot < 0; i++)
+		{
+			if(!connections[i] || !deadlines[i]) continue;
+			int remaining = (int)(deadlines[i] - now);
+			if(remaining <= 0 || !connections[i]->live) { RPC_MESSAGE none = {FAILURE}; *out = none; slot = i; }
+			else if(remaining < next) next = remaining;
+		}
+		if(slot >= 0) break;
 		
-		if(message.type != RPC_RESPONSE) 
-			message.rpc.type = FAILURE;
-		else if(input->type == FIND_NODE && message.rpc.type != FOUND_NODE)
-			message.rpc.type = FAILURE;
-		else if(input->type == FIND_VALUE && message.rpc.type != FOUND_VALUE)
-			message.rpc.type = FAILURE;
-		else message.rpc = read_rpc(node,connection,&message.rpc);
-		//connection_read(connection,(char*)&message,sizeof(message));
-		//if(message.type != RPC_RESPONSE) message.rpc.type = FAILURE;
+		serve_requests(node);
+		transport_wait(node->transport,next);
 	}
-	return message.rpc;
+	
+	for(int i = 0; i < n; i++) if(connections[i]) connections[i]->waiting--;
+	if(slot >= 0) deadlines[slot] = 0;
+	return slot;
+}
+
+RPC_MESSAGE wait_rpc(NODE * node, CONNECTION * connection, int type, unsigned seq, unsigned deadline)
+{
+	// wait_rpcs for one request
+	RPC_MESSAGE out = {FAILURE};
+	wait_rpcs(node,&connection,&seq,&deadline,1,type,&out);
+	return out;
+}
+
+RPC_MESSAGE send_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
+{
+	RPC_MESSAGE none = {FAILURE};
+	if(!connection->live) return none;
+	SPAN("send_rpc",rpc_names[input->type],connection->port,input->entry.hash);
+	
+	if(input->type != FIND_NODE && input->type != FIND_VALUE && input->type != JOIN && input->type != STORE && input->type != PING)
+	{
+		post_rpc(node,connection,input);
+		return none;
+	}
+	
+	// each attempt waits one retransmission timeout, which doubles
+	// after every miss up to RPC_MAX_TIMEOUT
+	for(int attempt = 0; attempt <= RPC_RETRIES && connection->live; attempt++)
+	{
+		unsigned sent = clock_ms();
+		uint64_t sent_us = metrics_clock_us();
+		post_rpc(node,connection,input);
+		
+		RPC_MESSAGE out = wait_rpc(node,connection,input->type,input->seq,sent + rpc_timeout(connection));
+		if(out.type != FAILURE)
+		{
+			// only the first attempt gives an unambiguous rtt (Karn)
+			if(attempt == 0) rtt_sample(connection,clock_ms() - sent);
+			metrics_observe(node->metrics,METRIC_RPC_LATENCY + input->type,metrics_clock_us() - sent_us);
+			return out;
+		}
+		
+		metrics_rpc(node->metrics,METRIC_RPC_TIMEOUTS,input->type);
+		rtt_backoff(connection);
+		log_warn("rpc type=%d to %d timed out, next timeout %ums",input->type,connection->port,connection->rto);
+	}
+	return none;
+}
+
+int get_join_seeds(NODE * node, K_ID joiner, SEED_CONTACT * seeds)
+{
+	// pick contacts for a joining node so that they spread over as many of
+	// the joiner's buckets as possible: one per bucket first, then a second
+	// one per bucket and so on until k per bucket or the batch is full
+	
+	int per_bucket[K_ID_LEN*8+1] = {0};
+	char taken[MAX_CONTACTS] = {0};
+	int n = 0;
+	
+	SEED_CONTACT self = {{0},node->info.ip,node->info.port};
+	memcpy(self.id,node->info.id,sizeof(K_ID));
+	seeds[n++] = self;
+	
+	for(int pass = 1; pass <= N_CONTACTS && n < JOIN_CONTACTS; pass++)
+	for(int i = 0; i < MAX_CONTACTS && n < JOIN_CONTACTS; i++)
+	{
+		CONTACT * contact = &node->contact_table[i];
+		if(taken[i] || !contact->is_online || hash_equ(contact->id,joiner)) continue;
+		
+		int bucket = hash_common_bits<K_ID_LEN>(joiner,contact->id);
+		if(per_bucket[bucket] != pass-1) continue;
+		per_bucket[bucket]++;
+		taken[i] = 1;
+		
+		SEED_CONTACT seed = {{0},contact->ip,contact->port};
+		memcpy(seed.id,contact->id,sizeof(K_ID));
+		seeds[n++] = seed;
+	}
+	return n;
 }
 
 RPC_MESSAGE read_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
 {
 	RPC_MESSAGE result = {input->type};
+	SPAN("read_rpc",input->type >= 0 && input->type <= PONG ? rpc_names[input->type] : NULL,input->sender.port,input->entry.hash);
+	span_flow(SPAN_FLOW_IN,span_flow_id(input->sender.port,node->info.port,input->type,input->entry.hash));
 	
 	if(input->data_size > 0)
 		input->data = (char*) malloc(input->data_size);
@@ -407,33 +839,79 @@ RPC_MESSAGE read_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
 		int size = input->data_size - i;
 		if(size > 4096) size = 4096;
 		
-		connection_read(connection,input->data+i,size);
+		if(!connection_wait(connection,input->data+i,size,RPC_MAX_TIMEOUT))
+		{
+			// the rest of the payload never came, nothing after it on the
+			// connection starts where a message does
+			log_warn("payload of a %s from %d cut short, closing the connection", rpc_names[result.type >= 0 && result.type <= PONG ? result.type : FAILURE], connection->port);
+			free(input->data);
+			input->data = NULL;
+			connection_close(connection);
+			RPC_MESSAGE none = {FAILURE};
+			return none;
+		}
 		
 		//printf("Receiving data: %.*s\n", size,input->data+i);
 	}
+	trace_rpc(connection,TRACE_RECEIVED,input);
+	metrics_rpc(node->metrics,METRIC_RPCS_RECEIVED,input->type);
 
 	switch(input->type)
 	{
 		case STORE:
+		case PUBLISH:
 		case FOUND_VALUE: input->entry.data = input->data; input->entry.size = input->data_size; break;
 	}
 	
+	if(input->type != FAILURE)
+	{
+		// any request or response proves the sender is alive
+		input->sender.connection = connection;
+		input->sender.last_seen = clock_s();
+		add_contact(node,&input->sender);
+	}
+	
 	switch(input->type)
 	{
-		case PING: add_contact(node,&input->sender); break;
-		case STORE: hash_insert(node->table,&input->entry); break;
+		case PING:
+		{
+			RPC_MESSAGE out = {PONG,node->info};
+			out.seq = input->seq;
+			send_rpc(node,connection,&out);
+			break;
+		}
+		case STORE:
+		{
+			RPC_MESSAGE out = {STORED,node->info};
+			out.seq = input->seq;
+			memcpy(out.entry.hash,input->entry.hash,sizeof(K_ID));
+			out.status = store_entry(node,&input->entry,input->ttl,STORE_STORED);
+			send_rpc(node,connection,&out);
+			break;
+		}
 		case FIND_VALUE:
 		{
 			input->entry.data = NULL;
-			hash_search(node->table,&input->entry);			
+			int slot = hash_search(node->table,&input->entry);
 			//if(!entry->data) rpc_find_node(sender,contact,entry->hash,closest);
 			if(input->entry.data) 
 			{
+				node->store_use[slot].last_used = clock_s();
+				KEY_STATS * stats = count_read(node,input->entry.hash);
 				RPC_MESSAGE out = {FOUND_VALUE,node->info,input->entry,{0}};
+				out.seq = input->seq;
+				if(stats->n_extra)
+				{
+					// advertise ourselves and the extra replicas so readers spread out
+					out.closest[0] = node->info;
+					for(int i = 0; i < stats->n_extra && i+1 < N_CONTACTS; i++)
+						out.closest[i+1] = stats->extra[i];
+				}
 				send_rpc(node,connection,&out);
+				metrics_add(node->metrics,METRIC_VALUE_HITS,1);
 				break;
 			}
-			else; //fallthrough
+			else metrics_add(node->metrics,METRIC_VALUE_MISSES,1); //fallthrough
 		}
 		case FIND_NODE: 
 		{
@@ -444,8 +922,10 @@ RPC_MESSAGE read_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
 			get_closest_nodes(node,input->entry.hash,closest);
 			
 			RPC_MESSAGE out = {FOUND_NODE,node->info,{0},{0}};
+			out.seq = input->seq;
+			memcpy(out.entry.hash,input->entry.hash,sizeof(K_ID)); // lets batched lookups tell the responses apart
 			
-			for(int i = 0; closest[i] && i < N_CONTACTS; i++)
+			for(int i = 0; i < N_CONTACTS && closest[i]; i++)
 				out.closest[i] = *closest[i];
 			
 			
@@ -464,9 +944,28 @@ RPC_MESSAGE read_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
 			
 			
 			send_rpc(node,connection,&out);
+			break;
+		}
+		
+		case JOIN:
+		{
+			SEED_CONTACT seeds[JOIN_CONTACTS];
+			int n = get_join_seeds(node,input->sender.id,seeds);
+			
+			RPC_MESSAGE out = {JOINED,node->info};
+			out.seq = input->seq;
+			out.data = (char*)seeds; out.data_size = n*sizeof(SEED_CONTACT);
+			send_rpc(node,connection,&out);
+			break;
 		}
 		
-		case FOUND_VALUE: result = *input; result.data = input->data; result.data_size = input->data_size; break;
+		case SUBSCRIBE: pubsub_read(node,input); break;
+		case PUBLISH: pubsub_read(node,input); free(input->data); break;
+		
+		case FOUND_VALUE: 
+		case JOINED: result = *input; result.data = input->data; result.data_size = input->data_size; break;
+		case STORED: if(input->status == STORE_FULL) refuse_replica(node,input); //fallthrough
+		case PONG:
 		case FOUND_NODE: result = *input; break;
 		break;
 		default: result.type = FAILURE;
@@ -476,78 +975,181 @@ RPC_MESSAGE read_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input)
 
 CONTACT * rpc_ping(NODE * sender, CONTACT * contact)
 {
-	printf("pinging %d\n",contact->port);
-	CONNECTION * connection = ping(sender->info.port,contact->port);
+	// over udp connecting proves nothing, only a PONG does, and read_rpc
+	// adds its sender
+	log_debug("pinging %d",contact->port);
+	CONNECTION * connection = transport_connect(sender->transport,contact->port);
 	if(!connection) return NULL;
 	
-	
-	HASH_ENTRY tmp = {{},(char*)&contact->port,4}; get_hash(&tmp);
-	memcpy(&contact->id,tmp.hash,sizeof(K_ID));
-	
 	RPC_MESSAGE in = {PING,sender->info};
 	RPC_MESSAGE out = send_rpc(sender,connection,&in);
-	//if(out.type==FAILURE) return NULL;
+	if(out.type==FAILURE) return NULL;
 	
-	contact = add_contact(sender,contact);
+	contact = find_contact(sender,out.sender.id);
 	if(contact) contact->connection = connection;
 	return contact;
 }
 
+int rpc_store_replica(NODE * sender, CONTACT * contact, HASH_ENTRY * entry, int ttl)
+{
+	// no ping first, the STORED response proves the contact is alive,
+	// returns 0 if there was none or the contact is full
+	CONNECTION * connection = transport_connect(sender->transport,contact->port);
+	if(!connection) return 0;
+	sender->rtt_saved++;
+
+	RPC_MESSAGE in = {STORE,sender->info,*entry};
+	in.ttl = ttl;
+	RPC_MESSAGE out = send_rpc(sender,connection,&in);
+	if(out.type == FAILURE) return 0;
+	
+	contact->connection = connection;
+	if(out.status != STORE_OK) log_debug("%d is full", contact->port);
+	return out.status == STORE_OK;
+}
+
 int rpc_store_value(NODE * sender, CONTACT * contact, HASH_ENTRY * entry)
 {
-	contact = rpc_ping(sender,contact);
-	if(!contact) return 0;
+	return rpc_store_replica(sender,contact,entry,0);
+}
 
+int rpc_cache_value(NODE * sender, CONTACT * contact, HASH_ENTRY * entry)
+{
+	// a copy that lives for REPLICA_TTL, the STORED response is not waited
+	// for, so the node loop never blocks on it
+	CONNECTION * connection = transport_connect(sender->transport,contact->port);
+	if(!connection) return 0;
+	
 	RPC_MESSAGE in = {STORE,sender->info,*entry};
-	RPC_MESSAGE out = send_rpc(sender,contact->connection,&in);
-	if(out.type==FAILURE) return 0;
+	in.ttl = REPLICA_TTL;
+	post_rpc(sender,connection,&in);
+	if(!connection->live) return 0;
 	
-	*entry = out.entry;
+	contact->connection = connection;
 	return 1;
 }
 
-int rpc_find_value(NODE * sender, CONTACT * contact, HASH_ENTRY * entry, CONTACT ** closest)
+int rpc_store_values(NODE * sender, CONTACT ** contacts, HASH_ENTRY * entry, int * status)
 {
-	contact = rpc_ping(sender,contact);
-	if(!contact) return 0;
+	// STOREs to all the contacts at once like kademlia_join, with the
+	// retries of send_rpc, status gets each one's status, -1 if it did not
+	// answer, returns how many stored
+	
+	CONNECTION * connections[N_CONTACTS] = {0};
+	unsigned deadlines[N_CONTACTS] = {0}, sent[N_CONTACTS] = {0}, seqs[N_CONTACTS] = {0};
+	RPC_MESSAGE in = {STORE,sender->info,*entry};
+	int waiting = 0;
+	for(int i = 0; i < N_CONTACTS && contacts[i]; i++)
+	{
+		status[i] = -1;
+		connections[i] = transport_connect(sender->transport,contacts[i]->port);
+		if(connections[i]) { sender->rtt_saved++; waiting++; }
+	}
+	
+	int stored = 0;
+	for(int attempt = 0; attempt <= RPC_RETRIES && waiting; attempt++)
+	{
+		for(int i = 0; i < N_CONTACTS && contacts[i]; i++)
+		if(connections[i] && status[i] < 0)
+		{
+			sent[i] = clock_ms();
+			deadlines[i] = sent[i] + rpc_timeout(connections[i]);
+			post_rpc(sender,connections[i],&in);
+			seqs[i] = in.seq;
+		}
+		
+		RPC_MESSAGE out;
+		int i;
+		while((i = wait_rpcs(sender,connections,seqs,deadlines,N_CONTACTS,STORE,&out)) >= 0)
+		{
+			if(out.type == FAILURE)
+			{
+				metrics_rpc(sender->metrics,METRIC_RPC_TIMEOUTS,STORE);
+				rtt_backoff(connections[i]);
+				continue;
+			}
+			if(attempt == 0) rtt_sample(connections[i],clock_ms() - sent[i]);
+			
+			contacts[i]->connection = connections[i];
+			status[i] = out.status;
+			stored += out.status == STORE_OK;
+			waiting--;
+		}
+	}
+	return stored;
+}
+
+int rpc_find_value(NODE * sender, CONTACT * contact, HASH_ENTRY * entry, CONTACT ** closest, LOOKUP * lookup)
+{
+	CONNECTION * connection = transport_connect(sender->transport,contact->port);
+	if(!connection) return 0;
+	sender->rtt_saved++;
 
 	RPC_MESSAGE in = {FIND_VALUE,sender->info,*entry};
-	RPC_MESSAGE out = send_rpc(sender,contact->connection,&in);
+	RPC_MESSAGE out = send_rpc(sender,connection,&in);
 	if(out.type == FAILURE) return 0;
 	
 	int n = 0;	
 	
-	if(out.type == FOUND_VALUE) *entry = out.entry;
+	if(out.type == FOUND_VALUE) 
+	{
+		*entry = out.entry;
+		if(out.closest[0].port) remember_replicas(sender,&out);
+	}
 	else if(out.type == FOUND_NODE) 
 	for(int i = 0; i < N_CONTACTS; i++)
 	{
-		CONTACT * contact = rpc_ping(sender,&out.closest[i]);
-		if(contact) closest[n++] = contact;
+		CONTACT * contact = lookup_contact(sender,lookup,&out.closest[i]);
+		if(contact) { closest[n++] = contact; sender->rtt_saved++; }
 	}
 	
 	return 1;
 }
 
-int rpc_find_node(NODE * sender, CONTACT * contact, K_ID hash, CONTACT ** closest)
+int rpc_join(NODE * sender, CONTACT * bootstrap)
 {
-	contact = rpc_ping(sender,contact);
-	if(!contact) return 0;
+	// asks the bootstrap node for a batch of contacts spread over our buckets
+	
+	CONNECTION * connection = transport_connect(sender->transport,bootstrap->port);
+	if(!connection) return 0;
+	
+	RPC_MESSAGE in = {JOIN,sender->info};
+	RPC_MESSAGE out = send_rpc(sender,connection,&in);
+	if(out.type == FAILURE) return 0;
+	
+	SEED_CONTACT * seeds = (SEED_CONTACT*)out.data;
+	int n = out.data_size/sizeof(SEED_CONTACT);
+	for(int i = 0; i < n; i++)
+	{
+		CONTACT contact = {0};
+		memcpy(contact.id,seeds[i].id,sizeof(K_ID));
+		contact.ip = seeds[i].ip;
+		contact.port = seeds[i].port;
+		add_contact(sender,&contact);
+	}
+	free(out.data);
+	
+	log_info("joined with %d contacts", n);
+	return n;
+}
+
+int rpc_find_node(NODE * sender, CONTACT * contact, K_ID hash, CONTACT ** closest, LOOKUP * lookup)
+{
+	CONNECTION * connection = transport_connect(sender->transport,contact->port);
+	if(!connection) return 0;
+	sender->rtt_saved++;
 
 	RPC_MESSAGE in = {FIND_NODE,sender->info}; memcpy(in.entry.hash,hash,sizeof(K_ID));
-	RPC_MESSAGE out = send_rpc(sender,contact->connection,&in);
+	RPC_MESSAGE out = send_rpc(sender,connection,&in);
 	if(out.type == FAILURE) return 0;
 	
-	printf("received found_node ", contact->port);
+	log_trace("received found_node %d", contact->port);
 	
 	int n = 0;
 	for(int i = 0; i < N_CONTACTS; i++)
 	{
-		CONTACT * contact = rpc_ping(sender,&out.closest[i]);
-		if(contact) 
-		{
-			closest[n++] = contact;
-			
-		}
+		CONTACT * contact = lookup_contact(sender,lookup,&out.closest[i]);
+		if(contact) { closest[n++] = contact; sender->rtt_saved++; }
 	}
 	
 	return 1;
@@ -562,7 +1164,7 @@ int rpc_ping(NODE * sender, CONTACT * contact)
 	NODE * node = &all_nodes[contact->idx];
 	if(node->is_online) 
 	{
-		contact->last_seen = time(NULL);
+		contact->last_seen = clock_s();
 		add_contact(sender,contact);
 		add_contact(node,&sender->info);
 	}
@@ -600,7 +1202,7 @@ void rpc_find_node(NODE * sender, CONTACT * contact, K_ID hash, CONTACT ** close
 		if(bucket) merge_contact_lists(closest,bucket->contacts,hash);
 	}
 	/*
-	for(int i = 0; closest[i] && i < N_CONTACTS; i++)
+	for(int i = 0; i < N_CONTACTS && closest[i]; i++)
 	{
 		printf("\t %d ", closest[i]->idx); hash_print(closest[i]->id); printf("\n");
 	}*/
@@ -619,85 +1221,378 @@ void rpc_find_value(NODE * sender, CONTACT * contact, HASH_ENTRY * entry, CONTAC
 #endif
 
 //
-//		Kademlia Operations
+//		Node loop
 //
 
-void kademlia_search(NODE * node, K_ID hash, HASH_ENTRY * entry, CONTACT ** closest, CONTACT ** exclusion, int * n_exclusion)
+void node_init(NODE * node, TRANSPORT * transport, int port)
 {
-	if(!hash && !entry) return;
-	else if(!hash) hash = entry->hash;
-	get_closest_nodes(node,hash,closest);
+	// a node's id is the hash of its port
+	node->info.port = port;
+	node->transport = transport;
 	
-	for(;;)
+	HASH_ENTRY tmp = {{},(char*)&port,4}; get_hash(&tmp);
+	memcpy(node->info.id,tmp.hash,sizeof(K_ID));
+	
+	node->quota = STORE_DEFAULT_QUOTA;
+	node->random = (port * 2654435761u) | 1;
+	node->pubsub_sequence = clock_s(); // message ids of a restarted node differ from the last run's
+	node->cache.limit = CACHE_DEFAULT_BYTES;
+	node->metrics = metrics_create(port);
+	transport->metrics = node->metrics;
+}
+
+void node_free(NODE * node)
+{
+	snapshot_wait(node);
+	if(node->transport && node->transport->metrics == node->metrics) node->transport->metrics = NULL;
+	free_routing_table(node->contacts);
+	node->contacts = NULL;
+	for(int i = 0; i < HASH_TABLE_SIZE; i++) free(node->table[i].data);
+	memset(node->table,0,sizeof(node->table));
+	memset(node->store_use,0,sizeof(node->store_use));
+	node->n_entries = 0;
+	node->store_bytes = 0;
+	cache_free(node);
+	metrics_free(node->metrics);
+	node->metrics = NULL;
+}
+
+static void update_gauges(NODE * node)
+{
+	// what node_poll cannot count as it happens, read from the node's state
+	
+	METRICS * metrics = node->metrics;
+	TRANSPORT * transport = node->transport;
+	int n = 0;
+	for(int i = 0; i < transport->n_connections; i++) n += transport->connections[i].live != 0;
+	metrics_set(metrics,METRIC_CONNECTIONS,n);
+	
+	n = 0;
+	for(int i = 0; i < MAX_CONTACTS; i++) n += node->contact_table[i].is_online != 0;
+	metrics_set(metrics,METRIC_CONTACTS,n);
+	metrics_set(metrics,METRIC_PENDING_CONTACTS,node->n_pending - node->n_verified);
+	
+	n = 0;
+	for(int i = 0; i < N_REPLICAS; i++) n += node->replicas[i].expires != 0;
+	metrics_set(metrics,METRIC_REPLICAS,n);
+	
+	int fill[METRICS_DEPTHS];
+	for(int i = 0; i < METRICS_DEPTHS; i++) fill[i] = -1;
+	BUCKET_TREE * stack[K_ID_LEN*8*2+2] = {node->contacts};
+	int depths[K_ID_LEN*8*2+2] = {0}, stack_size = node->contacts ? 1 : 0;
+	size_t contact_bytes = 0;
+	while(stack_size > 0)
 	{
-		CONTACT * new_contacts[N_CONTACTS] = {NULL};
-		int n_new_contacts = 0;
-		for(int i = 0; closest[i] && i < N_CONTACTS; i++)
+		BUCKET_TREE * tree = stack[--stack_size];
+		int depth = depths[stack_size];
+		contact_bytes += sizeof(BUCKET_TREE) + (tree->bucket ? sizeof(BUCKET) : 0);
+		if(tree->children[0])
 		{
-			int excluded = 0;
-			for(int j = 0; j < *n_exclusion; j++)
-			//if(exclusion[j]->idx == closest[i]->idx)
-			if(hash_equ(exclusion[j]->id,closest[i]->id))
-				{ excluded=1; break; }
-			
-			if(!excluded) 
-			{
-				new_contacts[n_new_contacts++] = closest[i];
-				exclusion[(*n_exclusion)++] = closest[i];
-				printf("found node %d\n", closest[i]->port);
-			}
-			
+			for(int c = 0; c < 2; c++) { depths[stack_size] = depth+1; stack[stack_size++] = tree->children[c]; }
 		}
+		else if(tree->bucket && depth < METRICS_DEPTHS)
+			fill[depth] = (fill[depth] < 0 ? 0 : fill[depth]) + tree->bucket->n_contacts;
+	}
+	for(int i = 0; i < METRICS_DEPTHS; i++) metrics_set(metrics,METRIC_BUCKET_FILL+i,fill[i]);
+	
+	node->contact_bytes = contact_bytes;
+	metrics_set(metrics,METRIC_MEMORY_BYTES,node_memory(node));
+	metrics_set(metrics,METRIC_MEMORY_QUOTA,node->quota);
+	metrics_set(metrics,METRIC_CACHE_BYTES,node->cache.bytes);
+}
+
+int node_poll(NODE * node)
+{
+	// serves what the peers sent and does the periodic work, returns how
+	// many messages there were
+	
+	TRANSPORT * transport = node->transport;
+	int handled = 0;
+	
+	for(int i = 0; i < transport->n_connections; i++)
+	{
+		GENERIC_MESSAGE tmp;
+		connection_read(&transport->connections[i],(char*)&tmp,sizeof(GENERIC_MESSAGE));
+		if(tmp.type != NO_MESSAGE) handled++;
 		
-		if(n_new_contacts==0) return;
-		
-		for(int i = 0; i<n_new_contacts; i++)
+		switch(tmp.type)
 		{
-			CONTACT * query[N_CONTACTS] = {0};
+			#define CASE(X) case X: log_trace("received %s from connection %d",#X,i);
 			
-			if(entry)
+			CASE(TEXT_MESSAGE)
 			{
-				rpc_find_value(node,new_contacts[i],entry,query);
-				
-				if(entry->data) 
-				{
-					if(i-1>=0) rpc_store_value(node,closest[i-1],entry);
-					return;
-				}
+				printf("%s\n",tmp.buffer);
+			}
+			break;
+			CASE(RPC_RESPONSE) // late response to one of our requests
+			{
+				RPC_MESSAGE late = read_rpc(node,&transport->connections[i],&tmp.rpc);
+				if(late.data_size > 0) free(late.data); // nobody waits for the value any more
+			}
+			break;
+			CASE(RPC_REQUEST)
+			{
+				log_trace("type=%d, data payload=%d",tmp.rpc.type,tmp.rpc.data_size);
+				read_rpc(node,&transport->connections[i],&tmp.rpc);
 			}
-			else 
-				rpc_find_node(node,new_contacts[i],hash,query);
+			break;
 			
-			merge_contact_lists(closest,query,hash);
+			#undef CASE
 		}
 	}
+	
+	verify_contacts(node); // lazily ping contacts learned by lookups
+	replicate_hot_keys(node);
+	expire_replicas(node);
+	pubsub_poll(node);
+	trace_flush(&rpc_trace,clock_ms());
+	
+	const char * path = node->snapshot_request.load();
+	if(path)
+	{
+		node_snapshot(node,path);
+		node->snapshot_request = NULL;
+	}
+	
+	unsigned now = clock_ms();
+	if(now - node->metrics_updated >= METRICS_SNAPSHOT_MS)
+	{
+		update_gauges(node);
+		node->metrics_updated = now;
+	}
+	return handled;
 }
 
-void kademlia_store_value(NODE * node, HASH_ENTRY * entry)
+//
+//		Kademlia Operations
+//
+
+static int store_closest(NODE * node, CONTACT ** closest, HASH_ENTRY * entry)
 {
-	CONTACT * exclusion[N_NODES] = {&node->info};
-	CONTACT * closest[N_CONTACTS] = {0};
-	int n_exclusion=1;
+	// the STOREs at the end of kademlia_store_value, how many stored it
 	
-	printf("finding nodes closest to "); hash_print(entry->hash); printf("\n");
-	
-	kademlia_search(node,entry->hash,NULL,closest,exclusion,&n_exclusion);
-	for(int i = 0; closest[i] && i < N_CONTACTS; i++)
+	char hex[2*K_ID_LEN+1];
+	for(int i = 0; i < N_CONTACTS && closest[i]; i++)
 	{
 		//printf("Storing data to node %d: ",closest[i]->idx); hash_print(closest[i]->id); printf("\n");
-		printf("Storing data to node: "); hash_print(closest[i]->id); printf("\n");
-		rpc_store_value(node,closest[i],entry);
+		log_debug("Storing data to node: %s", hash_string(closest[i]->id,hex));
 	}
+	int status[N_CONTACTS];
+	int stored = rpc_store_values(node,closest,entry,status), n_full = 0;
+	for(int i = 0; i < N_CONTACTS && closest[i]; i++) n_full += status[i] == STORE_FULL;
+	
+	if(n_full)
+	{
+		// the nodes that are full are made up for by the next closest ones
+		CONTACT * extra[N_CONTACTS] = {0};
+		get_extra_replicas(node,entry->hash,extra);
+		for(int i = 0; i < N_CONTACTS && extra[i] && n_full > 0; i++)
+		{
+			int tried = 0;
+			for(int j = 0; j < N_CONTACTS && closest[j] && !tried; j++) tried = hash_equ(closest[j]->id,extra[i]->id);
+			if(tried) continue;
+			
+			log_debug("%d nodes full, storing to %d instead", n_full, extra[i]->port);
+			if(rpc_store_value(node,extra[i],entry)) { stored++; n_full--; }
+		}
+	}
+	return stored;
+}
+
+struct NODE_RPCS
+{
+	// how kademlia_lookup reaches the other nodes, see kademlia.h
+	static void closest_contacts(NODE * node, K_ID hash, CONTACT ** closest, LOOKUP * lookup) { get_closest_nodes(node,hash,closest); }
+	static int find_node(NODE * node, CONTACT * contact, K_ID hash, CONTACT ** closest, LOOKUP * lookup) { return rpc_find_node(node,contact,hash,closest,lookup); }
+	static int find_value(NODE * node, CONTACT * contact, HASH_ENTRY * entry, CONTACT ** closest, LOOKUP * lookup) { return rpc_find_value(node,contact,entry,closest,lookup); }
+	static void cache_value(NODE * node, CONTACT * contact, HASH_ENTRY * entry) { rpc_cache_value(node,contact,entry); }
+	static int store_values(NODE * node, CONTACT ** closest, HASH_ENTRY * entry) { return store_closest(node,closest,entry); }
+};
+
+int kademlia_search(NODE * node, K_ID hash, HASH_ENTRY * entry, CONTACT ** closest, LOOKUP * lookup)
+{
+	// 0 if some of the closest contacts it ends with did not answer
+	
+	if(!hash && !entry) return 0;
+	else if(!hash) hash = entry->hash;
+	SPAN("kademlia_search",entry ? "value" : "node",0,hash);
+	return kademlia_lookup<KADEMLIA,NODE_RPCS>(node,hash,entry,closest,lookup);
+}
+
+int kademlia_store_value(NODE * node, HASH_ENTRY * entry)
+{
+	LOOKUP lookup = {{&node->info},1};
+	CONTACT * closest[N_CONTACTS] = {0};
+	int rtt_saved = node->rtt_saved;
+	uint64_t start = metrics_clock_us();
+	SPAN("kademlia_store_value",NULL,0,entry->hash);
+	
+	char hex[2*K_ID_LEN+1];
+	log_debug("finding nodes closest to %s", hash_string(entry->hash,hex));
+	cache_forget(node,entry->hash);
+	
+	int stored = kademlia_store<KADEMLIA,NODE_RPCS>(node,entry,closest,&lookup);
+	log_debug("Saved %d round trips", node->rtt_saved - rtt_saved);
+	metrics_add(node->metrics,METRIC_LOOKUPS + (stored ? LOOKUP_STORED : LOOKUP_NOT_STORED),1);
+	metrics_observe(node->metrics,METRIC_LOOKUP_LATENCY,metrics_clock_us() - start);
+	return stored;
 }
 
-void kademlia_find_value(NODE * node, HASH_ENTRY * entry)
+static int find_value(NODE * node, HASH_ENTRY * entry, int latest)
 {
-	CONTACT * exclusion[N_NODES] = {&node->info};
+	LOOKUP lookup = {{&node->info},1};
 	CONTACT * closest[N_CONTACTS] = {0};
-	int n_exclusion=1;
+	int rtt_saved = node->rtt_saved;
+	uint64_t start = metrics_clock_us();
+	SPAN("kademlia_find_value",NULL,0,entry->hash);
+	
+	REPLICA_HINT * hint = find_hint(node,entry->hash);
+	if(hint && hint->n_replicas)
+	{
+		// a hot key, spread the read over the replicas it was advertised with
+		CONTACT * replica = &hint->replicas[node_random(node)%hint->n_replicas];
+		CONTACT * query[N_CONTACTS] = {0};
+		rpc_find_value(node,replica,entry,query,NULL);
+	}
 	
 	//printf("searching for value for node %d\n", node->info.idx);
-	kademlia_search(node,NULL,entry,closest,exclusion,&n_exclusion);
+	int complete = entry->data || kademlia_search(node,NULL,entry,closest,&lookup);
+	log_debug("Saved %d round trips", node->rtt_saved - rtt_saved);
+	metrics_add(node->metrics,METRIC_LOOKUPS + (entry->data ? LOOKUP_FOUND : LOOKUP_MISSED),1);
+	metrics_observe(node->metrics,METRIC_LOOKUP_LATENCY,metrics_clock_us() - start);
+	if(entry->data) cache_put(node,entry);
+	else if(complete && !latest) cache_miss(node,entry->hash);
+	return entry->data ? 1 : complete ? 0 : -1;
+}
+
+int kademlia_find_value(NODE * node, HASH_ENTRY * entry, int latest)
+{
+	if(cache_get(node,entry)) return 1;
+	if(!latest && cache_missing(node,entry->hash)) return 0;
+	return find_value(node,entry,latest);
+}
+
+int kademlia_find_values(NODE * node, HASH_ENTRY * entries, int n, int latest)
+{
+	// FIND_VALUE for all the keys at once, each to the closest contact we
+	// know for it, so keys held by our own contacts take one round trip.
+	// Responses on a connection come back in order, their sequence number
+	// tells which request they answer. The keys that were not found that way, and
+	// not cached, are looked up one at a time. A key asked for more than
+	// once is looked up once and copied. With latest a key that was just
+	// missed is looked up anyway, see kademlia_find_value.
+	
+	SPAN("kademlia_find_values");
+	int found = 0, coalesced = 0;
+	int * same = (int*) malloc(n*sizeof(int)); // the first entry with the same key, or -1
+	char * done = (char*) calloc(n,1); // answered without a lookup
+	for(int i = 0; i < n; i++)
+	{
+		entries[i].data = NULL;
+		entries[i].size = 0;
+		same[i] = -1;
+		for(int j = 0; j < i && same[i] < 0; j++)
+			if(same[j] < 0 && hash_equ(entries[j].hash,entries[i].hash)) same[i] = j;
+		if(same[i] >= 0) coalesced++;
+		else done[i] = cache_get(node,&entries[i]) || (!latest && cache_missing(node,entries[i].hash));
+		found += entries[i].data != NULL;
+	}
+	
+	for(int first = 0; first < n; first += FIND_BATCH)
+	{
+		int batch = n - first < FIND_BATCH ? n - first : FIND_BATCH;
+		HASH_ENTRY * entry = entries + first;
+		CONNECTION * connections[FIND_BATCH] = {0};
+		unsigned deadlines[FIND_BATCH] = {0}, seqs[FIND_BATCH] = {0};
+		
+		for(int i = 0; i < batch; i++)
+		{
+			if(done[first+i] || same[first+i] >= 0) continue;
+			CONTACT * closest[N_CONTACTS] = {0};
+			get_closest_nodes(node,entry[i].hash,closest);
+			if(!closest[0] || !(connections[i] = transport_connect(node->transport,closest[0]->port))) continue;
+			
+			RPC_MESSAGE in = {FIND_VALUE,node->info}; memcpy(in.entry.hash,entry[i].hash,sizeof(K_ID));
+			deadlines[i] = clock_ms() + rpc_timeout(connections[i]);
+			post_rpc(node,connections[i],&in);
+			seqs[i] = in.seq;
+		}
+		
+		RPC_MESSAGE out;
+		int j;
+		while((j = wait_rpcs(node,connections,seqs,deadlines,batch,FIND_VALUE,&out)) >= 0)
+		{
+			if(out.type == FOUND_VALUE)
+			{
+				entry[j].data = out.entry.data;
+				entry[j].size = out.entry.size;
+				cache_put(node,&entry[j]);
+				found++;
+				metrics_add(node->metrics,METRIC_LOOKUPS + LOOKUP_FOUND,1);
+			}
+		}
+	}
+	
+	for(int i = 0; i < n; i++)
+	if(!entries[i].data && !done[i] && same[i] < 0)
+	{
+		find_value(node,&entries[i],latest);
+		found += entries[i].data != NULL;
+	}
+	
+	for(int i = 0; i < n; i++)
+	if(same[i] >= 0 && entries[same[i]].data)
+	{
+		entries[i].size = entries[same[i]].size;
+		entries[i].data = (char*) malloc(entries[i].size);
+		memcpy(entries[i].data,entries[same[i]].data,entries[i].size);
+		found++;
+	}
+	metrics_add(node->metrics,METRIC_LOOKUPS_COALESCED,coalesced);
+	free(same);
+	free(done);
+	return found;
+}
+
+int kademlia_join(NODE * node, CONTACT * bootstrap)
+{
+	// one JOIN round trip seeds the routing table, then a single round of
+	// FIND_NODE for our own id goes out to the k closest seeds at once
+	
+	uint64_t start = metrics_clock_us();
+	SPAN("kademlia_join",NULL,bootstrap->port);
+	if(!rpc_join(node,bootstrap))
+	{
+		metrics_add(node->metrics,METRIC_LOOKUPS + LOOKUP_NOT_JOINED,1);
+		return 0;
+	}
+	
+	CONTACT * closest[N_CONTACTS] = {0};
+	CONNECTION * connections[N_CONTACTS] = {0};
+	unsigned deadlines[N_CONTACTS] = {0}, seqs[N_CONTACTS] = {0};
+	get_closest_nodes(node,node->info.id,closest);
+	
+	RPC_MESSAGE in = {FIND_NODE,node->info}; memcpy(in.entry.hash,node->info.id,sizeof(K_ID));
+	for(int i = 0; i < N_CONTACTS && closest[i]; i++)
+	{
+		connections[i] = transport_connect(node->transport,closest[i]->port);
+		if(!connections[i]) continue;
+		deadlines[i] = clock_ms() + rpc_timeout(connections[i]);
+		post_rpc(node,connections[i],&in);
+		seqs[i] = in.seq;
+	}
+	
+	RPC_MESSAGE out;
+	while(wait_rpcs(node,connections,seqs,deadlines,N_CONTACTS,FIND_NODE,&out) >= 0)
+	{
+		if(out.type == FAILURE) continue;
+		
+		for(int j = 0; j < N_CONTACTS; j++)
+			learn_contact(node,&out.closest[j]);
+	}
+	metrics_add(node->metrics,METRIC_LOOKUPS + LOOKUP_JOINED,1);
+	metrics_observe(node->metrics,METRIC_LOOKUP_LATENCY,metrics_clock_us() - start);
+	return 1;
 }
 
 /*
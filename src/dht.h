@@ -16,24 +16,73 @@
 
 
 #include "connection.h"
+#include "kademlia.h"
+#include "trace.h"
+#include "log.h"
+#include "span.h"
 
+// these can be overridden on the command line to build a specialised client,
+// every node on a network has to agree on them
+
+#ifndef PARALLEL_QUERIES
 #define PARALLEL_QUERIES 1
+#endif
+#ifndef N_CONTACTS
 #define N_CONTACTS 5
+#endif
+#ifndef K_ID_LEN
 #define K_ID_LEN 20
+#endif
 #define N_NODES 64
 #define MAX_CONTACTS (N_NODES*4)
 #define N_REPLACEMENTS 20
+#define N_PENDING MAX_CONTACTS
+#define JOIN_CONTACTS 64 // most contacts a bootstrap node hands out
+#define FIND_BATCH 64 // FIND_VALUEs kademlia_find_values has out at once
 
-typedef unsigned char K_ID[K_ID_LEN]; // a 160 bit value
+// rpc timeouts in ms, see rpc_timeout
+#define RPC_INITIAL_TIMEOUT 1000 // before the first rtt sample
+#define RPC_MIN_TIMEOUT 20
+#define RPC_MAX_TIMEOUT 4000
+#define RPC_RETRIES 2
+#define RPC_SERVE_MS 5 // while waiting for a response, other peers' requests are served this often
 
-typedef struct
-{
-	K_ID hash;
-	char * data;
-	int size;
-}HASH_ENTRY;
+// read spreading for hot keys
+#define N_HOT_KEYS 64 // keys whose read rate a node tracks
+#define HOT_HALF_LIFE 10 // seconds for a read count to halve
+#define HOT_READS 16 // reads per half life for each extra replica
+#define REPLICA_TTL 60 // seconds an extra replica or a replica hint lives
+#define N_REPLICAS 256 // extra replicas a node holds for others
+#define N_HINTS 64 // keys we remember advertised replicas for
+
+#define METRICS_SNAPSHOT_MS 1000 // how often node_poll refreshes the gauges
+
+// channel pub/sub, see pubsub.c
+#define N_TOPICS 16 // channels a node keeps the subscribers of for others
+#define N_SUBSCRIPTIONS 16 // channels a node is subscribed to
+#define PUBSUB_MAX_MEMBERS 128 // subscribers of one channel
+#define PUBSUB_FANOUT 3 // nodes each node forwards a message to
+#define PUBSUB_TTL 60 // seconds a subscription lasts unless renewed
+#define PUBSUB_SEEN 256 // message ids remembered to drop duplicates
+
+// values we looked up, see cache.c
+#define CACHE_SLOTS 256 // values kept at most
+#define CACHE_DEFAULT_BYTES (4 << 20) // bytes of values kept unless told otherwise
+#define CACHE_MISSING 64 // keys remembered as not found
+#define CACHE_MISSING_MS 2000 // how long a key that was not found is not looked up again
+
+// memory quota, see store_entry
+#define STORE_DEFAULT_QUOTA (64 << 20) // bytes a node may use unless told otherwise
+#define STORE_MAX_ENTRIES (HASH_TABLE_SIZE/4*3) // keeps the open addressing table from filling up
+#define STORE_LOW_WATER 90 // percent of the quota and entries an eviction frees down to
+
+typedef KADEMLIA_PARAMS<N_CONTACTS,PARALLEL_QUERIES,K_ID_LEN*8> KADEMLIA;
 
-typedef HASH_ENTRY HASH_TABLE[0xFFFF];
+typedef KADEMLIA::K_ID K_ID; // a 160 bit value
+
+typedef HASH_ENTRY_T<KADEMLIA> HASH_ENTRY;
+
+typedef HASH_ENTRY HASH_TABLE[HASH_TABLE_SIZE];
 
 
 typedef struct
@@ -53,46 +102,185 @@ typedef struct
 	
 } CONTACT;
 
-struct BUCKET_TREE_t; typedef struct BUCKET_TREE_t BUCKET_TREE;
+typedef BUCKET_T<KADEMLIA,CONTACT> BUCKET;
+typedef BUCKET_TREE_T<KADEMLIA,CONTACT> BUCKET_TREE;
+
+#define LOOKUP_CONTACTS (N_NODES*2) // contacts learned that one lookup keeps
 
-typedef struct BUCKET_t
+typedef struct
 {
-	BUCKET_TREE * parent;	
-	CONTACT * contacts[N_CONTACTS];
+	// the state of one kademlia_search, see kademlia_lookup in kademlia.h.
+	// Contacts learned from its responses are copied here, the pending ring
+	// they are queued on for a ping is reused while a long lookup runs
+	CONTACT * exclusion[N_NODES]; // queried already, our own info first
+	int n_exclusion;
+	char answered[N_NODES]; // whether each of them did
+	CONTACT contacts[LOOKUP_CONTACTS];
 	int n_contacts;
-	int circle_idx;
-	//CONTACT * replacements;
-	//int n_replacements;
-	
-} BUCKET;
+	int rounds, queries; // of FIND_NODEs or FIND_VALUEs
+} LOOKUP;
 
-struct BUCKET_TREE_t
+typedef struct
+{
+	// read rate of a key this node serves
+	K_ID hash;
+	unsigned reads; // halves every HOT_HALF_LIFE seconds
+	unsigned last_read;
+	unsigned pushed; // when the extra replicas were last (re)stored
+	CONTACT extra[N_CONTACTS]; // nodes holding extra replicas
+	int n_extra;
+	unsigned refused[N_CONTACTS]; // ports that answered full, tried again at the next refresh
+	int n_refused;
+	unsigned topped_up; // when nodes were last added in place of full ones
+} KEY_STATS;
+
+typedef struct
 {
-	K_ID min,max;
-	//BUCKET_TREE_t * parent;
-	BUCKET_TREE_t * children[2];
-	BUCKET * bucket;
+	// an extra replica this node holds until it expires
+	K_ID hash;
+	unsigned expires;
+} REPLICA;
+
+typedef struct
+{
+	// replicas advertised in a FOUND_VALUE response
+	K_ID hash;
+	unsigned expires;
+	CONTACT replicas[N_CONTACTS];
+	int n_replicas;
+} REPLICA_HINT;
+
+enum STORE_ORIGINS
+{
+	STORE_CACHED, // an extra replica or path cached copy with a ttl, evicted first
+	STORE_STORED, // kept for another node, evicted once there are no cached copies
+	STORE_ORIGINATED, // saved on this node, never evicted
 };
 
+enum STORE_STATUS { STORE_OK, STORE_FULL }; // of a STORED response
+
+typedef struct
+{
+	// what eviction needs to know about an entry, by its slot in the table
+	unsigned last_used; // stored or read, seconds since the epoch
+	int origin;
+} STORE_USE;
+
+typedef struct
+{
+	K_ID id;
+	unsigned port;
+	unsigned expires;
+} PUBSUB_MEMBER;
+
+typedef struct
+{
+	// a channel this node is one of the roots of, the members closest to
+	// the topic first
+	K_ID topic;
+	PUBSUB_MEMBER members[PUBSUB_MAX_MEMBERS];
+	int n_members;
+} PUBSUB_TOPIC;
+
+typedef struct
+{
+	// a channel this node is subscribed to
+	char name[32];
+	K_ID topic;
+	CONTACT roots[N_CONTACTS]; // the nodes closest to the topic when last renewed
+	int n_roots;
+	unsigned renewed;
+} PUBSUB_SUBSCRIPTION;
+
+typedef struct
+{
+	K_ID hash;
+	char * data; // NULL for a free slot
+	int size;
+	int referenced; // read since the clock hand last passed
+} CACHE_ENTRY;
+
+typedef struct
+{
+	K_ID hash;
+	unsigned expires; // clock_ms
+} CACHE_MISS;
+
+typedef struct
+{
+	CACHE_ENTRY entries[CACHE_SLOTS];
+	int hand;
+	size_t bytes, limit;
+	CACHE_MISS missing[CACHE_MISSING]; // a ring
+	int next_missing;
+	uint64_t hits, misses, missing_hits;
+} VALUE_CACHE;
+
 typedef struct
 {
 	CONTACT info;
+	TRANSPORT * transport; // reaches the other nodes
 	HASH_TABLE table;
 	BUCKET_TREE * contacts;
 	int is_online;
 	CONTACT contact_table[MAX_CONTACTS]; 
+	
+	// contacts learned from FOUND_NODE responses waiting for a lazy ping
+	CONTACT pending[N_PENDING];
+	int n_pending,n_verified;
+	
+	int rtt_saved; // pings skipped because the rpc response proves liveness
+	unsigned rpc_sequence; // of the last request posted
+	
+	KEY_STATS hot_keys[N_HOT_KEYS];
+	REPLICA replicas[N_REPLICAS];
+	REPLICA_HINT hints[N_HINTS];
+	unsigned random; // picks among the hints and replicas, see node_random
+	
+	// memory accounting, see node_memory
+	STORE_USE store_use[HASH_TABLE_SIZE]; // moves along with the table entries
+	size_t quota; // bytes, STORE_DEFAULT_QUOTA from node_init
+	size_t store_bytes; // of the values
+	int n_entries;
+	size_t contact_bytes; // of the routing table, as of the last gauge update
+	
+	// channel pub/sub, see pubsub.c
+	PUBSUB_TOPIC topics[N_TOPICS];
+	PUBSUB_SUBSCRIPTION subscriptions[N_SUBSCRIPTIONS];
+	uint64_t pubsub_seen[PUBSUB_SEEN]; // ids of the last messages, a ring
+	int pubsub_next_seen;
+	unsigned pubsub_sequence; // of the messages we published
+	void (*pubsub_handler)(void * data, const char * channel, unsigned origin, const char * text, int length); // also sees each message delivered, see bots.c
+	void * pubsub_data;
+	
+	VALUE_CACHE cache; // in front of kademlia_find_value, see cache.c
+	
+	METRICS * metrics;
+	unsigned metrics_updated; // ms timestamp of the last gauge snapshot
+	
+	// another thread sets a path here and node_poll takes the snapshot
+	// and clears it, see snapshot.c
+	std::atomic<const char*> snapshot_request;
+	pthread_t snapshot_thread; // writing the last snapshot taken
+	int snapshot_writing;
 } NODE;
 
 //
 //		RPC Protocol
 //
 
-enum RPCS
+enum RPCS // the values are the ones traces record, from trace.h
 {
-	FAILURE, PING, STORE, FIND_NODE, FIND_VALUE, // requests
-	FOUND_NODE, FOUND_VALUE, // response
+	FAILURE = TRACE_FAILURE, PING = TRACE_PING, STORE = TRACE_STORE, FIND_NODE = TRACE_FIND_NODE, FIND_VALUE = TRACE_FIND_VALUE, // requests
+	FOUND_NODE = TRACE_FOUND_NODE, FOUND_VALUE = TRACE_FOUND_VALUE, // response
+	JOIN = TRACE_JOIN, JOINED = TRACE_JOINED, // bootstrap request and response
+	STORED = TRACE_STORED, // response to STORE
+	SUBSCRIBE = TRACE_SUBSCRIBE, PUBLISH = TRACE_PUBLISH, // channel pub/sub, no response
+	PONG = TRACE_PONG, // response to PING
 };
 
+extern const char * rpc_names[]; // by enum RPCS, NULL terminated
+
 enum MESSAGES
 {
 	NO_MESSAGE,
@@ -107,10 +295,35 @@ typedef struct
 	HASH_ENTRY entry;
 	CONTACT closest[N_CONTACTS];
 	
+	int ttl; // seconds a STORE is kept for, 0 keeps it
+	int status; // of a STORED response, enum STORE_STATUS
+	unsigned seq; // set by post_rpc on a request, its response echoes it
+	
 	int data_size;
 	char * data;
 } RPC_MESSAGE;
 
+typedef struct
+{
+	// compact contact sent in the payload of a JOINED response
+	K_ID id;
+	unsigned ip;
+	unsigned port;
+} SEED_CONTACT;
+
+typedef struct
+{
+	// the payload of a PUBLISH, followed by n_members ports and the text.
+	// The node a copy is sent to passes it on to those ports, the copy
+	// for the root has hops 0 and goes to every subscriber
+	uint64_t id; // publisher port and sequence, duplicates are dropped
+	char channel[32];
+	uint32_t origin; // port of the publisher
+	uint16_t hops;
+	uint16_t n_members;
+	uint16_t length; // of the text
+} PUBSUB_HEADER;
+
 typedef struct
 {
 	int type,length;
@@ -128,18 +341,72 @@ typedef struct
 
 RPC_MESSAGE send_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input);
 RPC_MESSAGE read_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input);
+void post_rpc(NODE * node, CONNECTION * connection, RPC_MESSAGE * input);
+RPC_MESSAGE wait_rpc(NODE * node, CONNECTION * connection, int type, unsigned seq, unsigned deadline);
+int wait_rpcs(NODE * node, CONNECTION ** connections, unsigned * seqs, unsigned * deadlines, int n, int type, RPC_MESSAGE * out); // the slot answered or timed out, -1 when none waits
+unsigned rpc_timeout(CONNECTION * connection);
+
+int kademlia_search(NODE * node, K_ID hash, HASH_ENTRY * entry, CONTACT ** closest, LOOKUP * lookup); // 0 if some of the closest did not answer
+int kademlia_store_value(NODE * node, HASH_ENTRY * entry); // how many nodes stored it
+int kademlia_find_value(NODE * node, HASH_ENTRY * entry, int latest); // 1 found, 0 not there, -1 not known. latest for a key whose value changes, a miss is not remembered
+int kademlia_find_values(NODE * node, HASH_ENTRY * entries, int n, int latest); // how many were found
+int kademlia_join(NODE * node, CONTACT * bootstrap);
+
+CONTACT * rpc_ping(NODE * sender, CONTACT * contact); // the contact, once it answered
+int rpc_store_replica(NODE * sender, CONTACT * contact, HASH_ENTRY * entry, int ttl);
+int rpc_cache_value(NODE * sender, CONTACT * contact, HASH_ENTRY * entry);
+void verify_contacts(NODE * node);
+void replicate_hot_keys(NODE * node);
+void expire_replicas(NODE * node);
+void decay_reads(KEY_STATS * key, unsigned now);
+REPLICA * find_replica(NODE * node, K_ID hash);
+int store_entry(NODE * node, HASH_ENTRY * entry, int ttl, int origin); // takes the entry's data, STORE_FULL if it was dropped
+size_t node_memory(NODE * node); // bytes counted against the quota
+int parse_bytes(const char * text, size_t * bytes); // a number with an optional k, m or g suffix
+
+void node_init(NODE * node, TRANSPORT * transport, int port);
+int node_poll(NODE * node);
+void node_free(NODE * node); // the routing table, stored values and metrics
+
+int pubsub_subscribe(NODE * node, const char * channel); // 0 if there are too many
+void pubsub_unsubscribe(NODE * node, const char * channel);
+int pubsub_publish(NODE * node, const char * channel, const char * text); // 0 if no root took it
+void pubsub_read(NODE * node, RPC_MESSAGE * input); // a SUBSCRIBE or PUBLISH, from read_rpc
+void pubsub_poll(NODE * node); // renews the subscriptions, from node_poll
+void pubsub_handoff(NODE * node, CONTACT * contact); // a new contact, from add_contact
+void pubsub_topic(const char * channel, K_ID topic); // hash("pubsub <channel>"), its roots are the nodes closest to it
 
-void kademlia_search(NODE * node, K_ID hash, HASH_ENTRY * entry, CONTACT ** closest, CONTACT ** exclusion, int * n_exclusion);
-void kademlia_store_value(NODE * node, HASH_ENTRY * entry);
-void kademlia_find_value(NODE * node, HASH_ENTRY * entry);
+int cache_get(NODE * node, HASH_ENTRY * entry); // sets the entry's data to a copy, 0 if it is not cached
+void cache_put(NODE * node, HASH_ENTRY * entry); // keeps a copy if the key is the hash of the value
+int cache_missing(NODE * node, K_ID hash); // 1 if the key was not found in the last CACHE_MISSING_MS
+void cache_miss(NODE * node, K_ID hash);
+void cache_forget(NODE * node, K_ID hash); // the key was stored, it may be found now
+void cache_free(NODE * node);
 
-CONTACT * rpc_ping(NODE * sender, CONTACT * contact);
+int node_snapshot(NODE * node, const char * path); // from the node's thread, the file is written in the background
+void snapshot_wait(NODE * node); // until the last snapshot is in its file
+
+typedef struct
+{
+	// nodes running on threads of this process, see cluster.c
+	NODE * nodes;
+	TRANSPORT * transports;
+	pthread_t * threads;
+	int n_nodes;
+	sem_t joined;
+	volatile int stop;
+} CLUSTER;
+
+int cluster_start(CLUSTER * cluster, int n_nodes, int first_port, int type, size_t quota);
+void cluster_stop(CLUSTER * cluster);
 
-void get_hash(HASH_ENTRY * entry);
 void hash_print(K_ID hash);
+char * hash_string(K_ID hash, char * out); // out holds 2*K_ID_LEN+1 chars
+
+extern TRACE rpc_trace; // every rpc sent and received is recorded while this is open
 
 
-void hash_insert(HASH_TABLE table, HASH_ENTRY * entry);
-void hash_search(HASH_TABLE table, HASH_ENTRY * entry);
+int hash_insert(HASH_TABLE table, HASH_ENTRY * entry); // the slot, -1 if the table is full
+int hash_search(HASH_TABLE table, HASH_ENTRY * entry); // the slot, -1 if not found
 
 #endif
\ No newline at end of file
@@ -0,0 +1,640 @@
+#ifndef KADEMLIA_H
+#define KADEMLIA_H
+
+//
+//		Compile time parameterised Kademlia core
+//
+// Everything here is a template on KADEMLIA_PARAMS<K,ALPHA,B>:
+// 	K is the bucket size (k in the spec)
+// 	ALPHA is the number of parallel queries
+// 	B is the width of an id in bits
+// Loops over an id or a bucket have a constant trip count so the compiler
+// can unroll them, and several configurations can live in one binary.
+// dht.h instantiates the configuration used on the wire.
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdint.h"
+
+template<int K, int ALPHA, int B>
+struct KADEMLIA_PARAMS
+{
+	static_assert(B % 32 == 0, "get_hash fills the id 32 bits at a time");
+
+	// lower case so they do not collide with the macros in dht.h
+	enum { k = K, alpha = ALPHA, bits = B, id_len = B/8 };
+	typedef unsigned char K_ID[B/8];
+};
+
+// *Really* minimal PCG32 code / (c) 2014 M.E. O'Neill / pcg-random.org
+// Licensed under Apache License 2.0 (NO WARRANTY, etc. see website)
+
+typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
+inline uint32_t pcg32_random_r(pcg32_random_t* rng)
+{
+    uint64_t oldstate = rng->state;
+    rng->state = oldstate * 6364136223846793005ULL + (rng->inc|1);
+    uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
+    uint32_t rot = oldstate >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+//
+//		Id operations
+//
+
+template<int LEN> inline void hash_distance(const unsigned char * a, const unsigned char * b, unsigned char * out)
+{
+	for(int i = 0; i < LEN; i++)
+		out[i] = a[i]^b[i];
+}
+
+template<int LEN> inline int hash_equ(const unsigned char * a, const unsigned char * b)
+{
+	for(int i = 0; i < LEN; i++)
+		if(a[i] != b[i]) return 0;
+	return 1;
+}
+
+template<int LEN> inline int hash_lth(const unsigned char * a, const unsigned char * b)
+{
+	for(int i = 0; i < LEN; i++)
+		if(a[i] < b[i]) return 1;
+		else if(a[i] > b[i]) return 0;
+	return 0;
+}
+
+template<int LEN> inline int hash_in_range(const unsigned char * hash, const unsigned char * min, const unsigned char * max)
+{
+	return hash_lth<LEN>(hash,max) && (hash_lth<LEN>(min,hash) || hash_equ<LEN>(hash,min));
+}
+
+template<int LEN> int hash_common_bits(const unsigned char * a, const unsigned char * b)
+{
+	// length of the shared prefix, this is the bucket b falls in for a
+	for(int i = 0; i < LEN; i++)
+	if(a[i] != b[i])
+	{
+		int bits = i*8;
+		for(unsigned char x = a[i]^b[i]; !(x&0x80); x <<= 1) bits++;
+		return bits;
+	}
+	return LEN*8;
+}
+
+template<int LEN> void hash_print(const unsigned char * hash)
+{
+	for(int i = 0; i < LEN; i++)
+		printf("%02X",hash[i]);
+}
+
+template<int LEN> char * hash_string(const unsigned char * hash, char * out)
+{
+	// the hex hash_print prints, out needs 2*LEN+1 chars
+	const char * digits = "0123456789ABCDEF";
+	for(int i = 0; i < LEN; i++)
+	{
+		out[2*i] = digits[hash[i] >> 4];
+		out[2*i+1] = digits[hash[i] & 15];
+	}
+	out[2*LEN] = '\0';
+	return out;
+}
+
+template<int LEN> void hash_split(const unsigned char * min, const unsigned char * max, unsigned char * split)
+{
+	// calculate a midpoint of two hashes
+	// ( find difference, divide by 2, add min)
+	memset(split,0,LEN);
+
+	unsigned carry = 1;
+	for(int i = LEN-1; i >= 0; i--)
+	{
+		unsigned a = max[i];
+		unsigned b = (~min[i])&0xFF;
+		split[i] = (a+b+carry)&0xFF;
+		carry = ((a+b+carry)&0xFF00) >> 8;
+	}
+
+	carry = 0;
+	for(int i = 0; i < LEN; i++)
+	{
+		unsigned a = split[i];
+		split[i] = (carry<<7) | (a>>1);
+		carry = a&0x1;
+	}
+
+	carry = 0;
+	for(int i = LEN-1; i >= 0; i--)
+	{
+		unsigned a = split[i];
+		unsigned b = min[i];
+		split[i] = (a+b+carry)&0xFF;
+		carry = ((a+b+carry)&0xFF00) >> 8;
+	}
+}
+
+//
+//		Local hash table
+//
+
+#define HASH_TABLE_SIZE 0x10000 // indexed by an unsigned short
+
+template<class P>
+struct HASH_ENTRY_T
+{
+	typename P::K_ID hash;
+	char * data;
+	int size;
+};
+
+template<class P> void get_hash(HASH_ENTRY_T<P> * entry)
+{
+	// No guarentee that this is a good hash, but it should be
+	// evenly distributed enough for our purposes.
+	char * input = entry->data;
+	int size = entry->size;
+	unsigned * output = (unsigned *)entry->hash;
+
+	// cryptographic salt for small inputs
+	// just to help with evening the distribution
+	unsigned buffer[4] = {0xFFAB10FA,0xA123ACDB,0x7FACE134,0xF0BC1724};
+
+	if(size < 16)
+	{
+		input = (char*)buffer;
+		memcpy(buffer,entry->data,size);
+		size = 16;
+	}
+
+	memset(entry->hash,0,P::id_len);
+
+	unsigned remainder = 0;
+	for(int i=size-(size%4); i < size; i++)
+		remainder = (remainder<<8) | (input[i]&0xFF);
+
+	pcg32_random_t pcg = {remainder,1};
+	for(int i = 0; i < P::id_len/4; i++)
+		output[i] ^= pcg32_random_r(&pcg);
+
+	for(int i = 0; i < size/4; i++)
+	{
+		pcg.state ^= ((unsigned*)input)[i];
+		for(int j = 0; j < P::id_len/4; j++)
+			output[j] ^= pcg32_random_r(&pcg);
+	}
+}
+
+template<class P> int hash_insert(HASH_ENTRY_T<P> * table, HASH_ENTRY_T<P> * entry)
+{
+	// returns the slot the entry went into, or -1 if the table is full,
+	// the search and remove functions still assume a free slot somewhere
+	// so the caller has to keep it from filling up
+
+	const int LEN = P::id_len;
+	unsigned short idx = entry->hash[LEN-2] | (entry->hash[LEN-1]<<8);
+	for(int probes = 0; table[idx].data; probes++, idx++)
+	{
+		if( hash_equ<LEN>(table[idx].hash,entry->hash) ) break;
+		if( probes == HASH_TABLE_SIZE-1 ) return -1;
+	}
+
+	table[idx] = *entry;
+	return idx;
+}
+
+template<class P> int hash_search(HASH_ENTRY_T<P> * table, HASH_ENTRY_T<P> * entry)
+{
+	// returns the slot the entry was found in or -1
+
+	const int LEN = P::id_len;
+	unsigned short idx = entry->hash[LEN-2] | (entry->hash[LEN-1]<<8);
+	while( !hash_equ<LEN>( table[idx].hash, entry->hash ) )
+	{
+		if(table[idx].data) idx++;
+		else return -1;
+	}
+	*entry = table[idx];
+	return idx;
+}
+
+template<class P, class M> int hash_remove(HASH_ENTRY_T<P> * table, const unsigned char * hash, M * parallel)
+{
+	// clears the entry and shifts the rest of its probe run back so that
+	// hash_search still finds them, returns 0 if the entry was not there.
+	// parallel, if not NULL, is an array indexed by slot that moves along
+
+	const int LEN = P::id_len;
+	unsigned short idx = hash[LEN-2] | (hash[LEN-1]<<8);
+	while( !hash_equ<LEN>( table[idx].hash, hash ) )
+	{
+		if(table[idx].data) idx++;
+		else return 0;
+	}
+
+	unsigned short hole = idx;
+	for(unsigned short next = idx+1; table[next].data; next++)
+	{
+		unsigned short home = table[next].hash[LEN-2] | (table[next].hash[LEN-1]<<8);
+		if( (unsigned short)(next-home) >= (unsigned short)(next-hole) )
+		{
+			table[hole] = table[next];
+			if(parallel) parallel[hole] = parallel[next];
+			hole = next;
+		}
+	}
+	memset(&table[hole],0,sizeof(table[hole]));
+	if(parallel) memset(&parallel[hole],0,sizeof(M));
+	return 1;
+}
+
+template<class P> int hash_remove(HASH_ENTRY_T<P> * table, const unsigned char * hash)
+{
+	return hash_remove<P,char>(table,hash,NULL);
+}
+
+//
+//		Growable hash table
+//
+// Same open addressing as the fixed table, but it starts empty and doubles
+// when it is 3/4 full. For nodes that only ever hold a handful of entries.
+//
+
+template<class P>
+struct HASH_STORE_T
+{
+	HASH_ENTRY_T<P> * entries;
+	int n_entries;
+	int capacity; // 0 or a power of two
+};
+
+template<class P> unsigned hash_slot(HASH_STORE_T<P> * store, const unsigned char * hash)
+{
+	const int LEN = P::id_len;
+	unsigned idx = hash[LEN-2] | (hash[LEN-1]<<8) | (hash[LEN-3]<<16) | ((unsigned)hash[LEN-4]<<24);
+	return idx & (store->capacity-1);
+}
+
+template<class P> void hash_insert(HASH_STORE_T<P> * store, HASH_ENTRY_T<P> * entry)
+{
+	if((store->n_entries+1)*4 > store->capacity*3)
+	{
+		HASH_STORE_T<P> grown = {NULL,0,store->capacity ? store->capacity*2 : 4};
+		grown.entries = (HASH_ENTRY_T<P>*) calloc(grown.capacity,sizeof(HASH_ENTRY_T<P>));
+		for(int i = 0; i < store->capacity; i++)
+			if(store->entries[i].data) hash_insert(&grown,&store->entries[i]);
+		free(store->entries);
+		*store = grown;
+	}
+
+	unsigned idx = hash_slot(store,entry->hash);
+	while( store->entries[idx].data )
+	{
+		if( hash_equ<P::id_len>(store->entries[idx].hash,entry->hash) ) break;
+		idx = (idx+1) & (store->capacity-1);
+	}
+
+	if(!store->entries[idx].data) store->n_entries++;
+	store->entries[idx] = *entry;
+}
+
+template<class P> int hash_search(HASH_STORE_T<P> * store, HASH_ENTRY_T<P> * entry)
+{
+	if(!store->capacity) return -1;
+
+	unsigned idx = hash_slot(store,entry->hash);
+	while( !hash_equ<P::id_len>( store->entries[idx].hash, entry->hash ) )
+	{
+		if(store->entries[idx].data) idx = (idx+1) & (store->capacity-1);
+		else return -1;
+	}
+	*entry = store->entries[idx];
+	return idx;
+}
+
+template<class P> int hash_remove(HASH_STORE_T<P> * store, const unsigned char * hash)
+{
+	// backward shift deletion like hash_remove on the fixed table
+
+	HASH_ENTRY_T<P> entry; memcpy(entry.hash,hash,P::id_len);
+	int found = hash_search(store,&entry);
+	if(found < 0 || !entry.data) return 0;
+
+	unsigned mask = store->capacity-1, hole = found;
+	for(unsigned next = (hole+1)&mask; store->entries[next].data; next = (next+1)&mask)
+	{
+		unsigned home = hash_slot(store,store->entries[next].hash);
+		if( ((next-home)&mask) >= ((next-hole)&mask) )
+		{
+			store->entries[hole] = store->entries[next];
+			hole = next;
+		}
+	}
+	memset(&store->entries[hole],0,sizeof(HASH_ENTRY_T<P>));
+	store->n_entries--;
+	return 1;
+}
+
+//
+//		Routing table
+//
+// C is the contact type, it only needs a K_ID member called id.
+//
+
+template<class P, class C> struct BUCKET_TREE_T;
+
+template<class P, class C>
+struct BUCKET_T
+{
+	BUCKET_TREE_T<P,C> * parent;
+	C * contacts[P::k];
+	int n_contacts;
+	int circle_idx;
+	//C * replacements;
+	//int n_replacements;
+};
+
+template<class P, class C>
+struct BUCKET_TREE_T
+{
+	typename P::K_ID min,max;
+	BUCKET_TREE_T * children[2];
+	BUCKET_T<P,C> * bucket;
+};
+
+template<class P, class C> void merge_contact_lists(C ** dst, C ** src, const unsigned char * hash)
+{
+	const int K = P::k, LEN = P::id_len;
+	typename P::K_ID src_distance[K] = {{0}};
+	typename P::K_ID dst_distance[K] = {{0}};
+
+	for(int i=0; i<K && dst[i]; i++)
+		hash_distance<LEN>(hash,dst[i]->id,dst_distance[i]);
+
+	for(int i=0; i<K && src[i]; i++)
+		hash_distance<LEN>(hash,src[i]->id,src_distance[i]);
+
+	for(int i=0; i<K && src[i]; i++)
+	{
+		C * contact = src[i];
+		int skip = 0;
+		for(int j = 0; j < K && dst[j]; j++)
+		if(hash_equ<LEN>(contact->id,dst[j]->id))
+			skip = 1;
+
+		if(skip) continue;
+
+		int add = 0;
+		int j = 0;
+		for(; j < K && dst[j]; j++)
+		if(hash_lth<LEN>(src_distance[i],dst_distance[j]))
+		{
+			for(int k = K-1; k > j; k--)
+				dst[k] = dst[k-1];
+			dst[j] = contact;
+			add=1;
+			break;
+		}
+
+		if(!add && j < K && !dst[j])
+		{
+			dst[j] = contact;
+			add=1;
+		}
+	}
+}
+
+template<class P, class C> BUCKET_T<P,C> * find_bucket(BUCKET_TREE_T<P,C> * tree, const unsigned char * id)
+{
+	if(!tree) return NULL;
+
+	if(tree->children[0])
+	{
+		if(hash_lth<P::id_len>(id,tree->children[0]->max))
+			return find_bucket(tree->children[0],id);
+		else
+			return find_bucket(tree->children[1],id);
+	}
+	else return tree->bucket;
+}
+
+template<class P, class C> C * search_contacts(BUCKET_TREE_T<P,C> * tree, const unsigned char * id)
+{
+	BUCKET_T<P,C> * bucket = find_bucket(tree,id);
+	if(bucket)
+	for(int i = 0; i < bucket->n_contacts; i++)
+	if(hash_equ<P::id_len>(bucket->contacts[i]->id, id))
+		return bucket->contacts[i];
+	return NULL;
+}
+
+template<class P, class C> void insert_contact(BUCKET_TREE_T<P,C> ** root, const unsigned char * self, C * contact)
+{
+	// places an already stored contact in its bucket, splitting the bucket
+	// covering our own id when it is full (callers check for duplicates)
+
+	#define MALLOC_Z(S) (memset(malloc((S)),0,(S)))
+
+	typedef BUCKET_T<P,C> BUCKET;
+	typedef BUCKET_TREE_T<P,C> BUCKET_TREE;
+	const int K = P::k, LEN = P::id_len;
+
+	BUCKET * bucket = find_bucket(*root,contact->id);
+
+	if(bucket == NULL)
+	{
+		*root = (BUCKET_TREE*) MALLOC_Z(sizeof(BUCKET_TREE));
+		bucket = (*root)->bucket = (BUCKET*) MALLOC_Z(sizeof(BUCKET));
+		bucket->parent = *root;
+		memset(bucket->parent->min,0x00,LEN);
+		memset(bucket->parent->max,0xFF,LEN);
+	}
+
+	if(bucket->n_contacts < K) bucket->n_contacts++;
+	else if( hash_in_range<LEN>(self, bucket->parent->min, bucket->parent->max) )
+	{
+		BUCKET_TREE * tree = bucket->parent;
+
+		typename P::K_ID split; hash_split<LEN>(tree->min,tree->max,split);
+
+		tree->children[0] = (BUCKET_TREE*) MALLOC_Z(sizeof(BUCKET_TREE));
+		tree->children[1] = (BUCKET_TREE*) MALLOC_Z(sizeof(BUCKET_TREE));
+		tree->children[0]->bucket = (BUCKET*) MALLOC_Z(sizeof(BUCKET));
+		tree->children[1]->bucket = (BUCKET*) MALLOC_Z(sizeof(BUCKET));
+
+		tree->children[0]->bucket->parent = tree->children[0];
+		tree->children[1]->bucket->parent = tree->children[1];
+		tree->bucket = NULL;
+
+		memcpy(tree->children[0]->min,bucket->parent->min,LEN);
+		memcpy(tree->children[1]->max,bucket->parent->max,LEN);
+		memcpy(tree->children[0]->max,split,LEN);
+		memcpy(tree->children[1]->min,split,LEN);
+
+		for(int i=0; i < bucket->n_contacts; i++)
+		{
+			BUCKET * dst = find_bucket(tree,bucket->contacts[i]->id);
+			dst->contacts[dst->circle_idx++] = bucket->contacts[i];
+			dst->n_contacts++;
+		}
+
+		free(bucket);
+		bucket = find_bucket(tree,contact->id);
+	}
+
+	bucket->circle_idx %= K;
+	bucket->contacts[bucket->circle_idx++] = contact;
+	bucket->circle_idx %= K;
+
+	#undef MALLOC_Z
+}
+
+template<class P, class C> int remove_contact(BUCKET_TREE_T<P,C> * tree, const unsigned char * id)
+{
+	// drops a contact that stopped answering, returns 0 if it was not there
+	BUCKET_T<P,C> * bucket = find_bucket(tree,id);
+	if(!bucket) return 0;
+
+	for(int i = 0; i < bucket->n_contacts; i++)
+	if(hash_equ<P::id_len>(bucket->contacts[i]->id,id))
+	{
+		// keep the slots dense, the next contact goes in at the end
+		bucket->n_contacts--;
+		for(int j = i; j < bucket->n_contacts; j++) bucket->contacts[j] = bucket->contacts[j+1];
+		bucket->contacts[bucket->n_contacts] = NULL;
+		bucket->circle_idx = bucket->n_contacts;
+		return 1;
+	}
+	return 0;
+}
+
+template<class P, class C> size_t routing_table_bytes(BUCKET_TREE_T<P,C> * tree)
+{
+	// heap memory used by the bucket tree, not counting the contacts
+	if(!tree) return 0;
+	size_t bytes = sizeof(BUCKET_TREE_T<P,C>);
+	if(tree->bucket) bytes += sizeof(BUCKET_T<P,C>);
+	return bytes + routing_table_bytes(tree->children[0]) + routing_table_bytes(tree->children[1]);
+}
+
+template<class P, class C> void free_routing_table(BUCKET_TREE_T<P,C> * tree)
+{
+	if(!tree) return;
+	free_routing_table(tree->children[0]);
+	free_routing_table(tree->children[1]);
+	free(tree->bucket);
+	free(tree);
+}
+
+template<class P, class C> void get_closest_contacts(BUCKET_TREE_T<P,C> * tree, const unsigned char * hash, C ** closest)
+{
+	// iterate on all buckets of contacts
+	// to find the nodes closest to the desired hash
+
+	BUCKET_TREE_T<P,C> * stack[P::bits*2] = {tree}; // n*2 should be big enough
+	int stack_size = tree ? 1 : 0;
+
+	while(stack_size>0)
+	{
+		BUCKET_TREE_T<P,C> * bucket_tree = stack[--stack_size];
+		BUCKET_T<P,C> * bucket = bucket_tree->bucket;
+		if(bucket_tree->children[0]) stack[stack_size++] = bucket_tree->children[0];
+		if(bucket_tree->children[1]) stack[stack_size++] = bucket_tree->children[1];
+
+		if(bucket) merge_contact_lists<P>(closest,bucket->contacts,hash);
+	}
+}
+
+//
+//		Lookups
+//
+// The iterative lookup of the spec, shared by the node (dht.c), the load
+// clients (load.c) and the simulator (dht/src/sim.h). R says how the rpcs
+// are made, with static members:
+// 	closest_contacts(node, hash, closest, lookup) the closest we know of
+// 	find_node(node, contact, hash, closest, lookup) 1 if the contact answered
+// 	find_value(node, contact, entry, closest, lookup) the same, sets the
+// 		entry's data if the contact had the value
+// 	cache_value(node, contact, entry) a found value, on the way back
+// 	store_values(node, closest, entry) how many of them stored it
+// L holds the state of one lookup, it needs these members:
+// 	C * exclusion[]; int n_exclusion; char answered[]; int rounds, queries;
+// The contacts queried go in exclusion, the node's own info first if it
+// can be among the closest. Contacts are queried one at a time (alpha = 1).
+//
+
+template<class P, class R, class N, class C, class E, class L> int kademlia_lookup(N * node, unsigned char * hash, E * entry, C ** closest, L * lookup)
+{
+	// 1 once the value is found, or when every one of the closest contacts
+	// it ends with answered, so a value that was not found is not there
+
+	const int MAX_QUERIED = sizeof(lookup->exclusion)/sizeof(lookup->exclusion[0]);
+
+	if(!hash && !entry) return 0;
+	else if(!hash) hash = entry->hash;
+	R::closest_contacts(node,hash,closest,lookup);
+
+	for(;;)
+	{
+		C * new_contacts[P::k] = {NULL};
+		int n_new_contacts = 0, queried[P::k];
+		for(int i = 0; i < P::k && closest[i]; i++)
+		{
+			int excluded = 0;
+			for(int j = 0; j < lookup->n_exclusion && !excluded; j++)
+				excluded = hash_equ<P::id_len>(lookup->exclusion[j]->id,closest[i]->id);
+			if(excluded) continue;
+			if(lookup->n_exclusion == MAX_QUERIED) break; // query what we have
+
+			queried[n_new_contacts] = lookup->n_exclusion;
+			new_contacts[n_new_contacts++] = closest[i];
+			lookup->answered[lookup->n_exclusion] = 0;
+			lookup->exclusion[lookup->n_exclusion++] = closest[i];
+		}
+
+		if(n_new_contacts==0) break;
+		lookup->queries += n_new_contacts;
+		lookup->rounds++;
+
+		for(int i = 0; i<n_new_contacts; i++)
+		{
+			C * query[P::k] = {0};
+
+			if(entry)
+			{
+				lookup->answered[queried[i]] = R::find_value(node,new_contacts[i],entry,query,lookup);
+
+				if(entry->data)
+				{
+					if(i-1>=0) R::cache_value(node,closest[i-1],entry);
+					return 1;
+				}
+			}
+			else
+				lookup->answered[queried[i]] = R::find_node(node,new_contacts[i],hash,query,lookup);
+
+			merge_contact_lists<P>(closest,query,hash);
+		}
+	}
+
+	if(!closest[0]) return 0; // nobody to ask
+	for(int i = 0; i < P::k && closest[i]; i++)
+	{
+		int answered = 0;
+		for(int j = 0; j < lookup->n_exclusion && !answered; j++)
+			if(hash_equ<P::id_len>(lookup->exclusion[j]->id,closest[i]->id)) answered = lookup->answered[j];
+		if(!answered) return 0;
+	}
+	return 1;
+}
+
+template<class P, class R, class N, class C, class E, class L> int kademlia_store(N * node, E * entry, C ** closest, L * lookup)
+{
+	// looks up the nodes closest to the key and stores the value on them,
+	// returns how many stored it
+	kademlia_lookup<P,R>(node,entry->hash,(E*)NULL,closest,lookup);
+	return R::store_values(node,closest,entry);
+}
+
+#endif
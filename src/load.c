@@ -0,0 +1,713 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "math.h"
+#include "dht.h"
+
+//
+//		Load generator
+//
+// main load <first client port> <node port>... [name=value...]
+//
+// Runs closed loop virtual clients against a cluster of nodes on this host.
+// Each client has its own connections and issues one operation at a time:
+//	put   a FIND_NODE lookup for the key, then STORE to the closest nodes at once
+//	get   a FIND_VALUE lookup for the key, until the value or no closer node
+//	chat  a FIND_NODE lookup for the lobby's topic, then PUBLISH to the closest root
+//	      like pubsub_publish without a subscription, the root sends it on to
+//	      the nodes in the lobby
+// Lookups are kademlia_lookup from kademlia.h like the nodes' own, so their
+// rpc counts compare with the simulator. Client i introduces itself as
+// first client port + i. Nodes add the clients to their routing tables,
+// clients answer their FIND_NODE with no contacts and their STORE with full.
+// A node holds at most MAX_CONNECTIONS connections, clients and peers.
+//
+// transport= picks how clients reach the nodes. cluster=N starts N nodes in
+// this process on the node port and up instead of using running ones,
+// with transport=inproc nothing goes through the network stack at all.
+//
+
+#define LOAD_MAX_NODES 32
+#define LOAD_MAX_CLIENTS 256
+#define LOAD_MAX_SEEN 64 // contacts a lookup keeps track of
+#define LOAD_MAX_VALUE 65536
+#define LOAD_DRAIN_MS 2 // longest client_wait goes without draining the connections
+#define LOAD_CHANNEL "lobby" // where chat publishes, every node started by main is in it
+
+enum LOAD_OPS { LOAD_PUT, LOAD_GET, LOAD_CHAT, N_LOAD_OPS };
+enum LOAD_SIZES { SIZE_CONSTANT, SIZE_UNIFORM, SIZE_EXPONENTIAL };
+
+typedef struct
+{
+	int n_clients;
+	double duration;       // seconds
+	double mix[N_LOAD_OPS]; // weights of put, get and chat
+	int n_keys;
+	double zipf;           // key popularity exponent, 0 for uniform
+	int value_size;        // mean bytes of a put
+	int value_model;
+	unsigned timeout;      // ms per rpc
+	unsigned seed;
+	int transport;
+	int cluster;           // nodes to start in this process, 0 for none
+	int metrics_port;      // serves the metrics of those nodes
+	char snapshot[256];    // prefix of the snapshot files of those nodes taken at the end
+	char spans[256];       // Chrome trace of the run
+	size_t quota;          // bytes each of those nodes may use, 0 for the default
+
+	int first_port;
+	int ports[LOAD_MAX_NODES];
+	int n_nodes;
+
+	double * key_cdf;      // cumulative popularity of the keys
+} LOAD_CONFIG;
+
+typedef struct
+{
+	unsigned * us;
+	int n, max;
+} LATENCIES;
+
+typedef struct
+{
+	LOAD_CONFIG * config;
+	int idx;
+	CONTACT info; // the sender the nodes see
+	TRANSPORT transport; // one connection per node, opened on first use
+	pcg32_random_t rng;
+	pthread_t thread;
+
+	LATENCIES latency[N_LOAD_OPS];
+	int errors[N_LOAD_OPS];
+	int lookups, rpcs, gets, found;
+	int refused; // STOREs answered full
+	unsigned posted[MAX_CONNECTIONS]; // seq of the request a response is due to on the connection, client_drain leaves it alone
+	unsigned sequence; // of the last request
+} LOAD_CLIENT;
+
+static char value_data[LOAD_MAX_VALUE]; // what puts store, never written after startup
+
+static uint64_t load_clock_us()
+{
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000ULL + t.tv_nsec/1000;
+}
+
+static double load_uniform(pcg32_random_t * rng)
+{
+	return pcg32_random_r(rng) / 4294967296.0;
+}
+
+static void port_id(int port, K_ID id)
+{
+	// the id a node on this port gives itself
+	HASH_ENTRY tmp = {{},(char*)&port,4}; get_hash(&tmp);
+	memcpy(id,tmp.hash,sizeof(K_ID));
+}
+
+static void key_hash(int key, K_ID hash)
+{
+	char name[32]; sprintf(name,"load key %d",key);
+	HASH_ENTRY tmp = {{},name,(int)strlen(name)}; get_hash(&tmp);
+	memcpy(hash,tmp.hash,sizeof(K_ID));
+}
+
+static int node_index(LOAD_CONFIG * config, unsigned port)
+{
+	for(int i = 0; i < config->n_nodes; i++)
+		if(config->ports[i] == (int)port) return i;
+	return -1;
+}
+
+//
+//		Workload
+//
+
+static int pick_key(LOAD_CLIENT * client)
+{
+	LOAD_CONFIG * config = client->config;
+	double u = load_uniform(&client->rng);
+	int lo = 0, hi = config->n_keys-1;
+	while(lo < hi)
+	{
+		int mid = (lo+hi)/2;
+		if(config->key_cdf[mid] < u) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static int pick_size(LOAD_CLIENT * client)
+{
+	LOAD_CONFIG * config = client->config;
+	double size = config->value_size;
+	switch(config->value_model)
+	{
+		case SIZE_UNIFORM: size = 1 + load_uniform(&client->rng)*(2*config->value_size-1); break;
+		case SIZE_EXPONENTIAL: size = -config->value_size*log(1 - load_uniform(&client->rng)); break;
+	}
+	if(size < 1) size = 1;
+	if(size > LOAD_MAX_VALUE) size = LOAD_MAX_VALUE;
+	return (int)size;
+}
+
+static int pick_op(LOAD_CLIENT * client)
+{
+	double * mix = client->config->mix;
+	double u = load_uniform(&client->rng)*(mix[LOAD_PUT]+mix[LOAD_GET]+mix[LOAD_CHAT]);
+	if(u < mix[LOAD_PUT]) return LOAD_PUT;
+	if(u < mix[LOAD_PUT]+mix[LOAD_GET]) return LOAD_GET;
+	return LOAD_CHAT;
+}
+
+static void record(LATENCIES * latency, uint64_t us)
+{
+	if(latency->n == latency->max)
+		latency->us = (unsigned*) realloc(latency->us,(latency->max = latency->max ? latency->max*2 : 1024)*sizeof(unsigned));
+	latency->us[latency->n++] = (unsigned)us;
+}
+
+//
+//		Client side of the protocol
+//
+
+static CONNECTION * client_connection(LOAD_CLIENT * client, int node)
+{
+	return transport_connect(&client->transport,client->config->ports[node]);
+}
+
+static void skip_payload(CONNECTION * connection, int size, unsigned timeout)
+{
+	char tmp[4096];
+	for(int i = 0; i < size; i+=4096)
+		connection_wait(connection,tmp,size-i > 4096 ? 4096 : size-i,timeout);
+}
+
+static void client_answer(LOAD_CLIENT * client, CONNECTION * connection, GENERIC_MESSAGE * message)
+{
+	// nodes take clients for contacts and send them requests too
+	if(message->type != RPC_REQUEST) return;
+	if(message->rpc.type == FIND_NODE || message->rpc.type == FIND_VALUE)
+	{
+		// we know no one
+		GENERIC_MESSAGE none = {RPC_RESPONSE,sizeof(GENERIC_MESSAGE)};
+		none.rpc.type = FOUND_NODE;
+		none.rpc.sender = client->info;
+		none.rpc.seq = message->rpc.seq;
+		connection_send(connection,(char*)&none,sizeof(none));
+	}
+	else if(message->rpc.type == STORE)
+	{
+		// and keep nothing
+		GENERIC_MESSAGE full = {RPC_RESPONSE,sizeof(GENERIC_MESSAGE)};
+		full.rpc.type = STORED;
+		full.rpc.sender = client->info;
+		full.rpc.seq = message->rpc.seq;
+		memcpy(full.rpc.entry.hash,message->rpc.entry.hash,sizeof(K_ID));
+		full.rpc.status = STORE_FULL;
+		connection_send(connection,(char*)&full,sizeof(full));
+	}
+}
+
+static int client_receive(LOAD_CLIENT * client, CONNECTION * connection, RPC_MESSAGE * output)
+{
+	// the messages that have arrived on the connection up to the response
+	// to the request posted on it, requests among them are answered and
+	// responses to earlier ones dropped, returns 1 if it was there
+
+	unsigned seq = client->posted[connection - client->transport.connections];
+	GENERIC_MESSAGE message;
+	while(connection_wait(connection,(char*)&message,sizeof(message),0))
+	{
+		if(message.type == TEXT_MESSAGE) continue;
+		skip_payload(connection,message.rpc.data_size,client->config->timeout);
+		if(message.type != RPC_RESPONSE) { client_answer(client,connection,&message); continue; }
+		if(!seq || message.rpc.seq != seq) continue;
+
+		span_flow(SPAN_FLOW_IN,span_flow_id(message.rpc.sender.port,client->info.port,message.rpc.type,message.rpc.entry.hash));
+		*output = message.rpc;
+		return 1;
+	}
+	return 0;
+}
+
+static void client_drain(LOAD_CLIENT * client)
+{
+	// takes what the nodes sent since the last operation, pings and the
+	// replicas they store on us, so a node never waits for room in our
+	// buffers while we talk to another one. With udp one full buffer holds
+	// up every datagram behind it. Connections a response is due on are
+	// left to client_wait
+
+	RPC_MESSAGE stray;
+	for(int i = 0; i < client->transport.n_connections; i++)
+		if(!client->posted[i])
+			while(client_receive(client,&client->transport.connections[i],&stray));
+}
+
+static CONNECTION * client_post(LOAD_CLIENT * client, int node, RPC_MESSAGE * input)
+{
+	// sends one request the way post_rpc does
+
+	CONNECTION * connection = client_connection(client,node);
+	if(!connection) return NULL;
+	client->rpcs++;
+	span_flow(SPAN_FLOW_OUT,span_flow_id(client->info.port,connection->port,input->type,input->entry.hash));
+
+	GENERIC_MESSAGE message = {RPC_REQUEST,sizeof(GENERIC_MESSAGE)};
+	message.rpc = *input;
+	message.rpc.sender = client->info;
+	do message.rpc.seq = ++client->sequence; while(!message.rpc.seq); // 0 is none posted
+	client->posted[connection - client->transport.connections] = message.rpc.seq;
+	message.rpc.data_size = input->type == STORE || input->type == PUBLISH ? input->entry.size : 0;
+	if(message.rpc.data_size <= 0)
+	{
+		connection_send(connection,(char*)&message,sizeof(message));
+		return connection;
+	}
+	char * data = (char*) malloc(sizeof(message) + message.rpc.data_size);
+	memcpy(data,&message,sizeof(message));
+	memcpy(data+sizeof(message),input->entry.data,message.rpc.data_size);
+	connection_send(connection,data,sizeof(message) + message.rpc.data_size);
+	free(data);
+	return connection;
+}
+
+static int client_wait(LOAD_CLIENT * client, CONNECTION ** connections, int n, RPC_MESSAGE * outputs)
+{
+	// the responses to the requests posted on the connections, NULL ones
+	// are skipped, returns how many succeeded before the timeout. All the
+	// other connections are drained meanwhile
+
+	unsigned deadline = clock_ms() + client->config->timeout;
+	int waiting = 0, ok = 0;
+	for(int i = 0; i < n; i++)
+	{
+		outputs[i].type = FAILURE;
+		waiting += connections[i] != NULL;
+	}
+
+	while(waiting)
+	{
+		for(int i = 0; i < n; i++)
+		{
+			unsigned * posted = connections[i] ? &client->posted[connections[i] - client->transport.connections] : NULL;
+			if(!posted || !*posted) continue;
+			if(client_receive(client,connections[i],&outputs[i]) || !connections[i]->live)
+			{
+				*posted = 0;
+				waiting--;
+				ok += outputs[i].type == FOUND_VALUE || outputs[i].type == FOUND_NODE || (outputs[i].type == STORED && outputs[i].status == STORE_OK);
+			}
+		}
+		client_drain(client);
+
+		int remaining = (int)(deadline - clock_ms());
+		if(waiting && remaining > 0) transport_wait(&client->transport,remaining < LOAD_DRAIN_MS ? remaining : LOAD_DRAIN_MS);
+		else if(waiting) break;
+	}
+
+	for(int i = 0; i < n; i++)
+		if(connections[i]) client->posted[connections[i] - client->transport.connections] = 0;
+	return ok;
+}
+
+static int client_rpc(LOAD_CLIENT * client, int node, RPC_MESSAGE * input, RPC_MESSAGE * output)
+{
+	// one request and its response
+	CONNECTION * connection = client_connection(client,node);
+	if(!connection) return 0;
+	SPAN("client_rpc",rpc_names[input->type],connection->port,input->entry.hash);
+	return client_post(client,node,input) && client_wait(client,&connection,1,output);
+}
+
+typedef struct
+{
+	// the state of one lookup, see kademlia_lookup in kademlia.h
+	CONTACT * exclusion[LOAD_MAX_SEEN]; // queried already
+	int n_exclusion;
+	char answered[LOAD_MAX_SEEN];
+	int rounds, queries;
+	CONTACT seen[LOAD_MAX_SEEN]; // every node it heard of, the client's own node first
+	int n_seen;
+} LOAD_LOOKUP;
+
+static void client_found(LOAD_CLIENT * client, LOAD_LOOKUP * lookup, RPC_MESSAGE * out, CONTACT ** closest)
+{
+	// the nodes in a FOUND_NODE the lookup had not heard of
+	int n = 0;
+	for(int i = 0; i < N_CONTACTS && lookup->n_seen < LOAD_MAX_SEEN; i++)
+	{
+		if(node_index(client->config,out->closest[i].port) < 0) continue; // not a node, or another client
+
+		int known = 0;
+		for(int j = 0; j < lookup->n_seen && !known; j++) known = lookup->seen[j].port == out->closest[i].port;
+		if(known) continue;
+
+		lookup->seen[lookup->n_seen] = out->closest[i];
+		closest[n++] = &lookup->seen[lookup->n_seen++];
+	}
+}
+
+struct LOAD_RPCS
+{
+	// how kademlia_lookup reaches the nodes from a client
+
+	static void closest_contacts(LOAD_CLIENT * client, K_ID hash, CONTACT ** closest, LOAD_LOOKUP * lookup)
+	{
+		closest[0] = &lookup->seen[0];
+	}
+
+	static int find_node(LOAD_CLIENT * client, CONTACT * contact, K_ID hash, CONTACT ** closest, LOAD_LOOKUP * lookup)
+	{
+		RPC_MESSAGE in = {FIND_NODE}, out;
+		memcpy(in.entry.hash,hash,sizeof(K_ID));
+		if(!client_rpc(client,node_index(client->config,contact->port),&in,&out)) return 0;
+		client_found(client,lookup,&out,closest);
+		return 1;
+	}
+
+	static int find_value(LOAD_CLIENT * client, CONTACT * contact, HASH_ENTRY * entry, CONTACT ** closest, LOAD_LOOKUP * lookup)
+	{
+		RPC_MESSAGE in = {FIND_VALUE}, out;
+		memcpy(in.entry.hash,entry->hash,sizeof(K_ID));
+		if(!client_rpc(client,node_index(client->config,contact->port),&in,&out)) return 0;
+		if(out.type == FOUND_VALUE) entry->data = value_data; // the payload was skipped, this only marks it found
+		else client_found(client,lookup,&out,closest);
+		return 1;
+	}
+
+	static void cache_value(LOAD_CLIENT * client, CONTACT * contact, HASH_ENTRY * entry) {} // clients keep nothing
+
+	static int store_values(LOAD_CLIENT * client, CONTACT ** closest, HASH_ENTRY * entry)
+	{
+		// to all of them at once like kademlia_store_value
+		RPC_MESSAGE in = {STORE,{0},*entry};
+		CONNECTION * connections[N_CONTACTS] = {0};
+		SPAN("client_store",NULL,0,entry->hash);
+		for(int i = 0; i < N_CONTACTS && closest[i]; i++)
+			connections[i] = client_post(client,node_index(client->config,closest[i]->port),&in);
+
+		RPC_MESSAGE out[N_CONTACTS];
+		int stored = client_wait(client,connections,N_CONTACTS,out);
+		for(int i = 0; i < N_CONTACTS; i++)
+			client->refused += out[i].type == STORED && out[i].status == STORE_FULL;
+		return stored;
+	}
+};
+
+static void lookup_start(LOAD_CLIENT * client, LOAD_LOOKUP * lookup)
+{
+	// lookups start at the client's own node
+	LOAD_CONFIG * config = client->config;
+	memset(lookup,0,sizeof(LOAD_LOOKUP));
+	lookup->seen[0].port = config->ports[client->idx % config->n_nodes];
+	port_id(lookup->seen[0].port,lookup->seen[0].id);
+	lookup->n_seen = 1;
+	client->lookups++;
+}
+
+static int client_put(LOAD_CLIENT * client)
+{
+	LOAD_LOOKUP lookup;
+	CONTACT * closest[N_CONTACTS] = {0};
+	HASH_ENTRY entry = {{},value_data,pick_size(client)};
+	key_hash(pick_key(client),entry.hash);
+
+	lookup_start(client,&lookup);
+	SPAN("client_put",NULL,0,entry.hash);
+	return kademlia_store<KADEMLIA,LOAD_RPCS>(client,&entry,closest,&lookup) > 0;
+}
+
+static int client_get(LOAD_CLIENT * client)
+{
+	LOAD_LOOKUP lookup;
+	CONTACT * closest[N_CONTACTS] = {0};
+	HASH_ENTRY entry = {{}};
+	key_hash(pick_key(client),entry.hash);
+
+	client->gets++;
+	lookup_start(client,&lookup);
+	SPAN("client_lookup",rpc_names[FIND_VALUE],0,entry.hash);
+	kademlia_lookup<KADEMLIA,LOAD_RPCS>(client,(unsigned char*)NULL,&entry,closest,&lookup);
+	client->found += entry.data != NULL;
+	return entry.data || closest[0]; // a miss is only an error if no node answered
+}
+
+static int client_chat(LOAD_CLIENT * client, int count)
+{
+	LOAD_LOOKUP lookup;
+	CONTACT * roots[N_CONTACTS] = {0};
+	K_ID topic, best, distance;
+	pubsub_topic(LOAD_CHANNEL,topic);
+	lookup_start(client,&lookup);
+	{
+		SPAN("client_lookup",rpc_names[FIND_NODE],0,topic);
+		kademlia_lookup<KADEMLIA,LOAD_RPCS>(client,topic,(HASH_ENTRY*)NULL,roots,&lookup);
+	}
+
+	// closest first, the lookup does not keep them in order
+	int root = -1;
+	for(int i = 0; i < N_CONTACTS && roots[i]; i++)
+	{
+		hash_distance<K_ID_LEN>(topic,roots[i]->id,distance);
+		if(root >= 0 && !hash_lth<K_ID_LEN>(distance,best)) continue;
+		memcpy(best,distance,sizeof(K_ID));
+		root = i;
+	}
+	if(root < 0) return 0;
+
+	// the header of a copy for the root, with hops 0 and no members
+	char data[sizeof(PUBSUB_HEADER) + 64];
+	PUBSUB_HEADER header = {(uint64_t)client->info.port << 32 | (unsigned)count};
+	snprintf(header.channel,sizeof(header.channel),"%s",LOAD_CHANNEL);
+	header.origin = client->info.port;
+	header.length = snprintf(data + sizeof(header),sizeof(data) - sizeof(header),"load client %d message %d",client->idx,count);
+	memcpy(data,&header,sizeof(header));
+
+	RPC_MESSAGE in = {PUBLISH};
+	memcpy(in.entry.hash,topic,sizeof(K_ID));
+	in.entry.data = data;
+	in.entry.size = sizeof(header) + header.length;
+	CONNECTION * connection = client_post(client,node_index(client->config,roots[root]->port),&in);
+	if(!connection) return 0;
+	client->posted[connection - client->transport.connections] = 0; // nothing answers a PUBLISH
+	return connection->live;
+}
+
+static void * client_thread(void * data)
+{
+	LOAD_CLIENT * client = (LOAD_CLIENT*) data;
+	span_thread_name("client %d",client->info.port);
+	uint64_t end = load_clock_us() + (uint64_t)(client->config->duration*1e6);
+
+	for(int count = 0;; count++)
+	{
+		client_drain(client);
+		uint64_t start = load_clock_us();
+		if(start >= end) break;
+
+		int op = pick_op(client), ok = 0;
+		switch(op)
+		{
+			case LOAD_PUT: ok = client_put(client); break;
+			case LOAD_GET: ok = client_get(client); break;
+			case LOAD_CHAT: ok = client_chat(client,count); break;
+		}
+		if(ok) record(&client->latency[op],load_clock_us() - start);
+		else client->errors[op]++;
+	}
+	return NULL;
+}
+
+//
+//		Report
+//
+
+static int compare_unsigned(const void * a, const void * b)
+{
+	unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_ms(unsigned * sorted, int n, double p)
+{
+	if(n == 0) return 0;
+	int i = (int)ceil(p/100*n) - 1;
+	return sorted[i < 0 ? 0 : i]/1000.0;
+}
+
+static void load_report(LOAD_CONFIG * config, LOAD_CLIENT * clients, double elapsed)
+{
+	const char * names[N_LOAD_OPS] = {"put", "get", "chat"};
+	int total = 0, errors = 0, lookups = 0, rpcs = 0, gets = 0, found = 0, refused = 0;
+
+	printf("\n%-6s %8s %9s %9s %9s %9s %9s %7s\n", "", "count", "ops/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "errors");
+	for(int op = 0; op < N_LOAD_OPS; op++)
+	{
+		LATENCIES all = {0};
+		int op_errors = 0;
+		for(int i = 0; i < config->n_clients; i++)
+		{
+			for(int j = 0; j < clients[i].latency[op].n; j++) record(&all,clients[i].latency[op].us[j]);
+			op_errors += clients[i].errors[op];
+		}
+		qsort(all.us,all.n,sizeof(unsigned),compare_unsigned);
+
+		printf("%-6s %8d %9.1f %9.2f %9.2f %9.2f %9.2f %7d\n", names[op], all.n, all.n/elapsed,
+			percentile_ms(all.us,all.n,50), percentile_ms(all.us,all.n,90), percentile_ms(all.us,all.n,99),
+			percentile_ms(all.us,all.n,100), op_errors);
+		total += all.n;
+		errors += op_errors;
+		free(all.us);
+	}
+	for(int i = 0; i < config->n_clients; i++)
+	{
+		lookups += clients[i].lookups;
+		rpcs += clients[i].rpcs;
+		gets += clients[i].gets;
+		found += clients[i].found;
+		refused += clients[i].refused;
+	}
+	printf("%-6s %8d %9.1f %47d\n", "total", total, total/elapsed, errors);
+	printf("gets found %d of %d (%.1f%%), %.2f rpcs per lookup\n", found, gets,
+		gets ? 100.0*found/gets : 0, lookups ? (double)rpcs/lookups : 0);
+	if(refused) printf("%d stores refused by full nodes\n", refused);
+}
+
+int load_main(int argc, char * argv[])
+{
+	static LOAD_CONFIG config = {16, 10, {1, 8, 1}, 1000, 0.99, 256, SIZE_CONSTANT, 2000, 1};
+
+	log_level = LOG_WARN; // the report is what matters here
+
+	int i = 0;
+	if(argc > 0) config.first_port = atoi(argv[i++]);
+	for(; i < argc && !strchr(argv[i],'=') && config.n_nodes < LOAD_MAX_NODES; i++)
+		config.ports[config.n_nodes++] = atoi(argv[i]);
+
+	for(; i < argc; i++)
+	{
+		char name[32];
+		if(sscanf(argv[i],"clients=%d",&config.n_clients)==1) continue;
+		if(sscanf(argv[i],"duration=%lf",&config.duration)==1) continue;
+		if(sscanf(argv[i],"put=%lf",&config.mix[LOAD_PUT])==1) continue;
+		if(sscanf(argv[i],"get=%lf",&config.mix[LOAD_GET])==1) continue;
+		if(sscanf(argv[i],"chat=%lf",&config.mix[LOAD_CHAT])==1) continue;
+		if(sscanf(argv[i],"keys=%d",&config.n_keys)==1) continue;
+		if(sscanf(argv[i],"zipf=%lf",&config.zipf)==1) continue;
+		if(sscanf(argv[i],"value=%d",&config.value_size)==1) continue;
+		if(sscanf(argv[i],"timeout=%u",&config.timeout)==1) continue;
+		if(sscanf(argv[i],"seed=%u",&config.seed)==1) continue;
+		if(sscanf(argv[i],"cluster=%d",&config.cluster)==1) continue;
+		if(sscanf(argv[i],"metrics=%d",&config.metrics_port)==1) continue;
+		if(sscanf(argv[i],"snapshot=%255s",config.snapshot)==1) continue;
+		if(sscanf(argv[i],"spans=%255s",config.spans)==1) continue;
+		if(strncmp(argv[i],"quota=",6)==0 && parse_bytes(argv[i]+6,&config.quota)) continue;
+		if(sscanf(argv[i],"log=%31s",name)==1 && log_level_named(name) >= 0)
+			{ log_level = log_level_named(name); continue; }
+		if(sscanf(argv[i],"transport=%31s",name)==1 && transport_type(name) >= 0)
+			{ config.transport = transport_type(name); continue; }
+		if(sscanf(argv[i],"values=%31s",name)==1)
+		{
+			if(strcmp(name,"constant")==0) { config.value_model = SIZE_CONSTANT; continue; }
+			if(strcmp(name,"uniform")==0) { config.value_model = SIZE_UNIFORM; continue; }
+			if(strcmp(name,"exponential")==0) { config.value_model = SIZE_EXPONENTIAL; continue; }
+		}
+
+		printf("unknown option: %s\n", argv[i]);
+		config.n_nodes = 0;
+		break;
+	}
+	if(config.first_port <= 0 || config.n_nodes == 0)
+	{
+		printf("usage: main load <first client port> <node port>... [name=value...]\n");
+		printf("options: clients duration (seconds) put get chat (weights of the mix) keys zipf (0 for uniform)\n");
+		printf("         value (mean bytes) values=constant|uniform|exponential timeout (ms per rpc) seed\n");
+		printf("         transport=tcp|udp|inproc cluster (nodes to run in this process from the node port up)\n");
+		printf("         metrics (http port serving the cluster's metrics) snapshot (files <prefix>.<port> of the cluster's nodes)\n");
+		printf("         log=error|warn|info|debug|trace (warn by default) spans (file for a Chrome trace of the run)\n");
+		return 1;
+	}
+	if(config.n_clients < 1 || config.n_clients > LOAD_MAX_CLIENTS || config.n_keys < 1 || config.duration <= 0
+		|| config.mix[LOAD_PUT] + config.mix[LOAD_GET] + config.mix[LOAD_CHAT] <= 0)
+		{ printf("need 1 to %d clients, a key, a duration and a mix above 0\n", LOAD_MAX_CLIENTS); return 1; }
+	for(int j = 0; j < config.n_nodes; j++)
+	if(config.ports[j] >= config.first_port && config.ports[j] < config.first_port + config.n_clients)
+		{ printf("client ports %d to %d overlap node port %d\n", config.first_port, config.first_port+config.n_clients-1, config.ports[j]); return 1; }
+	if(config.cluster > 0)
+	{
+		if(config.cluster > LOAD_MAX_NODES) { printf("at most %d nodes\n", LOAD_MAX_NODES); return 1; }
+		for(config.n_nodes = 0; config.n_nodes < config.cluster; config.n_nodes++)
+			config.ports[config.n_nodes] = config.ports[0] + config.n_nodes;
+	}
+	else if(config.transport == TRANSPORT_INPROC) { printf("transport=inproc needs cluster=\n"); return 1; }
+	if(config.n_clients + config.n_nodes > MAX_CONNECTIONS)
+		printf("warning: nodes only take %d connections, some clients will time out\n", MAX_CONNECTIONS);
+
+	config.key_cdf = (double*) malloc(config.n_keys*sizeof(double));
+	double sum = 0;
+	for(int k = 0; k < config.n_keys; k++) config.key_cdf[k] = sum += pow(k+1,-config.zipf);
+	for(int k = 0; k < config.n_keys; k++) config.key_cdf[k] /= sum;
+
+	for(int j = 0; j < LOAD_MAX_VALUE; j++) value_data[j] = 'a' + j%26;
+
+	WSADATA data;
+	WSAStartup(MAKEWORD(2,0), &data);
+	log_start();
+	span_enabled = config.spans[0] != 0;
+
+	CLUSTER cluster;
+	if(config.cluster > 0 && !cluster_start(&cluster,config.n_nodes,config.ports[0],config.transport,config.quota)) { log_stop(); return 1; }
+
+	METRICS * metrics[LOAD_MAX_NODES];
+	METRICS_SERVER metrics_server = {0};
+	for(int j = 0; config.cluster > 0 && j < config.n_nodes; j++) metrics[j] = cluster.nodes[j].metrics;
+	if(config.cluster > 0 && config.metrics_port && !metrics_serve(&metrics_server,config.metrics_port,metrics,config.n_nodes,rpc_names))
+		printf("Could not serve metrics on port %d\n", config.metrics_port);
+
+	LOAD_CLIENT * clients = (LOAD_CLIENT*) calloc(config.n_clients,sizeof(LOAD_CLIENT));
+	for(int j = 0; j < config.n_clients; j++)
+	if(!transport_create(&clients[j].transport,config.transport,config.first_port + j,config.n_nodes))
+	{
+		printf("Could not use %s port %d\n", transport_name(config.transport), config.first_port + j);
+		return 1;
+	}
+
+	uint64_t start = load_clock_us();
+	for(int j = 0; j < config.n_clients; j++)
+	{
+		LOAD_CLIENT * client = &clients[j];
+		client->config = &config;
+		client->idx = j;
+		client->info.port = config.first_port + j;
+		port_id(client->info.port,client->info.id);
+		client->rng.state = config.seed;
+		client->rng.inc = 2*j+1;
+		pthread_create(&client->thread,NULL,client_thread,client);
+	}
+	for(int j = 0; j < config.n_clients; j++) pthread_join(clients[j].thread,NULL);
+	double elapsed = (load_clock_us() - start)/1e6;
+
+	if(config.spans[0])
+	{
+		span_enabled = 0;
+		int n = span_write(config.spans,config.first_port,"main load");
+		if(n < 0) printf("Could not write %s\n", config.spans);
+		else printf("%d spans written to %s\n", n, config.spans);
+	}
+
+	if(config.cluster > 0 && config.snapshot[0])
+	{
+		// taken by the node threads while they keep serving
+		static char paths[LOAD_MAX_NODES][sizeof(config.snapshot)+8];
+		for(int j = 0; j < config.n_nodes; j++)
+		{
+			snprintf(paths[j],sizeof(paths[j]),"%s.%d",config.snapshot,config.ports[j]);
+			cluster.nodes[j].snapshot_request = paths[j];
+		}
+		for(int j = 0; j < config.n_nodes; j++)
+			while(cluster.nodes[j].snapshot_request.load()) Sleep(1);
+		printf("Snapshots of the nodes go to %s.<port>\n", config.snapshot);
+	}
+
+	// the nodes go first, they may still send to the clients
+	metrics_stop(&metrics_server);
+	if(config.cluster > 0) cluster_stop(&cluster);
+	for(int j = 0; j < config.n_clients; j++) transport_close(&clients[j].transport);
+	log_stop();
+
+	printf("\n%d %s clients on %d nodes for %.1fs, mix %g:%g:%g, %d keys zipf %g, %d byte values\n",
+		config.n_clients, transport_name(config.transport), config.n_nodes, elapsed, config.mix[LOAD_PUT], config.mix[LOAD_GET], config.mix[LOAD_CHAT],
+		config.n_keys, config.zipf, config.value_size);
+	load_report(&config,clients,elapsed);
+
+	for(int j = 0; j < config.n_clients; j++)
+	for(int op = 0; op < N_LOAD_OPS; op++)
+		free(clients[j].latency[op].us);
+	free(clients);
+	free(config.key_cdf);
+	WSACleanup();
+	return 0;
+}
@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "log.h"
+
+//
+//		Records
+//
+// A record keeps the format pointer and the arguments as they were passed,
+// integers widened to 64 bits, doubles as doubles and strings copied in
+// with their terminator. Nothing is formatted until the sink prints it.
+//
+
+#define LOG_RING_SIZE 512 // records per thread, a power of two
+#define LOG_ARGS_SIZE 232 // bytes of arguments a record holds, longer strings are cut
+#define LOG_LINE_SIZE 1024
+#define LOG_DRAIN_MS 10
+
+int log_level = LOG_INFO;
+
+typedef struct
+{
+	const char * format;
+	uint32_t time_ms; // since the first record
+	uint8_t level;
+	uint8_t truncated; // the arguments did not all fit
+	uint16_t size;     // bytes of args used
+	char args[LOG_ARGS_SIZE];
+} LOG_RECORD;
+
+typedef struct
+{
+	int length;   // of the conversion, from the % on
+	int modifier; // offset of the length modifier
+	int stars;    // * widths and precisions, each an int argument
+	int precision; // given in the format, -1 for none
+	int star_precision; // the precision is the last * argument
+	char type;
+} LOG_SPEC;
+
+static int log_spec(const char * f, LOG_SPEC * spec)
+{
+	// parses the conversion f starts with, returns 0 for %%
+
+	int i = 1;
+	spec->stars = 0;
+	spec->precision = -1;
+	spec->star_precision = 0;
+	while(f[i] && strchr("-+ #0",f[i])) i++;
+	if(f[i] == '*') { spec->stars++; i++; }
+	else while(f[i] >= '0' && f[i] <= '9') i++;
+	if(f[i] == '.')
+	{
+		i++;
+		if(f[i] == '*') { spec->stars++; spec->star_precision = 1; i++; }
+		else for(spec->precision = 0; f[i] >= '0' && f[i] <= '9'; i++) spec->precision = spec->precision*10 + f[i]-'0';
+	}
+	spec->modifier = i;
+	while(f[i] && strchr("hlLqjzt",f[i])) i++;
+	spec->type = f[i];
+	spec->length = f[i] ? i+1 : i;
+	return spec->type != '%';
+}
+
+static int log_put(LOG_RECORD * record, const void * data, int size)
+{
+	if(record->size + size > LOG_ARGS_SIZE) { record->truncated = 1; return 0; }
+	memcpy(record->args + record->size,data,size);
+	record->size += size;
+	return 1;
+}
+
+static void log_encode(LOG_RECORD * record, const char * f, va_list args)
+{
+	record->size = 0;
+	record->truncated = 0;
+
+	while(*f)
+	{
+		if(*f++ != '%') continue;
+		LOG_SPEC spec;
+		int more = log_spec(f-1,&spec);
+		f += spec.length-1;
+		if(!more) continue;
+
+		int star = -1;
+		for(int i = 0; i < spec.stars; i++)
+		{
+			star = va_arg(args,int);
+			if(!log_put(record,&star,sizeof(int))) return;
+		}
+
+		const char * m = f - spec.length + spec.modifier; // length modifier
+		int longs = 0;
+		for(; *m != spec.type; m++) longs += *m == 'l' ? 1 : *m == 'q' || *m == 'L' ? 2 : *m == 'j' || *m == 'z' || *m == 't' ? 3 : 0;
+
+		switch(spec.type)
+		{
+			case 'd': case 'i':
+			{
+				int64_t value = longs == 0 ? va_arg(args,int) : longs == 1 ? va_arg(args,long) :
+					longs == 3 ? (int64_t)va_arg(args,ptrdiff_t) : va_arg(args,long long);
+				if(!log_put(record,&value,sizeof(value))) return;
+				break;
+			}
+			case 'u': case 'o': case 'x': case 'X': case 'c':
+			{
+				uint64_t value = longs == 0 ? va_arg(args,unsigned) : longs == 1 ? va_arg(args,unsigned long) :
+					longs == 3 ? (uint64_t)va_arg(args,size_t) : va_arg(args,unsigned long long);
+				if(!log_put(record,&value,sizeof(value))) return;
+				break;
+			}
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			{
+				double value = longs == 2 ? (double)va_arg(args,long double) : va_arg(args,double);
+				if(!log_put(record,&value,sizeof(value))) return;
+				break;
+			}
+			case 'p':
+			{
+				uint64_t value = (uintptr_t)va_arg(args,void*);
+				if(!log_put(record,&value,sizeof(value))) return;
+				break;
+			}
+			case 's':
+			{
+				const char * s = va_arg(args,const char*);
+				if(!s) s = "(null)";
+				int max = spec.precision >= 0 ? spec.precision : spec.star_precision && star >= 0 ? star : 1<<30;
+				int n = 0, room = LOG_ARGS_SIZE - record->size - 1;
+				if(room < 0) { record->truncated = 1; return; }
+				while(n < max && n < room && s[n]) n++;
+				if(n == room && n < max && s[n]) record->truncated = 1;
+				memcpy(record->args + record->size,s,n);
+				record->args[record->size + n] = '\0';
+				record->size += n+1;
+				if(record->truncated) return;
+				break;
+			}
+			default: return; // %n or not a conversion
+		}
+	}
+}
+
+static void log_format(LOG_RECORD * record, char * out, int room)
+{
+	// the formatted message, cut to room
+
+	const char * f = record->format;
+	int n = 0, at = 0;
+	while(*f && n < room-1)
+	{
+		if(*f != '%') { out[n++] = *f++; continue; }
+		LOG_SPEC spec;
+		if(!log_spec(f,&spec)) { out[n++] = '%'; f += spec.length; continue; }
+
+		// the conversion with the length modifier replaced by ours
+		char conversion[32];
+		if(spec.modifier > 24) break;
+		memcpy(conversion,f,spec.modifier);
+		int c = spec.modifier;
+		if(strchr("diuoxX",spec.type)) { conversion[c++] = 'l'; conversion[c++] = 'l'; }
+		conversion[c++] = spec.type;
+		conversion[c] = '\0';
+		f += spec.length;
+
+		if(at >= record->size) break; // cut off when it was recorded
+		int star[2] = {0};
+		for(int i = 0; i < spec.stars; i++) { memcpy(&star[i],record->args + at,sizeof(int)); at += sizeof(int); }
+
+		#define LOG_PRINT(value) (spec.stars == 0 ? snprintf(out+n,room-n,conversion,value) : \
+			spec.stars == 1 ? snprintf(out+n,room-n,conversion,star[0],value) : \
+			snprintf(out+n,room-n,conversion,star[0],star[1],value))
+
+		int written = 0;
+		switch(spec.type)
+		{
+			case 'd': case 'i':
+			{
+				long long value; memcpy(&value,record->args + at,sizeof(value)); at += sizeof(value);
+				written = LOG_PRINT(value);
+				break;
+			}
+			case 'u': case 'o': case 'x': case 'X': case 'c':
+			{
+				unsigned long long value; memcpy(&value,record->args + at,sizeof(value)); at += sizeof(value);
+				written = spec.type == 'c' ? LOG_PRINT((int)value) : LOG_PRINT(value);
+				break;
+			}
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			{
+				double value; memcpy(&value,record->args + at,sizeof(value)); at += sizeof(value);
+				written = LOG_PRINT(value);
+				break;
+			}
+			case 'p':
+			{
+				uint64_t value; memcpy(&value,record->args + at,sizeof(value)); at += sizeof(value);
+				written = LOG_PRINT((void*)(uintptr_t)value);
+				break;
+			}
+			case 's':
+			{
+				const char * value = record->args + at; at += strlen(value)+1;
+				written = LOG_PRINT(value);
+				break;
+			}
+		}
+		#undef LOG_PRINT
+		if(written < 0) break;
+		n += written < room-1-n ? written : room-1-n;
+	}
+	if(record->truncated && n + 4 < room) { memcpy(out+n,"...",3); n += 3; }
+	out[n] = '\0';
+}
+
+//
+//		Rings
+//
+// Each thread writes into its own ring and only the sink reads from it, so
+// neither side locks. A ring is handed to a new thread once the thread
+// that had it exited and the sink has printed what was left in it. Rings
+// are never freed.
+//
+
+enum LOG_RING_STATES { RING_FREE, RING_OWNED, RING_EXITED };
+
+typedef struct LOG_RING_t
+{
+	LOG_RECORD records[LOG_RING_SIZE];
+	std::atomic<unsigned> head; // next record the owner writes
+	std::atomic<unsigned> tail; // next record the sink prints
+	std::atomic<unsigned> dropped;
+	std::atomic<int> state;
+	unsigned reported; // drops the sink has reported
+	int thread; // shown in the output
+	struct LOG_RING_t * next;
+} LOG_RING;
+
+static std::atomic<LOG_RING*> log_rings(NULL);
+static std::atomic<int> log_threads(0);
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static struct timespec log_epoch;
+
+static pthread_t log_thread;
+static sem_t log_wake;
+static volatile int log_running = 0, log_stopping = 0;
+
+static void log_exit(void * data)
+{
+	((LOG_RING*)data)->state.store(RING_EXITED,std::memory_order_release);
+}
+
+static void log_init()
+{
+	pthread_key_create(&log_key,log_exit);
+	clock_gettime(CLOCK_MONOTONIC,&log_epoch);
+}
+
+static uint32_t log_clock()
+{
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+	return (t.tv_sec - log_epoch.tv_sec)*1000 + (t.tv_nsec - log_epoch.tv_nsec)/1000000;
+}
+
+static LOG_RING * log_ring()
+{
+	// the ring of this thread
+
+	pthread_once(&log_once,log_init);
+	LOG_RING * ring = (LOG_RING*) pthread_getspecific(log_key);
+	if(ring) return ring;
+
+	for(ring = log_rings.load(); ring; ring = ring->next)
+	{
+		int state = RING_FREE;
+		if(ring->state.compare_exchange_strong(state,RING_OWNED)) break;
+	}
+	if(!ring)
+	{
+		ring = (LOG_RING*) calloc(1,sizeof(LOG_RING));
+		ring->state.store(RING_OWNED);
+		ring->next = log_rings.load();
+		while(!log_rings.compare_exchange_weak(ring->next,ring));
+	}
+	ring->thread = log_threads++;
+	pthread_setspecific(log_key,ring);
+	return ring;
+}
+
+static void log_print(int thread, LOG_RECORD * record)
+{
+	char line[LOG_LINE_SIZE];
+	log_format(record,line,sizeof(line));
+	printf("%8.3f %-5s %2d %s\n", record->time_ms/1000.0, log_level_name(record->level), thread, line);
+}
+
+void log_write(int level, const char * format, ...)
+{
+	LOG_RING * ring = log_ring();
+	LOG_RECORD unqueued, * record = &unqueued;
+	int queued = log_running;
+	unsigned head = 0;
+
+	if(queued)
+	{
+		head = ring->head.load(std::memory_order_relaxed);
+		if(head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE)
+		{
+			ring->dropped.fetch_add(1,std::memory_order_relaxed);
+			return;
+		}
+		record = &ring->records[head % LOG_RING_SIZE];
+	}
+
+	record->format = format;
+	record->level = level;
+	record->time_ms = log_clock();
+	va_list args;
+	va_start(args,format);
+	log_encode(record,format,args);
+	va_end(args);
+
+	if(queued) ring->head.store(head+1,std::memory_order_release);
+	else log_print(ring->thread,record);
+}
+
+//
+//		Sink
+//
+
+static int log_drain()
+{
+	// prints what is in the rings, oldest first, returns how many
+
+	int printed = 0;
+	for(;;)
+	{
+		LOG_RING * oldest = NULL;
+		LOG_RECORD * record = NULL;
+		for(LOG_RING * ring = log_rings.load(); ring; ring = ring->next)
+		{
+			unsigned tail = ring->tail.load(std::memory_order_relaxed);
+			if(tail == ring->head.load(std::memory_order_acquire)) continue;
+			LOG_RECORD * next = &ring->records[tail % LOG_RING_SIZE];
+			if(!record || next->time_ms < record->time_ms) { oldest = ring; record = next; }
+		}
+		if(!record) break;
+
+		log_print(oldest->thread,record);
+		oldest->tail.store(oldest->tail.load(std::memory_order_relaxed)+1,std::memory_order_release);
+		printed++;
+	}
+
+	for(LOG_RING * ring = log_rings.load(); ring; ring = ring->next)
+	{
+		unsigned dropped = ring->dropped.load(std::memory_order_relaxed);
+		if(dropped != ring->reported)
+		{
+			printf("%8.3f %-5s %2d dropped %u records, the log ring was full\n", log_clock()/1000.0,
+				log_level_name(LOG_WARN), ring->thread, dropped - ring->reported);
+			ring->reported = dropped;
+			printed++;
+		}
+		int state = RING_EXITED;
+		if(ring->tail.load() == ring->head.load()) ring->state.compare_exchange_strong(state,RING_FREE);
+	}
+	return printed;
+}
+
+static void * log_sink(void * data)
+{
+	while(!log_stopping)
+	{
+		if(log_drain()) fflush(stdout);
+
+		struct timespec deadline; clock_gettime(CLOCK_REALTIME,&deadline);
+		deadline.tv_nsec += LOG_DRAIN_MS*1000000;
+		if(deadline.tv_nsec >= 1000000000) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000; }
+		sem_timedwait(&log_wake,&deadline);
+	}
+	log_drain();
+	fflush(stdout);
+	return NULL;
+}
+
+void log_start()
+{
+	if(log_running) return;
+	pthread_once(&log_once,log_init);
+	sem_init(&log_wake,0,0);
+	log_stopping = 0;
+	log_running = 1;
+	pthread_create(&log_thread,NULL,log_sink,NULL);
+}
+
+void log_stop()
+{
+	// records written by other threads while this runs may be lost
+	if(!log_running) return;
+	log_stopping = 1;
+	sem_post(&log_wake);
+	pthread_join(log_thread,NULL);
+	log_running = 0;
+	log_drain();
+	fflush(stdout);
+	sem_destroy(&log_wake);
+}
+
+int log_level_named(const char * name)
+{
+	for(int level = LOG_ERROR; level <= LOG_TRACE; level++)
+		if(strcmp(name,log_level_name(level))==0) return level;
+	return -1;
+}
+
+const char * log_level_name(int level)
+{
+	switch(level)
+	{
+		case LOG_ERROR: return "error";
+		case LOG_WARN: return "warn";
+		case LOG_INFO: return "info";
+		case LOG_DEBUG: return "debug";
+		case LOG_TRACE: return "trace";
+	}
+	return "?";
+}
@@ -0,0 +1,38 @@
+#ifndef LOG_H
+#define LOG_H
+
+//
+//		Logging
+//
+// log_error .. log_trace take printf style arguments and write one line.
+// A call above LOG_COMPILE_LEVEL compiles to nothing, one above log_level
+// costs a compare and does not evaluate its arguments. Anything else is
+// copied unformatted, the format pointer and the raw arguments, into a
+// ring owned by the calling thread, and a background thread started by
+// log_start formats and prints it. Formats must be string literals, the
+// strings passed for %s are copied. A full ring drops records and the
+// sink reports how many.
+//
+
+enum LOG_LEVELS { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_TRACE };
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG // build with -DLOG_COMPILE_LEVEL=4 for trace records
+#endif
+
+extern int log_level; // LOG_INFO unless changed
+
+#define LOG_AT(level, ...) do { if((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) log_write((level), __VA_ARGS__); } while(0)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LOG_TRACE, __VA_ARGS__)
+
+void log_write(int level, const char * format, ...);
+void log_start(); // until then records are printed by the thread writing them
+void log_stop();  // prints what is left, call before exiting
+int log_level_named(const char * name); // -1 if not a level
+const char * log_level_name(int level);
+
+#endif
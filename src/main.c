@@ -1,267 +1,197 @@
 #include <stdlib.h>
 #include <stdio.h>
-
-#include <conio.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "dht.h"
 #include "connection.h"
-	
-pthread_t server_thread;
-
-CONNECTION connections[MAX_CONNECTIONS];
-WSADATA WSAData;
-
-void * client_socket_thread(void* data)
-{
-	CONNECTION * connection = (CONNECTION*)data;
- 	
-	sem_post( &connection->mutex );
-	for(;;)
-	{
-		sem_wait( &connection->mutex );
+#include "chatlog.h"
+#include "bots.h"
 
-		if(connection->buffer[0]=='\0')
-		{
-			sem_post( &connection->mutex );
-			
-			int n = 0; char tmp[SOCKET_BUFFER_SIZE];
+int load_main(int argc, char * argv[]); // load.c
 
-			n = recv(connection->socket, tmp, sizeof(tmp), 0);
-			
-			if(n<=0) break;
-			
-			//printf("received: %s\n",tmp);
-			sem_wait( &connection->mutex );
-			connection->size = n;
-			if(connection->live==0)
-			{
-				sem_post( &connection->mutex );
-				break;
-			}
-			memcpy(connection->buffer,tmp,sizeof(tmp));
-			
-		}
-		
-		sem_post( &connection->mutex );
-	}
-	
+#define LOBBY "lobby" // the channel of every node, lines go there until one is joined
+#define INPUT_LINES 16 // typed ahead of the main loop
 	
-	sem_wait( &connection->mutex );
-	printf("CLOSING CONNECTION\n");
-	connection->live = 0;
-	connection->size = 0;
-	connection->buffer[0]='\0';
-	closesocket(connection->socket);
-	sem_post( &connection->mutex );
-}
+WSADATA WSAData;
 
+//
+//		Input
+//
+// Lines are read on their own thread, so the node goes on serving its
+// peers while the user types. The main loop takes them off the queue one
+// at a time between polls, and the input thread wakes it up through the
+// transport's arrived semaphore.
+//
 
-void * server_socket_thread(void * data)
+typedef struct
 {
-	int port = *(int*)data;
-	SOCKET server, client;
- 
-	SOCKADDR_IN serverAddr, clientAddr;
- 
-	server = socket(AF_INET, SOCK_STREAM, 0);
- 
-	serverAddr.sin_addr.s_addr = INADDR_ANY;
-	serverAddr.sin_family = AF_INET;
-	serverAddr.sin_port = htons(port);
- 
-	bind(server, (SOCKADDR *)&serverAddr, sizeof(serverAddr));
-	listen(server, 0);
-
-	int clientAddrSize = sizeof(clientAddr);
-	for(;;)
-	if((client = accept(server, (SOCKADDR *)&clientAddr, &clientAddrSize)) != INVALID_SOCKET)
-	{	
-		int port = 0;
-		recv(client,(char*)&port,sizeof(int),0);
+	char lines[INPUT_LINES][sizeof(((GENERIC_MESSAGE*)0)->buffer)];
+	int first, n;
+	sem_t mutex;
+	sem_t room; // posted when a line is taken
+	TRANSPORT * transport; // woken up when a line is added, NULL once stopped
+	pthread_t thread;
+} INPUT_QUEUE;
 
-		if(port>0)
-		for(int i = 0; i < MAX_CONNECTIONS; i++)
-		{
-			sem_wait(&connections[i].mutex);
-			if( connections[i].live == 0)
-			{
-				printf("Received connection on port %d %d!\n",port,ntohs(clientAddr.sin_port));
-				connections[i].socket = client;
-				connections[i].addr = clientAddr;
-				connections[i].live = 1;
-				connections[i].port = port;// ntohs(clientAddr.sin_port);
-				
-				pthread_create(&connections[i].thread, NULL, client_socket_thread, &connections[i]);
-				// thread will post
-				break;
-			}
-			sem_post(&connections[i].mutex);
-		}
-
-	}	
-}
+static INPUT_QUEUE input; // the thread may still be in fgets at exit
+static BOTS bots;
 
-void connection_send(CONNECTION * connection, char * data, int size)
+static void * input_thread(void * data)
 {
-	sem_wait( &connection->mutex );
-	if(connection->live)
+	char line[sizeof(input.lines[0])];
+	while(fgets(line,sizeof(line),stdin))
 	{
-		sem_post( &connection->mutex );
-		send(connection->socket,data,size,0);
+		line[strcspn(line,"\r\n")] = '\0';
+		sem_wait( &input.room );
+		sem_wait( &input.mutex );
+		strcpy(input.lines[(input.first + input.n++) % INPUT_LINES],line);
+		if(input.transport) sem_post( &input.transport->arrived );
+		sem_post( &input.mutex );
 	}
-	else sem_post( &connection->mutex );
+	return NULL; // the node goes on serving without a terminal
 }
 
-void connection_read(CONNECTION * connection, char * data, int size)
+static void input_start(TRANSPORT * transport)
 {
-	sem_wait( &connection->mutex );
-	if(connection->live)
-	{
-		if(connection->buffer[0]=='\0') memset(data,0,size);
-		else
-		{
-			memcpy(data,connection->buffer,size);
-			connection->buffer[0] = '\0';
-		}
-	}
-	else memset(data,0,size);
-	sem_post( &connection->mutex );
+	sem_init( &input.mutex, 0, 1 );
+	sem_init( &input.room, 0, INPUT_LINES );
+	input.transport = transport;
+	pthread_create(&input.thread,NULL,input_thread,NULL);
+	pthread_detach(input.thread);
 }
 
-CONNECTION * ping(int server_port, int port)
+static int input_take(char * line)
 {
-	if(server_port == port) return NULL;
-	for(int i = 0; i < MAX_CONNECTIONS; i++)
+	// 0 if no line is waiting
+	sem_wait( &input.mutex );
+	int n = input.n;
+	if(n)
 	{
-		sem_wait(&connections[i].mutex);
-		if(connections[i].live)
-		if(connections[i].port==port)
-		{
-			sem_post(&connections[i].mutex);
-			return &connections[i];
-		}
-		sem_post(&connections[i].mutex);
+		strcpy(line,input.lines[input.first]);
+		input.first = (input.first + 1) % INPUT_LINES;
+		input.n--;
 	}
-	
-	for(int i = 0; i < MAX_CONNECTIONS; i++)
-	{
-		sem_wait(&connections[i].mutex);
-		if(connections[i].live==0)
-		{
-			SOCKET server;
-			SOCKADDR_IN addr;
+	sem_post( &input.mutex );
+	if(n) sem_post( &input.room );
+	return n > 0;
+}
 
-			server = socket(AF_INET, SOCK_STREAM, 0);
-		 
-			addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-			addr.sin_family = AF_INET;
-			addr.sin_port = htons(port);
-			printf("Connecting to %d\n", htons(port));
-		 
-			int r = connect(server, (SOCKADDR *)&addr, sizeof(addr));
-			send(server,(char*)&server_port,sizeof(int),0);
-			
-			if(r) { printf("ERROR!\n"); sem_post(&connections[i].mutex); break; }
-			else printf( "Connected to server!\n");
-			
-			connections[i].port = port;
-			connections[i].socket = server;
-			connections[i].addr = addr;
-			connections[i].live = 1;
-			connections[i].size = 0;
-			
-			pthread_create(&connections[i].thread, NULL, client_socket_thread, &connections[i]);
-			
-			return &connections[i];
-		}
-		sem_post(&connections[i].mutex);
-	}
-	
-	return NULL;
+static void input_stop()
+{
+	sem_wait( &input.mutex );
+	input.transport = NULL;
+	sem_post( &input.mutex );
 }
 
 int main(int argc, char **argv) 
 {
+	if(argc > 1 && strcmp(argv[1],"load")==0)
+		return load_main(argc-2,argv+2);
+	
 	if(argc < 2)
 	{
 		printf("Please supply a port number.\n");
+		printf("usage: main <port> [bootstrap port, 0 for none] [rpc trace file] [transport=tcp|udp] [log=error|warn|info|debug|trace]\n");
+		printf("       [metrics=<http port for Prometheus>] [spans=<Chrome trace written at exit>] [quota=<bytes, k, m or g>]\n");
+		printf("       [chat=<file keeping what was seen of the chat logs>] [cache=<bytes of looked up values kept>]\n");
+		printf("       [bots=<channel the built in bots answer in>]\n");
+		printf("       main load <first client port> <node port>... [name=value...]\n");
 		return 0;
 	}
 	
-	int server_port = atoi(argv[1]);
+	int server_port = atoi(argv[1]), bootstrap_port = 0, type = TRANSPORT_TCP, metrics_port = 0;
+	const char * trace_path = NULL, * span_path = NULL, * chat_path = NULL, * bots_channel = NULL;
+	size_t quota = STORE_DEFAULT_QUOTA, cache = CACHE_DEFAULT_BYTES;
 	
-	WSAStartup(MAKEWORD(2,0), &WSAData);
+	for(int i = 2, n = 0; i < argc; i++)
+	{
+		char name[32];
+		if(sscanf(argv[i],"transport=%31s",name)==1 && transport_type(name) >= 0) type = transport_type(name);
+		else if(sscanf(argv[i],"log=%31s",name)==1 && log_level_named(name) >= 0) log_level = log_level_named(name);
+		else if(sscanf(argv[i],"metrics=%d",&metrics_port)==1);
+		else if(strncmp(argv[i],"spans=",6)==0) span_path = argv[i]+6;
+		else if(strncmp(argv[i],"quota=",6)==0 && parse_bytes(argv[i]+6,&quota));
+		else if(strncmp(argv[i],"chat=",5)==0) chat_path = argv[i]+5;
+		else if(strncmp(argv[i],"bots=",5)==0) bots_channel = argv[i]+5;
+		else if(strncmp(argv[i],"cache=",6)==0 && parse_bytes(argv[i]+6,&cache));
+		else if(n++ == 0) bootstrap_port = atoi(argv[i]);
+		else trace_path = argv[i];
+	}
+	if(type == TRANSPORT_INPROC) { printf("inproc only works inside one process, see main load cluster=\n"); return 0; }
 	
-	for(int i = 0; i < MAX_CONNECTIONS; i++)
+	if(trace_path)
 	{
-		sem_init(&connections[i].mutex,0,1);
-		sem_init(&connections[i].empty,0,1);
+		if(trace_create(&rpc_trace,trace_path,sizeof(K_ID))) printf("Recording rpcs to %s\n", trace_path);
+		else printf("Could not open %s for the rpc trace\n", trace_path);
 	}
 	
-	pthread_create(&server_thread, NULL, server_socket_thread, &server_port);
+	WSAStartup(MAKEWORD(2,0), &WSAData);
+	log_start();
+	span_thread_name("node %d",server_port);
+	span_enabled = span_path != NULL;
+	
+	TRANSPORT transport;
+	if(!transport_create(&transport,type,server_port,MAX_CONNECTIONS) || !transport_listen(&transport))
+	{
+		printf("Could not use %s port %d\n", transport_name(type), server_port);
+		return 0;
+	}
 	
-	int waiting = 1,quit=0;
+	int quit=0;
 	
 	
 	NODE node = {0};
-	node.info.port = server_port;
-	
-	HASH_ENTRY tmp = {{},(char*)&server_port,4}; get_hash(&tmp);
-	memcpy(node.info.id,tmp.hash,sizeof(K_ID));
+	node_init(&node,&transport,server_port);
+	node.quota = quota;
+	node.cache.limit = cache;
 	printf("Your node ID for port %d is: ", server_port); hash_print(node.info.id); printf("\n");
 	
-	if(argc > 2)
+	METRICS_SERVER metrics_server = {0};
+	if(metrics_port && !metrics_serve(&metrics_server,metrics_port,&node.metrics,1,rpc_names))
+		printf("Could not serve metrics on port %d\n", metrics_port);
+	
+	if(bootstrap_port)
 	{
-		int port = atoi(argv[2]);
-		
-		CONTACT tmpc; tmpc.port = port;
-		if(port)
-		{			
-			rpc_ping(&node,&tmpc);//ping(server_port,port);
-			Sleep(10); // windows function
-			kademlia_find_value(&node,&tmp); // populate routing table
-		}
+		CONTACT tmpc; tmpc.port = bootstrap_port;
+		kademlia_join(&node,&tmpc); // populate routing table
+	}
+	
+	// the channels of an earlier run, caught up with from where we left them
+	CHAT_LOG chat = {0};
+	CHAT_CHANNEL * channel = NULL;
+	pubsub_subscribe(&node,LOBBY);
+	if(chat_path && chat_load(&chat,chat_path))
+	for(int i = 0; i < chat.n_channels; i++)
+	{
+		pubsub_subscribe(&node,chat.channels[i].name);
+		chat_sync(&node,&chat.channels[i]);
 	}
+	if(chat.n_channels) channel = &chat.channels[0];
+	
+	if(!bots_start(&bots,&node)) printf("Could not start the bot workers\n");
+	else if(bots_channel) bots_builtin(&bots,bots_channel);
 	
+	input_start(&transport);
 	for(;!quit;)
 	{
 		GENERIC_MESSAGE message = {NO_MESSAGE};
 		char * buffer = message.buffer;
 		
-		// check for new messages and print
+		// serve the peers, then run the next typed command if there is one,
+		// a lookup it does still serves the peers while it waits
 		
-		if (_kbhit()) waiting=0; // windows function
+		int handled = node_poll(&node);
+		chat_poll(&node,&chat);
+		handled += bots_poll(&bots);
 		
-		for(int i = 0; i < MAX_CONNECTIONS; i++)
+		if(!input_take(buffer))
 		{
-			GENERIC_MESSAGE tmp;
-			connection_read(&connections[i],(char*)&tmp,sizeof(GENERIC_MESSAGE));
-			
-			switch(tmp.type)
-			{
-				#define CASE(X) case X: printf("received %s from connection %d:\n",#X,i);
-				
-				CASE(TEXT_MESSAGE)
-				{
-					printf("%s\n",tmp.buffer);
-				}
-				break;
-				CASE(RPC_REQUEST)
-				{
-					printf("type=%d, data payload=%d\n",tmp.rpc.type,tmp.rpc.data_size);
-					read_rpc(&node,&connections[i],&tmp.rpc);
-				}
-				break;
-			}
+			if(!handled) transport_wait(&transport,10); // idle, do not spin
+			continue;
 		}
 		
-		buffer[0] = '\0';
-		message.type = NO_MESSAGE;
-		
-		if(waiting) continue;
-		
-		gets(buffer);
-		
 		if(buffer[0] == '/')
 		{
 			char * dlm = " \t\n";
@@ -274,7 +204,75 @@ int main(int argc, char **argv)
 				CONTACT tmp; tmp.port = port;
 				if(port) rpc_ping(&node,&tmp);
 			}
-			else if(strcmp("/wait",tok)==0) waiting=1; // do not poll for input
+			else if(strcmp("/log",tok)==0)
+			{
+				char * v = strtok(NULL,dlm);
+				if(v && log_level_named(v) >= 0) log_level = log_level_named(v);
+				printf("log level %s\n", log_level_name(log_level));
+			}
+			else if(strcmp("/spans",tok)==0)
+			{
+				// on, off, clear or a file to write them to
+				char * v = strtok(NULL,dlm);
+				if(!v) printf("usage: /spans on|off|clear|<file>\n");
+				else if(strcmp(v,"on")==0) span_enabled = 1;
+				else if(strcmp(v,"off")==0) span_enabled = 0;
+				else if(strcmp(v,"clear")==0) span_clear();
+				else if(span_write(v,server_port,"node") < 0) printf("Could not write %s\n", v);
+				else printf("spans written to %s\n", v);
+				printf("spans are %s\n", span_enabled ? "on" : "off");
+			}
+			else if(strcmp("/snapshot",tok)==0)
+			{
+				char * path = strtok(NULL,dlm);
+				if(!path) printf("usage: /snapshot <file>\n");
+				else if(node_snapshot(&node,path)) printf("writing a snapshot to %s\n", path);
+				else printf("Could not take a snapshot\n");
+			}
+			else if(strcmp("/join",tok)==0)
+			{
+				// what we write goes to the channel's log from now on
+				char * name = strtok(NULL,dlm);
+				if(!name) printf("usage: /join <channel>\n");
+				else if(!(channel = chat_channel(&chat,name)) || !pubsub_subscribe(&node,name)) printf("Too many channels\n");
+				else if(chat_sync(&node,channel) < 0) printf("Some of the history of %s is missing\n", name);
+			}
+			else if(strcmp("/leave",tok)==0)
+			{
+				if(channel) { chat_flush(&node,channel); pubsub_unsubscribe(&node,channel->name); }
+				channel = NULL;
+			}
+			else if(strcmp("/bots",tok)==0)
+			{
+				// the built in bots answer in the channel from now on
+				char * name = strtok(NULL,dlm);
+				if(name) bots_builtin(&bots,name);
+				bots_print(&bots);
+			}
+			else if(strcmp("/sync",tok)==0)
+			{
+				char * name = strtok(NULL,dlm);
+				CHAT_CHANNEL * sync = name ? chat_channel(&chat,name) : channel;
+				if(!sync) printf("usage: /sync <channel>\n");
+				else if(chat_sync(&node,sync) == 0) printf("Nothing new in %s\n", sync->name);
+			}
+			else if(strcmp("/memory",tok)==0)
+			{
+				printf("%d entries with %u bytes of values, %u bytes of index, %u bytes of routing table\n",
+					node.n_entries, (unsigned)node.store_bytes, (unsigned)(node.n_entries*(sizeof(HASH_ENTRY)+sizeof(STORE_USE))),
+					(unsigned)node.contact_bytes);
+				printf("%u of %u bytes used\n", (unsigned)node_memory(&node), (unsigned)node.quota);
+			}
+			else if(strcmp("/cache",tok)==0)
+			{
+				int n = 0;
+				for(int i = 0; i < CACHE_SLOTS; i++) n += node.cache.entries[i].data != NULL;
+				uint64_t lookups = node.cache.hits + node.cache.misses;
+				printf("%d values, %u of %u bytes cached\n", n, (unsigned)node.cache.bytes, (unsigned)node.cache.limit);
+				printf("%llu hits, %llu misses, %.1f%% hit rate\n", (unsigned long long)node.cache.hits, (unsigned long long)node.cache.misses,
+					lookups ? 100.0*node.cache.hits/lookups : 0.0);
+				printf("%llu lookups skipped for keys missing a moment ago\n", (unsigned long long)node.cache.missing_hits);
+			}
 			else if(strcmp("/save",tok)==0)
 			{
 				HASH_ENTRY entry = {0};
@@ -288,7 +286,7 @@ int main(int argc, char **argv)
 				
 				printf("adding hash: "); hash_print(entry.hash); printf("\n");
 				printf("DATA: %s\n",entry.data);
-				hash_insert(node.table,&entry);
+				if(store_entry(&node,&entry,0,STORE_ORIGINATED) != STORE_OK) printf("Over the memory quota, not saved\n");
 			}
 			else if(strcmp("/load",tok)==0)
 			{
@@ -313,61 +311,58 @@ int main(int argc, char **argv)
 				{
 					printf("DATA: %s\n",entry.data);
 				}
-				else printf("Nothing found!\n");
+				else
+				{
+					kademlia_find_value(&node,&entry,0);
+					if(entry.data) printf("DATA: %.*s\n",entry.size,entry.data);
+					else printf("Nothing found!\n");
+					free(entry.data);
+				}
 			}
 			else if(strcmp("/send",tok)==0)
 			{
+				// to the nodes closest to its hash, where /load finds it
 				HASH_ENTRY entry = {0};
 				
 				entry.size = strlen(tok + 6)+1;
-				entry.data = (char*)malloc(entry.size); memcpy(entry.data,tok+6,entry.size);
-				entry.data[entry.size] = '\0';
-				
+				entry.data = tok + 6;
 				
 				get_hash(&entry);
 				
 				printf("sending hash: "); hash_print(entry.hash); printf("\n");
 				printf("DATA: %s\n",entry.data);
-				//hash_insert(node.table,&entry);
-				
-				RPC_MESSAGE message = {STORE};
-				message.entry = entry;
-				
-				printf("size: %d\n", message.entry.size); 
-				for(int i = 0; i < MAX_CONNECTIONS; i++)
-					send_rpc(&node,&connections[i],&message);
+				printf("stored at %d nodes\n", kademlia_store_value(&node,&entry));
 			}
 			else if(strcmp("/init",tok)==0); // initialize chat state
 			else if(strcmp("/quit",tok)==0) quit=1; // initialize chat state
-			_kbhit(); // windows function
-			waiting = 1;
-			
 		}
 		else
 		{
-			// general post to chat
+			// general post to chat, through the channel's tree, and to our own bots
 			
-			message.type = TEXT_MESSAGE;
-			for(int i = 0; i < MAX_CONNECTIONS; i++)
-			{
-				connection_send(&connections[i],(char*)&message,sizeof(GENERIC_MESSAGE));
-			}
-			_kbhit(); // windows function
-			waiting = 1;
+			const char * name = channel ? channel->name : LOBBY;
+			if(!pubsub_publish(&node,name,buffer)) printf("Could not reach the channel\n");
+			bots_read(&bots,name,server_port,buffer,strlen(buffer));
+			if(channel) chat_append(&node,channel,buffer);
 		}
 
 	}
 
-	for(int i = 0; i < MAX_CONNECTIONS; i++)
-	{
-		sem_wait(&connections[i].mutex);
-		if(connections[i].live)
-		{
-			closesocket(connections[i].socket);
-			connections[i].live = 0;
-		}
-		sem_post(&connections[i].mutex);
-	}
+	for(int i = 0; i < chat.n_channels; i++) chat_flush(&node,&chat.channels[i]);
+	for(int i = 0; i < N_SUBSCRIPTIONS; i++)
+		if(node.subscriptions[i].name[0]) pubsub_unsubscribe(&node,node.subscriptions[i].name);
+	if(chat_path && !chat_save(&chat,chat_path)) printf("Could not write %s\n", chat_path);
+	chat_free(&chat);
+	
+	trace_close(&rpc_trace);
+	if(span_path && span_write(span_path,server_port,"node") < 0) printf("Could not write %s\n", span_path);
+	
+	bots_stop(&bots);
+	input_stop();
+	metrics_stop(&metrics_server);
+	transport_close(&transport);
+	node_free(&node);
+	log_stop();
 	
 	WSACleanup();
 	
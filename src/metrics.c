@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "log.h"
+
+// upper bounds of the histogram buckets in us
+static const uint64_t metrics_bounds[METRICS_HIST_BUCKETS-1] =
+	{100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000};
+
+uint64_t metrics_clock_us()
+{
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000ULL + t.tv_nsec/1000;
+}
+
+//
+//		Shards
+//
+// A thread keeps the shards it records into in a list under a pthread key.
+// When it exits the shards are released and the next thread to record
+// into the same registry takes one over, its counts carry on adding up.
+//
+
+typedef struct METRICS_SLOT_t
+{
+	METRICS * metrics;
+	unsigned id;
+	METRICS_SHARD * shard;
+	struct METRICS_SLOT_t * next;
+} METRICS_SLOT;
+
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static std::atomic<unsigned> metrics_ids(1);
+
+static void metrics_exit(void * data)
+{
+	for(METRICS_SLOT * slot = (METRICS_SLOT*)data, * next; slot; slot = next)
+	{
+		next = slot->next;
+		slot->shard->owned.store(0,std::memory_order_release);
+		free(slot);
+	}
+}
+
+static void metrics_init()
+{
+	pthread_key_create(&metrics_key,metrics_exit);
+}
+
+METRICS * metrics_create(int port)
+{
+	pthread_once(&metrics_once,metrics_init);
+	METRICS * metrics = (METRICS*) calloc(1,sizeof(METRICS));
+	metrics->port = port;
+	metrics->id = metrics_ids++;
+	for(int i = 0; i < METRICS_DEPTHS; i++) metrics->gauges[METRIC_BUCKET_FILL+i].store(-1);
+	return metrics;
+}
+
+void metrics_free(METRICS * metrics)
+{
+	if(!metrics) return;
+	for(METRICS_SHARD * shard = metrics->shards.load(), * next; shard; shard = next)
+	{
+		next = shard->next;
+		free(shard);
+	}
+	free(metrics);
+}
+
+METRICS_SHARD * metrics_shard(METRICS * metrics)
+{
+	METRICS_SLOT * slots = (METRICS_SLOT*) pthread_getspecific(metrics_key);
+	for(METRICS_SLOT * slot = slots; slot; slot = slot->next)
+		if(slot->metrics == metrics && slot->id == metrics->id) return slot->shard;
+
+	METRICS_SHARD * shard;
+	for(shard = metrics->shards.load(); shard; shard = shard->next)
+	{
+		int owned = 0;
+		if(shard->owned.compare_exchange_strong(owned,1)) break;
+	}
+	if(!shard)
+	{
+		shard = (METRICS_SHARD*) calloc(1,sizeof(METRICS_SHARD));
+		shard->owned.store(1);
+		shard->next = metrics->shards.load();
+		while(!metrics->shards.compare_exchange_weak(shard->next,shard));
+	}
+
+	METRICS_SLOT * slot = (METRICS_SLOT*) malloc(sizeof(METRICS_SLOT));
+	slot->metrics = metrics;
+	slot->id = metrics->id;
+	slot->shard = shard;
+	slot->next = slots;
+	pthread_setspecific(metrics_key,slot);
+	return shard;
+}
+
+void metrics_observe(METRICS * metrics, int histogram, uint64_t us)
+{
+	if(!metrics) return;
+	METRICS_SHARD * shard = metrics_shard(metrics);
+
+	int b = 0;
+	while(b < METRICS_HIST_BUCKETS-1 && us > metrics_bounds[b]) b++;
+	std::atomic<uint64_t> * bucket = &shard->buckets[histogram][b], * sum = &shard->sums[histogram];
+	bucket->store(bucket->load(std::memory_order_relaxed) + 1,std::memory_order_relaxed);
+	sum->store(sum->load(std::memory_order_relaxed) + us,std::memory_order_relaxed);
+}
+
+//
+//		Text format
+//
+
+typedef struct
+{
+	char * data;
+	int size, capacity;
+} METRICS_TEXT;
+
+static void text_printf(METRICS_TEXT * text, const char * format, ...)
+{
+	for(;;)
+	{
+		va_list args;
+		va_start(args,format);
+		int n = vsnprintf(text->data + text->size,text->capacity - text->size,format,args);
+		va_end(args);
+		if(n < 0) return;
+		if(text->size + n < text->capacity) { text->size += n; return; }
+		text->capacity = text->capacity*2 + n;
+		text->data = (char*) realloc(text->data,text->capacity);
+	}
+}
+
+static uint64_t counter_sum(METRICS * metrics, int counter)
+{
+	uint64_t sum = 0;
+	for(METRICS_SHARD * shard = metrics->shards.load(std::memory_order_acquire); shard; shard = shard->next)
+		sum += shard->counters[counter].load(std::memory_order_relaxed);
+	return sum;
+}
+
+static void family(METRICS_TEXT * text, const char * name, const char * type, const char * help)
+{
+	text_printf(text,"# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void counters(METRICS_TEXT * text, METRICS ** metrics, int n_metrics, const char * name, int counter, const char * help)
+{
+	family(text,name,"counter",help);
+	for(int i = 0; i < n_metrics; i++)
+		text_printf(text,"%s{node=\"%d\"} %llu\n", name, metrics[i]->port, (unsigned long long)counter_sum(metrics[i],counter));
+}
+
+static void gauges(METRICS_TEXT * text, METRICS ** metrics, int n_metrics, const char * name, int gauge, const char * help)
+{
+	family(text,name,"gauge",help);
+	for(int i = 0; i < n_metrics; i++)
+		text_printf(text,"%s{node=\"%d\"} %lld\n", name, metrics[i]->port, (long long)metrics[i]->gauges[gauge].load(std::memory_order_relaxed));
+}
+
+static void rpc_counters(METRICS_TEXT * text, METRICS ** metrics, int n_metrics, const char ** rpc_names,
+	const char * name, int counter, const char * help)
+{
+	family(text,name,"counter",help);
+	for(int i = 0; i < n_metrics; i++)
+	for(int type = 0; type < METRICS_RPC_TYPES && rpc_names[type]; type++)
+		text_printf(text,"%s{node=\"%d\",type=\"%s\"} %llu\n", name, metrics[i]->port, rpc_names[type],
+			(unsigned long long)counter_sum(metrics[i],counter+type));
+}
+
+static void histogram(METRICS_TEXT * text, const char * name, const char * labels, METRICS * metrics, int histogram)
+{
+	uint64_t buckets[METRICS_HIST_BUCKETS] = {0}, sum = 0, count = 0;
+	for(METRICS_SHARD * shard = metrics->shards.load(std::memory_order_acquire); shard; shard = shard->next)
+	{
+		for(int b = 0; b < METRICS_HIST_BUCKETS; b++) buckets[b] += shard->buckets[histogram][b].load(std::memory_order_relaxed);
+		sum += shard->sums[histogram].load(std::memory_order_relaxed);
+	}
+	for(int b = 0; b < METRICS_HIST_BUCKETS; b++)
+	{
+		count += buckets[b];
+		if(b < METRICS_HIST_BUCKETS-1) text_printf(text,"%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, metrics_bounds[b]/1e6, (unsigned long long)count);
+		else text_printf(text,"%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)count);
+	}
+	text_printf(text,"%s_sum{%s} %g\n%s_count{%s} %llu\n", name, labels, sum/1e6, name, labels, (unsigned long long)count);
+}
+
+int metrics_format(METRICS ** metrics, int n_metrics, const char ** rpc_names, char ** out)
+{
+	METRICS_TEXT text = {(char*) malloc(4096), 0, 4096};
+	char labels[128];
+
+	counters(&text,metrics,n_metrics,"dht_bytes_received_total",METRIC_BYTES_IN,"Bytes read off connections.");
+	counters(&text,metrics,n_metrics,"dht_bytes_sent_total",METRIC_BYTES_OUT,"Bytes sent on connections.");
+	rpc_counters(&text,metrics,n_metrics,rpc_names,"dht_rpcs_sent_total",METRIC_RPCS_SENT,"Requests and responses sent.");
+	rpc_counters(&text,metrics,n_metrics,rpc_names,"dht_rpcs_received_total",METRIC_RPCS_RECEIVED,"Requests and responses received.");
+	rpc_counters(&text,metrics,n_metrics,rpc_names,"dht_rpc_timeouts_total",METRIC_RPC_TIMEOUTS,"Requests that got no response in time.");
+
+	family(&text,"dht_rpc_latency_seconds","histogram","Time from a request to its response.");
+	for(int i = 0; i < n_metrics; i++)
+	for(int type = 0; type < METRICS_RPC_TYPES && rpc_names[type]; type++)
+	{
+		uint64_t sent = counter_sum(metrics[i],METRIC_RPCS_SENT+type);
+		if(!sent) continue;
+		snprintf(labels,sizeof(labels),"node=\"%d\",type=\"%s\"", metrics[i]->port, rpc_names[type]);
+		histogram(&text,"dht_rpc_latency_seconds",labels,metrics[i],METRIC_RPC_LATENCY+type);
+	}
+
+	static const char * outcomes[N_LOOKUP_OUTCOMES] = {"found", "missed", "stored", "not_stored", "joined", "not_joined"};
+	family(&text,"dht_lookups_total","counter","Lookups this node ran by outcome.");
+	for(int i = 0; i < n_metrics; i++)
+	for(int o = 0; o < N_LOOKUP_OUTCOMES; o++)
+		text_printf(&text,"dht_lookups_total{node=\"%d\",outcome=\"%s\"} %llu\n", metrics[i]->port, outcomes[o],
+			(unsigned long long)counter_sum(metrics[i],METRIC_LOOKUPS+o));
+
+	family(&text,"dht_lookup_latency_seconds","histogram","Time a lookup this node ran took.");
+	for(int i = 0; i < n_metrics; i++)
+	{
+		snprintf(labels,sizeof(labels),"node=\"%d\"", metrics[i]->port);
+		histogram(&text,"dht_lookup_latency_seconds",labels,metrics[i],METRIC_LOOKUP_LATENCY);
+	}
+
+	counters(&text,metrics,n_metrics,"dht_value_hits_total",METRIC_VALUE_HITS,"FIND_VALUE requests answered with the value.");
+	counters(&text,metrics,n_metrics,"dht_value_misses_total",METRIC_VALUE_MISSES,"FIND_VALUE requests answered with closer nodes.");
+	counters(&text,metrics,n_metrics,"dht_evictions_total",METRIC_EVICTIONS,"Entries dropped to stay under the memory quota.");
+	counters(&text,metrics,n_metrics,"dht_stores_refused_total",METRIC_STORES_REFUSED,"STORE requests answered full.");
+	counters(&text,metrics,n_metrics,"dht_pubsub_delivered_total",METRIC_PUBSUB_DELIVERED,"Channel messages shown to a subscriber.");
+	counters(&text,metrics,n_metrics,"dht_pubsub_forwarded_total",METRIC_PUBSUB_FORWARDED,"Copies of channel messages sent on down the tree.");
+	counters(&text,metrics,n_metrics,"dht_pubsub_duplicates_total",METRIC_PUBSUB_DUPLICATES,"Channel messages dropped as already seen.");
+	counters(&text,metrics,n_metrics,"dht_cache_hits_total",METRIC_CACHE_HITS,"Lookups answered from the value cache.");
+	counters(&text,metrics,n_metrics,"dht_cache_misses_total",METRIC_CACHE_MISSES,"Lookups that were not in the value cache.");
+	counters(&text,metrics,n_metrics,"dht_cache_missing_hits_total",METRIC_CACHE_MISSING_HITS,"Lookups answered not found because the key was just missed.");
+	counters(&text,metrics,n_metrics,"dht_lookups_coalesced_total",METRIC_LOOKUPS_COALESCED,"Lookups that shared the search for the same key in a batch.");
+	counters(&text,metrics,n_metrics,"dht_bot_commands_total",METRIC_BOT_COMMANDS,"Bot commands handed to the workers.");
+	counters(&text,metrics,n_metrics,"dht_bot_limited_total",METRIC_BOT_LIMITED,"Bot commands dropped by their rate limit.");
+	counters(&text,metrics,n_metrics,"dht_bot_dropped_total",METRIC_BOT_DROPPED,"Bot commands dropped because the workers were behind.");
+
+	gauges(&text,metrics,n_metrics,"dht_connections",METRIC_CONNECTIONS,"Open connections.");
+	gauges(&text,metrics,n_metrics,"dht_contacts",METRIC_CONTACTS,"Contacts in the routing table.");
+	gauges(&text,metrics,n_metrics,"dht_pending_contacts",METRIC_PENDING_CONTACTS,"Contacts learned from lookups waiting for a ping.");
+	gauges(&text,metrics,n_metrics,"dht_store_entries",METRIC_STORE_ENTRIES,"Values stored.");
+	gauges(&text,metrics,n_metrics,"dht_store_bytes",METRIC_STORE_BYTES,"Bytes of values stored.");
+	gauges(&text,metrics,n_metrics,"dht_replicas",METRIC_REPLICAS,"Extra replicas of hot keys held for others.");
+	gauges(&text,metrics,n_metrics,"dht_memory_bytes",METRIC_MEMORY_BYTES,"Bytes of values, index entries and routing table counted against the quota.");
+	gauges(&text,metrics,n_metrics,"dht_memory_quota_bytes",METRIC_MEMORY_QUOTA,"Memory quota of the node.");
+	gauges(&text,metrics,n_metrics,"dht_cache_bytes",METRIC_CACHE_BYTES,"Bytes of values in the value cache.");
+
+	family(&text,"dht_bucket_contacts","gauge","Contacts in the routing table bucket at each depth of the tree.");
+	for(int i = 0; i < n_metrics; i++)
+	for(int depth = 0; depth < METRICS_DEPTHS; depth++)
+	{
+		long long fill = metrics[i]->gauges[METRIC_BUCKET_FILL+depth].load(std::memory_order_relaxed);
+		if(fill >= 0) text_printf(&text,"dht_bucket_contacts{node=\"%d\",depth=\"%d\"} %lld\n", metrics[i]->port, depth, fill);
+	}
+
+	*out = text.data;
+	return text.size;
+}
+
+//
+//		Http
+//
+
+static void * metrics_thread(void * data)
+{
+	// one request per connection, whatever it asks for gets the metrics
+
+	METRICS_SERVER * server = (METRICS_SERVER*) data;
+	SOCKET listener = server->socket; // set before the thread starts, stays until it is joined
+	SOCKET client;
+	while((client = accept(listener,NULL,NULL)) != INVALID_SOCKET)
+	{
+		char request[1024];
+		recv(client,request,sizeof(request),0);
+
+		char * body;
+		int size = metrics_format(server->metrics,server->n_metrics,server->rpc_names,&body);
+		char header[128];
+		int n = snprintf(header,sizeof(header),"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",size);
+		send(client,header,n,0);
+		for(int sent = 0, r; sent < size; sent += r)
+			if((r = send(client,body+sent,size-sent,0)) <= 0) break;
+		free(body);
+
+		shutdown(client,2);
+		closesocket(client);
+	}
+	return NULL;
+}
+
+int metrics_serve(METRICS_SERVER * server, int port, METRICS ** metrics, int n_metrics, const char ** rpc_names)
+{
+	SOCKADDR_IN addr;
+
+	memset(server,0,sizeof(METRICS_SERVER));
+	server->metrics = metrics;
+	server->n_metrics = n_metrics;
+	server->rpc_names = rpc_names;
+	server->socket = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // no one else needs to see them
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if(bind(server->socket, (SOCKADDR *)&addr, sizeof(addr)) != 0)
+	{
+		closesocket(server->socket);
+		server->socket = INVALID_SOCKET;
+		return 0;
+	}
+	listen(server->socket, 4);
+	pthread_create(&server->thread, NULL, metrics_thread, server);
+	log_info("serving metrics on http://127.0.0.1:%d/metrics", port);
+	return 1;
+}
+
+void metrics_stop(METRICS_SERVER * server)
+{
+	if(server->socket == INVALID_SOCKET || !server->thread) return;
+
+	// shutdown wakes the accept on linux, winsock only gives up on a closed
+	// socket, the thread has its own copy so nothing is written under it
+	shutdown(server->socket,2);
+	closesocket(server->socket);
+	pthread_join(server->thread,NULL);
+	server->socket = INVALID_SOCKET;
+	server->thread = 0;
+}
@@ -0,0 +1,132 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "stdint.h"
+#include <atomic>
+#include <pthread.h>
+#include "sockets.h"
+
+//
+//		Metrics
+//
+// Each node has a METRICS registry. Counters and histograms are kept in a
+// shard per recording thread, which only that thread writes, so recording
+// is a load and a store with no lock or shared cache line. A scrape adds
+// the shards up. Gauges have one writer, the node thread, which sets them
+// from node_poll. metrics_serve answers http requests on a local port with
+// every registry in the Prometheus text format.
+//
+
+#define METRICS_RPC_TYPES 16 // counted per rpc type, enum RPCS in dht.h
+#define METRICS_DEPTHS 257   // routing table depths, up to 256 bit ids
+#define METRICS_HIST_BUCKETS 16 // the last one has no upper bound
+
+enum LOOKUP_OUTCOMES
+{
+	LOOKUP_FOUND, LOOKUP_MISSED, // kademlia_find_value
+	LOOKUP_STORED, LOOKUP_NOT_STORED, // kademlia_store_value
+	LOOKUP_JOINED, LOOKUP_NOT_JOINED, // kademlia_join
+	N_LOOKUP_OUTCOMES
+};
+
+enum METRIC_COUNTERS
+{
+	METRIC_BYTES_IN, METRIC_BYTES_OUT,
+	METRIC_VALUE_HITS, METRIC_VALUE_MISSES, // FIND_VALUE requests served
+	METRIC_EVICTIONS, METRIC_STORES_REFUSED, // entries dropped to stay under the quota, STOREs answered full
+	METRIC_PUBSUB_DELIVERED, METRIC_PUBSUB_FORWARDED, METRIC_PUBSUB_DUPLICATES, // channel messages, see pubsub.c
+	METRIC_CACHE_HITS, METRIC_CACHE_MISSES, // values looked up, see cache.c
+	METRIC_CACHE_MISSING_HITS, // lookups of a key not found a moment ago
+	METRIC_LOOKUPS_COALESCED, // keys asked for twice in one kademlia_find_values
+	METRIC_BOT_COMMANDS, METRIC_BOT_LIMITED, METRIC_BOT_DROPPED, // see bots.c
+	METRIC_RPCS_SENT, // one per rpc type from each of these on
+	METRIC_RPCS_RECEIVED = METRIC_RPCS_SENT + METRICS_RPC_TYPES,
+	METRIC_RPC_TIMEOUTS = METRIC_RPCS_RECEIVED + METRICS_RPC_TYPES,
+	METRIC_LOOKUPS = METRIC_RPC_TIMEOUTS + METRICS_RPC_TYPES, // one per LOOKUP_OUTCOMES
+	N_METRIC_COUNTERS = METRIC_LOOKUPS + N_LOOKUP_OUTCOMES
+};
+
+enum METRIC_HISTOGRAMS
+{
+	METRIC_RPC_LATENCY, // one per rpc type
+	METRIC_LOOKUP_LATENCY = METRIC_RPC_LATENCY + METRICS_RPC_TYPES,
+	N_METRIC_HISTOGRAMS
+};
+
+enum METRIC_GAUGES
+{
+	METRIC_CONNECTIONS, METRIC_CONTACTS, METRIC_PENDING_CONTACTS,
+	METRIC_STORE_ENTRIES, METRIC_STORE_BYTES, METRIC_REPLICAS,
+	METRIC_MEMORY_BYTES, METRIC_MEMORY_QUOTA, // see node_memory
+	METRIC_CACHE_BYTES,
+	METRIC_BUCKET_FILL, // contacts in the bucket at each depth, -1 where there is none
+	N_METRIC_GAUGES = METRIC_BUCKET_FILL + METRICS_DEPTHS
+};
+
+typedef struct METRICS_SHARD_t
+{
+	std::atomic<uint64_t> counters[N_METRIC_COUNTERS];
+	std::atomic<uint64_t> buckets[N_METRIC_HISTOGRAMS][METRICS_HIST_BUCKETS];
+	std::atomic<uint64_t> sums[N_METRIC_HISTOGRAMS]; // us
+	std::atomic<int> owned; // 0 once its thread exited, another one may take it
+	struct METRICS_SHARD_t * next;
+} METRICS_SHARD;
+
+typedef struct
+{
+	int port; // of the node, a label on every sample
+	unsigned id; // tells registries apart that were created at the same address
+	std::atomic<METRICS_SHARD*> shards;
+	std::atomic<int64_t> gauges[N_METRIC_GAUGES];
+} METRICS;
+
+METRICS * metrics_create(int port);
+void metrics_free(METRICS * metrics); // once no thread records into it
+
+METRICS_SHARD * metrics_shard(METRICS * metrics); // of the calling thread
+uint64_t metrics_clock_us();
+
+inline void metrics_add(METRICS * metrics, int counter, uint64_t n)
+{
+	if(!metrics) return;
+	std::atomic<uint64_t> * c = &metrics_shard(metrics)->counters[counter];
+	c->store(c->load(std::memory_order_relaxed) + n,std::memory_order_relaxed);
+}
+
+inline void metrics_rpc(METRICS * metrics, int counter, int type)
+{
+	// type comes off the network, anything unknown counts as FAILURE
+	metrics_add(metrics,counter + (type > 0 && type < METRICS_RPC_TYPES ? type : 0),1);
+}
+
+void metrics_observe(METRICS * metrics, int histogram, uint64_t us);
+
+inline void metrics_set(METRICS * metrics, int gauge, int64_t value)
+{
+	if(metrics) metrics->gauges[gauge].store(value,std::memory_order_relaxed);
+}
+
+inline void metrics_change(METRICS * metrics, int gauge, int64_t delta)
+{
+	// only from the thread that sets the gauge
+	if(metrics) metrics_set(metrics,gauge,metrics->gauges[gauge].load(std::memory_order_relaxed) + delta);
+}
+
+//
+//		Export
+//
+
+typedef struct
+{
+	SOCKET socket;
+	pthread_t thread;
+	METRICS ** metrics;
+	int n_metrics;
+	const char ** rpc_names; // label values for the rpc types
+} METRICS_SERVER;
+
+int metrics_format(METRICS ** metrics, int n_metrics, const char ** rpc_names, char ** out); // malloc'd text, returns its length
+int metrics_serve(METRICS_SERVER * server, int port, METRICS ** metrics, int n_metrics, const char ** rpc_names); // 0 if port is taken
+void metrics_stop(METRICS_SERVER * server);
+
+#endif
@@ -0,0 +1,352 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "dht.h"
+
+#define PUBSUB_MAX_HOPS 32 // a copy that went further is in a loop
+
+//
+//		Channel pub/sub
+//
+// The topic of a channel is hash("pubsub <channel>") and its roots are
+// the k nodes closest to it. A subscriber posts a SUBSCRIBE to each root
+// and renews it every PUBSUB_TTL/2 seconds. A publisher posts its message
+// to the closest root only, which orders the subscribers by their distance
+// to the topic and splits them among PUBSUB_FANOUT children. Each child gets
+// its part of the list in the message, shows the message and splits the
+// rest the same way, so the tree grows outwards from the topic in the id
+// space and no node sends more than PUBSUB_FANOUT copies whatever the size
+// of the channel. Every message has an id, a node drops the copies of one
+// it has seen, for instance when a publisher tried another root. A node that
+// joins closer to a topic than a root gets the root's members from it, the
+// way a value is handed to a closer node, so that a publisher that picks
+// it still reaches the ones that subscribed before it was there.
+//
+
+void pubsub_topic(const char * channel, K_ID topic)
+{
+	char name[64];
+	snprintf(name,sizeof(name),"pubsub %s",channel);
+	HASH_ENTRY tmp = {{},name,(int)strlen(name)}; get_hash(&tmp);
+	memcpy(topic,tmp.hash,sizeof(K_ID));
+}
+
+static int closer(K_ID topic, K_ID a, K_ID b)
+{
+	// 1 if a is closer to the topic than b
+	K_ID da, db;
+	hash_distance<K_ID_LEN>(topic,a,da);
+	hash_distance<K_ID_LEN>(topic,b,db);
+	return hash_lth<K_ID_LEN>(da,db);
+}
+
+//
+//		Roots
+//
+
+static PUBSUB_TOPIC * find_topic(NODE * node, K_ID topic, int add)
+{
+	// drops the members that expired on the way, a topic without any is free
+	unsigned now = clock_s();
+	PUBSUB_TOPIC * unused = NULL;
+	for(int i = 0; i < N_TOPICS; i++)
+	{
+		PUBSUB_TOPIC * t = &node->topics[i];
+		int n = 0;
+		for(int j = 0; j < t->n_members; j++)
+			if(t->members[j].expires > now) t->members[n++] = t->members[j];
+		t->n_members = n;
+
+		if(n && hash_equ<K_ID_LEN>(t->topic,topic)) return t;
+		if(!n && !unused) unused = t;
+	}
+	if(!add || !unused) return NULL;
+	memcpy(unused->topic,topic,sizeof(K_ID));
+	return unused;
+}
+
+static void add_member(NODE * node, K_ID topic, K_ID id, unsigned port, int ttl)
+{
+	// a ttl of 0 takes the member off
+	PUBSUB_TOPIC * t = find_topic(node,topic,ttl > 0);
+	if(!t)
+	{
+		if(ttl > 0) log_warn("no room for the subscribers of another channel");
+		return;
+	}
+
+	for(int j = 0; j < t->n_members; j++)
+	if(t->members[j].port == port)
+	{
+		memmove(&t->members[j],&t->members[j+1],(t->n_members-j-1)*sizeof(PUBSUB_MEMBER));
+		t->n_members--;
+		break;
+	}
+	if(ttl <= 0) return;
+	if(t->n_members == PUBSUB_MAX_MEMBERS) { log_warn("a channel has %d subscribers, %d is not taken", PUBSUB_MAX_MEMBERS, port); return; }
+
+	// kept in order of distance to the topic
+	int at = 0;
+	while(at < t->n_members && closer(topic,t->members[at].id,id)) at++;
+	memmove(&t->members[at+1],&t->members[at],(t->n_members-at)*sizeof(PUBSUB_MEMBER));
+	PUBSUB_MEMBER member = {{0},port,clock_s() + ttl};
+	memcpy(member.id,id,sizeof(K_ID));
+	t->members[at] = member;
+	t->n_members++;
+}
+
+void pubsub_handoff(NODE * node, CONTACT * contact)
+{
+	// the members go N_CONTACTS at a time in closest[], with the ttl of
+	// the first to expire
+	unsigned now = clock_s();
+	for(int i = 0; i < N_TOPICS; i++)
+	{
+		PUBSUB_TOPIC * t = find_topic(node,node->topics[i].topic,0);
+		if(t != &node->topics[i] || !closer(t->topic,contact->id,node->info.id)) continue;
+		CONNECTION * connection = transport_connect(node->transport,contact->port);
+		if(!connection) return;
+
+		log_debug("handing %d subscribers to %d", t->n_members, contact->port);
+		for(int j = 0; j < t->n_members;)
+		{
+			RPC_MESSAGE in = {SUBSCRIBE,node->info};
+			memcpy(in.entry.hash,t->topic,sizeof(K_ID));
+			in.ttl = PUBSUB_TTL;
+			for(int n = 0; n < N_CONTACTS && j < t->n_members; j++)
+			{
+				PUBSUB_MEMBER * member = &t->members[j];
+				if(member->port == contact->port) continue;
+				memcpy(in.closest[n].id,member->id,sizeof(K_ID));
+				in.closest[n++].port = member->port;
+				if((int)(member->expires - now) < in.ttl) in.ttl = member->expires - now;
+			}
+			if(in.closest[0].port) post_rpc(node,connection,&in);
+		}
+	}
+}
+
+static void find_roots(NODE * node, PUBSUB_SUBSCRIPTION * sub)
+{
+	LOOKUP lookup = {{&node->info},1};
+	CONTACT * closest[N_CONTACTS] = {0};
+	kademlia_search(node,sub->topic,NULL,closest,&lookup);
+
+	// closest first, the search does not keep them in order
+	sub->n_roots = 0;
+	for(int i = 0; i < N_CONTACTS && closest[i]; i++)
+	{
+		int at = sub->n_roots++;
+		for(; at > 0 && closer(sub->topic,closest[i]->id,sub->roots[at-1].id); at--) sub->roots[at] = sub->roots[at-1];
+		sub->roots[at] = *closest[i];
+	}
+}
+
+static int is_root(NODE * node, PUBSUB_SUBSCRIPTION * sub)
+{
+	// closer to the topic than the last of the roots we found
+	return sub->n_roots < N_CONTACTS || closer(sub->topic,node->info.id,sub->roots[sub->n_roots-1].id);
+}
+
+static void renew(NODE * node, PUBSUB_SUBSCRIPTION * sub, int ttl)
+{
+	RPC_MESSAGE in = {SUBSCRIBE,node->info};
+	memcpy(in.entry.hash,sub->topic,sizeof(K_ID));
+	in.ttl = ttl;
+	for(int i = 0; i < sub->n_roots; i++)
+	{
+		CONNECTION * connection = transport_connect(node->transport,sub->roots[i].port);
+		if(connection) post_rpc(node,connection,&in);
+	}
+	if(is_root(node,sub)) add_member(node,sub->topic,node->info.id,node->info.port,ttl);
+	sub->renewed = clock_s();
+}
+
+static PUBSUB_SUBSCRIPTION * find_subscription(NODE * node, const char * channel)
+{
+	for(int i = 0; i < N_SUBSCRIPTIONS; i++)
+		if(node->subscriptions[i].name[0] && strcmp(node->subscriptions[i].name,channel) == 0) return &node->subscriptions[i];
+	return NULL;
+}
+
+int pubsub_subscribe(NODE * node, const char * channel)
+{
+	PUBSUB_SUBSCRIPTION * sub = find_subscription(node,channel);
+	for(int i = 0; i < N_SUBSCRIPTIONS && !sub; i++)
+		if(!node->subscriptions[i].name[0]) sub = &node->subscriptions[i];
+	if(!sub) return 0;
+
+	SPAN("pubsub_subscribe");
+	snprintf(sub->name,sizeof(sub->name),"%s",channel);
+	pubsub_topic(sub->name,sub->topic);
+	find_roots(node,sub);
+	renew(node,sub,PUBSUB_TTL);
+	log_info("subscribed to %s at %d roots", sub->name, sub->n_roots);
+	return 1;
+}
+
+void pubsub_unsubscribe(NODE * node, const char * channel)
+{
+	PUBSUB_SUBSCRIPTION * sub = find_subscription(node,channel);
+	if(!sub) return;
+	renew(node,sub,0);
+	memset(sub,0,sizeof(PUBSUB_SUBSCRIPTION));
+}
+
+void pubsub_poll(NODE * node)
+{
+	// renews at most one subscription per call, the lookup takes a while
+	unsigned now = clock_s();
+	for(int i = 0; i < N_SUBSCRIPTIONS; i++)
+	{
+		PUBSUB_SUBSCRIPTION * sub = &node->subscriptions[i];
+		if(!sub->name[0] || now - sub->renewed < PUBSUB_TTL/2) continue;
+		find_roots(node,sub);
+		renew(node,sub,PUBSUB_TTL);
+		return;
+	}
+}
+
+//
+//		Messages
+//
+
+static int seen(NODE * node, uint64_t id)
+{
+	// remembers the id if it is new
+	for(int i = 0; i < PUBSUB_SEEN; i++)
+		if(node->pubsub_seen[i] == id) return 1;
+	node->pubsub_seen[node->pubsub_next_seen] = id;
+	node->pubsub_next_seen = (node->pubsub_next_seen + 1) % PUBSUB_SEEN;
+	return 0;
+}
+
+static void deliver(NODE * node, PUBSUB_HEADER * header, const char * text)
+{
+	printf("[%s] %u: %.*s\n", header->channel, header->origin, header->length, text);
+	metrics_add(node->metrics,METRIC_PUBSUB_DELIVERED,1);
+	if(node->pubsub_handler) node->pubsub_handler(node->pubsub_data,header->channel,header->origin,text,header->length);
+}
+
+static int post_publish(NODE * node, CONNECTION * connection, K_ID topic, PUBSUB_HEADER * header, const uint32_t * ports, int n, const char * text)
+{
+	// the copy that reaches the n ports through the connection's peer,
+	// 0 if the connection is gone
+	int size = sizeof(PUBSUB_HEADER) + n*sizeof(uint32_t) + header->length;
+	char * data = (char*) malloc(size);
+	PUBSUB_HEADER copy = *header;
+	copy.n_members = n;
+	memcpy(data,&copy,sizeof(copy));
+	memcpy(data + sizeof(copy),ports,n*sizeof(uint32_t));
+	memcpy(data + sizeof(copy) + n*sizeof(uint32_t),text,header->length);
+
+	RPC_MESSAGE in = {PUBLISH,node->info,{{},data,size}};
+	memcpy(in.entry.hash,topic,sizeof(K_ID));
+	post_rpc(node,connection,&in);
+	free(data);
+	return connection->live;
+}
+
+static void forward(NODE * node, K_ID topic, PUBSUB_HEADER * header, const uint32_t * ports, int n, const char * text)
+{
+	// splits the ports among PUBSUB_FANOUT children in order, each takes
+	// the rest of its share on, one that can not be reached is replaced
+	// by the next port of its share
+	PUBSUB_HEADER next = *header;
+	next.hops++;
+	int share = (n + PUBSUB_FANOUT - 1)/PUBSUB_FANOUT;
+	for(int start = 0; start < n; start += share)
+	{
+		int end = start + share < n ? start + share : n;
+		for(int child = start; child < end; child++)
+		{
+			CONNECTION * connection = transport_connect(node->transport,ports[child]);
+			if(!connection || !post_publish(node,connection,topic,&next,ports+child+1,end-child-1,text)) continue;
+			metrics_add(node->metrics,METRIC_PUBSUB_FORWARDED,1);
+			break;
+		}
+	}
+}
+
+static void disseminate(NODE * node, K_ID topic, PUBSUB_HEADER * header, const char * text)
+{
+	// as a root, to every subscriber we know of but the publisher
+	PUBSUB_TOPIC * t = find_topic(node,topic,0);
+	uint32_t ports[PUBSUB_MAX_MEMBERS];
+	int n = 0, member = 0;
+	for(int j = 0; t && j < t->n_members; j++)
+	{
+		unsigned port = t->members[j].port;
+		if(port == node->info.port) member = 1;
+		else if(port != header->origin) ports[n++] = port;
+	}
+	log_debug("message %llx of %s to %d subscribers", (unsigned long long)header->id, header->channel, n + member);
+	if(member && header->origin != node->info.port) deliver(node,header,text);
+	forward(node,topic,header,ports,n,text);
+}
+
+int pubsub_publish(NODE * node, const char * channel, const char * text)
+{
+	SPAN("pubsub_publish");
+	PUBSUB_SUBSCRIPTION tmp = {{0}}, * sub = find_subscription(node,channel);
+	if(!sub)
+	{
+		// publishing without listening, the roots are looked up every time
+		sub = &tmp;
+		snprintf(sub->name,sizeof(sub->name),"%s",channel);
+		pubsub_topic(sub->name,sub->topic);
+		find_roots(node,sub);
+	}
+
+	size_t length = strlen(text);
+	PUBSUB_HEADER header = {(uint64_t)node->info.port << 32 | ++node->pubsub_sequence};
+	snprintf(header.channel,sizeof(header.channel),"%s",sub->name);
+	header.origin = node->info.port;
+	header.length = length < 0xFFFF ? length : 0xFFFF;
+	seen(node,header.id);
+
+	// the closest root, which may be us
+	if(!sub->n_roots || closer(sub->topic,node->info.id,sub->roots[0].id))
+	{
+		disseminate(node,sub->topic,&header,text);
+		return 1;
+	}
+	for(int i = 0; i < sub->n_roots; i++)
+	{
+		CONNECTION * connection = transport_connect(node->transport,sub->roots[i].port);
+		if(connection && post_publish(node,connection,sub->topic,&header,NULL,0,text)) return 1;
+		log_warn("root %d of %s is not reachable", sub->roots[i].port, sub->name);
+	}
+	return 0;
+}
+
+void pubsub_read(NODE * node, RPC_MESSAGE * input)
+{
+	if(input->type == SUBSCRIBE)
+	{
+		// the sender's own, or the members a root handed to us
+		if(!input->closest[0].port) add_member(node,input->entry.hash,input->sender.id,input->sender.port,input->ttl);
+		for(int i = 0; i < N_CONTACTS && input->closest[i].port; i++)
+			add_member(node,input->entry.hash,input->closest[i].id,input->closest[i].port,input->ttl);
+		return;
+	}
+
+	PUBSUB_HEADER header;
+	if(input->entry.size < (int)sizeof(header)) return;
+	memcpy(&header,input->entry.data,sizeof(header));
+	const uint32_t * ports = (const uint32_t*)(input->entry.data + sizeof(header));
+	const char * text = (const char*)(ports + header.n_members);
+	if((int)(sizeof(header) + header.n_members*sizeof(uint32_t) + header.length) > input->entry.size) return;
+	header.channel[sizeof(header.channel)-1] = '\0';
+
+	if(seen(node,header.id)) { metrics_add(node->metrics,METRIC_PUBSUB_DUPLICATES,1); return; }
+	if(header.hops > PUBSUB_MAX_HOPS) { log_warn("message of %s dropped after %d hops", header.channel, header.hops); return; }
+
+	if(header.hops == 0) disseminate(node,input->entry.hash,&header,text); // we are the root
+	else
+	{
+		deliver(node,&header,text);
+		forward(node,input->entry.hash,&header,ports,header.n_members,text);
+	}
+}
@@ -0,0 +1,123 @@
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+#include "dht.h"
+#include "snapshot.h"
+
+//
+//		Snapshots
+//
+// node_snapshot copies the routing table, the store index and the read
+// counts of the hot keys into a SNAPSHOT_BUFFER on the node's thread, which
+// takes well under a millisecond, and a thread of its own writes it to the
+// file. Values are not copied, only their keys and sizes. The format is in
+// snapshot.h, "main snapshot" in the simulator analyses the files.
+//
+
+typedef struct
+{
+	SNAPSHOT_BUFFER buffer;
+	char * path;
+} SNAPSHOT_WRITE;
+
+static void * write_thread(void * data)
+{
+	SNAPSHOT_WRITE * write = (SNAPSHOT_WRITE*) data;
+	FILE * file = fopen(write->path,"wb");
+	if(file && fwrite(write->buffer.data,write->buffer.size,1,file) == 1)
+		log_info("snapshot of %d bytes written to %s", write->buffer.size, write->path);
+	else log_error("could not write the snapshot to %s", write->path);
+	if(file) fclose(file);
+	free(write->buffer.data);
+	free(write->path);
+	free(write);
+	return NULL;
+}
+
+static void append_buckets(SNAPSHOT_BUFFER * buffer, BUCKET_TREE * tree, int depth, SNAPSHOT_HEADER * header)
+{
+	// leaves in order of their ranges, like list_contacts
+	if(tree->children[0])
+	{
+		append_buckets(buffer,tree->children[0],depth+1,header);
+		append_buckets(buffer,tree->children[1],depth+1,header);
+		return;
+	}
+	if(!tree->bucket) return;
+
+	BUCKET * bucket = tree->bucket;
+	SNAPSHOT_BUCKET record = {(uint16_t)depth,(uint16_t)bucket->n_contacts};
+	snapshot_append(buffer,&record,sizeof(record));
+	snapshot_append(buffer,tree->min,sizeof(K_ID));
+	snapshot_append(buffer,tree->max,sizeof(K_ID));
+	header->n_buckets++;
+
+	for(int i = 0; i < bucket->n_contacts; i++)
+	{
+		CONTACT * contact = bucket->contacts[i];
+		CONNECTION * connection = contact->connection;
+		SNAPSHOT_CONTACT out = {contact->ip,(uint16_t)contact->port,(uint8_t)(contact->is_online != 0),
+			(uint8_t)(connection && connection->live),contact->last_seen,connection ? connection->srtt : 0};
+		snapshot_append(buffer,&out,sizeof(out));
+		snapshot_append(buffer,contact->id,sizeof(K_ID));
+		header->n_contacts++;
+	}
+}
+
+int node_snapshot(NODE * node, const char * path)
+{
+	// from the node's thread, returns 0 if the writer could not be started
+	unsigned now = clock_s();
+	SNAPSHOT_BUFFER buffer = {0};
+	SNAPSHOT_HEADER header = {SNAPSHOT_MAGIC,SNAPSHOT_VERSION,sizeof(K_ID),N_CONTACTS,(uint16_t)node->info.port,now};
+	snapshot_append(&buffer,&header,sizeof(header)); // the counts are filled in at the end
+	snapshot_append(&buffer,node->info.id,sizeof(K_ID));
+
+	if(node->contacts) append_buckets(&buffer,node->contacts,0,&header);
+
+	for(int i = 0; i < HASH_TABLE_SIZE; i++)
+	{
+		HASH_ENTRY * entry = &node->table[i];
+		if(!entry->data) continue;
+		REPLICA * replica = find_replica(node,entry->hash);
+		SNAPSHOT_ENTRY out = {(uint32_t)entry->size,replica ? replica->expires : 0};
+		snapshot_append(&buffer,&out,sizeof(out));
+		snapshot_append(&buffer,entry->hash,sizeof(K_ID));
+		header.n_entries++;
+	}
+
+	for(int i = 0; i < N_HOT_KEYS; i++)
+	{
+		KEY_STATS key = node->hot_keys[i];
+		decay_reads(&key,now);
+		if(!key.reads) continue;
+		SNAPSHOT_HOT_KEY out = {key.reads,key.last_read,(uint32_t)key.n_extra};
+		snapshot_append(&buffer,&out,sizeof(out));
+		snapshot_append(&buffer,key.hash,sizeof(K_ID));
+		header.n_hot_keys++;
+	}
+	memcpy(buffer.data,&header,sizeof(header));
+	log_debug("snapshot of %d buckets, %d contacts and %d entries taken", header.n_buckets, header.n_contacts, header.n_entries);
+
+	snapshot_wait(node); // one file at a time
+	SNAPSHOT_WRITE * write = (SNAPSHOT_WRITE*) malloc(sizeof(SNAPSHOT_WRITE));
+	write->buffer = buffer;
+	write->path = strdup(path);
+	if(pthread_create(&node->snapshot_thread,NULL,write_thread,write) != 0)
+	{
+		free(buffer.data);
+		free(write->path);
+		free(write);
+		return 0;
+	}
+	node->snapshot_writing = 1;
+	return 1;
+}
+
+void snapshot_wait(NODE * node)
+{
+	if(!node->snapshot_writing) return;
+	pthread_join(node->snapshot_thread,NULL);
+	node->snapshot_writing = 0;
+}
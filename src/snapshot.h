@@ -0,0 +1,137 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+
+//
+//		Node snapshots
+//
+// A snapshot file is a SNAPSHOT_HEADER and the node's id, then n_buckets
+// buckets, each a SNAPSHOT_BUCKET, its min and max id and n_contacts
+// contacts, then n_entries store entries and n_hot_keys hot keys. Every
+// record is its fixed part followed by id_len bytes of id or key, in host
+// byte order like the rpc traces. Written by the client (src/snapshot.c)
+// and read by the simulator's analyser (main snapshot).
+//
+
+#define SNAPSHOT_MAGIC 0x504E534B // "KSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_ID_LEN 32
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t id_len;
+	uint16_t k;        // contacts per bucket
+	uint16_t port;     // of the node
+	uint32_t time;     // when it was taken, seconds since the epoch
+	uint32_t n_buckets, n_contacts, n_entries, n_hot_keys;
+} SNAPSHOT_HEADER;
+
+typedef struct
+{
+	uint16_t depth;    // bits of prefix the ids in the bucket share
+	uint16_t n_contacts;
+} SNAPSHOT_BUCKET;
+
+typedef struct
+{
+	uint32_t ip;
+	uint16_t port;
+	uint8_t online;
+	uint8_t connected;
+	uint32_t last_seen; // seconds since the epoch
+	uint32_t srtt;      // ms, 0 until the first rpc to it
+} SNAPSHOT_CONTACT;
+
+typedef struct
+{
+	uint32_t size;
+	uint32_t expires;   // for extra replicas of hot keys, 0 if kept for good
+} SNAPSHOT_ENTRY;
+
+typedef struct
+{
+	uint32_t reads;     // halves every HOT_HALF_LIFE seconds, as of last_read
+	uint32_t last_read;
+	uint32_t n_extra;   // nodes holding extra replicas
+} SNAPSHOT_HOT_KEY;
+
+static_assert(sizeof(SNAPSHOT_HEADER) == 32 && sizeof(SNAPSHOT_CONTACT) == 16, "snapshot records must not be padded");
+
+//
+//		Writing
+//
+// Records are appended to a growing buffer in memory so the node only
+// spends the time to copy its state, the file is written afterwards.
+//
+
+typedef struct
+{
+	char * data;
+	int size, capacity;
+} SNAPSHOT_BUFFER;
+
+inline void snapshot_append(SNAPSHOT_BUFFER * buffer, const void * data, int size)
+{
+	if(buffer->size + size > buffer->capacity)
+	{
+		buffer->capacity = (buffer->size + size)*2;
+		buffer->data = (char*) realloc(buffer->data,buffer->capacity);
+	}
+	memcpy(buffer->data + buffer->size,data,size);
+	buffer->size += size;
+}
+
+//
+//		Reading
+//
+
+typedef struct
+{
+	FILE * file;
+	SNAPSHOT_HEADER header;
+	unsigned char id[SNAPSHOT_MAX_ID_LEN];
+} SNAPSHOT;
+
+inline int snapshot_open(SNAPSHOT * snapshot, const char * path)
+{
+	// reads the header and id, returns 0 if the file is missing or not a snapshot
+	memset(snapshot,0,sizeof(SNAPSHOT));
+	if(!(snapshot->file = fopen(path,"rb"))) return 0;
+	SNAPSHOT_HEADER * header = &snapshot->header;
+	if(fread(header,sizeof(SNAPSHOT_HEADER),1,snapshot->file) != 1 || header->magic != SNAPSHOT_MAGIC
+		|| header->version != SNAPSHOT_VERSION || header->id_len > SNAPSHOT_MAX_ID_LEN
+		|| fread(snapshot->id,header->id_len,1,snapshot->file) != 1)
+	{
+		fclose(snapshot->file);
+		snapshot->file = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+inline int snapshot_read(SNAPSHOT * snapshot, void * record, int size, unsigned char * id)
+{
+	// the fixed part of the next record and the id after it, 0 at the end
+	return fread(record,size,1,snapshot->file) == 1
+		&& fread(id,snapshot->header.id_len,1,snapshot->file) == 1;
+}
+
+inline int snapshot_read_id(SNAPSHOT * snapshot, unsigned char * id)
+{
+	// the second id of a bucket
+	return fread(id,snapshot->header.id_len,1,snapshot->file) == 1;
+}
+
+inline void snapshot_close(SNAPSHOT * snapshot)
+{
+	if(snapshot->file) fclose(snapshot->file);
+	snapshot->file = NULL;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SOCKETS_H
+#define SOCKETS_H
+
+//
+//		Sockets
+//
+// The client is built with winsock. The simulator in dht/ also builds the
+// node code on posix systems, where these stand in for the winsock names
+// the node code uses.
+//
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+typedef struct sockaddr SOCKADDR;
+typedef struct sockaddr_in SOCKADDR_IN;
+#define INVALID_SOCKET (-1)
+inline int closesocket(SOCKET socket) { return close(socket); }
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <atomic>
+#include <pthread.h>
+
+#include "span.h"
+
+volatile int span_enabled = 0;
+
+uint64_t span_clock_ns()
+{
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+//
+//		Rings
+//
+// Every thread records into a ring of its own, found through a pthread
+// key, so a span is a few stores and no lock. span_write reads the rings
+// while their threads go on: it copies the events, then drops the ones
+// the owner may have overwritten during the copy. The ring of an exited
+// thread is kept until its spans have been written or cleared, then a new
+// thread takes it over.
+//
+
+typedef struct
+{
+	const char * name, * detail;
+	uint64_t start, end; // ns, a flow keeps its id in start
+	int peer;
+	unsigned char key[4]; // the first bytes of the key
+	uint8_t phase, has_key;
+} SPAN_EVENT;
+
+enum SPAN_RING_STATES { SPAN_FREE, SPAN_OWNED, SPAN_EXITED };
+
+typedef struct SPAN_RING_t
+{
+	char name[32];
+	int thread; // tid in the trace
+	SPAN_EVENT * events; // SPAN_RING_SIZE of them, allocated by the first span
+	std::atomic<unsigned> count; // events recorded
+	std::atomic<unsigned> first; // count when the ring was last cleared
+	std::atomic<int> state;
+	struct SPAN_RING_t * next;
+} SPAN_RING;
+
+static std::atomic<SPAN_RING*> span_rings(NULL);
+static std::atomic<int> span_threads(1);
+static pthread_key_t span_key;
+static pthread_once_t span_once = PTHREAD_ONCE_INIT;
+
+static void span_exit(void * data)
+{
+	((SPAN_RING*)data)->state.store(SPAN_EXITED,std::memory_order_release);
+}
+
+static void span_init()
+{
+	pthread_key_create(&span_key,span_exit);
+}
+
+static SPAN_RING * span_ring()
+{
+	// the ring of this thread
+
+	pthread_once(&span_once,span_init);
+	SPAN_RING * ring = (SPAN_RING*) pthread_getspecific(span_key);
+	if(ring) return ring;
+
+	for(ring = span_rings.load(); ring; ring = ring->next)
+	{
+		int state = SPAN_FREE;
+		if(ring->state.compare_exchange_strong(state,SPAN_OWNED)) break;
+	}
+	if(!ring)
+	{
+		ring = (SPAN_RING*) calloc(1,sizeof(SPAN_RING));
+		ring->state.store(SPAN_OWNED);
+		ring->next = span_rings.load();
+		while(!span_rings.compare_exchange_weak(ring->next,ring));
+	}
+	ring->first.store(ring->count.load());
+	ring->thread = span_threads++;
+	snprintf(ring->name,sizeof(ring->name),"thread %d",ring->thread);
+	pthread_setspecific(span_key,ring);
+	return ring;
+}
+
+void span_record(int phase, const char * name, const char * detail, int peer, const unsigned char * key, uint64_t start, uint64_t end)
+{
+	SPAN_RING * ring = span_ring();
+	if(!ring->events) ring->events = (SPAN_EVENT*) malloc(SPAN_RING_SIZE*sizeof(SPAN_EVENT));
+
+	unsigned count = ring->count.load(std::memory_order_relaxed);
+	SPAN_EVENT * event = &ring->events[count % SPAN_RING_SIZE];
+	event->name = name;
+	event->detail = detail;
+	event->start = start;
+	event->end = end;
+	event->peer = peer;
+	event->has_key = key != NULL;
+	if(key) memcpy(event->key,key,sizeof(event->key));
+	event->phase = phase;
+	ring->count.store(count+1,std::memory_order_release);
+}
+
+void span_thread_name(const char * format, ...)
+{
+	SPAN_RING * ring = span_ring();
+	va_list args;
+	va_start(args,format);
+	vsnprintf(ring->name,sizeof(ring->name),format,args);
+	va_end(args);
+}
+
+//
+//		Chrome trace JSON
+//
+// Spans are complete ("X") events, flows are "s" and "f" events bound to
+// the span around them. Timestamps are the steady clock in us, so traces
+// of several processes on one machine line up when merged.
+//
+
+static void span_print(FILE * file, SPAN_EVENT * event, int pid, int thread)
+{
+	if(event->phase != SPAN_COMPLETE)
+	{
+		fprintf(file,",\n{\"name\":\"%s\",\"cat\":\"rpc\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"id\":\"0x%llx\"%s}",
+			event->name, event->phase == SPAN_FLOW_OUT ? "s" : "f", pid, thread, event->end/1000.0,
+			(unsigned long long)event->start, event->phase == SPAN_FLOW_IN ? ",\"bp\":\"e\"" : "");
+		return;
+	}
+
+	fprintf(file,",\n{\"name\":\"%s\",\"cat\":\"dht\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+		event->name, pid, thread, event->start/1000.0, (event->end - event->start)/1000.0);
+	const char * comma = "";
+	if(event->detail) { fprintf(file,"\"detail\":\"%s\"", event->detail); comma = ","; }
+	if(event->peer) { fprintf(file,"%s\"peer\":%d", comma, event->peer); comma = ","; }
+	if(event->has_key) fprintf(file,"%s\"key\":\"%02X%02X%02X%02X\"", comma, event->key[0], event->key[1], event->key[2], event->key[3]);
+	fprintf(file,"}}");
+}
+
+int span_write(const char * path, int pid, const char * process)
+{
+	FILE * file = fopen(path,"w");
+	if(!file) return -1;
+
+	SPAN_EVENT * copy = (SPAN_EVENT*) malloc(SPAN_RING_SIZE*sizeof(SPAN_EVENT));
+	int written = 0;
+	fprintf(file,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}}", pid, process);
+	for(SPAN_RING * ring = span_rings.load(); ring; ring = ring->next)
+	{
+		int state = ring->state.load(std::memory_order_acquire);
+		if(state == SPAN_FREE || !ring->events) continue;
+
+		unsigned count = ring->count.load(std::memory_order_acquire), first = ring->first.load();
+		if(count - first > SPAN_RING_SIZE) first = count - SPAN_RING_SIZE;
+		for(unsigned i = first; i != count; i++) copy[i - first] = ring->events[i % SPAN_RING_SIZE];
+
+		// whatever the owner wrote meanwhile replaced the oldest events
+		unsigned after = ring->count.load(std::memory_order_acquire), skip = 0;
+		if(after - first > SPAN_RING_SIZE) skip = after - first - SPAN_RING_SIZE;
+
+		fprintf(file,",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, ring->thread, ring->name);
+		for(unsigned i = skip; i < count - first; i++) span_print(file,&copy[i],pid,ring->thread);
+		written += count - first - (skip < count - first ? skip : count - first);
+
+		if(state == SPAN_EXITED) ring->state.compare_exchange_strong(state,SPAN_FREE);
+	}
+	fprintf(file,"\n]}\n");
+	fclose(file);
+	free(copy);
+	return written;
+}
+
+void span_clear()
+{
+	// drops what was recorded so far
+	for(SPAN_RING * ring = span_rings.load(); ring; ring = ring->next)
+	{
+		ring->first.store(ring->count.load());
+		int state = SPAN_EXITED;
+		ring->state.compare_exchange_strong(state,SPAN_FREE);
+	}
+}
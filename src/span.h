@@ -0,0 +1,68 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include "stdint.h"
+
+//
+//		Spans
+//
+// SPAN(name, detail, peer, key) at the top of a block records how long the
+// block took, from the steady clock in ns, into a buffer owned by the
+// calling thread. detail is a static string such as an rpc name, peer a
+// port and key an id whose first bytes are shown, any of them may be 0.
+// span_flow ties the span it is called in to a span on another thread or
+// in another process with the same flow id, rpcs use it to join a request
+// to the span that serves it. While span_enabled is 0 a span costs a load
+// and a compare, building with -DNO_SPANS removes them altogether.
+// span_write exports everything buffered as Chrome trace JSON, which
+// chrome://tracing and ui.perfetto.dev open.
+//
+
+#define SPAN_RING_SIZE (1 << 14) // spans kept per thread, older ones are overwritten
+
+extern volatile int span_enabled; // 0 unless switched on
+
+enum SPAN_PHASES { SPAN_COMPLETE, SPAN_FLOW_OUT, SPAN_FLOW_IN };
+
+uint64_t span_clock_ns();
+void span_record(int phase, const char * name, const char * detail, int peer, const unsigned char * key, uint64_t start, uint64_t end);
+void span_thread_name(const char * format, ...); // shown for the calling thread
+int span_write(const char * path, int pid, const char * process); // events written, -1 if the file can not be
+void span_clear();
+
+inline uint64_t span_flow_id(int from, int to, int type, const unsigned char * key)
+{
+	// the same on both ends of a message, from and to are the node ports
+	uint32_t k = key ? key[0] | key[1] << 8 | key[2] << 16 | (uint32_t)key[3] << 24 : 0;
+	return ((uint64_t)(from & 0xFFFF) << 48 | (uint64_t)(to & 0xFFFF) << 32) ^ (k ^ (uint32_t)type*0x9E3779B1u);
+}
+
+inline void span_flow(int phase, uint64_t id)
+{
+	// the flow id goes where a span keeps its start time
+#ifndef NO_SPANS
+	if(span_enabled) span_record(phase,"rpc",0,0,0,id,span_clock_ns());
+#endif
+}
+
+struct SPAN_SCOPE
+{
+	const char * name, * detail;
+	int peer;
+	const unsigned char * key;
+	uint64_t start;
+
+	SPAN_SCOPE(const char * name, const char * detail = 0, int peer = 0, const unsigned char * key = 0)
+		: name(name), detail(detail), peer(peer), key(key), start(span_enabled ? span_clock_ns() : 0) {}
+	~SPAN_SCOPE() { if(start && span_enabled) span_record(SPAN_COMPLETE,name,detail,peer,key,start,span_clock_ns()); }
+};
+
+#define SPAN_JOIN(a, b) a##b
+#define SPAN_NAME(line) SPAN_JOIN(span_,line)
+#ifdef NO_SPANS
+#define SPAN(...) do {} while(0)
+#else
+#define SPAN(...) SPAN_SCOPE SPAN_NAME(__LINE__)(__VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "stdio.h"
+#include "string.h"
+#include "stdint.h"
+#include "stddef.h"
+
+//
+//		RPC traces
+//
+// A trace file is a TRACE_HEADER followed by one record for every rpc a
+// node sent or received, in host byte order. A record is the fixed part of
+// TRACE_RECORD followed by id_len bytes of key, 36 bytes for 160 bit ids.
+// Shared by the client, which writes them, and the simulator, which
+// replays them.
+//
+
+#define TRACE_MAGIC 0x4352544B // "KTRC"
+#define TRACE_VERSION 1
+#define TRACE_MAX_ID_LEN 32
+
+enum TRACE_DIRECTIONS { TRACE_SENT, TRACE_RECEIVED };
+
+// the rpc types, enum RPCS in dht.h takes its values from here so a trace
+// can be read without it. A new rpc type goes at the end, with its name
+enum TRACE_RPCS
+{
+	TRACE_FAILURE, TRACE_PING, TRACE_STORE, TRACE_FIND_NODE, TRACE_FIND_VALUE,
+	TRACE_FOUND_NODE, TRACE_FOUND_VALUE, TRACE_JOIN, TRACE_JOINED, TRACE_STORED,
+	TRACE_SUBSCRIBE, TRACE_PUBLISH, TRACE_PONG, TRACE_N_RPCS
+};
+
+#define TRACE_RPC_NAMES "failure", "ping", "store", "find_node", "find_value", "found_node", "found_value", \
+	"join", "joined", "stored", "subscribe", "publish", "pong"
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t id_len;
+} TRACE_HEADER;
+
+typedef struct
+{
+	uint32_t time_ms; // since the trace was started
+	uint32_t ip;      // of the peer, network byte order
+	uint16_t port;    // of the peer
+	uint8_t type;     // enum TRACE_RPCS
+	uint8_t direction;
+	uint32_t size;    // payload bytes
+	uint8_t key[TRACE_MAX_ID_LEN]; // the hash or id the rpc is about
+} TRACE_RECORD;
+
+#define TRACE_FIXED_SIZE 16 // bytes of TRACE_RECORD before the key
+static_assert(offsetof(TRACE_RECORD,key) == TRACE_FIXED_SIZE, "TRACE_RECORD must not be padded");
+
+typedef struct
+{
+	FILE * file;
+	int id_len;
+	uint32_t start; // ms timestamp of the first record when writing
+	uint32_t flushed; // ms timestamp of the last flush
+	int started, pending;
+} TRACE;
+
+#define TRACE_FLUSH_MS 1000 // a node that is killed loses at most this much
+
+inline int trace_create(TRACE * trace, const char * path, int id_len)
+{
+	// returns 0 if the file can not be written
+	TRACE_HEADER header = {TRACE_MAGIC, TRACE_VERSION, (uint16_t)id_len};
+	memset(trace,0,sizeof(TRACE));
+	if(id_len > TRACE_MAX_ID_LEN || !(trace->file = fopen(path,"wb"))) return 0;
+	trace->id_len = id_len;
+	fwrite(&header,sizeof(header),1,trace->file);
+	return 1;
+}
+
+inline void trace_flush(TRACE * trace, uint32_t now_ms)
+{
+	// call now and then so records reach the file even when no more come
+	if(!trace->pending || now_ms - trace->flushed < TRACE_FLUSH_MS) return;
+	fflush(trace->file);
+	trace->flushed = now_ms;
+	trace->pending = 0;
+}
+
+inline void trace_write(TRACE * trace, uint32_t now_ms, TRACE_RECORD * record)
+{
+	if(!trace->file) return;
+	if(!trace->started) { trace->start = now_ms; trace->started = 1; }
+	record->time_ms = now_ms - trace->start;
+	fwrite(record,TRACE_FIXED_SIZE,1,trace->file);
+	fwrite(record->key,trace->id_len,1,trace->file);
+	trace->pending = 1;
+	trace_flush(trace,now_ms);
+}
+
+inline int trace_open(TRACE * trace, const char * path)
+{
+	// for reading, returns 0 if the file is missing or not a trace
+	TRACE_HEADER header;
+	memset(trace,0,sizeof(TRACE));
+	if(!(trace->file = fopen(path,"rb"))) return 0;
+	if(fread(&header,sizeof(header),1,trace->file) != 1 || header.magic != TRACE_MAGIC
+		|| header.version != TRACE_VERSION || header.id_len > TRACE_MAX_ID_LEN)
+	{
+		fclose(trace->file);
+		trace->file = NULL;
+		return 0;
+	}
+	trace->id_len = header.id_len;
+	return 1;
+}
+
+inline int trace_read(TRACE * trace, TRACE_RECORD * record)
+{
+	// returns 0 at the end of the trace
+	memset(record,0,sizeof(TRACE_RECORD));
+	return fread(record,TRACE_FIXED_SIZE,1,trace->file) == 1
+		&& fread(record->key,trace->id_len,1,trace->file) == 1;
+}
+
+inline void trace_close(TRACE * trace)
+{
+	if(trace->file) fclose(trace->file);
+	trace->file = NULL;
+}
+
+#endif